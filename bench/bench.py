@@ -0,0 +1,176 @@
+#!/usr/bin/env python3
+"""Compiler throughput benchmark.
+
+Generates each corpus of gen.py, compiles it with lcc -ftime-trace a few
+times and keeps the fastest run of every phase, then compiles it once more
+with --mem-report for the resident set. For lex, parse (without lex),
+resolve and emit it reports lines/sec, tokens/sec and the peak RSS at the
+end of the phase, and compares them with the stored baseline:
+
+  make bench            compare with bench/baseline.json
+  make bench-baseline   record a new baseline on this machine
+
+The exit status is 1 when a phase got slower, or its peak RSS grew, by
+more than the tolerance. Phases faster than --min-ms in the baseline are
+shown but not compared, they are mostly noise.
+"""
+
+import argparse
+import json
+import os
+import subprocess
+import sys
+import tempfile
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+import gen  # noqa: E402
+
+PHASES = ("lex", "parse", "resolve", "emit")
+CORPORA = ("defuns", "nesting", "cond", "let", "keys", "mixed")
+
+
+def run_lcc(lcc, source, trace, extra=()):
+    cmd = [lcc, f"-ftime-trace={trace}", *extra, source]
+    with open(os.devnull, "w") as null:
+        result = subprocess.run(cmd, stdout=null, stderr=subprocess.PIPE)
+    if result.returncode != 0:
+        tail = result.stderr.decode(errors="replace").splitlines()[-5:]
+        sys.exit(f"{' '.join(cmd)} failed:\n" + "\n".join(tail))
+    with open(trace) as f:
+        return json.load(f)["traceEvents"]
+
+
+def phases_of(events):
+    """seconds, tokens and peak RSS of the phases, parse without lex"""
+    out = {}
+    for e in events:
+        if e.get("cat") != "phase" or e["name"] not in PHASES:
+            continue
+        p = out.setdefault(e["name"], {"seconds": 0.0})
+        p["seconds"] += e["dur"] / 1e6
+        if "tokens" in e["args"]:
+            p["tokens"] = e["args"]["tokens"]
+        if "peak_rss_kb" in e["args"]:
+            p["peak_rss_kb"] = e["args"]["peak_rss_kb"]
+    if "lex" in out and "parse" in out:
+        # the lexer runs inside the parser, a token at a time
+        out["parse"]["seconds"] -= out["lex"]["seconds"]
+        if "peak_rss_kb" in out["parse"]:
+            out["lex"]["peak_rss_kb"] = out["parse"]["peak_rss_kb"]
+    return out
+
+
+def measure(lcc, corpus, lines, runs, workdir):
+    source = os.path.join(workdir, f"{corpus}.lc")
+    text = gen.generate(corpus, lines)
+    with open(source, "w") as f:
+        f.write("\n".join(text) + "\n")
+    trace = os.path.join(workdir, f"{corpus}.trace.json")
+
+    best = {}
+    for _ in range(runs):
+        for name, p in phases_of(run_lcc(lcc, source, trace)).items():
+            if name not in best or p["seconds"] < best[name]["seconds"]:
+                best[name] = p
+    memory = phases_of(run_lcc(lcc, source, trace, ["--mem-report"]))
+
+    tokens = best.get("lex", {}).get("tokens", 0)
+    result = {"lines": len(text), "tokens": tokens, "phases": {}}
+    for name in PHASES:
+        if name not in best:
+            continue
+        seconds = max(best[name]["seconds"], 1e-9)
+        result["phases"][name] = {
+            "seconds": round(seconds, 6),
+            "lines_per_sec": round(len(text) / seconds),
+            "tokens_per_sec": round(tokens / seconds),
+            "peak_rss_kb": memory.get(name, {}).get("peak_rss_kb", 0),
+        }
+    return result
+
+
+def compare(corpus, now, base, tolerance, min_ms):
+    """the regressions of one corpus, as messages"""
+    if base is None:
+        return []
+    if base["lines"] != now["lines"] or base["tokens"] != now["tokens"]:
+        print(f"  {corpus}: corpus differs from the baseline, not compared")
+        return []
+    problems = []
+    for name, p in now["phases"].items():
+        b = base["phases"].get(name)
+        if b is None:
+            continue
+        if b["seconds"] * 1e3 >= min_ms and (
+            p["lines_per_sec"] < b["lines_per_sec"] * (1 - tolerance)
+        ):
+            problems.append(
+                f"{corpus}/{name}: {p['lines_per_sec']} lines/s, "
+                f"baseline {b['lines_per_sec']}"
+            )
+        if b["peak_rss_kb"] > 0 and (
+            p["peak_rss_kb"] > b["peak_rss_kb"] * (1 + tolerance)
+        ):
+            problems.append(
+                f"{corpus}/{name}: peak RSS {p['peak_rss_kb']} kB, "
+                f"baseline {b['peak_rss_kb']} kB"
+            )
+    return problems
+
+
+def ratio(now, base, key):
+    if base is None or base.get(key, 0) == 0:
+        return ""
+    return f"{100.0 * now[key] / base[key] - 100.0:+.1f}%"
+
+
+def main():
+    here = os.path.dirname(os.path.abspath(__file__))
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--lcc", default="./lcc")
+    parser.add_argument("--lines", type=int, default=20000)
+    parser.add_argument("--runs", type=int, default=3)
+    parser.add_argument("--corpus", action="append", choices=CORPORA)
+    parser.add_argument("--baseline", default=os.path.join(here, "baseline.json"))
+    parser.add_argument("--tolerance", type=float, default=0.15)
+    parser.add_argument("--min-ms", type=float, default=10.0)
+    parser.add_argument("--update", action="store_true",
+                        help="write the results as the new baseline")
+    args = parser.parse_args()
+
+    baseline = {}
+    if not args.update and os.path.exists(args.baseline):
+        with open(args.baseline) as f:
+            baseline = json.load(f).get("corpora", {})
+    elif not args.update:
+        print(f"no baseline at {args.baseline}, run make bench-baseline")
+
+    results, problems = {}, []
+    print(f"{'corpus':<8} {'phase':<8} {'ms':>9} {'lines/s':>11} "
+          f"{'tokens/s':>11} {'peak MB':>8} {'vs base':>8}")
+    with tempfile.TemporaryDirectory(prefix="lcc-bench-") as workdir:
+        for corpus in args.corpus or CORPORA:
+            now = measure(args.lcc, corpus, args.lines, args.runs, workdir)
+            results[corpus] = now
+            base = baseline.get(corpus)
+            for name, p in now["phases"].items():
+                b = None if base is None else base["phases"].get(name)
+                print(f"{corpus:<8} {name:<8} {p['seconds'] * 1e3:9.2f} "
+                      f"{p['lines_per_sec']:11} {p['tokens_per_sec']:11} "
+                      f"{p['peak_rss_kb'] / 1024:8.1f} "
+                      f"{ratio(p, b, 'lines_per_sec'):>8}")
+            problems += compare(corpus, now, base, args.tolerance, args.min_ms)
+
+    if args.update:
+        with open(args.baseline, "w") as f:
+            json.dump({"lines": args.lines, "corpora": results}, f, indent=2)
+            f.write("\n")
+        print(f"baseline written to {args.baseline}")
+        return 0
+    for problem in problems:
+        print(f"regression: {problem}")
+    return 1 if problems else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,132 @@
+#!/usr/bin/env python3
+"""Synthetic LCC corpora for the compiler benchmarks.
+
+Each shape stresses one part of the front end and is repeated until the
+corpus reaches the requested number of lines:
+
+  defuns   many small functions
+  nesting  deeply nested lets and expressions
+  cond     long cond chains
+  let      wide lets
+  keys     &key functions and calls passing every key, in shuffled order
+  mixed    all of the above, interleaved
+
+The output only depends on the shape, the size and the seed, so a corpus
+can be regenerated instead of stored.
+
+  python3 bench/gen.py --shape cond --lines 20000 > cond.lc
+"""
+
+import argparse
+import random
+import sys
+
+SHAPES = ("defuns", "nesting", "cond", "let", "keys", "mixed")
+
+
+def defuns(rng, n):
+    a, b = rng.randint(1, 9), rng.randint(1, 9)
+    return [
+        f"(defun small-{n} (a b)",
+        f"  (declare (type i32 a b small-{n}))",
+        f"  (let ((s (+ a {a})))",
+        "    (declare (type i32 s))",
+        f"    (setf s (* s (- b {b})))",
+        "    (return (+ s b))))",
+    ]
+
+
+def nesting(rng, n, depth=32):
+    lines = [f"(defun nested-{n} (x)", f"  (declare (type i32 x nested-{n}))"]
+    for d in range(depth):
+        pad = "  " * (d + 1)
+        lines.append(f"{pad}(let ((v{d} (+ x {rng.randint(1, 99)})))")
+        lines.append(f"{pad}  (declare (type i32 v{d}))")
+        lines.append(f"{pad}  (setf x (- v{d} {rng.randint(1, 99)}))")
+    expr = "x"
+    for d in range(depth):
+        expr = f"(+ v{d} {expr})"
+    pad = "  " * (depth + 1)
+    lines.append(f"{pad}(return {expr})" + ")" * (depth + 1))
+    return lines
+
+
+def cond(rng, n, arms=64):
+    lines = [
+        f"(defun dispatch-{n} (x)",
+        f"  (declare (type i32 x dispatch-{n}))",
+        "  (cond (",
+    ]
+    for arm in range(arms):
+        lines.append(f"    ((= x {arm}) (return {rng.randint(0, 999)}))")
+    lines.append("    (t (return 0)))))")
+    return lines
+
+
+def wide_let(rng, n, width=48):
+    names = [f"w{i}" for i in range(width)]
+    lines = [f"(defun wide-{n} (a)", f"  (declare (type i32 a wide-{n}))", "  (let ("]
+    for name in names:
+        lines.append(f"      ({name} (+ a {rng.randint(0, 999)}))")
+    lines.append("    )")
+    lines.append(f"    (declare (type i32 {' '.join(names)}))")
+    total = names[0]
+    for name in names[1:]:
+        total = f"(+ {name} {total})"
+    lines.append(f"    (return {total})))")
+    return lines
+
+
+def keys(rng, n, width=8, calls=8):
+    params = " ".join(f"(k{i} p{i})" for i in range(width))
+    types = " ".join(f"p{i}" for i in range(width))
+    lines = [
+        f"(defun keyed-{n} (a &key {params})",
+        f"  (declare (type i32 a {types} keyed-{n}))",
+        f"  (return (+ a (* p0 p{width - 1}))))",
+        f"(defun caller-{n} (x)",
+        f"  (declare (type i32 x caller-{n}))",
+    ]
+    for _ in range(calls):
+        order = list(range(width))
+        rng.shuffle(order)
+        args = " ".join(f":k{i} {rng.randint(0, 99)}" for i in order)
+        lines.append(f"  (keyed-{n} x {args})")
+    # resolve_pass does not look into setf, keyword calls stay statements
+    lines.append(f"  (return (keyed-{n} x {args})))")
+    return lines
+
+
+GENERATORS = {
+    "defuns": defuns,
+    "nesting": nesting,
+    "cond": cond,
+    "let": wide_let,
+    "keys": keys,
+}
+
+
+def generate(shape, lines, seed=1):
+    """the corpus as a list of lines, at least `lines` long"""
+    rng = random.Random(f"{shape}:{seed}")
+    out = [f"; synthetic {shape} corpus, {lines} lines, seed {seed}"]
+    kinds = list(GENERATORS) if shape == "mixed" else [shape]
+    n = 0
+    while len(out) < lines:
+        out.extend(GENERATORS[kinds[n % len(kinds)]](rng, n))
+        n += 1
+    out.extend(["(defun main ()", "  (declare (type i32 main))", "  (return 0))"])
+    return out
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--shape", choices=SHAPES, default="mixed")
+    parser.add_argument("--lines", type=int, default=20000)
+    parser.add_argument("--seed", type=int, default=1)
+    args = parser.parse_args()
+    sys.stdout.write("\n".join(generate(args.shape, args.lines, args.seed)) + "\n")
+
+
+if __name__ == "__main__":
+    main()
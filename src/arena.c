@@ -0,0 +1,210 @@
+#include "debug.h"
+#include "opt.h"
+#include "tree.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Region allocation. (with-arena (a size) body) binds a to a fresh bump
+ * pointer arena whose first block holds size bytes, and (alloc a T [n])
+ * returns room for n elements of type T from it, aligned for T. Everything
+ * allocated from the arena is released at once when control leaves the body,
+ * at its end or through a return, so the body must not hand out pointers into
+ * the arena. a is a *lcc-arena and can be passed to functions.
+ *
+ * The runtime is printed ahead of the program. Blocks are chained and grow
+ * geometrically when an allocation does not fit in the current one.
+ */
+
+extern const char *lcc_current_file;
+
+static bool arenas_used = false;
+static int n_returns = 0;
+
+static struct tree *copy_type(struct tree *type) {
+  struct tree *copy = build_type_expr(type->loc, build_tid(NULL, MOD_NONE));
+  copy_type_to_type(copy, type);
+  return copy;
+}
+
+static struct tree *release(struct location loc, const char *arena) {
+  return build_fn_call(loc, strdup("lcc_arena_release"),
+                       build_var_ref(loc, strdup(arena)));
+}
+
+static bool is_return(struct tree *t) {
+  return t->type == REFERENCE_EXPR && t->reference_expr.type == FN_CALL &&
+         strcmp(t->reference_expr.call.name, "return") == 0;
+}
+
+/* (return x) becomes { _retN = x; release; return _retN; } so that x is
+ * computed while the arena is alive */
+static void release_before(struct tree **slot, const char *arena) {
+  struct tree *ret = *slot;
+  struct location loc = ret->loc;
+  struct tree *next = ret->next;
+  ret->next = NULL;
+  struct tree *vars = NULL;
+  if (ret->reference_expr.call.args != NULL) {
+    char name[32];
+    snprintf(name, sizeof(name), "_ret%d", n_returns++);
+    vars = build_var(loc, VAR_DECL, strdup(name),
+                     build_type_expr((struct location){0, 0, 0, 0},
+                                     build_tid(NULL, MOD_MONOMORPH)),
+                     ret->reference_expr.call.args);
+    ret->reference_expr.call.args = build_var_ref(loc, strdup(name));
+  }
+  struct tree *body = release(loc, arena);
+  body->next = ret;
+  struct tree *block = build_let_stmt(loc, vars, body);
+  block->next = next;
+  *slot = block;
+}
+
+static void release_returns(struct tree **chain, const char *arena) {
+  for (struct tree **slot = chain; *slot != NULL; slot = &(*slot)->next) {
+    struct tree *t = *slot;
+    if (is_return(t)) {
+      release_before(slot, arena);
+      continue;
+    }
+    switch (t->type) {
+    case LET_STMT:
+      release_returns(&t->let_stmt.body, arena);
+      break;
+    case IF_STMT:
+      release_returns(&t->if_else_stmt.if_block, arena);
+      release_returns(&t->if_else_stmt.else_block, arena);
+      break;
+    case COND_STMT:
+      for (struct tree *expr = t->cond_stmt.exprs; expr != NULL;
+           expr = expr->next)
+        release_returns(&expr->cond_expr.body, arena);
+      break;
+    case CASE_STMT:
+      for (struct tree *c = t->case_stmt.cases; c != NULL; c = c->next)
+        release_returns(&c->case_expr.body, arena);
+      break;
+    case WHILE_STMT:
+    case DOWHILE_STMT:
+      release_returns(&t->while_stmt.body, arena);
+      break;
+    case FOR_STMT:
+      release_returns(&t->for_stmt.body, arena);
+      break;
+    case FOREACH_STMT:
+      release_returns(&t->foreach_stmt.body, arena);
+      break;
+    default:
+      break;
+    }
+  }
+}
+
+struct tree *build_with_arena(struct location loc, char *name,
+                              struct tree *size, struct tree *body) {
+  translate_to_var_name(name);
+  size_t len = strlen(name) + sizeof("_storage");
+  char *storage = malloc(len);
+  snprintf(storage, len, "%s_storage", name);
+
+  // the arena lives in storage, the name the body sees is a pointer to it
+  struct tree *vars = build_var(
+      loc, VAR_DECL, storage,
+      build_type_expr(loc, build_tid(strdup("lcc_arena"), MOD_NONE)),
+      build_fn_call(loc, strdup("lcc_arena_create"), size));
+  struct tree *ptr_type =
+      build_type_expr(loc, build_tid(strdup("lcc_arena"), MOD_NONE));
+  add_type_ptr(ptr_type, SINGLE_PTR, 0);
+  vars->next = build_var(loc, VAR_DECL, name, ptr_type,
+                         build_addr(loc, build_var_ref(loc, strdup(storage))));
+
+  release_returns(&body, name);
+  body = append_tree(release(loc, name), body);
+  arenas_used = true;
+  return build_let_stmt(loc, vars, body);
+}
+
+struct tree *build_alloc(struct location loc, struct tree *arena,
+                         struct tree *type, struct tree *count) {
+  struct tree *size = build_fn_call(loc, strdup("sizeof"), copy_type(type));
+  if (count != NULL) {
+    count->next = size;
+    size = build_binop(loc, '*', count);
+  }
+  struct tree *align = build_fn_call(loc, strdup("_Alignof"), copy_type(type));
+  arena->next = size;
+  size->next = align;
+  add_type_ptr(type, SINGLE_PTR, 0);
+  arenas_used = true;
+  return build_cast(loc, type,
+                    build_fn_call(loc, strdup("lcc_arena_alloc"), arena));
+}
+
+void print_arena_runtime(bool emit_asm) {
+  if (!arenas_used || emit_asm)
+    return;
+  fprintf(stdout,
+          "#include <stddef.h>\n"
+          "#include <stdint.h>\n"
+          "#include <stdio.h>\n"
+          "#include <stdlib.h>\n"
+          "typedef struct lcc_arena_block {\n"
+          "  struct lcc_arena_block *next;\n"
+          "  size_t size, used;\n"
+          "  _Alignas(16) char data[];\n"
+          "} lcc_arena_block;\n"
+          "typedef struct lcc_arena {\n"
+          "  lcc_arena_block *head;\n"
+          "  size_t next_size;\n"
+          "} lcc_arena;\n"
+          "static inline lcc_arena lcc_arena_create(size_t size) {\n"
+          "  return (lcc_arena){NULL, size < 64 ? 64 : size};\n"
+          "}\n"
+          "static void *lcc_arena_grow(lcc_arena *a, size_t size, "
+          "size_t align) {\n"
+          "  size_t block = a->next_size;\n"
+          "  while (block < size + align)\n"
+          "    block *= 2;\n"
+          "  lcc_arena_block *b = malloc(sizeof(lcc_arena_block) + block);\n"
+          "  if (b == NULL) {\n"
+          "    fprintf(stderr, \"%s: arena out of memory\\n\");\n"
+          "    abort();\n"
+          "  }\n"
+          "  b->next = a->head;\n"
+          "  b->size = block;\n"
+          "  b->used = 0;\n"
+          "  a->head = b;\n"
+          "  a->next_size = block * 2;\n"
+          "  uintptr_t p = ((uintptr_t)b->data + align - 1) & "
+          "~(uintptr_t)(align - 1);\n"
+          "  b->used = p - (uintptr_t)b->data + size;\n"
+          "  return (void *)p;\n"
+          "}\n"
+          "static inline void *lcc_arena_alloc(lcc_arena *a, size_t size, "
+          "size_t align) {\n"
+          "  lcc_arena_block *b = a->head;\n"
+          "  if (b != NULL) {\n"
+          "    uintptr_t p = ((uintptr_t)b->data + b->used + align - 1) & "
+          "~(uintptr_t)(align - 1);\n"
+          "    if (p + size <= (uintptr_t)b->data + b->size) {\n"
+          "      b->used = p - (uintptr_t)b->data + size;\n"
+          "      return (void *)p;\n"
+          "    }\n"
+          "  }\n"
+          "  return lcc_arena_grow(a, size, align);\n"
+          "}\n"
+          "static inline void lcc_arena_release(lcc_arena *a) {\n"
+          "  for (lcc_arena_block *b = a->head, *next; b != NULL; b = next) "
+          "{\n"
+          "    next = b->next;\n"
+          "    free(b);\n"
+          "  }\n"
+          "  a->head = NULL;\n"
+          "}\n",
+          lcc_current_file);
+}
@@ -0,0 +1,770 @@
+#include "debug.h"
+#include "opt.h"
+#include "tree.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hashmap.h"
+
+/*
+ * Lowering of strided multi-dimensional arrays. A variable of type [,]T (one
+ * comma per extra dimension) becomes a plain *T together with long variables
+ * holding its extents and strides:
+ *
+ *   (let ((m (make-array rows cols))) (declare (type [,]f64 m)) ...)
+ *   => (let ((_m_dim0 rows) (_m_dim1 cols) (_m_stride0 _m_dim1)
+ *            (m (calloc (* _m_dim0 _m_dim1) 8))) ...)
+ *
+ * and (aref m i j) becomes (aref m (+ (* i _m_stride0) j)). Arrays are
+ * row-major unless declared with (declare (column-major m)); the contiguous
+ * dimension has no stride variable, so the innermost index stays a unit
+ * stride access. (array-dim m k) reads an extent, and array parameters are
+ * passed as the pointer followed by all extents and strides.
+ *
+ * Inside a for loop whose induction variable only changes by a constant step,
+ * i * stride is strength reduced to a running offset kept in a let wrapped
+ * around the loop and bumped at the end of the body.
+ */
+
+extern const char *lcc_current_file;
+
+struct array_var {
+  int rank;
+  char **dim;
+  char **stride; // NULL for the unit stride
+};
+
+struct sr_temp {
+  char *stride;
+  char *name;
+  struct sr_temp *next;
+};
+
+struct sr_loop {
+  struct tree *var;
+  struct tree *init;
+  struct tree *step;
+  int depth; // only arrays declared outside of the loop can be reduced
+  struct sr_temp *temps;
+  int n_temps;
+};
+
+struct array_scope {
+  char *name;
+  struct array_var *array;
+  struct sr_loop *loop;
+};
+
+static struct array_scope *scope = NULL;
+static int n_scope = 0, cap_scope = 0;
+
+/* ranks of the regular arguments of every function, 0 if not an array */
+struct array_fn {
+  int n_args;
+  int rank[];
+};
+
+static struct hashmap_s array_fns;
+static int n_sr_temps = 0;
+
+static void push_scope(char *name, struct array_var *array,
+                       struct sr_loop *loop) {
+  if (n_scope >= cap_scope) {
+    cap_scope = cap_scope == 0 ? 32 : cap_scope * 2;
+    scope = realloc(scope, cap_scope * sizeof(struct array_scope));
+  }
+  scope[n_scope++] = (struct array_scope){name, array, loop};
+}
+
+static void destroy_array_var(struct array_var *array) {
+  for (int k = 0; k < array->rank; k++) {
+    free(array->dim[k]);
+    free(array->stride[k]);
+  }
+  free(array->dim);
+  free(array->stride);
+  free(array);
+}
+
+static void pop_scope(int saved) {
+  while (n_scope > saved) {
+    n_scope--;
+    if (scope[n_scope].array != NULL)
+      destroy_array_var(scope[n_scope].array);
+  }
+}
+
+static int lookup(char *name) {
+  for (int i = n_scope - 1; i >= 0; i--) {
+    if (strcmp(scope[i].name, name) == 0)
+      return i;
+  }
+  return -1;
+}
+
+static bool is_var_ref(struct tree *t) {
+  return t != NULL && t->type == REFERENCE_EXPR &&
+         t->reference_expr.type == VAR_REF;
+}
+
+static bool is_int_cst(struct tree *t) {
+  return t != NULL && t->type == REFERENCE_EXPR &&
+         t->reference_expr.type == INTEGER_CST;
+}
+
+static int array_index(struct tree *t) {
+  if (!is_var_ref(t))
+    return -1;
+  int i = lookup(t->reference_expr.symbol);
+  return i >= 0 && scope[i].array != NULL ? i : -1;
+}
+
+static int array_rank(struct tree *type) {
+  if (type == NULL || type->type != TYPE_EXPR ||
+      type->type_expr.ptr == NULL ||
+      type->type_expr.ptr->type != STRIDED_PTR)
+    return 0;
+  return type->type_expr.ptr->size;
+}
+
+static struct tree *long_type(struct location loc) {
+  return build_type_expr(loc, build_tid(strdup("long"), MOD_NONE));
+}
+
+static int elem_size(struct tree *type) {
+  if (type->type_expr.ptr->next != NULL)
+    return 8;
+  return type_id_size(type->type_expr.id);
+}
+
+static char *array_name(char *var, const char *what, int k) {
+  size_t len = strlen(var) + strlen(what) + 16;
+  char *name = malloc(len);
+  snprintf(name, len, "_%s_%s%d", var, what, k);
+  return name;
+}
+
+static struct array_var *new_array_var(char *var, int rank) {
+  struct array_var *array = malloc(sizeof(struct array_var));
+  array->rank = rank;
+  array->dim = calloc(rank, sizeof(char *));
+  array->stride = calloc(rank, sizeof(char *));
+  for (int k = 0; k < rank; k++)
+    array->dim[k] = array_name(var, "dim", k);
+  return array;
+}
+
+static bool column_major(struct tree *decls, char *name) {
+  for (struct tree *t = decls; t != NULL; t = t->next) {
+    if (t->type != ATTR_DECL || strcmp(t->attr_decl.name, "column-major") != 0)
+      continue;
+    for (struct tree *arg = t->attr_decl.args; arg != NULL; arg = arg->next) {
+      if (is_var_ref(arg) && strcmp(arg->reference_expr.symbol, name) == 0)
+        return true;
+    }
+  }
+  return false;
+}
+
+static struct tree *append_decl(struct tree *chain, struct location loc,
+                                char *name, struct tree *value) {
+  return append_tree(
+      build_var(loc, VAR_DECL, strdup(name), long_type(loc), value), chain);
+}
+
+/* (make-array d0 d1 ...) allocates zeroed storage for the declared layout */
+static struct tree *lower_make_array(struct tree *decl, struct tree *call,
+                                     struct array_var *array, bool columns) {
+  struct location loc = decl->loc;
+  int rank = array->rank;
+  struct tree *args = call->reference_expr.call.args;
+  call->reference_expr.call.args = NULL;
+
+  int n_args = 0;
+  for (struct tree *arg = args; arg != NULL; arg = arg->next)
+    n_args++;
+  if (n_args != rank) {
+    errorat("make-array for the %d-dimensional array '%s' takes %d extent(s)",
+            lcc_current_file, loc.first_line, loc.first_column, rank,
+            decl->var_decl.name, rank);
+    destroy_tree(args);
+    return NULL;
+  }
+
+  struct tree *chain = NULL;
+  for (int k = 0; k < rank; k++) {
+    struct tree *next = args->next;
+    args->next = NULL;
+    chain = append_decl(chain, loc, array->dim[k], args);
+    args = next;
+  }
+
+  // the contiguous dimension has stride 1, every other one the product of
+  // the extents that vary faster
+  int first = columns ? 1 : rank - 2;
+  int last = columns ? rank : -1;
+  int dir = columns ? 1 : -1;
+  for (int k = first; k != last; k += dir) {
+    int inner = k - dir;
+    array->stride[k] = array_name(decl->var_decl.name, "stride", k);
+    struct tree *value = build_var_ref(loc, strdup(array->dim[inner]));
+    if (array->stride[inner] != NULL)
+      value = build_binop(
+          loc, '*',
+          append_tree(build_var_ref(loc, strdup(array->stride[inner])),
+                      value));
+    chain = append_decl(chain, loc, array->stride[k], value);
+  }
+
+  int size = elem_size(decl->var_decl.type);
+  if (size < 0) {
+    errorat("size of the element type '%s' of '%s' is unknown",
+            lcc_current_file, loc.first_line, loc.first_column,
+            decl->var_decl.type->type_expr.id->name, decl->var_decl.name);
+    size = 1;
+  }
+  struct tree *total = NULL;
+  for (int k = rank - 1; k >= 0; k--)
+    total = append_tree(total, build_var_ref(loc, strdup(array->dim[k])));
+  struct tree *alloc_args =
+      append_tree(build_int_cst(loc, size), build_binop(loc, '*', total));
+  decl->var_decl.value = build_fn_call(loc, strdup("calloc"), alloc_args);
+  return chain;
+}
+
+/* another array of the same rank shares its storage and layout */
+static struct tree *lower_array_alias(struct tree *decl, struct tree *ref,
+                                      struct array_var *array) {
+  struct location loc = decl->loc;
+  struct array_var *src = scope[array_index(ref)].array;
+  if (src->rank != array->rank) {
+    errorat("cannot initialise the %d-dimensional array '%s' from a "
+            "%d-dimensional one",
+            lcc_current_file, loc.first_line, loc.first_column, array->rank,
+            decl->var_decl.name, src->rank);
+    return NULL;
+  }
+  struct tree *chain = NULL;
+  for (int k = 0; k < array->rank; k++)
+    chain = append_decl(chain, loc, array->dim[k],
+                        build_var_ref(loc, strdup(src->dim[k])));
+  for (int k = 0; k < array->rank; k++) {
+    if (src->stride[k] == NULL)
+      continue;
+    array->stride[k] = array_name(decl->var_decl.name, "stride", k);
+    chain = append_decl(chain, loc, array->stride[k],
+                        build_var_ref(loc, strdup(src->stride[k])));
+  }
+  return chain;
+}
+
+static void lower(struct tree **slot);
+static void lower_chain(struct tree **chain, struct tree *decls);
+
+/* returns the slot of the declaration, after the variables it introduced */
+static struct tree **lower_array_decl(struct tree **slot, struct tree *decls) {
+  struct tree *decl = *slot;
+  int rank = array_rank(decl->var_decl.type);
+  struct array_var *array = new_array_var(decl->var_decl.name, rank);
+  struct tree *value = decl->var_decl.value;
+
+  struct tree *chain = NULL;
+  decl->var_decl.value = NULL;
+  if (value != NULL && value->type == REFERENCE_EXPR &&
+      value->reference_expr.type == FN_CALL &&
+      strcmp(value->reference_expr.call.name, "make_array") == 0) {
+    lower_chain(&value->reference_expr.call.args, NULL);
+    chain = lower_make_array(decl, value, array,
+                             column_major(decls, decl->var_decl.name));
+    destroy_tree(value);
+  } else if (array_index(value) >= 0) {
+    chain = lower_array_alias(decl, value, array);
+    decl->var_decl.value = value;
+  } else {
+    errorat("array '%s' must be initialised with make-array or another array",
+            lcc_current_file, decl->loc.first_line, decl->loc.first_column,
+            decl->var_decl.name);
+    decl->var_decl.value = value;
+  }
+
+  decl->var_decl.type->type_expr.ptr->type = SINGLE_PTR;
+  decl->var_decl.type->type_expr.ptr->size = 0;
+  push_scope(decl->var_decl.name, array, NULL);
+  if (chain == NULL)
+    return slot;
+
+  *slot = append_tree(decl, chain);
+  while (*slot != decl)
+    slot = &(*slot)->next;
+  return slot;
+}
+
+static void lower_chain(struct tree **chain, struct tree *decls) {
+  for (struct tree **slot = chain; *slot != NULL; slot = &(*slot)->next) {
+    struct tree *t = *slot;
+    if ((t->type == VAR_DECL || t->type == PARM_DECL) &&
+        array_rank(t->var_decl.type) > 0)
+      slot = lower_array_decl(slot, decls);
+    else
+      lower(slot);
+  }
+}
+
+static char *sr_temp(struct sr_loop *loop, char *stride) {
+  for (struct sr_temp *temp = loop->temps; temp != NULL; temp = temp->next) {
+    if (strcmp(temp->stride, stride) == 0)
+      return temp->name;
+  }
+  struct sr_temp *temp = malloc(sizeof(struct sr_temp));
+  char name[32];
+  snprintf(name, sizeof(name), "_sr%d", n_sr_temps++);
+  temp->name = strdup(name);
+  temp->stride = strdup(stride);
+  temp->next = loop->temps;
+  loop->temps = temp;
+  loop->n_temps++;
+  return temp->name;
+}
+
+/* v, (+ v c), (+ c v) or (- v c) for a reducible induction variable v */
+static struct sr_loop *reducible(struct tree *index, int array, int *offset) {
+  *offset = 0;
+  struct tree *var = index;
+  if (index->type == BINOP_EXPR &&
+      (index->binop_expr.op == '+' || index->binop_expr.op == '-')) {
+    struct tree *lhs = index->binop_expr.body;
+    struct tree *rhs = lhs == NULL ? NULL : lhs->next;
+    if (rhs == NULL || rhs->next != NULL)
+      return NULL;
+    if (index->binop_expr.op == '+' && is_int_cst(lhs)) {
+      struct tree *tmp = lhs;
+      lhs = rhs;
+      rhs = tmp;
+    }
+    if (!is_int_cst(rhs))
+      return NULL;
+    var = lhs;
+    *offset = index->binop_expr.op == '+' ? rhs->reference_expr.ival
+                                          : -rhs->reference_expr.ival;
+  }
+  if (!is_var_ref(var))
+    return NULL;
+  int i = lookup(var->reference_expr.symbol);
+  if (i < 0 || scope[i].loop == NULL || array >= scope[i].loop->depth)
+    return NULL;
+  return scope[i].loop;
+}
+
+static struct tree *stride_term(struct tree *index, int array, int k) {
+  char *stride = scope[array].array->stride[k];
+  struct location loc = index->loc;
+  if (stride == NULL)
+    return index;
+
+  int offset;
+  struct sr_loop *loop = reducible(index, array, &offset);
+  if (loop == NULL)
+    return build_binop(
+        loc, '*', append_tree(build_var_ref(loc, strdup(stride)), index));
+
+  destroy_tree(index);
+  struct tree *term = build_var_ref(loc, strdup(sr_temp(loop, stride)));
+  if (offset == 0)
+    return term;
+  struct tree *scaled = build_binop(
+      loc, '*',
+      append_tree(build_var_ref(loc, strdup(stride)),
+                  build_int_cst(loc, offset < 0 ? -offset : offset)));
+  return build_binop(loc, offset < 0 ? '-' : '+', append_tree(scaled, term));
+}
+
+static void lower_aref(struct tree *t) {
+  lower(&t->ref_expr.expr);
+  lower_chain(&t->ref_expr.indices, NULL);
+  int array = array_index(t->ref_expr.expr);
+  if (array < 0)
+    return;
+
+  int rank = scope[array].array->rank, n_indices = 0;
+  for (struct tree *index = t->ref_expr.indices; index != NULL;
+       index = index->next)
+    n_indices++;
+  if (n_indices != rank) {
+    errorat("aref of the %d-dimensional array '%s' with %d index(es)",
+            lcc_current_file, t->loc.first_line, t->loc.first_column, rank,
+            t->ref_expr.expr->reference_expr.symbol, n_indices);
+    return;
+  }
+
+  struct tree *terms = NULL, *index = t->ref_expr.indices;
+  for (int k = 0; k < rank; k++) {
+    struct tree *next = index->next;
+    index->next = NULL;
+    terms = append_tree(stride_term(index, array, k), terms);
+    index = next;
+  }
+  t->ref_expr.indices =
+      rank == 1 ? terms : build_binop(t->loc, '+', terms);
+}
+
+static void lower_call(struct tree **slot) {
+  struct tree *t = *slot;
+  char *name = t->reference_expr.call.name;
+  lower_chain(&t->reference_expr.call.args, NULL);
+  struct tree *args = t->reference_expr.call.args;
+
+  if (strcmp(name, "array_dim") == 0) {
+    int array = array_index(args);
+    struct tree *k = args == NULL ? NULL : args->next;
+    if (array < 0 || !is_int_cst(k) || k->next != NULL ||
+        k->reference_expr.ival < 0 ||
+        k->reference_expr.ival >= scope[array].array->rank) {
+      errorat("expected (array-dim array dimension) with a constant dimension",
+              lcc_current_file, t->loc.first_line, t->loc.first_column);
+      return;
+    }
+    struct tree *ref = build_var_ref(
+        t->loc, strdup(scope[array].array->dim[k->reference_expr.ival]));
+    ref->next = t->next;
+    t->next = NULL;
+    *slot = ref;
+    destroy_tree(t);
+    return;
+  }
+
+  struct array_fn *fn = hashmap_get(&array_fns, name, strlen(name));
+  if (fn == NULL)
+    return;
+  int i = 0;
+  for (struct tree *arg = args; arg != NULL && i < fn->n_args;
+       arg = arg->next, i++) {
+    if (fn->rank[i] == 0)
+      continue;
+    int array = array_index(arg);
+    if (array < 0 || scope[array].array->rank != fn->rank[i]) {
+      errorat("argument %d of %s must be a %d-dimensional array",
+              lcc_current_file, arg->loc.first_line, arg->loc.first_column,
+              i + 1, name, fn->rank[i]);
+      continue;
+    }
+    // the extents and strides follow the pointer
+    struct array_var *src = scope[array].array;
+    struct tree *extra = NULL;
+    for (int k = src->rank - 1; k >= 0; k--)
+      extra = append_tree(extra,
+                          src->stride[k] == NULL
+                              ? build_int_cst(arg->loc, 1)
+                              : build_var_ref(arg->loc, strdup(src->stride[k])));
+    for (int k = src->rank - 1; k >= 0; k--)
+      extra = append_tree(extra, build_var_ref(arg->loc, strdup(src->dim[k])));
+    struct tree *next = arg->next;
+    arg->next = extra;
+    while (arg->next != NULL)
+      arg = arg->next;
+    arg->next = next;
+  }
+}
+
+struct write_search {
+  char *name;
+  bool found;
+};
+
+static bool find_write(struct tree *t, void *data) {
+  struct write_search *search = data;
+  struct tree *target = NULL;
+  if (t->type == SET_EXPR)
+    target = t->set_expr.var;
+  else if (t->type == ADDR_EXPR)
+    target = t->ref_expr.expr;
+  if (is_var_ref(target) &&
+      strcmp(target->reference_expr.symbol, search->name) == 0)
+    search->found = true;
+  return !search->found;
+}
+
+/* a single induction variable stepped by a constant and not written in the
+ * body, starting from a constant or a variable */
+static struct sr_loop *sr_loop(struct tree *t) {
+  struct tree *var = t->for_stmt.vars, *step = t->for_stmt.loop_eval;
+  if (var == NULL || var->next != NULL || var->type != VAR_DECL ||
+      var->var_decl.value == NULL || step == NULL || step->next != NULL ||
+      step->type != SET_EXPR || !is_var_ref(step->set_expr.var) ||
+      strcmp(step->set_expr.var->reference_expr.symbol, var->var_decl.name) !=
+          0 ||
+      (step->set_expr.mod != '+' && step->set_expr.mod != '-') ||
+      !is_int_cst(step->set_expr.value))
+    return NULL;
+  struct tree *init = var->var_decl.value;
+  if (!is_int_cst(init) &&
+      (!is_var_ref(init) ||
+       strcmp(init->reference_expr.symbol, var->var_decl.name) == 0))
+    return NULL;
+  struct write_search search = {var->var_decl.name, false};
+  walk_tree(t->for_stmt.body, find_write, &search);
+  if (search.found)
+    return NULL;
+
+  struct sr_loop *loop = calloc(1, sizeof(struct sr_loop));
+  loop->var = var;
+  loop->init = init;
+  loop->step = step;
+  loop->depth = n_scope;
+  return loop;
+}
+
+static struct tree *copy_operand(struct tree *t) {
+  if (is_int_cst(t))
+    return build_int_cst(t->loc, t->reference_expr.ival);
+  return build_var_ref(t->loc, strdup(t->reference_expr.symbol));
+}
+
+/* wraps the loop in a let holding the running offsets */
+static void reduce_loop(struct tree **slot, struct sr_loop *loop) {
+  struct tree *t = *slot;
+  struct location loc = t->loc;
+  struct tree *vars = NULL;
+  for (struct sr_temp *temp = loop->temps; temp != NULL;) {
+    struct tree *value = copy_operand(loop->init);
+    if (!is_int_cst(value) || value->reference_expr.ival != 0)
+      value = build_binop(
+          loc, '*',
+          append_tree(build_var_ref(loc, strdup(temp->stride)), value));
+    vars = append_tree(vars, build_var(loc, VAR_DECL, strdup(temp->name),
+                                       long_type(loc), value));
+
+    struct tree *amount = build_var_ref(loc, strdup(temp->stride));
+    int step = loop->step->set_expr.value->reference_expr.ival;
+    if (step != 1)
+      amount = build_binop(loc, '*',
+                           append_tree(amount, build_int_cst(loc, step)));
+    t->for_stmt.body = append_tree(
+        build_set_expr(loc, build_var_ref(loc, strdup(temp->name)), amount,
+                       loop->step->set_expr.mod),
+        t->for_stmt.body);
+
+    struct sr_temp *next = temp->next;
+    free(temp->name);
+    free(temp->stride);
+    free(temp);
+    temp = next;
+  }
+
+  info("%s:%d: strength reduced %d array stride(s)", lcc_current_file,
+       loc.first_line, loop->n_temps);
+  struct tree *let = build_let_stmt(loc, vars, t);
+  let->next = t->next;
+  t->next = NULL;
+  *slot = let;
+}
+
+static void lower_for(struct tree **slot) {
+  struct tree *t = *slot;
+  lower_chain(&t->for_stmt.vars, NULL);
+  lower(&t->for_stmt.condition);
+  lower(&t->for_stmt.loop_eval);
+
+  struct sr_loop *loop = sr_loop(t);
+  if (loop != NULL)
+    push_scope(loop->var->var_decl.name, NULL, loop);
+  lower_chain(&t->for_stmt.body, NULL);
+  if (loop == NULL)
+    return;
+  if (loop->temps != NULL)
+    reduce_loop(slot, loop);
+  free(loop);
+}
+
+static void lower(struct tree **slot) {
+  struct tree *t = *slot;
+  if (t == NULL)
+    return;
+  int saved = n_scope;
+  switch (t->type) {
+  case VAR_DECL:
+  case PARM_DECL:
+    lower(&t->var_decl.value);
+    push_scope(t->var_decl.name, NULL, NULL);
+    // declarations stay visible for the rest of the enclosing body
+    return;
+  case SET_EXPR:
+    lower(&t->set_expr.var);
+    lower(&t->set_expr.value);
+    break;
+  case AREF_EXPR:
+    lower_aref(t);
+    break;
+  case ADDR_EXPR:
+    lower(&t->ref_expr.expr);
+    break;
+  case FIELD_EXPR:
+    lower(&t->field_expr.expr);
+    break;
+  case CAST_EXPR:
+    lower(&t->cast_expr.expr);
+    break;
+  case LIST_EXPR:
+    lower_chain(&t->list_expr.elems, NULL);
+    break;
+  case BINOP_EXPR:
+    lower_chain(&t->binop_expr.body, NULL);
+    break;
+  case COMPARE_EXPR:
+    lower(&t->compare_expr.lhs);
+    lower(&t->compare_expr.rhs);
+    break;
+  case REFERENCE_EXPR:
+    if (t->reference_expr.type == FN_CALL)
+      lower_call(slot);
+    break;
+  case LET_STMT:
+    lower_chain(&t->let_stmt.vars, t->let_stmt.body);
+    lower_chain(&t->let_stmt.body, NULL);
+    break;
+  case IF_STMT:
+    lower(&t->if_else_stmt.condition);
+    lower_chain(&t->if_else_stmt.if_block, NULL);
+    pop_scope(saved);
+    lower_chain(&t->if_else_stmt.else_block, NULL);
+    break;
+  case COND_STMT:
+    for (struct tree *expr = t->cond_stmt.exprs; expr != NULL;
+         expr = expr->next) {
+      lower(&expr->cond_expr.condition);
+      lower_chain(&expr->cond_expr.body, NULL);
+      pop_scope(saved);
+    }
+    break;
+  case CASE_STMT:
+    lower(&t->case_stmt.expr);
+    for (struct tree *c = t->case_stmt.cases; c != NULL; c = c->next) {
+      lower_chain(&c->case_expr.body, NULL);
+      pop_scope(saved);
+    }
+    break;
+  case WHILE_STMT:
+  case DOWHILE_STMT:
+    lower(&t->while_stmt.condition);
+    lower_chain(&t->while_stmt.body, NULL);
+    break;
+  case FOR_STMT:
+    lower_for(slot);
+    break;
+  default:
+    break;
+  }
+  pop_scope(saved);
+}
+
+static void lower_params(struct tree **chain) {
+  for (struct tree **slot = chain; *slot != NULL; slot = &(*slot)->next) {
+    struct tree *parm = *slot;
+    int rank = array_rank(parm->var_decl.type);
+    if (rank == 0) {
+      push_scope(parm->var_decl.name, NULL, NULL);
+      continue;
+    }
+    struct array_var *array = new_array_var(parm->var_decl.name, rank);
+    struct tree *extra = NULL;
+    for (int k = 0; k < rank; k++)
+      extra = append_tree(build_var(parm->loc, PARM_DECL,
+                                    strdup(array->dim[k]), long_type(parm->loc),
+                                    NULL),
+                          extra);
+    for (int k = 0; k < rank; k++) {
+      array->stride[k] = array_name(parm->var_decl.name, "stride", k);
+      extra = append_tree(build_var(parm->loc, PARM_DECL,
+                                    strdup(array->stride[k]),
+                                    long_type(parm->loc), NULL),
+                          extra);
+    }
+    parm->var_decl.type->type_expr.ptr->type = SINGLE_PTR;
+    parm->var_decl.type->type_expr.ptr->size = 0;
+    push_scope(parm->var_decl.name, array, NULL);
+
+    struct tree *next = parm->next;
+    parm->next = extra;
+    while (*slot != NULL && (*slot)->next != NULL)
+      slot = &(*slot)->next;
+    (*slot)->next = next;
+  }
+}
+
+static void check_no_array(struct tree *chain, const char *kind) {
+  for (struct tree *t = chain; t != NULL; t = t->next) {
+    struct tree *decl = t->type == LAMBDA_KEY ? t->lambda_key.expr : t;
+    if (decl == NULL || (decl->type != VAR_DECL && decl->type != PARM_DECL) ||
+        array_rank(decl->var_decl.type) == 0)
+      continue;
+    errorat("array '%s' cannot be %s argument", lcc_current_file,
+            decl->loc.first_line, decl->loc.first_column, decl->var_decl.name,
+            kind);
+  }
+}
+
+static void collect_array_fn(struct tree *fn) {
+  struct tree *list = fn->fn_decl.arglist;
+  if (list == NULL || list->type != LAMBDA_LIST)
+    return;
+  check_no_array(list->lambda_list.optionals, "an &optional");
+  check_no_array(list->lambda_list.keys, "a &key");
+  check_no_array(list->lambda_list.rest, "a &rest");
+
+  int n_args = 0;
+  bool has_array = false;
+  for (struct tree *arg = list->lambda_list.args; arg != NULL; arg = arg->next) {
+    n_args++;
+    has_array |= array_rank(arg->var_decl.type) > 0;
+  }
+  if (!has_array)
+    return;
+  struct array_fn *ranks =
+      malloc(sizeof(struct array_fn) + n_args * sizeof(int));
+  ranks->n_args = n_args;
+  int i = 0;
+  for (struct tree *arg = list->lambda_list.args; arg != NULL; arg = arg->next)
+    ranks->rank[i++] = array_rank(arg->var_decl.type);
+  hashmap_put(&array_fns, fn->fn_decl.name, strlen(fn->fn_decl.name), ranks);
+}
+
+static int free_array_fn(void *const context, void *const value) {
+  free(value);
+  return 1;
+}
+
+void lower_arrays(struct tree *t) {
+  if (hashmap_create(64, &array_fns) != 0) {
+    error("Failed to create hashmap.");
+    return;
+  }
+  for (struct tree *head = t; head != NULL; head = head->next) {
+    if (head->type == FN_DECL)
+      collect_array_fn(head);
+  }
+
+  for (struct tree *head = t; head != NULL; head = head->next) {
+    if (head->type == VAR_DECL && array_rank(head->var_decl.type) > 0) {
+      errorat("array '%s' with strides must be local", lcc_current_file,
+              head->loc.first_line, head->loc.first_column,
+              head->var_decl.name);
+      continue;
+    }
+    if (head->type != FN_DECL || head->fn_decl.arglist == NULL)
+      continue;
+    struct tree *list = head->fn_decl.arglist;
+    lower_params(&list->lambda_list.args);
+    lower_chain(&list->lambda_list.aux, NULL);
+    lower_chain(&head->fn_decl.body, NULL);
+    pop_scope(0);
+  }
+  free(scope);
+  scope = NULL;
+  n_scope = cap_scope = 0;
+
+  hashmap_iterate(&array_fns, free_array_fn, NULL);
+  hashmap_destroy(&array_fns);
+}
@@ -0,0 +1,1409 @@
+#include "debug.h"
+#include "timer.h"
+#include "tree.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hashmap.h"
+
+/*
+ * x86-64 (System V, GNU as) backend.
+ *
+ * This is a single pass stack machine code generator meant for debug builds:
+ * every expression leaves its value in %rax (integers and pointers) or %xmm0
+ * (floating point, always held as a double), and intermediate values are
+ * pushed on the machine stack. No register allocation is done.
+ */
+
+extern const char *lcc_current_file;
+
+enum asm_kind {
+  KIND_VOID,
+  KIND_INT,
+  KIND_FLOAT,
+  KIND_PTR,
+  KIND_ARRAY,
+};
+
+struct asm_type {
+  struct type_id *id;
+  struct type_ptr *ptr;
+};
+
+struct asm_var {
+  char *name;
+  int offset;
+  bool global;
+  bool thread_local;
+  struct asm_type type;
+};
+
+struct asm_const {
+  int label;
+  struct tree *cst;
+  struct asm_const *next;
+};
+
+struct asm_arg {
+  struct tree *tree;
+  struct asm_type type;
+  bool declared; // passed to a parameter of a known type
+  bool stack;
+};
+
+static struct type_id tid_int = {"int", MOD_NONE};
+static struct type_id tid_uint = {"unsigned int", MOD_NONE};
+static struct type_id tid_long = {"long", MOD_NONE};
+static struct type_id tid_ulong = {"unsigned long", MOD_NONE};
+static struct type_id tid_double = {"double", MOD_NONE};
+static struct type_id tid_char = {"char", MOD_NONE};
+static struct type_id tid_bool = {"_Bool", MOD_NONE};
+static struct type_id tid_void = {"void", MOD_NONE};
+static struct type_ptr ptr_single = {SINGLE_PTR, NULL, 0};
+
+#define TYPE_INT ((struct asm_type){&tid_int, NULL})
+#define TYPE_UINT ((struct asm_type){&tid_uint, NULL})
+#define TYPE_LONG ((struct asm_type){&tid_long, NULL})
+#define TYPE_ULONG ((struct asm_type){&tid_ulong, NULL})
+#define TYPE_DOUBLE ((struct asm_type){&tid_double, NULL})
+#define TYPE_CHAR ((struct asm_type){&tid_char, NULL})
+#define TYPE_BOOL ((struct asm_type){&tid_bool, NULL})
+#define TYPE_VOID ((struct asm_type){&tid_void, NULL})
+#define TYPE_STRING ((struct asm_type){&tid_char, &ptr_single})
+
+static const char *int_regs[] = {"%rdi", "%rsi", "%rdx",
+                                 "%rcx", "%r8",  "%r9"};
+#define N_INT_REGS 6
+#define N_FLOAT_REGS 8
+
+static struct hashmap_s functions;
+static struct hashmap_s globals;
+
+static struct asm_var *vars = NULL;
+static int n_vars = 0, cap_vars = 0;
+
+static struct asm_const *constants = NULL;
+
+static int label_count = 0;
+static int frame_offset = 0;
+static int depth = 0;
+static struct tree *current_fn = NULL;
+
+#define emit(fmt, ...)                                                         \
+  fprintf(stdout, "\t" fmt "\n" __VA_OPT__(, ) __VA_ARGS__)
+#define emit_label(n) fprintf(stdout, ".L%d:\n", (n))
+
+#define asm_errorat(t, msg, ...)                                               \
+  errorat(msg, lcc_current_file, (t)->loc.first_line,                          \
+          (t)->loc.first_column __VA_OPT__(, ) __VA_ARGS__)
+
+/* type helpers */
+
+static struct asm_type type_of_tree(struct tree *type) {
+  if (type == NULL || type->type != TYPE_EXPR || is_monomorph(type))
+    return (struct asm_type){NULL, NULL};
+  return (struct asm_type){type->type_expr.id, type->type_expr.ptr};
+}
+
+static bool type_known(struct asm_type type) { return type.id != NULL; }
+
+struct base_type {
+  const char *name;
+  enum asm_kind kind;
+  int size;
+  bool is_unsigned;
+};
+
+static const struct base_type base_types[] = {
+    {"void", KIND_VOID, 0, false},
+    {"char", KIND_INT, 1, false},
+    {"signed char", KIND_INT, 1, false},
+    {"short", KIND_INT, 2, false},
+    {"int", KIND_INT, 4, false},
+    {"long", KIND_INT, 8, false},
+    {"long long", KIND_INT, 8, false},
+    {"unsigned char", KIND_INT, 1, true},
+    {"unsigned short", KIND_INT, 2, true},
+    {"unsigned int", KIND_INT, 4, true},
+    {"unsigned", KIND_INT, 4, true},
+    {"unsigned long", KIND_INT, 8, true},
+    {"unsigned long long", KIND_INT, 8, true},
+    {"_Bool", KIND_INT, 1, true},
+    {"bool", KIND_INT, 1, true},
+    {"int8_t", KIND_INT, 1, false},
+    {"int16_t", KIND_INT, 2, false},
+    {"int32_t", KIND_INT, 4, false},
+    {"int64_t", KIND_INT, 8, false},
+    {"uint8_t", KIND_INT, 1, true},
+    {"uint16_t", KIND_INT, 2, true},
+    {"uint32_t", KIND_INT, 4, true},
+    {"uint64_t", KIND_INT, 8, true},
+    {"size_t", KIND_INT, 8, true},
+    {"ssize_t", KIND_INT, 8, false},
+    {"intptr_t", KIND_INT, 8, false},
+    {"uintptr_t", KIND_INT, 8, true},
+    {"float", KIND_FLOAT, 4, false},
+    {"double", KIND_FLOAT, 8, false},
+};
+
+static const struct base_type *get_base_type(struct type_id *id) {
+  if (id == NULL || id->name == NULL || id->lanes != 0)
+    return NULL;
+  for (size_t i = 0; i < sizeof(base_types) / sizeof(base_types[0]); i++) {
+    if (strcmp(base_types[i].name, id->name) == 0)
+      return &base_types[i];
+  }
+  return NULL;
+}
+
+static enum asm_kind type_kind(struct asm_type type) {
+  if (type.ptr != NULL)
+    return type.ptr->type == SIZED_PTR ? KIND_ARRAY : KIND_PTR;
+  const struct base_type *base = get_base_type(type.id);
+  if (base == NULL)
+    return KIND_VOID;
+  return base->kind;
+}
+
+static struct asm_type elem_type(struct asm_type type) {
+  return (struct asm_type){type.id, type.ptr == NULL ? NULL : type.ptr->next};
+}
+
+static int type_size(struct asm_type type) {
+  if (type.ptr != NULL) {
+    if (type.ptr->type == SIZED_PTR)
+      return type.ptr->size * type_size(elem_type(type));
+    return 8;
+  }
+  const struct base_type *base = get_base_type(type.id);
+  if (base == NULL)
+    return -1;
+  return base->size;
+}
+
+static bool type_unsigned(struct asm_type type) {
+  if (type.ptr != NULL)
+    return true;
+  const struct base_type *base = get_base_type(type.id);
+  return base != NULL && base->is_unsigned;
+}
+
+static bool is_float(struct asm_type type) {
+  return type_kind(type) == KIND_FLOAT;
+}
+
+static bool is_pointer(struct asm_type type) {
+  enum asm_kind kind = type_kind(type);
+  return kind == KIND_PTR || kind == KIND_ARRAY;
+}
+
+static bool check_type(struct tree *t, struct asm_type type) {
+  if (!type_known(type))
+    return false;
+  if (type.id != NULL && type.id->lanes != 0) {
+    asm_errorat(t, "vector types are not supported by the asm backend");
+    return false;
+  }
+  if (type.ptr == NULL && get_base_type(type.id) == NULL) {
+    asm_errorat(t, "type '%s' is not supported by the asm backend",
+                type.id->name);
+    return false;
+  }
+  return true;
+}
+
+/* variables */
+
+static struct asm_var *find_var(const char *name) {
+  for (int i = n_vars - 1; i >= 0; i--) {
+    if (strcmp(vars[i].name, name) == 0)
+      return &vars[i];
+  }
+  return hashmap_get(&globals, name, strlen(name));
+}
+
+static struct asm_var *push_var(char *name, struct asm_type type) {
+  if (n_vars >= cap_vars) {
+    cap_vars = cap_vars == 0 ? 32 : cap_vars * 2;
+    vars = realloc(vars, cap_vars * sizeof(struct asm_var));
+  }
+  int size = type_size(type);
+  if (size <= 0)
+    size = 8;
+  frame_offset += (size + 7) & ~7;
+
+  struct asm_var *var = &vars[n_vars++];
+  var->name = name;
+  var->offset = -frame_offset;
+  var->global = false;
+  var->thread_local = false;
+  var->type = type;
+  return var;
+}
+
+static struct tree *find_fn(const char *name) {
+  return hashmap_get(&functions, name, strlen(name));
+}
+
+static struct asm_type fn_return_type(struct tree *fn) {
+  struct asm_type type = type_of_tree(fn->fn_decl.type);
+  if (!type_known(type))
+    return TYPE_VOID;
+  return type;
+}
+
+static int new_label(void) { return label_count++; }
+
+/* constants are collected and written to .rodata after the code */
+static int add_constant(struct tree *cst) {
+  for (struct asm_const *c = constants; c != NULL; c = c->next) {
+    if (c->cst->reference_expr.type != cst->reference_expr.type)
+      continue;
+    if (cst->reference_expr.type == STRING_CST &&
+        strcmp(c->cst->reference_expr.symbol, cst->reference_expr.symbol) == 0)
+      return c->label;
+    if (cst->reference_expr.type == FLOAT_CST &&
+        c->cst->reference_expr.fval == cst->reference_expr.fval)
+      return c->label;
+  }
+  struct asm_const *c = calloc(1, sizeof(struct asm_const));
+  c->label = new_label();
+  c->cst = cst;
+  c->next = constants;
+  constants = c;
+  return c->label;
+}
+
+/* stack machine primitives */
+
+static void push(void) {
+  emit("pushq %%rax");
+  depth++;
+}
+
+static void pop(const char *reg) {
+  emit("popq %s", reg);
+  depth--;
+}
+
+static void pushf(void) {
+  emit("subq $8, %%rsp");
+  emit("movsd %%xmm0, (%%rsp)");
+  depth++;
+}
+
+static void popf(int reg) {
+  emit("movsd (%%rsp), %%xmm%d", reg);
+  emit("addq $8, %%rsp");
+  depth--;
+}
+
+static void load(struct asm_type type) {
+  switch (type_kind(type)) {
+  case KIND_ARRAY:
+  case KIND_VOID:
+    // arrays decay to the address already in %rax
+    return;
+  case KIND_FLOAT:
+    if (type_size(type) == 4) {
+      emit("movss (%%rax), %%xmm0");
+      emit("cvtss2sd %%xmm0, %%xmm0");
+    } else {
+      emit("movsd (%%rax), %%xmm0");
+    }
+    return;
+  case KIND_PTR:
+    emit("movq (%%rax), %%rax");
+    return;
+  case KIND_INT:
+    break;
+  }
+  bool u = type_unsigned(type);
+  switch (type_size(type)) {
+  case 1:
+    emit("%s (%%rax), %%rax", u ? "movzbq" : "movsbq");
+    break;
+  case 2:
+    emit("%s (%%rax), %%rax", u ? "movzwq" : "movswq");
+    break;
+  case 4:
+    if (u)
+      emit("movl (%%rax), %%eax");
+    else
+      emit("movslq (%%rax), %%rax");
+    break;
+  default:
+    emit("movq (%%rax), %%rax");
+    break;
+  }
+}
+
+/* stores %rax or %xmm0 at the address in %rdi */
+static void store(struct asm_type type) {
+  switch (type_kind(type)) {
+  case KIND_FLOAT:
+    if (type_size(type) == 4) {
+      emit("cvtsd2ss %%xmm0, %%xmm1");
+      emit("movss %%xmm1, (%%rdi)");
+    } else {
+      emit("movsd %%xmm0, (%%rdi)");
+    }
+    return;
+  case KIND_ARRAY:
+  case KIND_VOID:
+    return;
+  default:
+    break;
+  }
+  switch (type_size(type)) {
+  case 1:
+    emit("movb %%al, (%%rdi)");
+    break;
+  case 2:
+    emit("movw %%ax, (%%rdi)");
+    break;
+  case 4:
+    emit("movl %%eax, (%%rdi)");
+    break;
+  default:
+    emit("movq %%rax, (%%rdi)");
+    break;
+  }
+}
+
+/* keep integers canonical: sign or zero extended to 64 bits */
+static void normalize(struct asm_type type) {
+  if (type_kind(type) != KIND_INT)
+    return;
+  bool u = type_unsigned(type);
+  switch (type_size(type)) {
+  case 1:
+    if (get_base_type(type.id) != NULL &&
+        (strcmp(type.id->name, "_Bool") == 0 ||
+         strcmp(type.id->name, "bool") == 0)) {
+      emit("cmpq $0, %%rax");
+      emit("setne %%al");
+    }
+    emit("%s %%al, %%rax", u ? "movzbq" : "movsbq");
+    break;
+  case 2:
+    emit("%s %%ax, %%rax", u ? "movzwq" : "movswq");
+    break;
+  case 4:
+    if (u)
+      emit("movl %%eax, %%eax");
+    else
+      emit("movslq %%eax, %%rax");
+    break;
+  default:
+    break;
+  }
+}
+
+static void convert(struct asm_type from, struct asm_type to) {
+  if (!type_known(to) || !type_known(from))
+    return;
+  bool from_float = is_float(from), to_float = is_float(to);
+  if (type_kind(to) == KIND_VOID)
+    return;
+  if (from_float && !to_float) {
+    emit("cvttsd2siq %%xmm0, %%rax");
+    normalize(to);
+  } else if (!from_float && to_float) {
+    emit("cvtsi2sdq %%rax, %%xmm0");
+  } else if (!from_float) {
+    normalize(to);
+  }
+}
+
+static void test_zero(struct asm_type type) {
+  if (is_float(type)) {
+    emit("xorpd %%xmm1, %%xmm1");
+    emit("ucomisd %%xmm1, %%xmm0");
+    emit("setne %%al");
+    emit("setp %%dl");
+    emit("orb %%dl, %%al");
+    emit("cmpb $0, %%al");
+  } else {
+    emit("cmpq $0, %%rax");
+  }
+}
+
+static void gen_expr(struct tree *t);
+static void gen_stmt(struct tree *t);
+static void gen_body(struct tree *t);
+static struct asm_type expr_type(struct tree *t);
+
+/* usual arithmetic conversion, simplified to the kinds the backend handles */
+static struct asm_type common_type(struct asm_type a, struct asm_type b) {
+  if (is_pointer(a))
+    return a;
+  if (is_pointer(b))
+    return b;
+  if (is_float(a) || is_float(b))
+    return TYPE_DOUBLE;
+  if (type_size(a) == 8 || type_size(b) == 8)
+    return type_unsigned(a) || type_unsigned(b) ? TYPE_ULONG : TYPE_LONG;
+  // narrower types promote to int, unsigned int stays unsigned
+  if ((type_size(a) == 4 && type_unsigned(a)) ||
+      (type_size(b) == 4 && type_unsigned(b)))
+    return TYPE_UINT;
+  return TYPE_INT;
+}
+
+/* undeclared functions return int, except for these allocators */
+static const char *pointer_fns[] = {"malloc", "calloc", "realloc",
+                                    "aligned_alloc", "strdup"};
+
+static struct asm_type call_type(struct tree *t) {
+  if (strcmp(t->reference_expr.call.name, "return") == 0)
+    return TYPE_VOID;
+  struct tree *fn = find_fn(t->reference_expr.call.name);
+  if (fn != NULL)
+    return fn_return_type(fn);
+  for (size_t i = 0; i < sizeof(pointer_fns) / sizeof(pointer_fns[0]); i++) {
+    if (strcmp(pointer_fns[i], t->reference_expr.call.name) == 0)
+      return TYPE_STRING;
+  }
+  return TYPE_INT;
+}
+
+static struct asm_type expr_type(struct tree *t) {
+  if (t == NULL)
+    return TYPE_VOID;
+  switch (t->type) {
+  case REFERENCE_EXPR:
+    switch (t->reference_expr.type) {
+    case INTEGER_CST:
+      return TYPE_INT;
+    case FLOAT_CST:
+      return TYPE_DOUBLE;
+    case STRING_CST:
+      return TYPE_STRING;
+    case CHAR_CST:
+      return TYPE_CHAR;
+    case BOOL_CST:
+      return TYPE_BOOL;
+    case VAR_REF:;
+      struct asm_var *var = find_var(t->reference_expr.symbol);
+      if (var == NULL)
+        return TYPE_INT;
+      return var->type;
+    case FN_CALL:
+      return call_type(t);
+    }
+    break;
+  case AREF_EXPR:;
+    struct asm_type type = expr_type(t->ref_expr.expr);
+    if (t->ref_expr.indices == NULL)
+      return elem_type(type);
+    for (struct tree *index = t->ref_expr.indices; index != NULL;
+         index = index->next)
+      type = elem_type(type);
+    return type;
+  case ADDR_EXPR:
+  case LIST_EXPR:
+    // pointer to something; only the kind matters for codegen
+    return TYPE_STRING;
+  case CAST_EXPR:
+    return type_of_tree(t->cast_expr.type);
+  case BINOP_EXPR:;
+    struct asm_type result = expr_type(t->binop_expr.body);
+    for (struct tree *body = t->binop_expr.body->next; body != NULL;
+         body = body->next)
+      result = common_type(result, expr_type(body));
+    if (type_kind(result) == KIND_INT && type_size(result) < 4)
+      return TYPE_INT;
+    return result;
+  case COMPARE_EXPR:
+    return TYPE_INT;
+  case SET_EXPR:
+    return expr_type(t->set_expr.var);
+  default:
+    break;
+  }
+  return TYPE_VOID;
+}
+
+static void gen_addr(struct tree *t) {
+  switch (t->type) {
+  case REFERENCE_EXPR:
+    if (t->reference_expr.type == VAR_REF) {
+      struct asm_var *var = find_var(t->reference_expr.symbol);
+      if (var == NULL) {
+        asm_errorat(t, "symbol '%s' does not exist",
+                    t->reference_expr.symbol);
+        return;
+      }
+      if (var->thread_local) {
+        emit("movq %%fs:0, %%rax");
+        emit("leaq %s@tpoff(%%rax), %%rax", var->name);
+      } else if (var->global)
+        emit("leaq %s(%%rip), %%rax", var->name);
+      else
+        emit("leaq %d(%%rbp), %%rax", var->offset);
+      return;
+    }
+    break;
+  case AREF_EXPR:;
+    struct asm_type type = expr_type(t->ref_expr.expr);
+    gen_expr(t->ref_expr.expr);
+    for (struct tree *index = t->ref_expr.indices; index != NULL;
+         index = index->next) {
+      struct asm_type elem = elem_type(type);
+      push();
+      gen_expr(index);
+      convert(expr_type(index), TYPE_LONG);
+      emit("imulq $%d, %%rax", type_size(elem));
+      pop("%rdi");
+      emit("addq %%rdi, %%rax");
+      if (index->next != NULL)
+        load(elem);
+      type = elem;
+    }
+    return;
+  case FIELD_EXPR:
+    asm_errorat(t, "structures are not supported by the asm backend");
+    return;
+  default:
+    break;
+  }
+  asm_errorat(t, "%s is not an lvalue", get_tree_type(t));
+}
+
+static void gen_arg(struct asm_arg *arg) {
+  gen_expr(arg->tree);
+  convert(expr_type(arg->tree), arg->type);
+  if (!is_float(arg->type)) {
+    push();
+    return;
+  }
+  // only declared float parameters are narrowed; varargs stay double
+  if (arg->declared && type_size(arg->type) == 4)
+    emit("cvtsd2ss %%xmm0, %%xmm0");
+  pushf();
+}
+
+static void gen_call(struct tree *t) {
+  char *name = t->reference_expr.call.name;
+  if (strcmp(name, "return") == 0) {
+    struct tree *value = t->reference_expr.call.args;
+    if (value != NULL) {
+      struct asm_type ret = fn_return_type(current_fn);
+      gen_expr(value);
+      convert(expr_type(value), ret);
+      if (is_float(ret) && type_size(ret) == 4)
+        emit("cvtsd2ss %%xmm0, %%xmm0");
+    }
+    emit("jmp .L%s.return", current_fn->fn_decl.name);
+    return;
+  }
+
+  if (strcmp(name, "__builtin_expect") == 0 &&
+      t->reference_expr.call.args != NULL) {
+    // a hint for the C backends, the branches keep their order here
+    gen_expr(t->reference_expr.call.args);
+    return;
+  }
+
+  struct tree *fn = find_fn(name);
+  if (fn == NULL && strncmp(name, "atomic_", 7) == 0) {
+    asm_errorat(t, "atomic builtins are not supported by the asm backend");
+    return;
+  }
+  if (fn == NULL && strcmp(name, "lcc_task_new") == 0) {
+    asm_errorat(t, "spawn is not supported by the asm backend");
+    return;
+  }
+  struct tree *params = NULL;
+  if (fn != NULL && fn->fn_decl.arglist != NULL)
+    params = fn->fn_decl.arglist->lambda_list.args;
+
+  int n_args = 0;
+  for (struct tree *arg = t->reference_expr.call.args; arg != NULL;
+       arg = arg->next)
+    n_args++;
+  struct asm_arg *args = calloc(n_args + 1, sizeof(struct asm_arg));
+
+  // the registers are handed out left to right, what is left over goes on
+  // the stack, each argument in an eightbyte of its own
+  int n_int = 0, n_float = 0, n_stack = 0, i = 0;
+  for (struct tree *arg = t->reference_expr.call.args; arg != NULL;
+       arg = arg->next, i++) {
+    args[i].tree = arg;
+    args[i].type = expr_type(arg);
+    if (params != NULL) {
+      struct asm_type param = type_of_tree(params->var_decl.type);
+      if (type_known(param)) {
+        args[i].type = param;
+        args[i].declared = true;
+      }
+      params = params->next;
+    }
+    if (is_float(args[i].type))
+      args[i].stack = n_float++ >= N_FLOAT_REGS;
+    else
+      args[i].stack = n_int++ >= N_INT_REGS;
+    n_stack += args[i].stack;
+  }
+
+  // the stack arguments go first, last to first, so that the first of them
+  // is at (%rsp) and %rsp is 16-byte aligned at the call
+  int pad = (depth + n_stack) % 2;
+  if (n_stack != 0) {
+    if (pad)
+      emit("subq $8, %%rsp");
+    depth += pad;
+  }
+  for (i = n_args - 1; i >= 0; i--) {
+    if (args[i].stack)
+      gen_arg(&args[i]);
+  }
+  for (i = 0; i < n_args; i++) {
+    if (!args[i].stack)
+      gen_arg(&args[i]);
+  }
+
+  int n_int_regs = n_int < N_INT_REGS ? n_int : N_INT_REGS;
+  int n_float_regs = n_float < N_FLOAT_REGS ? n_float : N_FLOAT_REGS;
+  n_int = n_int_regs;
+  n_float = n_float_regs;
+  for (i = n_args - 1; i >= 0; i--) {
+    if (args[i].stack)
+      continue;
+    if (is_float(args[i].type))
+      popf(--n_float);
+    else
+      pop(int_regs[--n_int]);
+  }
+  free(args);
+
+  if (n_stack == 0 && pad)
+    emit("subq $8, %%rsp");
+  // %al bounds the vector registers a varargs callee saves
+  emit("movl $%d, %%eax", n_float_regs);
+  emit("call %s", name);
+  if (n_stack + pad != 0)
+    emit("addq $%d, %%rsp", 8 * (n_stack + pad));
+  if (n_stack != 0)
+    depth -= n_stack + pad;
+
+  struct asm_type ret = call_type(t);
+  if (is_float(ret)) {
+    if (type_size(ret) == 4)
+      emit("cvtss2sd %%xmm0, %%xmm0");
+  } else {
+    normalize(ret);
+  }
+}
+
+static void gen_binop(struct tree *t) {
+  struct asm_type type = expr_type(t);
+  struct tree *body = t->binop_expr.body;
+  if (body == NULL) {
+    asm_errorat(t, "empty arithmetic expression");
+    return;
+  }
+  struct asm_type acc = expr_type(body);
+  gen_expr(body);
+  if (!is_pointer(type))
+    convert(acc, type);
+
+  for (body = body->next; body != NULL; body = body->next) {
+    struct asm_type rhs = expr_type(body);
+    if (is_float(type)) {
+      pushf();
+      gen_expr(body);
+      convert(rhs, type);
+      emit("movsd %%xmm0, %%xmm1");
+      popf(0);
+      switch (t->binop_expr.op) {
+      case '+':
+        emit("addsd %%xmm1, %%xmm0");
+        break;
+      case '-':
+        emit("subsd %%xmm1, %%xmm0");
+        break;
+      case '*':
+        emit("mulsd %%xmm1, %%xmm0");
+        break;
+      case '/':
+        emit("divsd %%xmm1, %%xmm0");
+        break;
+      }
+      continue;
+    }
+
+    push();
+    gen_expr(body);
+    if (is_pointer(type)) {
+      // pointer arithmetic scales the integer operand
+      if (!is_pointer(rhs)) {
+        convert(rhs, TYPE_LONG);
+        emit("imulq $%d, %%rax", type_size(elem_type(type)));
+      }
+    } else {
+      convert(rhs, type);
+    }
+    emit("movq %%rax, %%rdi");
+    pop("%rax");
+    if (is_pointer(type) && !is_pointer(acc)) {
+      emit("imulq $%d, %%rax", type_size(elem_type(type)));
+      acc = type;
+    }
+
+    switch (t->binop_expr.op) {
+    case '+':
+      emit("addq %%rdi, %%rax");
+      break;
+    case '-':
+      emit("subq %%rdi, %%rax");
+      if (is_pointer(rhs) && is_pointer(acc)) {
+        emit("cqo");
+        emit("movq $%d, %%rdi", type_size(elem_type(type)));
+        emit("idivq %%rdi");
+      }
+      break;
+    case '*':
+      emit("imulq %%rdi, %%rax");
+      break;
+    case '/':
+      if (type_unsigned(type) && type_size(type) == 4) {
+        emit("xorl %%edx, %%edx");
+        emit("divl %%edi");
+      } else if (type_unsigned(type)) {
+        emit("xorl %%edx, %%edx");
+        emit("divq %%rdi");
+      } else {
+        emit("cqo");
+        emit("idivq %%rdi");
+      }
+      break;
+    }
+    normalize(type);
+  }
+}
+
+static void gen_compare(struct tree *t) {
+  enum compare_op op = t->compare_expr.op;
+  int label;
+  switch (op) {
+  case OP_NOT:
+    gen_expr(t->compare_expr.lhs);
+    test_zero(expr_type(t->compare_expr.lhs));
+    emit("sete %%al");
+    emit("movzbq %%al, %%rax");
+    return;
+  case OP_AND:
+  case OP_OR:
+    label = new_label();
+    gen_expr(t->compare_expr.lhs);
+    test_zero(expr_type(t->compare_expr.lhs));
+    emit("movq $%d, %%rax", op == OP_OR ? 1 : 0);
+    emit("%s .L%d", op == OP_OR ? "jne" : "je", label);
+    gen_expr(t->compare_expr.rhs);
+    test_zero(expr_type(t->compare_expr.rhs));
+    emit("setne %%al");
+    emit("movzbq %%al, %%rax");
+    emit_label(label);
+    return;
+  default:
+    break;
+  }
+
+  struct asm_type lhs = expr_type(t->compare_expr.lhs);
+  struct asm_type rhs = expr_type(t->compare_expr.rhs);
+  struct asm_type type = common_type(lhs, rhs);
+  gen_expr(t->compare_expr.lhs);
+  convert(lhs, type);
+  if (is_float(type)) {
+    pushf();
+    gen_expr(t->compare_expr.rhs);
+    convert(rhs, type);
+    emit("movsd %%xmm0, %%xmm1");
+    popf(0);
+    emit("ucomisd %%xmm1, %%xmm0");
+  } else {
+    push();
+    gen_expr(t->compare_expr.rhs);
+    convert(rhs, type);
+    emit("movq %%rax, %%rdi");
+    pop("%rax");
+    emit("cmpq %%rdi, %%rax");
+  }
+
+  bool u = is_float(type) || type_unsigned(type);
+  switch (op) {
+  case OP_LT:
+    emit("%s %%al", u ? "setb" : "setl");
+    break;
+  case OP_GT:
+    emit("%s %%al", u ? "seta" : "setg");
+    break;
+  case OP_LE:
+    emit("%s %%al", u ? "setbe" : "setle");
+    break;
+  case OP_GE:
+    emit("%s %%al", u ? "setae" : "setge");
+    break;
+  case OP_EQL:
+    emit("sete %%al");
+    if (is_float(type)) {
+      emit("setnp %%dl");
+      emit("andb %%dl, %%al");
+    }
+    break;
+  default:
+    break;
+  }
+  emit("movzbq %%al, %%rax");
+}
+
+static void gen_set(struct tree *t) {
+  struct asm_type type = expr_type(t->set_expr.var);
+  struct asm_type value = expr_type(t->set_expr.value);
+  gen_addr(t->set_expr.var);
+  push();
+
+  if (t->set_expr.mod != 0) {
+    // compound assignment is lowered to var = var op value
+    struct tree binop = {.type = BINOP_EXPR, .loc = t->loc, .valid = true};
+    struct tree lhs = *t->set_expr.var;
+    lhs.next = t->set_expr.value;
+    binop.binop_expr.op = t->set_expr.mod;
+    binop.binop_expr.body = &lhs;
+    value = expr_type(&binop);
+    gen_binop(&binop);
+  } else {
+    gen_expr(t->set_expr.value);
+  }
+  convert(value, type);
+  pop("%rdi");
+  store(type);
+}
+
+static void gen_cast(struct tree *t) {
+  struct asm_type to = type_of_tree(t->cast_expr.type);
+  if (!check_type(t, to))
+    return;
+  gen_expr(t->cast_expr.expr);
+  convert(expr_type(t->cast_expr.expr), to);
+}
+
+/* the array of a typed &rest, stored in a slot of the frame of its own, see
+ * rest_args */
+static void gen_list(struct tree *t) {
+  struct asm_type elem = type_of_tree(t->list_expr.type);
+  if (!check_type(t, elem))
+    return;
+  int size = type_size(elem), n = 0;
+  for (struct tree *e = t->list_expr.elems; e != NULL; e = e->next)
+    n++;
+  frame_offset += (n * size + 7) & ~7;
+  int offset = -frame_offset;
+  for (struct tree *e = t->list_expr.elems; e != NULL; e = e->next) {
+    gen_expr(e);
+    convert(expr_type(e), elem);
+    emit("leaq %d(%%rbp), %%rdi", offset);
+    store(elem);
+    offset += size;
+  }
+  emit("leaq %d(%%rbp), %%rax", -frame_offset);
+}
+
+static void gen_expr(struct tree *t) {
+  if (t == NULL)
+    return;
+  switch (t->type) {
+  case REFERENCE_EXPR:
+    switch (t->reference_expr.type) {
+    case INTEGER_CST:
+      emit("movq $%d, %%rax", t->reference_expr.ival);
+      break;
+    case CHAR_CST:
+      emit("movq $%d, %%rax", t->reference_expr.cval);
+      break;
+    case BOOL_CST:
+      emit("movq $%d, %%rax", t->reference_expr.bval ? 1 : 0);
+      break;
+    case FLOAT_CST:
+      emit("movsd .L%d(%%rip), %%xmm0", add_constant(t));
+      break;
+    case STRING_CST:
+      emit("leaq .L%d(%%rip), %%rax", add_constant(t));
+      break;
+    case VAR_REF:
+      gen_addr(t);
+      load(expr_type(t));
+      break;
+    case FN_CALL:
+      gen_call(t);
+      break;
+    }
+    break;
+  case AREF_EXPR:
+    if (t->ref_expr.indices == NULL) {
+      gen_expr(t->ref_expr.expr);
+    } else {
+      gen_addr(t);
+    }
+    load(expr_type(t));
+    break;
+  case FIELD_EXPR:
+    gen_addr(t);
+    break;
+  case ADDR_EXPR:
+    gen_addr(t->ref_expr.expr);
+    break;
+  case CAST_EXPR:
+    gen_cast(t);
+    break;
+  case BINOP_EXPR:
+    gen_binop(t);
+    break;
+  case COMPARE_EXPR:
+    gen_compare(t);
+    break;
+  case SET_EXPR:
+    gen_set(t);
+    break;
+  case TYPE_EXPR:
+    asm_errorat(t, "types are not values in the asm backend");
+    break;
+  case LIST_EXPR:
+    gen_list(t);
+    break;
+  default:
+    gen_stmt(t);
+    break;
+  }
+}
+
+static void gen_var_decl(struct tree *t) {
+  struct asm_type type = type_of_tree(t->var_decl.type);
+  if (!type_known(type) && t->var_decl.value != NULL)
+    type = expr_type(t->var_decl.value);
+  if (!type_known(type)) {
+    asm_errorat(t, "type of '%s' is unknown. Add a type declaration",
+                t->var_decl.name);
+    return;
+  }
+  if (!check_type(t, type))
+    return;
+  int align = t->var_decl.align;
+  if (align > 16) {
+    asm_errorat(t, "'%s' cannot be aligned to %d bytes on the stack",
+                t->var_decl.name, align);
+    return;
+  }
+  if (align > 8) {
+    // %rbp is 16 byte aligned, so is the variable when its offset is
+    int size = (type_size(type) + 7) & ~7;
+    frame_offset += (align - (frame_offset + size) % align) % align;
+  }
+  struct asm_var *var = push_var(t->var_decl.name, type);
+  if (t->var_decl.value == NULL)
+    return;
+  int offset = var->offset;
+  gen_expr(t->var_decl.value);
+  convert(expr_type(t->var_decl.value), type);
+  emit("leaq %d(%%rbp), %%rdi", offset);
+  store(type);
+}
+
+static void gen_cond(struct tree *condition, int false_label) {
+  gen_expr(condition);
+  test_zero(expr_type(condition));
+  emit("je .L%d", false_label);
+}
+
+static void gen_stmt(struct tree *t) {
+  if (t == NULL)
+    return;
+  int saved_vars = n_vars;
+  int top, end, next;
+  switch (t->type) {
+  case VAR_DECL:
+    gen_var_decl(t);
+    return;
+  case LET_STMT:
+    for (struct tree *var = t->let_stmt.vars; var != NULL; var = var->next)
+      gen_var_decl(var);
+    gen_body(t->let_stmt.body);
+    break;
+  case IF_STMT:
+    end = new_label();
+    next = new_label();
+    gen_cond(t->if_else_stmt.condition, next);
+    gen_body(t->if_else_stmt.if_block);
+    emit("jmp .L%d", end);
+    emit_label(next);
+    gen_body(t->if_else_stmt.else_block);
+    emit_label(end);
+    break;
+  case COND_STMT:
+    end = new_label();
+    for (struct tree *expr = t->cond_stmt.exprs; expr != NULL;
+         expr = expr->next) {
+      next = new_label();
+      if (get_bool(expr->cond_expr.condition) != 1)
+        gen_cond(expr->cond_expr.condition, next);
+      gen_body(expr->cond_expr.body);
+      emit("jmp .L%d", end);
+      emit_label(next);
+    }
+    emit_label(end);
+    break;
+  case CASE_STMT:;
+    struct asm_type type = expr_type(t->case_stmt.expr);
+    end = new_label();
+    // case labels are numbered consecutively, reserve them up front
+    int first = label_count;
+    for (struct tree *c = t->case_stmt.cases; c != NULL; c = c->next)
+      new_label();
+    gen_expr(t->case_stmt.expr);
+    convert(type, TYPE_LONG);
+    push();
+    int label = first, default_label = end;
+    for (struct tree *c = t->case_stmt.cases; c != NULL; c = c->next) {
+      if (get_bool(c->case_expr.expr) == 1) {
+        default_label = label++;
+        continue;
+      }
+      gen_expr(c->case_expr.expr);
+      emit("cmpq %%rax, (%%rsp)");
+      emit("je .L%d", label++);
+    }
+    emit("jmp .L%d", default_label);
+    for (struct tree *c = t->case_stmt.cases; c != NULL; c = c->next) {
+      emit_label(first++);
+      gen_body(c->case_expr.body);
+      emit("jmp .L%d", end);
+    }
+    emit_label(end);
+    emit("addq $8, %%rsp");
+    depth--;
+    break;
+  case WHILE_STMT:
+    top = new_label();
+    end = new_label();
+    emit_label(top);
+    gen_cond(t->while_stmt.condition, end);
+    gen_body(t->while_stmt.body);
+    emit("jmp .L%d", top);
+    emit_label(end);
+    break;
+  case DOWHILE_STMT:
+    top = new_label();
+    emit_label(top);
+    gen_body(t->while_stmt.body);
+    gen_expr(t->while_stmt.condition);
+    test_zero(expr_type(t->while_stmt.condition));
+    emit("jne .L%d", top);
+    break;
+  case FOR_STMT:
+    top = new_label();
+    end = new_label();
+    for (struct tree *var = t->for_stmt.vars; var != NULL; var = var->next)
+      gen_var_decl(var);
+    emit_label(top);
+    gen_cond(t->for_stmt.condition, end);
+    gen_body(t->for_stmt.body);
+    gen_expr(t->for_stmt.loop_eval);
+    emit("jmp .L%d", top);
+    emit_label(end);
+    break;
+  case TYPE_DECL:
+  case ATTR_DECL:
+  case INCLUDE_STMT:
+    break;
+  case FN_DECL:
+    asm_errorat(t, "nested functions are not supported");
+    break;
+  default:
+    gen_expr(t);
+    break;
+  }
+  n_vars = saved_vars;
+}
+
+/* -g: file 1 is the .lc source, see print_asm */
+static void gen_loc(struct tree *t) {
+  if (line_directives && t->loc.first_line > 0)
+    fprintf(stdout, "\t.loc 1 %d %d\n", t->loc.first_line,
+            t->loc.first_column);
+}
+
+static void gen_body(struct tree *t) {
+  for (struct tree *body = t; body != NULL; body = body->next) {
+    gen_loc(body);
+    gen_stmt(body);
+  }
+}
+
+/* the parameters past the registers are in the caller's frame, above the
+ * return address and the saved %rbp */
+static void gen_params(struct tree *params, int *n_int, int *n_float,
+                       int *n_stack) {
+  for (struct tree *param = params; param != NULL; param = param->next) {
+    struct tree *decl = param;
+    if (decl->type == LAMBDA_KEY)
+      decl = decl->lambda_key.expr;
+    struct asm_type type = type_of_tree(decl->var_decl.type);
+    if (!type_known(type)) {
+      asm_errorat(decl, "type of parameter '%s' is unknown",
+                  decl->var_decl.name);
+      continue;
+    }
+    if (!check_type(decl, type))
+      continue;
+    struct asm_var *var = push_var(decl->var_decl.name, type);
+    const char *mov = type_size(type) == 4 ? "movss" : "movsd";
+    if (is_float(type) && *n_float < N_FLOAT_REGS) {
+      emit("%s %%xmm%d, %d(%%rbp)", mov, (*n_float)++, var->offset);
+    } else if (is_float(type)) {
+      emit("%s %d(%%rbp), %%xmm0", mov, 16 + 8 * (*n_stack)++);
+      emit("%s %%xmm0, %d(%%rbp)", mov, var->offset);
+    } else {
+      if (*n_int < N_INT_REGS)
+        emit("movq %s, %%rax", int_regs[(*n_int)++]);
+      else
+        emit("movq %d(%%rbp), %%rax", 16 + 8 * (*n_stack)++);
+      emit("leaq %d(%%rbp), %%rdi", var->offset);
+      store(type);
+    }
+  }
+}
+
+/* (declare (hot)) and (cold) place the function as GCC does */
+static const char *fn_section(struct tree *t) {
+  for (struct tree *body = t->fn_decl.body; body != NULL; body = body->next) {
+    if (body->type != ATTR_DECL || body->attr_decl.args != NULL)
+      continue;
+    if (strcmp(body->attr_decl.name, "hot") == 0)
+      return "\t.section .text.hot,\"ax\",@progbits";
+    if (strcmp(body->attr_decl.name, "cold") == 0)
+      return "\t.section .text.unlikely,\"ax\",@progbits";
+  }
+  return "\t.text";
+}
+
+static void gen_fn(struct tree *t) {
+  struct tree *args = t->fn_decl.arglist;
+  if (t->fn_decl.body == NULL && args->lambda_list.aux == NULL)
+    return;
+  // a typed &rest is a pointer and a length, untyped ones are C varargs
+  if (args->lambda_list.rest != NULL && args->lambda_list.rest->next == NULL) {
+    asm_errorat(t, "untyped &rest functions are not supported by the asm "
+                   "backend");
+    return;
+  }
+
+  current_fn = t;
+  frame_offset = 0;
+  depth = 0;
+  n_vars = 0;
+
+  char *name = t->fn_decl.name;
+  fprintf(stdout, "\n%s\n\t.globl %s\n\t.type %s, @function\n%s:\n",
+          fn_section(t), name, name, name);
+  gen_loc(t);
+  emit("pushq %%rbp");
+  emit("movq %%rsp, %%rbp");
+  emit("subq $.L%s.frame, %%rsp", name);
+
+  int n_int = 0, n_float = 0, n_stack = 0;
+  gen_params(args->lambda_list.args, &n_int, &n_float, &n_stack);
+  gen_params(args->lambda_list.optionals, &n_int, &n_float, &n_stack);
+  gen_params(args->lambda_list.keys, &n_int, &n_float, &n_stack);
+  gen_params(args->lambda_list.rest, &n_int, &n_float, &n_stack);
+  for (struct tree *aux = args->lambda_list.aux; aux != NULL; aux = aux->next)
+    gen_var_decl(aux);
+
+  gen_body(t->fn_decl.body);
+
+  // falling off the end returns 0, which is what C does for main
+  emit("xorl %%eax, %%eax");
+  fprintf(stdout, ".L%s.return:\n", name);
+  emit("leave");
+  emit("ret");
+  fprintf(stdout, "\t.set .L%s.frame, %d\n", name, (frame_offset + 15) & ~15);
+  fprintf(stdout, "\t.size %s, .-%s\n", name, name);
+  current_fn = NULL;
+}
+
+static void gen_global_value(struct asm_var *var, struct tree *value,
+                             int size) {
+  if (value->type != REFERENCE_EXPR) {
+    asm_errorat(value, "global '%s' must be initialised with a constant",
+                var->name);
+    return;
+  }
+  if (is_float(var->type)) {
+    double d;
+    switch (value->reference_expr.type) {
+    case FLOAT_CST:
+      d = value->reference_expr.fval;
+      break;
+    case INTEGER_CST:
+      d = value->reference_expr.ival;
+      break;
+    default:
+      asm_errorat(value, "invalid initialiser for '%s'", var->name);
+      return;
+    }
+    if (size == 4) {
+      float f = d;
+      uint32_t bits;
+      memcpy(&bits, &f, sizeof(bits));
+      fprintf(stdout, "\t.long %u\n", bits);
+    } else {
+      uint64_t bits;
+      memcpy(&bits, &d, sizeof(bits));
+      fprintf(stdout, "\t.quad %lu\n", (unsigned long)bits);
+    }
+    return;
+  }
+
+  long ival;
+  switch (value->reference_expr.type) {
+  case INTEGER_CST:
+    ival = value->reference_expr.ival;
+    break;
+  case CHAR_CST:
+    ival = value->reference_expr.cval;
+    break;
+  case BOOL_CST:
+    ival = value->reference_expr.bval;
+    break;
+  case STRING_CST:
+    fprintf(stdout, "\t.quad .L%d\n", add_constant(value));
+    return;
+  default:
+    asm_errorat(value, "invalid initialiser for '%s'", var->name);
+    return;
+  }
+  switch (size) {
+  case 1:
+    fprintf(stdout, "\t.byte %ld\n", ival);
+    break;
+  case 2:
+    fprintf(stdout, "\t.short %ld\n", ival);
+    break;
+  case 4:
+    fprintf(stdout, "\t.long %ld\n", ival);
+    break;
+  default:
+    fprintf(stdout, "\t.quad %ld\n", ival);
+    break;
+  }
+}
+
+static void gen_global(struct tree *t) {
+  struct asm_type type = type_of_tree(t->var_decl.type);
+  if (!check_type(t, type))
+    return;
+  struct asm_var *var = calloc(1, sizeof(struct asm_var));
+  var->name = t->var_decl.name;
+  var->global = true;
+  var->thread_local = t->var_decl.thread_local;
+  var->type = type;
+  hashmap_put(&globals, var->name, strlen(var->name), var);
+
+  int size = type_size(type);
+  int align = t->var_decl.align > 8 ? t->var_decl.align : 8;
+  struct tree *value = t->var_decl.value;
+  fprintf(stdout, "\n\t.globl %s\n", var->name);
+  if (var->thread_local)
+    fprintf(stdout, value == NULL ? "\t.section .tbss,\"awT\",@nobits\n"
+                                  : "\t.section .tdata,\"awT\",@progbits\n");
+  else
+    fprintf(stdout, value == NULL ? "\t.bss\n" : "\t.data\n");
+  fprintf(stdout, "\t.align %d\n%s:\n", align, var->name);
+  if (value == NULL)
+    fprintf(stdout, "\t.zero %d\n", size);
+  else
+    gen_global_value(var, value, size);
+  // pad the rest of the line so that the next global cannot share it
+  if (t->var_decl.cacheline)
+    fprintf(stdout, "\t.align %d\n", align);
+}
+
+static void emit_constants(void) {
+  if (constants == NULL)
+    return;
+  fprintf(stdout, "\n\t.section .rodata\n");
+  for (struct asm_const *c = constants, *next; c != NULL; c = next) {
+    next = c->next;
+    if (c->cst->reference_expr.type == FLOAT_CST) {
+      uint64_t bits;
+      memcpy(&bits, &c->cst->reference_expr.fval, sizeof(bits));
+      fprintf(stdout, "\t.align 8\n.L%d:\n\t.quad %lu\n", c->label,
+              (unsigned long)bits);
+    } else {
+      fprintf(stdout, ".L%d:\n\t.string %s\n", c->label,
+              c->cst->reference_expr.symbol);
+    }
+    free(c);
+  }
+  constants = NULL;
+}
+
+static int free_global(void *const context, void *const value) {
+  free(value);
+  return 1;
+}
+
+void print_asm(struct tree *t) {
+  if (hashmap_create(128, &functions) != 0 ||
+      hashmap_create(128, &globals) != 0) {
+    error("Failed to create hashmap.");
+    return;
+  }
+
+  for (struct tree *head = t; head != NULL; head = head->next) {
+    if (head->type == FN_DECL)
+      hashmap_put(&functions, head->fn_decl.name,
+                  strlen(head->fn_decl.name), head);
+  }
+
+  fprintf(stdout, "\t.file \"%s\"\n", lcc_current_file);
+  if (line_directives)
+    fprintf(stdout, "\t.file 1 \"%s\"\n", lcc_current_file);
+  for (struct tree *head = t; head != NULL; head = head->next) {
+    timer_begin_form("emit", head);
+    switch (head->type) {
+    case FN_DECL:
+      gen_fn(head);
+      break;
+    case VAR_DECL:
+      gen_global(head);
+      break;
+    case CONTAINER_DECL:
+      asm_errorat(head, "containers are not supported by the asm backend");
+      break;
+    case CLOSURE_DECL:
+      asm_errorat(head, "closures are not supported by the asm backend");
+      break;
+    case CORO_DECL:
+      asm_errorat(head, "coroutines are not supported by the asm backend");
+      break;
+    default:
+      break;
+    }
+    timer_end();
+  }
+  emit_constants();
+  fprintf(stdout, "\n\t.section .note.GNU-stack,\"\",@progbits\n");
+
+  hashmap_iterate(&globals, free_global, NULL);
+  hashmap_destroy(&globals);
+  hashmap_destroy(&functions);
+  free(vars);
+  vars = NULL;
+  n_vars = cap_vars = 0;
+}
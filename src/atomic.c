@@ -0,0 +1,199 @@
+#include "debug.h"
+#include "opt.h"
+#include "tree.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hashmap.h"
+
+/*
+ * Atomic builtins, lowered to the explicit forms of <stdatomic.h>. The first
+ * argument is the atomic object itself (a variable or an aref), the last one
+ * the memory order:
+ *
+ *   (atomic-load x order)             (atomic-store x value order)
+ *   (atomic-exchange x value order)   (fetch-add x value order) ...
+ *   (cas x expected desired order)    (cas-weak x expected desired order)
+ *   (atomic-fence order)
+ *
+ * cas follows atomic_compare_exchange: expected is a variable that receives
+ * the current value when the exchange fails. The memory order is one of
+ * relaxed, consume, acquire, release, acq-rel and seq-cst.
+ */
+
+extern const char *lcc_current_file;
+
+enum order_use {
+  ORDER_ANY,
+  ORDER_LOAD,  // no release semantics
+  ORDER_STORE, // no acquire semantics
+};
+
+static const struct {
+  const char *name;
+  const char *c_name;
+  int n_values;   // arguments between the object and the order
+  bool expected;  // the first value is passed by address
+  bool object;    // has an atomic object as first argument
+  enum order_use use;
+} atomic_builtins[] = {
+    {"atomic_load", "atomic_load_explicit", 0, false, true, ORDER_LOAD},
+    {"atomic_store", "atomic_store_explicit", 1, false, true, ORDER_STORE},
+    {"atomic_exchange", "atomic_exchange_explicit", 1, false, true, ORDER_ANY},
+    {"cas", "atomic_compare_exchange_strong_explicit", 2, true, true,
+     ORDER_ANY},
+    {"cas_weak", "atomic_compare_exchange_weak_explicit", 2, true, true,
+     ORDER_ANY},
+    {"fetch_add", "atomic_fetch_add_explicit", 1, false, true, ORDER_ANY},
+    {"fetch_sub", "atomic_fetch_sub_explicit", 1, false, true, ORDER_ANY},
+    {"fetch_or", "atomic_fetch_or_explicit", 1, false, true, ORDER_ANY},
+    {"fetch_and", "atomic_fetch_and_explicit", 1, false, true, ORDER_ANY},
+    {"fetch_xor", "atomic_fetch_xor_explicit", 1, false, true, ORDER_ANY},
+    {"atomic_fence", "atomic_thread_fence", 0, false, false, ORDER_ANY},
+};
+
+static const struct {
+  const char *name;
+  const char *c_name;
+  bool load, store; // valid for loads and stores
+} memory_orders[] = {
+    {"relaxed", "memory_order_relaxed", true, true},
+    {"consume", "memory_order_consume", true, false},
+    {"acquire", "memory_order_acquire", true, false},
+    {"release", "memory_order_release", false, true},
+    {"acq_rel", "memory_order_acq_rel", false, false},
+    {"seq_cst", "memory_order_seq_cst", true, true},
+};
+
+static bool atomics_used = false;
+static bool atomic_calls = false;  // a call may name a builtin
+static struct hashmap_s functions; // user definitions take precedence
+
+static int atomic_builtin(const char *name) {
+  for (size_t b = 0; b < sizeof(atomic_builtins) / sizeof(atomic_builtins[0]);
+       b++) {
+    if (strcmp(atomic_builtins[b].name, name) == 0)
+      return b;
+  }
+  return -1;
+}
+
+struct tree *note_atomic_call(struct tree *call) {
+  atomic_calls |= atomic_builtin(call->reference_expr.call.name) >= 0;
+  return call;
+}
+
+static int memory_order(struct tree *t) {
+  if (t == NULL || t->type != REFERENCE_EXPR ||
+      t->reference_expr.type != VAR_REF)
+    return -1;
+  for (size_t i = 0; i < sizeof(memory_orders) / sizeof(memory_orders[0]);
+       i++) {
+    if (strcmp(memory_orders[i].name, t->reference_expr.symbol) == 0)
+      return i;
+  }
+  return -1;
+}
+
+static void set_symbol(struct tree *t, const char *name) {
+  free(t->reference_expr.symbol);
+  t->reference_expr.symbol = strdup(name);
+}
+
+/* the order used when a compare and exchange fails, which cannot release */
+static struct tree *failure_order(struct tree *order, int i) {
+  const char *name = memory_orders[i].c_name;
+  if (strcmp(memory_orders[i].name, "release") == 0)
+    name = "memory_order_relaxed";
+  else if (strcmp(memory_orders[i].name, "acq_rel") == 0)
+    name = "memory_order_acquire";
+  return build_var_ref(order->loc, strdup(name));
+}
+
+static struct tree *take_addr(struct tree *t) {
+  struct tree *addr = build_addr(t->loc, t);
+  addr->next = t->next;
+  t->next = NULL;
+  return addr;
+}
+
+static void lower_atomic(struct tree *t, size_t b) {
+  char *name = t->reference_expr.call.name;
+  struct tree *args = t->reference_expr.call.args;
+  int n_args = 0;
+  for (struct tree *arg = args; arg != NULL; arg = arg->next)
+    n_args++;
+  int expected = atomic_builtins[b].n_values + atomic_builtins[b].object + 1;
+  if (n_args != expected) {
+    errorat("%s takes %d argument(s), the last one being the memory order",
+            lcc_current_file, t->loc.first_line, t->loc.first_column, name,
+            expected);
+    return;
+  }
+
+  struct tree *order = args;
+  while (order->next != NULL)
+    order = order->next;
+  int i = memory_order(order);
+  if (i < 0) {
+    errorat("expected relaxed, consume, acquire, release, acq-rel or seq-cst",
+            lcc_current_file, order->loc.first_line, order->loc.first_column);
+    return;
+  }
+  if ((atomic_builtins[b].use == ORDER_LOAD && !memory_orders[i].load) ||
+      (atomic_builtins[b].use == ORDER_STORE && !memory_orders[i].store)) {
+    errorat("memory order %s is not valid for %s", lcc_current_file,
+            order->loc.first_line, order->loc.first_column,
+            order->reference_expr.symbol, name);
+    return;
+  }
+
+  if (atomic_builtins[b].object) {
+    args = take_addr(args);
+    if (atomic_builtins[b].expected)
+      args->next = take_addr(args->next);
+    t->reference_expr.call.args = args;
+  }
+  if (atomic_builtins[b].expected)
+    order->next = failure_order(order, i);
+  set_symbol(order, memory_orders[i].c_name);
+
+  free(t->reference_expr.call.name);
+  t->reference_expr.call.name = strdup(atomic_builtins[b].c_name);
+  atomics_used = true;
+}
+
+static bool find_atomics(struct tree *t, void *data) {
+  if (t->type != REFERENCE_EXPR || t->reference_expr.type != FN_CALL)
+    return true;
+  char *name = t->reference_expr.call.name;
+  int b = atomic_builtin(name);
+  if (b >= 0 && hashmap_get(&functions, name, strlen(name)) == NULL)
+    lower_atomic(t, b);
+  return true;
+}
+
+void lower_atomics(struct tree *t) {
+  if (!atomic_calls)
+    return;
+  if (hashmap_create(64, &functions) != 0) {
+    error("Failed to create hashmap.");
+    return;
+  }
+  for (struct tree *head = t; head != NULL; head = head->next) {
+    if (head->type == FN_DECL)
+      hashmap_put(&functions, head->fn_decl.name, strlen(head->fn_decl.name),
+                  head);
+  }
+  walk_tree(t, find_atomics, NULL);
+  hashmap_destroy(&functions);
+}
+
+void print_atomic_header(bool emit_asm) {
+  if (atomics_used && !emit_asm)
+    fprintf(stdout, "#include <stdatomic.h>\n");
+}
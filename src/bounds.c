@@ -0,0 +1,474 @@
+#include "debug.h"
+#include "opt.h"
+#include "tree.h"
+
+#include <limits.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Bounds checks for aref on sized arrays ([N]T), enabled with -fbounds-check.
+ * Every index into a sized array variable is wrapped in a call to
+ * lcc_bounds_check(index, N, line), which aborts with a message when the
+ * index is outside [0, N) and returns it otherwise.
+ *
+ * Checks that can be proven redundant are not emitted. Ranges are tracked for
+ * for-loop induction variables that are only written by the step, taken from
+ * the initial value and the loop condition, and for variables compared
+ * against bounds in an if or cond that does not write them. Index
+ * expressions are evaluated with interval arithmetic over those ranges.
+ */
+
+extern const char *lcc_current_file;
+
+int bounds_checks_emitted = 0;
+static int bounds_checks_removed = 0;
+
+struct range {
+  long long lo, hi;
+};
+
+#define UNKNOWN_RANGE ((struct range){LLONG_MIN, LLONG_MAX})
+
+struct bounds_var {
+  struct tree *decl;
+  struct range range;
+};
+
+static struct bounds_var *scope = NULL;
+static int n_scope = 0, cap_scope = 0;
+
+static void push_var(struct tree *decl, struct range range) {
+  if (n_scope >= cap_scope) {
+    cap_scope = cap_scope == 0 ? 32 : cap_scope * 2;
+    scope = realloc(scope, cap_scope * sizeof(struct bounds_var));
+  }
+  scope[n_scope++] = (struct bounds_var){decl, range};
+}
+
+static struct bounds_var *lookup(char *name) {
+  for (int i = n_scope - 1; i >= 0; i--) {
+    if (strcmp(scope[i].decl->var_decl.name, name) == 0)
+      return &scope[i];
+  }
+  return NULL;
+}
+
+static bool is_var_ref(struct tree *t) {
+  return t != NULL && t->type == REFERENCE_EXPR &&
+         t->reference_expr.type == VAR_REF;
+}
+
+static bool known(struct range r) {
+  return r.lo != LLONG_MIN && r.hi != LLONG_MAX;
+}
+
+/* interval arithmetic, values outside of +-2^31 are treated as unknown */
+static struct range clamp(struct range r) {
+  if (r.lo < INT_MIN || r.hi > INT_MAX)
+    return UNKNOWN_RANGE;
+  return r;
+}
+
+static struct range range_of(struct tree *t) {
+  switch (t->type) {
+  case REFERENCE_EXPR:
+    switch (t->reference_expr.type) {
+    case INTEGER_CST:
+      return (struct range){t->reference_expr.ival, t->reference_expr.ival};
+    case CHAR_CST:
+      return (struct range){t->reference_expr.cval, t->reference_expr.cval};
+    case VAR_REF:;
+      struct bounds_var *var = lookup(t->reference_expr.symbol);
+      return var == NULL ? UNKNOWN_RANGE : var->range;
+    default:
+      return UNKNOWN_RANGE;
+    }
+  case BINOP_EXPR:;
+    struct tree *body = t->binop_expr.body;
+    if (body == NULL)
+      return UNKNOWN_RANGE;
+    struct range r = range_of(body);
+    for (body = body->next; body != NULL && known(r); body = body->next) {
+      struct range o = range_of(body);
+      if (!known(o))
+        return UNKNOWN_RANGE;
+      switch (t->binop_expr.op) {
+      case '+':
+        r = clamp((struct range){r.lo + o.lo, r.hi + o.hi});
+        break;
+      case '-':
+        r = clamp((struct range){r.lo - o.hi, r.hi - o.lo});
+        break;
+      case '*':;
+        long long a = r.lo * o.lo, b = r.lo * o.hi, c = r.hi * o.lo,
+                  d = r.hi * o.hi;
+        long long lo = a < b ? a : b, hi = a > b ? a : b;
+        lo = c < lo ? c : lo;
+        lo = d < lo ? d : lo;
+        hi = c > hi ? c : hi;
+        hi = d > hi ? d : hi;
+        r = clamp((struct range){lo, hi});
+        break;
+      default:
+        return UNKNOWN_RANGE;
+      }
+    }
+    return r;
+  default:
+    return UNKNOWN_RANGE;
+  }
+}
+
+static struct range intersect(struct range a, struct range b) {
+  return (struct range){a.lo > b.lo ? a.lo : b.lo, a.hi < b.hi ? a.hi : b.hi};
+}
+
+/* the range of var implied by a condition being true */
+static struct range implied_range(struct tree *cond, struct tree *decl) {
+  if (cond == NULL || cond->type != COMPARE_EXPR)
+    return UNKNOWN_RANGE;
+  if (cond->compare_expr.op == OP_AND)
+    return intersect(implied_range(cond->compare_expr.lhs, decl),
+                     implied_range(cond->compare_expr.rhs, decl));
+
+  struct tree *lhs = cond->compare_expr.lhs, *rhs = cond->compare_expr.rhs;
+  enum compare_op op = cond->compare_expr.op;
+  if (rhs == NULL)
+    return UNKNOWN_RANGE;
+  if (!is_var_ref(lhs) ||
+      strcmp(lhs->reference_expr.symbol, decl->var_decl.name) != 0) {
+    if (!is_var_ref(rhs) ||
+        strcmp(rhs->reference_expr.symbol, decl->var_decl.name) != 0)
+      return UNKNOWN_RANGE;
+    struct tree *tmp = lhs;
+    lhs = rhs;
+    rhs = tmp;
+    switch (op) {
+    case OP_LT:
+      op = OP_GT;
+      break;
+    case OP_GT:
+      op = OP_LT;
+      break;
+    case OP_LE:
+      op = OP_GE;
+      break;
+    case OP_GE:
+      op = OP_LE;
+      break;
+    default:
+      break;
+    }
+  }
+
+  struct range bound = range_of(rhs);
+  struct range r = UNKNOWN_RANGE;
+  switch (op) {
+  case OP_LT:
+    if (bound.hi != LLONG_MAX)
+      r.hi = bound.hi - 1;
+    break;
+  case OP_LE:
+    r.hi = bound.hi;
+    break;
+  case OP_GT:
+    if (bound.lo != LLONG_MIN)
+      r.lo = bound.lo + 1;
+    break;
+  case OP_GE:
+    r.lo = bound.lo;
+    break;
+  case OP_EQL:
+    r = bound;
+    break;
+  default:
+    break;
+  }
+  return r;
+}
+
+struct write_search {
+  char *name;
+  bool found;
+};
+
+static bool find_write(struct tree *t, void *data) {
+  struct write_search *search = data;
+  struct tree *target = NULL;
+  if (t->type == SET_EXPR)
+    target = t->set_expr.var;
+  else if (t->type == ADDR_EXPR)
+    target = t->ref_expr.expr;
+  if (is_var_ref(target) &&
+      strcmp(target->reference_expr.symbol, search->name) == 0)
+    search->found = true;
+  return !search->found;
+}
+
+static bool writes(struct tree *t, char *name) {
+  struct write_search search = {name, false};
+  walk_tree(t, find_write, &search);
+  return search.found;
+}
+
+/* the variables of the enclosing scope that a condition narrows down */
+static void refine(struct tree *cond, struct tree *body) {
+  int n = n_scope;
+  for (int i = 0; i < n; i++) {
+    if (lookup(scope[i].decl->var_decl.name) != &scope[i])
+      continue;
+    struct range r = implied_range(cond, scope[i].decl);
+    if (r.lo == LLONG_MIN && r.hi == LLONG_MAX)
+      continue;
+    if (writes(body, scope[i].decl->var_decl.name))
+      continue;
+    push_var(scope[i].decl, intersect(scope[i].range, r));
+  }
+}
+
+/* the first element of the type chain is the outermost dimension */
+static struct type_ptr *array_dims(struct tree *base) {
+  if (!is_var_ref(base))
+    return NULL;
+  struct bounds_var *var = lookup(base->reference_expr.symbol);
+  if (var == NULL || var->decl->var_decl.type == NULL ||
+      var->decl->var_decl.type->type != TYPE_EXPR)
+    return NULL;
+  struct type_ptr *ptr = var->decl->var_decl.type->type_expr.ptr;
+  if (ptr == NULL || ptr->type != SIZED_PTR)
+    return NULL;
+  return ptr;
+}
+
+static void check_chain(struct tree **chain);
+static void check(struct tree **slot);
+
+static void check_aref(struct tree *t) {
+  check(&t->ref_expr.expr);
+  struct type_ptr *dim = array_dims(t->ref_expr.expr);
+  for (struct tree **slot = &t->ref_expr.indices; *slot != NULL;
+       slot = &(*slot)->next) {
+    check(slot);
+    if (dim == NULL || dim->type != SIZED_PTR) {
+      dim = NULL;
+      continue;
+    }
+    struct tree *index = *slot;
+    struct range r = range_of(index);
+    if (r.lo >= 0 && r.hi < dim->size) {
+      bounds_checks_removed++;
+    } else {
+      struct tree *next = index->next;
+      index->next = NULL;
+      struct tree *args = append_tree(
+          build_int_cst(index->loc, index->loc.first_line),
+          build_int_cst(index->loc, dim->size));
+      args = append_tree(args, index);
+      struct tree *call =
+          build_fn_call(index->loc, strdup("lcc_bounds_check"), args);
+      call->next = next;
+      *slot = call;
+      bounds_checks_emitted++;
+    }
+    dim = dim->next;
+  }
+}
+
+/* for (i c0) with a constant step and no other writes to i */
+static struct range induction_range(struct tree *t, struct tree *var) {
+  struct tree *step = t->for_stmt.loop_eval;
+  if (var->var_decl.value == NULL || step == NULL ||
+      step->type != SET_EXPR || step->next != NULL ||
+      !is_var_ref(step->set_expr.var) ||
+      strcmp(step->set_expr.var->reference_expr.symbol,
+             var->var_decl.name) != 0 ||
+      writes(t->for_stmt.body, var->var_decl.name))
+    return UNKNOWN_RANGE;
+  struct range amount = range_of(step->set_expr.value);
+  struct range init = range_of(var->var_decl.value);
+  struct range cond = implied_range(t->for_stmt.condition, var);
+  if (amount.lo <= 0 || !known(amount))
+    return UNKNOWN_RANGE;
+  if (step->set_expr.mod == '+')
+    return (struct range){init.lo, cond.hi};
+  if (step->set_expr.mod == '-')
+    return (struct range){cond.lo, init.hi};
+  return UNKNOWN_RANGE;
+}
+
+static void check(struct tree **slot) {
+  struct tree *t = *slot;
+  if (t == NULL)
+    return;
+  int saved = n_scope;
+  switch (t->type) {
+  case FN_DECL:
+    if (t->fn_decl.arglist != NULL)
+      check(&t->fn_decl.arglist);
+    check_chain(&t->fn_decl.body);
+    break;
+  case LAMBDA_LIST:
+    check_chain(&t->lambda_list.args);
+    check_chain(&t->lambda_list.optionals);
+    for (struct tree *key = t->lambda_list.keys; key != NULL; key = key->next)
+      check(&key->lambda_key.expr);
+    check_chain(&t->lambda_list.aux);
+    // the enclosing FN_DECL owns these scopes
+    return;
+  case VAR_DECL:
+  case PARM_DECL:
+    check(&t->var_decl.value);
+    push_var(t, UNKNOWN_RANGE);
+    // declarations stay visible for the rest of the enclosing body
+    return;
+  case SET_EXPR:
+    check(&t->set_expr.var);
+    check(&t->set_expr.value);
+    break;
+  case AREF_EXPR:
+    check_aref(t);
+    break;
+  case ADDR_EXPR:
+    check(&t->ref_expr.expr);
+    break;
+  case FIELD_EXPR:
+    check(&t->field_expr.expr);
+    break;
+  case CAST_EXPR:
+    check(&t->cast_expr.expr);
+    break;
+  case LIST_EXPR:
+    check_chain(&t->list_expr.elems);
+    break;
+  case BINOP_EXPR:
+    check_chain(&t->binop_expr.body);
+    break;
+  case COMPARE_EXPR:
+    check(&t->compare_expr.lhs);
+    check(&t->compare_expr.rhs);
+    break;
+  case REFERENCE_EXPR:
+    if (t->reference_expr.type == FN_CALL)
+      check_chain(&t->reference_expr.call.args);
+    break;
+  case LET_STMT:
+    check_chain(&t->let_stmt.vars);
+    check_chain(&t->let_stmt.body);
+    break;
+  case IF_STMT:
+    check(&t->if_else_stmt.condition);
+    refine(t->if_else_stmt.condition, t->if_else_stmt.if_block);
+    check_chain(&t->if_else_stmt.if_block);
+    n_scope = saved;
+    check_chain(&t->if_else_stmt.else_block);
+    break;
+  case COND_STMT:
+    for (struct tree *expr = t->cond_stmt.exprs; expr != NULL;
+         expr = expr->next) {
+      check(&expr->cond_expr.condition);
+      refine(expr->cond_expr.condition, expr->cond_expr.body);
+      check_chain(&expr->cond_expr.body);
+      n_scope = saved;
+    }
+    break;
+  case CASE_STMT:
+    check(&t->case_stmt.expr);
+    for (struct tree *c = t->case_stmt.cases; c != NULL; c = c->next) {
+      check_chain(&c->case_expr.body);
+      n_scope = saved;
+    }
+    break;
+  case WHILE_STMT:
+  case DOWHILE_STMT:
+    check(&t->while_stmt.condition);
+    check_chain(&t->while_stmt.body);
+    break;
+  case FOR_STMT:
+    check_chain(&t->for_stmt.vars);
+    check(&t->for_stmt.condition);
+    check(&t->for_stmt.loop_eval);
+    for (struct tree *var = t->for_stmt.vars; var != NULL; var = var->next) {
+      struct range r = induction_range(t, var);
+      if (r.lo != LLONG_MIN || r.hi != LLONG_MAX)
+        push_var(var, r);
+    }
+    check_chain(&t->for_stmt.body);
+    break;
+  default:
+    break;
+  }
+  n_scope = saved;
+}
+
+static void check_chain(struct tree **chain) {
+  for (struct tree **slot = chain; *slot != NULL; slot = &(*slot)->next)
+    check(slot);
+}
+
+void bounds_check_pass(struct tree *t) {
+  int saved = n_scope;
+  for (struct tree *head = t; head != NULL; head = head->next) {
+    if (head->type == VAR_DECL)
+      push_var(head, UNKNOWN_RANGE);
+    else if (head->type == FN_DECL)
+      check(&head);
+  }
+  n_scope = saved;
+  free(scope);
+  scope = NULL;
+  n_scope = cap_scope = 0;
+
+  info("%s: %d bounds check(s) remain, %d removed by range analysis",
+       lcc_current_file, bounds_checks_emitted, bounds_checks_removed);
+}
+
+void print_bounds_check_helper(bool emit_asm) {
+  if (bounds_checks_emitted == 0)
+    return;
+  if (!emit_asm) {
+    fprintf(stdout,
+            "#include <stdio.h>\n"
+            "#include <stdlib.h>\n"
+            "static inline long lcc_bounds_check(long index, long size, "
+            "long line) {\n"
+            "  if (index < 0 || index >= size) {\n"
+            "    fprintf(stderr, \"%%s:%%ld: index %%ld out of bounds for "
+            "size %%ld\\n\", \"%s\", line, index, size);\n"
+            "    abort();\n"
+            "  }\n"
+            "  return index;\n"
+            "}\n",
+            lcc_current_file);
+    return;
+  }
+  fprintf(stdout,
+          "\t.text\n"
+          "\t.type lcc_bounds_check, @function\n"
+          "lcc_bounds_check:\n"
+          "\tcmpq %%rsi, %%rdi\n"
+          "\tjae .Llcc_bounds_fail\n"
+          "\tmovq %%rdi, %%rax\n"
+          "\tret\n"
+          ".Llcc_bounds_fail:\n"
+          "\tsubq $8, %%rsp\n"
+          "\tmovq %%rsi, %%r9\n"
+          "\tmovq %%rdi, %%r8\n"
+          "\tmovq %%rdx, %%rcx\n"
+          "\tleaq .Llcc_bounds_file(%%rip), %%rdx\n"
+          "\tleaq .Llcc_bounds_msg(%%rip), %%rsi\n"
+          "\tmovq stderr(%%rip), %%rdi\n"
+          "\txorl %%eax, %%eax\n"
+          "\tcall fprintf@PLT\n"
+          "\tcall abort@PLT\n"
+          "\t.section .rodata\n"
+          ".Llcc_bounds_msg:\n"
+          "\t.string \"%%s:%%ld: index %%ld out of bounds for size %%ld\\n\"\n"
+          ".Llcc_bounds_file:\n"
+          "\t.string \"%s\"\n"
+          "\t.text\n",
+          lcc_current_file);
+}
@@ -0,0 +1,935 @@
+#include "debug.h"
+#include "opt.h"
+#include "tree.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hashmap.h"
+
+/*
+ * Closures.
+ *
+ *   (lambda (x) : i32 (declare (type i32 x)) (return (+ x k)))
+ *
+ * is a value of type (lambda (i32) i32) and is called with (funcall f 3).
+ * Every lambda is lifted into a function of its own, _lambdaN, which takes
+ * its environment as a void * first argument. The variables it uses from the
+ * enclosing function are captured by value into a structure, _lambdaN_env,
+ * and cannot be assigned inside the lambda. A closure value is a structure
+ * holding the code pointer and the environment, named after its type,
+ * lambda_int__to_int for (lambda (i32) i32).
+ *
+ * Escape analysis decides where the environment lives. It stays on the stack
+ * of the function creating the closure unless the closure is returned,
+ * stored, captured by another lambda or passed where it may be kept. Each
+ * function's closure parameters are summarised first, a parameter that is
+ * only called or handed to parameters that do not escape does not escape
+ * either. Escaping environments are allocated with malloc and released with
+ * (free-closure f).
+ *
+ * Calls through a variable bound to a lambda and never assigned call the
+ * lifted function directly. A function called with a known lambda for a
+ * closure parameter that it calls, map and reduce style helpers, is cloned
+ * for that lambda, so that the call in its loop is direct and the C compiler
+ * can inline it.
+ */
+
+extern const char *lcc_current_file;
+
+static struct hashmap_s closures;
+static bool closures_created = false;
+static struct tree *decls = NULL, *decls_end = NULL;
+static bool closures_used = false;
+static int n_lambdas = 0;
+
+/* instantiation */
+
+struct tree *build_closure_type(struct location loc, struct tree *args,
+                                struct tree *type) {
+  char name[256] = "lambda_";
+  bool valid = true;
+  int n = 0;
+  for (struct tree *arg = args; arg != NULL && valid; arg = arg->next) {
+    if (n++ > 0)
+      strncat(name, "__", sizeof(name) - strlen(name) - 1);
+    valid = mangle_type(arg, name, sizeof(name));
+  }
+  strncat(name, "__to_", sizeof(name) - strlen(name) - 1);
+  valid = valid && mangle_type(type, name, sizeof(name));
+  if (!valid) {
+    destroy_tree(args);
+    destroy_tree(type);
+    return build_type_expr(loc, build_tid(NULL, MOD_MONOMORPH));
+  }
+
+  if (!closures_created) {
+    if (hashmap_create(32, &closures) != 0)
+      error("Failed to create hashmap.");
+    closures_created = true;
+  }
+  if (hashmap_get(&closures, name, strlen(name)) != NULL) {
+    destroy_tree(args);
+    destroy_tree(type);
+  } else {
+    struct tree *decl = build_closure(loc, strdup(name), type, args);
+    hashmap_put(&closures, decl->closure_decl.name, strlen(name), decl);
+    if (decls_end == NULL)
+      decls = decls_end = decl;
+    else
+      decls_end = decls_end->next = decl;
+  }
+  closures_used = true;
+  return build_type_expr(loc, build_tid(strdup(name), MOD_NONE));
+}
+
+struct tree *build_lambda(struct location loc, struct tree *lambda_list,
+                          struct tree *type, struct tree *body) {
+  struct tree *list = lambda_list;
+  if (list->lambda_list.optionals != NULL || list->lambda_list.rest != NULL ||
+      list->lambda_list.keys != NULL || list->lambda_list.aux != NULL) {
+    errorat("lambda takes required arguments only", lcc_current_file,
+            loc.first_line, loc.first_column);
+  }
+  char name[32];
+  snprintf(name, sizeof(name), "_lambda%d", n_lambdas++);
+  closures_used = true;
+  struct tree *fn = build_fn(loc, strdup(name), type, lambda_list, body);
+  // reports and the symbol map show the lambda by its position
+  free(fn->fn_decl.source_name);
+  fn->fn_decl.source_name = strdup("lambda");
+  return build_lambda_expr(loc, fn);
+}
+
+static struct tree *copy_type(struct tree *type) {
+  struct tree *copy = build_type_expr(type->loc, build_tid(NULL, MOD_NONE));
+  copy_type_to_type(copy, type);
+  return copy;
+}
+
+static struct tree *find_closure(struct tree *type) {
+  if (type == NULL || type->type != TYPE_EXPR || !closures_created ||
+      type->type_expr.ptr != NULL || type->type_expr.id->name == NULL)
+    return NULL;
+  char *name = type->type_expr.id->name;
+  return hashmap_get(&closures, name, strlen(name));
+}
+
+/* the type of the closure made from decl, NULL when a parameter is untyped */
+static struct tree *lambda_type(struct tree *decl) {
+  struct tree *args = NULL;
+  for (struct tree *arg = decl->fn_decl.arglist->lambda_list.args; arg != NULL;
+       arg = arg->next) {
+    if (is_monomorph(arg->var_decl.type)) {
+      errorat("lambda argument '%s' needs a declared type", lcc_current_file,
+              arg->loc.first_line, arg->loc.first_column, arg->var_decl.name);
+      destroy_tree(args);
+      return NULL;
+    }
+    args = append_tree(copy_type(arg->var_decl.type), args);
+  }
+  return build_closure_type(decl->loc, args, copy_type(decl->fn_decl.type));
+}
+
+/* escape analysis */
+
+struct param {
+  bool closure, escapes, assigned, called;
+};
+
+struct summary {
+  struct tree *fn;
+  struct tree *original; // the declaration before lowering, to clone
+  int n_params;
+  struct param params[];
+};
+
+static struct hashmap_s summaries;
+
+struct uses {
+  const char *name;
+  bool escapes, assigned, called;
+  int captured; // lambdas around the current node
+};
+
+static bool is_var(struct tree *t, const char *name) {
+  return t != NULL && t->type == REFERENCE_EXPR &&
+         t->reference_expr.type == VAR_REF &&
+         strcmp(t->reference_expr.symbol, name) == 0;
+}
+
+static bool is_call(struct tree *t, const char *name) {
+  return t->type == REFERENCE_EXPR && t->reference_expr.type == FN_CALL &&
+         strcmp(t->reference_expr.call.name, name) == 0;
+}
+
+static struct summary *find_summary(const char *name) {
+  return hashmap_get(&summaries, name, strlen(name));
+}
+
+/* every use of u->name escapes but calling it and passing it to a parameter
+ * that does not escape */
+static bool uses_walk(struct tree *t, void *data) {
+  struct uses *u = data;
+  if (is_var(t, u->name)) {
+    u->escapes = true;
+    return false;
+  }
+  if (t->type == SET_EXPR && is_var(t->set_expr.var, u->name)) {
+    u->assigned = u->escapes = true;
+    walk_tree(t->set_expr.value, uses_walk, u);
+    return false;
+  }
+  if (t->type == LAMBDA_EXPR) {
+    u->captured++;
+    walk_tree(t->lambda_expr.decl->fn_decl.body, uses_walk, u);
+    u->captured--;
+    return false;
+  }
+  if (t->type != REFERENCE_EXPR || t->reference_expr.type != FN_CALL ||
+      u->captured > 0)
+    return true;
+
+  struct tree *args = t->reference_expr.call.args;
+  if (is_call(t, "funcall") && is_var(args, u->name)) {
+    u->called = true;
+    walk_tree(args->next, uses_walk, u);
+    return false;
+  }
+  struct summary *callee = find_summary(t->reference_expr.call.name);
+  if (callee == NULL)
+    return true;
+  int i = 0;
+  for (struct tree *arg = args; arg != NULL; arg = arg->next, i++) {
+    if (i < callee->n_params && callee->params[i].closure &&
+        !callee->params[i].escapes && is_var(arg, u->name))
+      continue;
+    walk_tree_node(arg, uses_walk, u);
+  }
+  return false;
+}
+
+static struct uses find_uses(const char *name, struct tree *chain,
+                             struct tree *more) {
+  struct uses u = {name, false, false, false, 0};
+  walk_tree(chain, uses_walk, &u);
+  walk_tree(more, uses_walk, &u);
+  return u;
+}
+
+static int free_summary(void *const context, void *const value) {
+  struct summary *s = value;
+  destroy_tree(s->original);
+  free(s);
+  return 1;
+}
+
+/* optimistic, every closure parameter starts out not escaping until one of
+ * its uses says otherwise */
+static void summarize(struct tree *t) {
+  for (struct tree *head = t; head != NULL; head = head->next) {
+    if (head->type != FN_DECL || head->fn_decl.arglist == NULL)
+      continue;
+    int n = 0;
+    for (struct tree *arg = head->fn_decl.arglist->lambda_list.args;
+         arg != NULL; arg = arg->next)
+      n++;
+    struct summary *s =
+        calloc(1, sizeof(struct summary) + n * sizeof(struct param));
+    s->fn = head;
+    s->n_params = n;
+    int i = 0;
+    for (struct tree *arg = head->fn_decl.arglist->lambda_list.args;
+         arg != NULL; arg = arg->next, i++) {
+      s->params[i].closure = find_closure(arg->var_decl.type) != NULL;
+      s->params[i].escapes = !s->params[i].closure;
+    }
+    struct summary *old =
+        hashmap_get(&summaries, head->fn_decl.name, strlen(head->fn_decl.name));
+    if (old != NULL)
+      free_summary(NULL, old);
+    hashmap_put(&summaries, head->fn_decl.name, strlen(head->fn_decl.name), s);
+  }
+
+  for (bool changed = true; changed;) {
+    changed = false;
+    for (struct tree *head = t; head != NULL; head = head->next) {
+      if (head->type != FN_DECL || head->fn_decl.arglist == NULL)
+        continue;
+      struct summary *s = find_summary(head->fn_decl.name);
+      int i = 0;
+      for (struct tree *arg = head->fn_decl.arglist->lambda_list.args;
+           arg != NULL; arg = arg->next, i++) {
+        if (s->params[i].escapes)
+          continue;
+        struct uses u = find_uses(arg->var_decl.name, head->fn_decl.body, NULL);
+        s->params[i].assigned = u.assigned;
+        s->params[i].called = u.called;
+        if (u.escapes) {
+          s->params[i].escapes = true;
+          changed = true;
+        }
+      }
+    }
+  }
+
+  // functions calling one of their closure parameters can be specialised
+  for (struct tree *head = t; head != NULL; head = head->next) {
+    if (head->type != FN_DECL || head->fn_decl.arglist == NULL)
+      continue;
+    struct summary *s = find_summary(head->fn_decl.name);
+    for (int i = 0; i < s->n_params; i++) {
+      if (s->params[i].closure && !s->params[i].assigned &&
+          s->params[i].called && s->fn == head && s->original == NULL)
+        s->original = copy_tree(head);
+    }
+  }
+}
+
+/* lowering */
+
+struct binding {
+  char *name;
+  struct tree *type;
+  const char *lambda; // the lifted function when the closure is known
+};
+
+static struct binding *scope = NULL;
+static int n_scope = 0, cap_scope = 0;
+static int n_globals = 0, fn_base = 0;
+static struct tree *pending = NULL, *pending_end = NULL;
+static struct hashmap_s specialized;
+static bool heap_used = false;
+
+static void push_scope(char *name, struct tree *type, const char *lambda) {
+  if (n_scope >= cap_scope) {
+    cap_scope = cap_scope == 0 ? 32 : cap_scope * 2;
+    scope = realloc(scope, cap_scope * sizeof(struct binding));
+  }
+  scope[n_scope++] = (struct binding){name, type, lambda};
+}
+
+/* the locals of the current function from top down to bottom, then the
+ * globals */
+static struct binding *lookup_from(const char *name, int top, int bottom) {
+  for (int i = top - 1; i >= bottom; i--) {
+    if (strcmp(scope[i].name, name) == 0)
+      return &scope[i];
+  }
+  return NULL;
+}
+
+static struct binding *lookup(const char *name) {
+  struct binding *b = lookup_from(name, n_scope, fn_base);
+  return b != NULL ? b : lookup_from(name, n_globals, 0);
+}
+
+static void add_pending(struct tree *t) {
+  t->next = NULL;
+  if (pending_end == NULL)
+    pending = pending_end = t;
+  else
+    pending_end = pending_end->next = t;
+}
+
+static void replace(struct tree **slot, struct tree *t) {
+  struct tree *old = *slot;
+  t->next = old->next;
+  old->next = NULL;
+  destroy_tree(old);
+  *slot = t;
+}
+
+static struct tree *type_of(struct tree *t) {
+  if (t->type == CAST_EXPR)
+    return t->cast_expr.type;
+  if (t->type != REFERENCE_EXPR)
+    return NULL;
+  if (t->reference_expr.type == VAR_REF) {
+    struct binding *b = lookup(t->reference_expr.symbol);
+    return b == NULL ? NULL : b->type;
+  }
+  if (t->reference_expr.type == FN_CALL) {
+    struct summary *s = find_summary(t->reference_expr.call.name);
+    return s == NULL ? NULL : s->fn->fn_decl.type;
+  }
+  return NULL;
+}
+
+static void lower(struct tree **slot);
+static void lower_chain(struct tree **chain, struct tree *more);
+
+struct capture {
+  struct tree *vars; // a VAR_DECL per captured variable
+  int base;          // first binding of the lambda
+  bool valid;
+};
+
+static bool capture_walk(struct tree *t, void *data) {
+  struct capture *c = data;
+  if (t->type == SET_EXPR && t->set_expr.var->type == REFERENCE_EXPR &&
+      t->set_expr.var->reference_expr.type == VAR_REF &&
+      lookup_from(t->set_expr.var->reference_expr.symbol, c->base, fn_base) !=
+          NULL) {
+    errorat("cannot assign '%s', lambdas capture variables by value",
+            lcc_current_file, t->loc.first_line, t->loc.first_column,
+            t->set_expr.var->reference_expr.symbol);
+    c->valid = false;
+  }
+  if (t->type != REFERENCE_EXPR || t->reference_expr.type != VAR_REF)
+    return true;
+  char *name = t->reference_expr.symbol;
+  struct binding *b = lookup_from(name, c->base, fn_base);
+  if (b == NULL)
+    return false;
+  for (struct tree *var = c->vars; var != NULL; var = var->next) {
+    if (strcmp(var->var_decl.name, name) == 0)
+      return false;
+  }
+  if (b->type == NULL || is_monomorph(b->type)) {
+    errorat("captured variable '%s' needs a declared type", lcc_current_file,
+            t->loc.first_line, t->loc.first_column, name);
+    c->valid = false;
+    return false;
+  }
+  c->vars = append_tree(build_var(t->loc, VAR_DECL, strdup(name),
+                                  copy_type(b->type), NULL),
+                        c->vars);
+  return false;
+}
+
+static struct tree *env_type(struct location loc, const char *lambda) {
+  size_t len = strlen(lambda) + sizeof("_env");
+  char *name = malloc(len);
+  snprintf(name, len, "%s_env", lambda);
+  return build_type_expr(loc, build_tid(name, MOD_NONE));
+}
+
+/* the captured variables are read from the environment on entry */
+static void unpack_env(struct tree *decl, struct tree *captured) {
+  struct location loc = decl->loc;
+  struct tree *vars = NULL;
+  for (struct tree *var = captured; var != NULL; var = var->next) {
+    struct tree *type = env_type(loc, decl->fn_decl.name);
+    add_type_ptr(type, SINGLE_PTR, 0);
+    struct tree *env =
+        build_cast(loc, type, build_var_ref(loc, strdup("_env")));
+    vars = append_tree(
+        build_var(var->loc, VAR_DECL, strdup(var->var_decl.name),
+                  copy_type(var->var_decl.type),
+                  build_field_ref(loc, env, strdup(var->var_decl.name), true)),
+        vars);
+  }
+  decl->fn_decl.body = build_let_stmt(loc, vars, decl->fn_decl.body);
+}
+
+/* the environment holding captured, on the stack as a compound literal or
+ * copied to the heap */
+static struct tree *build_env(struct location loc, const char *lambda,
+                              struct tree *captured, bool stack) {
+  if (captured == NULL)
+    return build_int_cst(loc, 0);
+  struct tree *keys = NULL;
+  for (struct tree *var = captured; var != NULL; var = var->next) {
+    keys = append_tree(
+        build_lambda_key(var->loc, strdup(var->var_decl.name),
+                         build_var_ref(var->loc, strdup(var->var_decl.name))),
+        keys);
+  }
+  size_t len = strlen(lambda) + sizeof("make__env");
+  char *make = malloc(len);
+  snprintf(make, len, "make_%s_env", lambda);
+  struct tree *env =
+      build_list(loc, env_type(loc, lambda), build_fn_call(loc, make, keys));
+  if (stack)
+    return env;
+  env->next = build_fn_call(loc, strdup("sizeof"), env_type(loc, lambda));
+  heap_used = true;
+  return build_fn_call(loc, strdup("lcc_closure_env"), env);
+}
+
+/* moves the lambda at slot to the top level and puts the closure in its
+ * place, returns the name of the lifted function */
+static const char *lift(struct tree **slot, bool stack) {
+  struct tree *t = *slot;
+  struct tree *decl = t->lambda_expr.decl;
+  struct tree *type = lambda_type(decl);
+  if (type == NULL)
+    return NULL;
+  struct tree *closure = find_closure(type);
+  destroy_tree(type);
+  if (closure == NULL)
+    return NULL;
+
+  int base = n_scope;
+  for (struct tree *arg = decl->fn_decl.arglist->lambda_list.args; arg != NULL;
+       arg = arg->next)
+    push_scope(arg->var_decl.name, arg->var_decl.type, NULL);
+  lower_chain(&decl->fn_decl.body, NULL);
+  n_scope = base;
+
+  struct capture c = {NULL, base, true};
+  walk_tree(decl->fn_decl.body, capture_walk, &c);
+  if (!c.valid) {
+    destroy_tree(c.vars);
+    return NULL;
+  }
+
+  struct location loc = t->loc;
+  char *name = decl->fn_decl.name;
+  if (c.vars != NULL) {
+    struct tree *fields = NULL;
+    for (struct tree *var = c.vars; var != NULL; var = var->next) {
+      fields = append_tree(build_var(var->loc, VAR_DECL,
+                                     strdup(var->var_decl.name),
+                                     copy_type(var->var_decl.type), NULL),
+                           fields);
+    }
+    size_t len = strlen(name) + sizeof("_env");
+    char *env_name = malloc(len);
+    snprintf(env_name, len, "%s_env", name);
+    add_pending(build_struct(loc, env_name, NULL, fields));
+    unpack_env(decl, c.vars);
+  }
+
+  struct tree *void_ptr = build_type_expr(loc, build_tid(strdup("void"),
+                                                         MOD_NONE));
+  add_type_ptr(void_ptr, SINGLE_PTR, 0);
+  struct tree *env_parm =
+      build_var(loc, PARM_DECL, strdup("_env"), void_ptr, NULL);
+  env_parm->next = decl->fn_decl.arglist->lambda_list.args;
+  decl->fn_decl.arglist->lambda_list.args = env_parm;
+  t->lambda_expr.decl = NULL;
+  add_pending(decl);
+
+  struct tree *fn = build_var_ref(loc, strdup(name));
+  fn->next = build_env(loc, name, c.vars, stack);
+  destroy_tree(c.vars);
+  size_t len = strlen(closure->closure_decl.name) + sizeof("_make");
+  char *make = malloc(len);
+  snprintf(make, len, "%s_make", closure->closure_decl.name);
+  replace(slot, build_fn_call(loc, make, fn));
+  return name;
+}
+
+/* (funcall f x...) becomes _lambdaN(f.env, x...) when f is known and
+ * NAME_call(f, x...) otherwise */
+static void lower_funcall(struct tree *t) {
+  struct tree *target = t->reference_expr.call.args;
+  if (target == NULL) {
+    errorat("funcall expects a closure", lcc_current_file, t->loc.first_line,
+            t->loc.first_column);
+    return;
+  }
+  lower_chain(&target->next, NULL);
+  struct binding *b = target->type == REFERENCE_EXPR &&
+                              target->reference_expr.type == VAR_REF
+                          ? lookup(target->reference_expr.symbol)
+                          : NULL;
+  char *name;
+  if (b != NULL && b->lambda != NULL) {
+    name = strdup(b->lambda);
+    struct tree *args = target->next;
+    target->next = NULL;
+    struct tree *env = build_field_ref(t->loc, target, strdup("env"), false);
+    env->next = args;
+    t->reference_expr.call.args = env;
+  } else {
+    lower(&t->reference_expr.call.args);
+    struct tree *closure = find_closure(type_of(t->reference_expr.call.args));
+    if (closure == NULL) {
+      errorat("funcall expects a closure, declare the type of its first "
+              "argument",
+              lcc_current_file, t->loc.first_line, t->loc.first_column);
+      return;
+    }
+    size_t len = strlen(closure->closure_decl.name) + sizeof("_call");
+    name = malloc(len);
+    snprintf(name, len, "%s_call", closure->closure_decl.name);
+  }
+  free(t->reference_expr.call.name);
+  t->reference_expr.call.name = name;
+}
+
+static void lower_fn(struct tree *fn, const char **known);
+
+/* the lambdas of a copy are lifted again and need names of their own */
+static bool rename_lambdas(struct tree *t, void *data) {
+  if (t->type == LAMBDA_EXPR) {
+    char name[32];
+    snprintf(name, sizeof(name), "_lambda%d", n_lambdas++);
+    free(t->lambda_expr.decl->fn_decl.name);
+    t->lambda_expr.decl->fn_decl.name = strdup(name);
+  }
+  return true;
+}
+
+/* a call of F with known lambdas for closure parameters that F calls is
+ * redirected to a copy of F specialised for them, F__lambdaN */
+static void specialize(struct tree *t, struct summary *callee,
+                       const char **known) {
+  char name[256];
+  snprintf(name, sizeof(name), "%s", t->reference_expr.call.name);
+  for (int i = 0; i < callee->n_params; i++) {
+    if (known[i] != NULL)
+      snprintf(&name[strlen(name)], sizeof(name) - strlen(name), "_%s",
+               known[i]);
+  }
+  struct tree *clone = hashmap_get(&specialized, name, strlen(name));
+  if (clone == NULL) {
+    clone = copy_tree(callee->original);
+    free(clone->fn_decl.name);
+    clone->fn_decl.name = strdup(name);
+    walk_tree(clone->fn_decl.body, rename_lambdas, NULL);
+    hashmap_put(&specialized, clone->fn_decl.name, strlen(name), clone);
+    lower_fn(clone, known);
+    add_pending(clone);
+  }
+  free(t->reference_expr.call.name);
+  t->reference_expr.call.name = strdup(clone->fn_decl.name);
+}
+
+static void lower_call(struct tree **slot) {
+  struct tree *t = *slot;
+  if (is_call(t, "funcall")) {
+    lower_funcall(t);
+    return;
+  }
+  if (is_call(t, "free_closure")) {
+    struct tree *arg = t->reference_expr.call.args;
+    if (arg == NULL || arg->next != NULL) {
+      errorat("free-closure takes one closure", lcc_current_file,
+              t->loc.first_line, t->loc.first_column);
+      return;
+    }
+    lower(&t->reference_expr.call.args);
+    t->reference_expr.call.args =
+        build_field_ref(t->loc, t->reference_expr.call.args, strdup("env"),
+                        false);
+    free(t->reference_expr.call.name);
+    t->reference_expr.call.name = strdup("free");
+    heap_used = true;
+    return;
+  }
+
+  struct summary *callee = find_summary(t->reference_expr.call.name);
+  const char **known = NULL;
+  if (callee != NULL && callee->n_params > 0)
+    known = calloc(callee->n_params, sizeof(char *));
+  bool any_known = false;
+  int i = 0;
+  for (struct tree **arg = &t->reference_expr.call.args; *arg != NULL;
+       arg = &(*arg)->next, i++) {
+    if ((*arg)->type == LAMBDA_KEY) {
+      lower(&(*arg)->lambda_key.expr);
+      continue;
+    }
+    struct param *p =
+        known != NULL && i < callee->n_params ? &callee->params[i] : NULL;
+    if (p == NULL || !p->closure) {
+      lower(arg);
+      continue;
+    }
+    const char *lambda = NULL;
+    if ((*arg)->type == LAMBDA_EXPR) {
+      lambda = lift(arg, !p->escapes);
+    } else {
+      struct binding *b =
+          (*arg)->type == REFERENCE_EXPR &&
+                  (*arg)->reference_expr.type == VAR_REF
+              ? lookup((*arg)->reference_expr.symbol)
+              : NULL;
+      lambda = b == NULL ? NULL : b->lambda;
+      lower(arg);
+    }
+    if (lambda != NULL && !p->assigned && p->called &&
+        callee->original != NULL) {
+      known[i] = lambda;
+      any_known = true;
+    }
+  }
+  if (any_known)
+    specialize(t, callee, known);
+  free(known);
+}
+
+/* a variable initialised by a lambda knows the function it calls unless it
+ * is assigned, and keeps its environment on the stack unless it escapes */
+static void bind_lambda(struct tree *var, struct tree *more) {
+  struct tree *type = lambda_type(var->var_decl.value->lambda_expr.decl);
+  if (type == NULL)
+    return;
+  if (is_monomorph(var->var_decl.type))
+    copy_type_to_type(var->var_decl.type, type);
+  destroy_tree(type);
+  struct uses u = find_uses(var->var_decl.name, var->next, more);
+  const char *lambda = lift(&var->var_decl.value, !u.escapes);
+  push_scope(var->var_decl.name, var->var_decl.type,
+             u.assigned ? NULL : lambda);
+}
+
+static void lower_chain(struct tree **chain, struct tree *more) {
+  for (struct tree **slot = chain; *slot != NULL; slot = &(*slot)->next) {
+    struct tree *t = *slot;
+    if (t->type == VAR_DECL && t->var_decl.value != NULL &&
+        t->var_decl.value->type == LAMBDA_EXPR)
+      bind_lambda(t, more);
+    else
+      lower(slot);
+  }
+}
+
+static void lower(struct tree **slot) {
+  struct tree *t = *slot;
+  if (t == NULL)
+    return;
+  int saved = n_scope;
+  switch (t->type) {
+  case VAR_DECL:
+  case PARM_DECL:
+    lower(&t->var_decl.value);
+    // a variable holding a closure returned by a function takes its type
+    if (t->var_decl.value != NULL && is_monomorph(t->var_decl.type) &&
+        find_closure(type_of(t->var_decl.value)) != NULL)
+      copy_type_to_type(t->var_decl.type, type_of(t->var_decl.value));
+    push_scope(t->var_decl.name, t->var_decl.type, NULL);
+    // declarations stay visible for the rest of the enclosing body
+    return;
+  case LAMBDA_EXPR:
+    lift(slot, false);
+    break;
+  case SET_EXPR:
+    lower(&t->set_expr.var);
+    lower(&t->set_expr.value);
+    break;
+  case AREF_EXPR:
+    lower(&t->ref_expr.expr);
+    lower_chain(&t->ref_expr.indices, NULL);
+    break;
+  case ADDR_EXPR:
+    lower(&t->ref_expr.expr);
+    break;
+  case FIELD_EXPR:
+    lower(&t->field_expr.expr);
+    break;
+  case CAST_EXPR:
+    lower(&t->cast_expr.expr);
+    break;
+  case LIST_EXPR:
+    lower_chain(&t->list_expr.elems, NULL);
+    break;
+  case BINOP_EXPR:
+    lower_chain(&t->binop_expr.body, NULL);
+    break;
+  case COMPARE_EXPR:
+    lower(&t->compare_expr.lhs);
+    lower(&t->compare_expr.rhs);
+    break;
+  case REFERENCE_EXPR:
+    if (t->reference_expr.type == FN_CALL)
+      lower_call(slot);
+    break;
+  case LET_STMT:
+    lower_chain(&t->let_stmt.vars, t->let_stmt.body);
+    lower_chain(&t->let_stmt.body, NULL);
+    break;
+  case IF_STMT:
+    lower(&t->if_else_stmt.condition);
+    lower_chain(&t->if_else_stmt.if_block, NULL);
+    n_scope = saved;
+    lower_chain(&t->if_else_stmt.else_block, NULL);
+    break;
+  case COND_STMT:
+    for (struct tree *expr = t->cond_stmt.exprs; expr != NULL;
+         expr = expr->next) {
+      lower(&expr->cond_expr.condition);
+      lower_chain(&expr->cond_expr.body, NULL);
+      n_scope = saved;
+    }
+    break;
+  case CASE_STMT:
+    lower(&t->case_stmt.expr);
+    for (struct tree *c = t->case_stmt.cases; c != NULL; c = c->next) {
+      lower_chain(&c->case_expr.body, NULL);
+      n_scope = saved;
+    }
+    break;
+  case WHILE_STMT:
+  case DOWHILE_STMT:
+    lower(&t->while_stmt.condition);
+    lower_chain(&t->while_stmt.body, NULL);
+    break;
+  case FOR_STMT:
+    lower_chain(&t->for_stmt.vars, NULL);
+    lower(&t->for_stmt.condition);
+    lower(&t->for_stmt.loop_eval);
+    lower_chain(&t->for_stmt.body, NULL);
+    break;
+  case FOREACH_STMT:
+    lower(&t->foreach_stmt.expr);
+    lower_chain(&t->foreach_stmt.vars, NULL);
+    lower_chain(&t->foreach_stmt.body, NULL);
+    break;
+  default:
+    break;
+  }
+  n_scope = saved;
+}
+
+static void push_params(struct tree *chain, const char **known) {
+  int i = 0;
+  for (struct tree *parm = chain; parm != NULL; parm = parm->next, i++) {
+    struct tree *decl = parm->type == LAMBDA_KEY ? parm->lambda_key.expr : parm;
+    if (decl == NULL || (decl->type != VAR_DECL && decl->type != PARM_DECL))
+      continue;
+    lower(&decl->var_decl.value);
+    push_scope(decl->var_decl.name, decl->var_decl.type,
+               known == NULL ? NULL : known[i]);
+  }
+}
+
+static void lower_fn(struct tree *fn, const char **known) {
+  int saved = n_scope, saved_base = fn_base;
+  fn_base = n_scope;
+  struct tree *list = fn->fn_decl.arglist;
+  if (list != NULL && list->type == LAMBDA_LIST) {
+    push_params(list->lambda_list.args, known);
+    push_params(list->lambda_list.optionals, NULL);
+    push_params(list->lambda_list.rest, NULL);
+    push_params(list->lambda_list.keys, NULL);
+    push_params(list->lambda_list.aux, NULL);
+  }
+  lower_chain(&fn->fn_decl.body, NULL);
+  n_scope = saved;
+  fn_base = saved_base;
+}
+
+/* placement, a closure type precedes the first function and anything else
+ * naming it */
+
+static bool names(struct tree *type, const char *name) {
+  return type != NULL && type->type == TYPE_EXPR &&
+         type->type_expr.id->name != NULL &&
+         strcmp(type->type_expr.id->name, name) == 0;
+}
+
+static bool uses_closure(struct tree *head, const char *name) {
+  switch (head->type) {
+  case FN_DECL:
+    return true;
+  case VAR_DECL:
+    return names(head->var_decl.type, name);
+  case STRUCT_DECL:
+    for (struct tree *v = head->struct_decl.fields; v != NULL; v = v->next) {
+      if (names(v->var_decl.type, name))
+        return true;
+    }
+    return false;
+  case CLOSURE_DECL:
+    if (names(head->closure_decl.type, name))
+      return true;
+    for (struct tree *arg = head->closure_decl.args; arg != NULL;
+         arg = arg->next) {
+      if (names(arg, name))
+        return true;
+    }
+    return false;
+  default:
+    return false;
+  }
+}
+
+static struct tree *place(struct tree *t, struct tree *decl) {
+  struct tree **slot = &t;
+  while (*slot != NULL && !uses_closure(*slot, decl->closure_decl.name))
+    slot = &(*slot)->next;
+  decl->next = *slot;
+  *slot = decl;
+  return t;
+}
+
+static struct tree *place_all(struct tree *t, struct tree *decl) {
+  if (decl == NULL)
+    return t;
+  // the closures a closure names were declared before it, place it first
+  struct tree *next = decl->next;
+  t = place_all(t, next);
+  return place(t, decl);
+}
+
+struct tree *lower_closures(struct tree *t) {
+  if (!closures_used)
+    return t;
+  if (hashmap_create(64, &summaries) != 0 ||
+      hashmap_create(32, &specialized) != 0) {
+    error("Failed to create hashmap.");
+    return t;
+  }
+  summarize(t);
+
+  for (struct tree *head = t; head != NULL; head = head->next) {
+    if (head->type == VAR_DECL)
+      push_scope(head->var_decl.name, head->var_decl.type, NULL);
+  }
+  n_globals = fn_base = n_scope;
+  // lifted lambdas and specialised functions go before their first caller
+  for (struct tree **slot = &t; *slot != NULL; slot = &(*slot)->next) {
+    struct tree *head = *slot;
+    if (head->type == VAR_DECL && head->var_decl.value != NULL &&
+        head->var_decl.value->type == LAMBDA_EXPR) {
+      errorat("lambda outside of a function", lcc_current_file,
+              head->loc.first_line, head->loc.first_column);
+      continue;
+    }
+    if (head->type != FN_DECL)
+      continue;
+    lower_fn(head, NULL);
+    if (pending != NULL) {
+      pending_end->next = head;
+      *slot = pending;
+      slot = &pending_end->next;
+      pending = pending_end = NULL;
+    }
+  }
+  free(scope);
+  scope = NULL;
+  n_scope = cap_scope = n_globals = fn_base = 0;
+
+  struct tree *placed = decls;
+  decls = decls_end = NULL;
+  t = place_all(t, placed);
+
+  hashmap_iterate(&summaries, free_summary, NULL);
+  hashmap_destroy(&summaries);
+  hashmap_destroy(&specialized);
+  if (closures_created)
+    hashmap_destroy(&closures);
+  closures_created = false;
+  return t;
+}
+
+void print_closure_header(bool emit_asm) {
+  if (!closures_used || emit_asm)
+    return;
+  if (!heap_used)
+    return;
+  fprintf(stdout,
+          "#include <stddef.h>\n"
+          "#include <stdio.h>\n"
+          "#include <stdlib.h>\n"
+          "#include <string.h>\n"
+          "static inline void *lcc_closure_env(const void *env, size_t size) "
+          "{\n"
+          "  void *p = malloc(size);\n"
+          "  if (p == NULL) {\n"
+          "    fprintf(stderr, \"%s: closure out of memory\\n\");\n"
+          "    abort();\n"
+          "  }\n"
+          "  memcpy(p, env, size);\n"
+          "  return p;\n"
+          "}\n",
+          lcc_current_file);
+}
@@ -0,0 +1,639 @@
+#include "debug.h"
+#include "opt.h"
+#include "tree.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hashmap.h"
+
+/*
+ * Built-in containers, specialised for their element types when the program
+ * is compiled:
+ *
+ *   (vector T)        growable array, (push v x) (pop v) (get v i)
+ *                     (put v i x) (reserve v n)
+ *   (hash-table K V)  open addressing table, (put h k x) (get h k [default])
+ *                     (has h k) (remove h k)
+ *
+ * Both take (len c), (clear c) and (destroy c), the latter releasing the
+ * storage. Every instantiation becomes a structure and a set of static inline
+ * helpers named after it, vector_int_push for (vector i32), so elements are
+ * stored inline without void * indirection. (get v i) of a vector is a place
+ * and can be assigned with setf. A container declared with 0 or without a
+ * value starts empty; containers are handles, copying one shares its
+ * storage.
+ *
+ * (for (x : c) body) iterates over the elements of a vector or the keys of a
+ * hash-table, (for (i x : v) body) and (for (k x : h) body) also name the
+ * index or the value. Hash-table keys are integers, pointers or *char
+ * strings, which are compared by content and not copied.
+ */
+
+extern const char *lcc_current_file;
+
+enum op_kind {
+  OP_CALL,  // a helper taking the address of the container
+  OP_INDEX, // an element of a vector
+  OP_STORE, // assignment to an element of a vector
+  OP_FIELD, // a field of the container
+};
+
+struct container_op {
+  const char *name;
+  int n_args; // including the container
+  bool vector, hash_table;
+  enum op_kind kind;
+  const char *helper;
+};
+
+static const struct container_op ops[] = {
+    {"push", 2, true, false, OP_CALL, "push"},
+    {"pop", 1, true, false, OP_CALL, "pop"},
+    {"reserve", 2, true, false, OP_CALL, "reserve"},
+    {"get", 2, true, false, OP_INDEX, NULL},
+    {"put", 3, true, false, OP_STORE, NULL},
+    {"get", 2, false, true, OP_CALL, "get"},
+    {"get", 3, false, true, OP_CALL, "get_or"},
+    {"put", 3, false, true, OP_CALL, "put"},
+    {"has", 2, false, true, OP_CALL, "has"},
+    {"remove", 2, false, true, OP_CALL, "remove"},
+    {"len", 1, true, true, OP_FIELD, "len"},
+    {"clear", 1, true, true, OP_CALL, "clear"},
+    {"destroy", 1, true, true, OP_CALL, "destroy"},
+};
+
+static struct hashmap_s containers;
+static bool containers_created = false;
+static struct tree *decls = NULL, *decls_end = NULL;
+static bool containers_used = false;
+
+struct container_scope {
+  char *name;
+  struct tree *type;
+};
+
+static struct container_scope *scope = NULL;
+static int n_scope = 0, cap_scope = 0;
+static struct tree *functions;
+static int n_iterators = 0;
+
+static void push_scope(char *name, struct tree *type) {
+  if (n_scope >= cap_scope) {
+    cap_scope = cap_scope == 0 ? 32 : cap_scope * 2;
+    scope = realloc(scope, cap_scope * sizeof(struct container_scope));
+  }
+  scope[n_scope++] = (struct container_scope){name, type};
+}
+
+static struct tree *lookup(char *name) {
+  for (int i = n_scope - 1; i >= 0; i--) {
+    if (strcmp(scope[i].name, name) == 0)
+      return scope[i].type;
+  }
+  return NULL;
+}
+
+/* instantiation */
+
+/* appends the name of type to buf, p_int for *i32 */
+bool mangle_type(struct tree *type, char *buf, size_t size) {
+  struct type_id *id = type->type_expr.id;
+  size_t len = strlen(buf);
+  for (struct type_ptr *ptr = type->type_expr.ptr; ptr != NULL;
+       ptr = ptr->next) {
+    if (ptr->type != SINGLE_PTR) {
+      errorat("elements cannot be arrays, use *T",
+              lcc_current_file, type->loc.first_line, type->loc.first_column);
+      return false;
+    }
+    len += snprintf(&buf[len], len < size ? size - len : 0, "p_");
+  }
+  static const char *modifiers[] = {
+      [MOD_NONE] = "",          [MOD_CONST] = "const_",
+      [MOD_VOLATILE] = "volatile_", [MOD_RESTRICT] = "restrict_",
+      [MOD_ATOMIC] = "atomic_", [MOD_MONOMORPH] = "",
+  };
+  len += snprintf(&buf[len], len < size ? size - len : 0, "%s%s",
+                  modifiers[id->modifier], id->name);
+  if (id->lanes > 0)
+    len += snprintf(&buf[len], len < size ? size - len : 0, "_x%d", id->lanes);
+  for (char *c = buf; *c != 0; c++) {
+    if (*c == ' ')
+      *c = '_';
+  }
+  return len < size;
+}
+
+static bool check_key(struct tree *key) {
+  struct type_id *id = key->type_expr.id;
+  if (key->type_expr.ptr != NULL)
+    return true;
+  if (id->lanes > 0 || strstr(id->name, "float") != NULL ||
+      strstr(id->name, "double") != NULL) {
+    errorat("hash-table keys must be integers, pointers or *char strings",
+            lcc_current_file, key->loc.first_line, key->loc.first_column);
+    return false;
+  }
+  return true;
+}
+
+struct tree *build_container_type(struct location loc, char *kind,
+                                  struct tree *key, struct tree *value) {
+  bool vector = strcmp(kind, "vector") == 0 && key == NULL;
+  bool hash_table = strcmp(kind, "hash-table") == 0 && key != NULL;
+  if (!vector && !hash_table) {
+    errorat("unknown type constructor '%s'", lcc_current_file,
+            loc.first_line, loc.first_column, kind);
+    free(kind);
+    destroy_tree(key);
+    return value;
+  }
+  free(kind);
+
+  char name[256];
+  snprintf(name, sizeof(name), vector ? "vector_" : "hash_table_");
+  bool valid = true;
+  if (hash_table) {
+    valid = check_key(key) && mangle_type(key, name, sizeof(name));
+    strncat(name, "__", sizeof(name) - strlen(name) - 1);
+  }
+  valid = valid && mangle_type(value, name, sizeof(name));
+  if (!valid) {
+    destroy_tree(key);
+    return value;
+  }
+
+  if (!containers_created) {
+    if (hashmap_create(32, &containers) != 0)
+      error("Failed to create hashmap.");
+    containers_created = true;
+  }
+  if (hashmap_get(&containers, name, strlen(name)) != NULL) {
+    destroy_tree(key);
+    destroy_tree(value);
+  } else {
+    struct tree *decl = build_container(loc, strdup(name), key, value);
+    hashmap_put(&containers, decl->container_decl.name, strlen(name), decl);
+    if (decls_end == NULL)
+      decls = decls_end = decl;
+    else
+      decls_end = decls_end->next = decl;
+  }
+  return build_type_expr(loc, build_tid(strdup(name), MOD_NONE));
+}
+
+static struct tree *find_container(struct tree *type, bool *indirect) {
+  if (type == NULL || type->type != TYPE_EXPR || !containers_created ||
+      type->type_expr.id->name == NULL)
+    return NULL;
+  struct type_ptr *ptr = type->type_expr.ptr;
+  if (ptr != NULL && (ptr->next != NULL || ptr->type != SINGLE_PTR))
+    return NULL;
+  *indirect = ptr != NULL;
+  char *name = type->type_expr.id->name;
+  return hashmap_get(&containers, name, strlen(name));
+}
+
+/* types of expressions, before they are lowered */
+
+static struct tree *find_fn(const char *name) {
+  for (struct tree *head = functions; head != NULL; head = head->next) {
+    if (head->type == FN_DECL && strcmp(head->fn_decl.name, name) == 0)
+      return head;
+  }
+  return NULL;
+}
+
+static struct tree *type_of(struct tree *t) {
+  switch (t->type) {
+  case REFERENCE_EXPR:
+    if (t->reference_expr.type == VAR_REF)
+      return lookup(t->reference_expr.symbol);
+    if (t->reference_expr.type == FN_CALL) {
+      struct tree *fn = find_fn(t->reference_expr.call.name);
+      if (fn != NULL)
+        return fn->fn_decl.type;
+      // the elements of nested containers
+      struct tree *args = t->reference_expr.call.args;
+      bool indirect;
+      struct tree *decl =
+          args != NULL ? find_container(type_of(args), &indirect) : NULL;
+      if (decl != NULL && (strcmp(t->reference_expr.call.name, "get") == 0 ||
+                           strcmp(t->reference_expr.call.name, "pop") == 0))
+        return decl->container_decl.value;
+    }
+    return NULL;
+  case CAST_EXPR:
+    return t->cast_expr.type;
+  default:
+    return NULL;
+  }
+}
+
+/* operations */
+
+static void lower(struct tree **slot);
+static void lower_chain(struct tree **chain) {
+  for (struct tree **slot = chain; *slot != NULL; slot = &(*slot)->next)
+    lower(slot);
+}
+
+static void replace(struct tree **slot, struct tree *t) {
+  struct tree *old = *slot;
+  t->next = old->next;
+  old->next = NULL;
+  destroy_tree(old);
+  *slot = t;
+}
+
+static bool is_place(struct tree *t) {
+  return (t->type == REFERENCE_EXPR && t->reference_expr.type == VAR_REF) ||
+         t->type == AREF_EXPR || t->type == FIELD_EXPR;
+}
+
+static char *helper_name(struct tree *decl, const char *helper) {
+  size_t len = strlen(decl->container_decl.name) + strlen(helper) + 2;
+  char *name = malloc(len);
+  snprintf(name, len, "%s_%s", decl->container_decl.name, helper);
+  return name;
+}
+
+static void lower_op(struct tree **slot, struct tree *decl, bool indirect) {
+  struct tree *t = *slot;
+  char *name = t->reference_expr.call.name;
+  bool vector = decl->container_decl.key == NULL;
+  int n_args = 0;
+  for (struct tree *arg = t->reference_expr.call.args; arg != NULL;
+       arg = arg->next) {
+    if (arg->type == LAMBDA_KEY) {
+      errorat("%s does not take keys", lcc_current_file, arg->loc.first_line,
+              arg->loc.first_column, name);
+      return;
+    }
+    n_args++;
+  }
+  const struct container_op *op = NULL;
+  for (size_t i = 0; i < sizeof(ops) / sizeof(ops[0]) && op == NULL; i++) {
+    if (strcmp(ops[i].name, name) == 0 && ops[i].n_args == n_args &&
+        (vector ? ops[i].vector : ops[i].hash_table))
+      op = &ops[i];
+  }
+  if (op == NULL) {
+    errorat("no %s of %d argument(s) for %s", lcc_current_file,
+            t->loc.first_line, t->loc.first_column, name, n_args,
+            decl->container_decl.name);
+    return;
+  }
+
+  lower_chain(&t->reference_expr.call.args);
+  struct tree *self = t->reference_expr.call.args;
+  struct tree *args = self->next;
+  self->next = NULL;
+  t->reference_expr.call.args = NULL;
+  if (!indirect && op->kind != OP_FIELD && !is_place(self)) {
+    errorat("%s needs a container that can be modified in place",
+            lcc_current_file, self->loc.first_line, self->loc.first_column,
+            name);
+    t->reference_expr.call.args = self;
+    self->next = args;
+    return;
+  }
+
+  struct tree *lowered = NULL;
+  struct tree *data;
+  switch (op->kind) {
+  case OP_CALL:
+    if (!indirect)
+      self = build_addr(t->loc, self);
+    self->next = args;
+    lowered = build_fn_call(t->loc, helper_name(decl, op->helper), self);
+    break;
+  case OP_INDEX:
+  case OP_STORE:
+    data = build_field_ref(t->loc, self, strdup("data"), indirect);
+    struct tree *value = args->next;
+    args->next = NULL;
+    lowered = build_aref(t->loc, data, args);
+    if (op->kind == OP_STORE)
+      lowered = build_set_expr(t->loc, lowered, value, 0);
+    break;
+  case OP_FIELD:
+    lowered = build_field_ref(t->loc, self, strdup(op->helper), indirect);
+    break;
+  }
+  replace(slot, lowered);
+}
+
+static void lower_call(struct tree **slot) {
+  struct tree *t = *slot;
+  struct tree *args = t->reference_expr.call.args;
+  bool indirect;
+  struct tree *decl = NULL;
+  if (args != NULL && args->type != LAMBDA_KEY &&
+      find_fn(t->reference_expr.call.name) == NULL)
+    decl = find_container(type_of(args), &indirect);
+  if (decl != NULL) {
+    lower_op(slot, decl, indirect);
+    return;
+  }
+  for (struct tree **arg = &t->reference_expr.call.args; *arg != NULL;
+       arg = &(*arg)->next) {
+    if ((*arg)->type == LAMBDA_KEY)
+      lower(&(*arg)->lambda_key.expr);
+    else
+      lower(arg);
+  }
+}
+
+/* iteration, (for (k x : h) body) becomes
+ *   for (size_t _itN = 0; _itN < h.cap; _itN++)
+ *     if (h.data[_itN].in_use) { k = h.data[_itN].key; x = ...; body } */
+
+static struct tree *element(struct tree *coll, bool indirect, char *iterator,
+                            const char *field) {
+  struct location loc = coll->loc;
+  struct tree *ref = build_field_ref(
+      loc, build_var_ref(loc, strdup(coll->reference_expr.symbol)),
+      strdup("data"), indirect);
+  ref = build_aref(loc, ref, build_var_ref(loc, strdup(iterator)));
+  if (field != NULL)
+    ref = build_field_ref(loc, ref, strdup(field), false);
+  return ref;
+}
+
+static void bind(struct tree *var, struct tree *type, struct tree *value) {
+  if (is_monomorph(var->var_decl.type))
+    copy_type_to_type(var->var_decl.type, type);
+  var->var_decl.value = value;
+}
+
+static void lower_foreach(struct tree **slot) {
+  struct tree *t = *slot;
+  struct tree *coll = t->foreach_stmt.expr;
+  bool indirect;
+  struct tree *decl = NULL;
+  if (coll->type != REFERENCE_EXPR || coll->reference_expr.type != VAR_REF ||
+      (decl = find_container(type_of(coll), &indirect)) == NULL) {
+    errorat("for iterates over a variable holding a vector or a hash-table",
+            lcc_current_file, coll->loc.first_line, coll->loc.first_column);
+    return;
+  }
+  bool vector = decl->container_decl.key == NULL;
+  struct location loc = t->loc;
+
+  struct tree *first = t->foreach_stmt.vars, *second = first->next;
+  first->next = NULL;
+  char *iterator;
+  struct tree *index;
+  if (vector && second != NULL) {
+    index = first;
+    struct tree *size_type =
+        build_type_expr(loc, build_tid(strdup("size_t"), MOD_NONE));
+    bind(index, size_type, build_int_cst(loc, 0));
+    destroy_tree(size_type);
+    first = second;
+    second = NULL;
+  } else {
+    char name[32];
+    snprintf(name, sizeof(name), "_it%d", n_iterators++);
+    index = build_var(loc, VAR_DECL, strdup(name),
+                      build_type_expr(loc, build_tid(strdup("size_t"),
+                                                     MOD_NONE)),
+                      build_int_cst(loc, 0));
+  }
+  iterator = index->var_decl.name;
+
+  struct tree *vars;
+  if (vector) {
+    bind(first, decl->container_decl.value,
+         element(coll, indirect, iterator, NULL));
+    vars = first;
+  } else {
+    bind(first, decl->container_decl.key,
+         element(coll, indirect, iterator, "key"));
+    if (second != NULL)
+      bind(second, decl->container_decl.value,
+           element(coll, indirect, iterator, "value"));
+    first->next = second;
+    vars = first;
+  }
+  struct tree *body = build_let_stmt(loc, vars, t->foreach_stmt.body);
+  if (!vector)
+    body = build_if_else_stmt(loc, element(coll, indirect, iterator, "in_use"),
+                              body, NULL);
+
+  struct tree *bound = build_field_ref(
+      loc, build_var_ref(loc, strdup(coll->reference_expr.symbol)),
+      strdup(vector ? "len" : "cap"), indirect);
+  struct tree *loop = build_for_stmt(
+      loc,
+      build_type_expr((struct location){0, 0, 0, 0},
+                      build_tid(NULL, MOD_MONOMORPH)),
+      index,
+      build_compare(loc, OP_LT, build_var_ref(loc, strdup(iterator)), bound),
+      build_inc(loc, build_var_ref(loc, strdup(iterator))), body);
+  t->foreach_stmt.vars = NULL;
+  t->foreach_stmt.body = NULL;
+  replace(slot, loop);
+  lower(slot);
+}
+
+/* containers start empty, a local declared without a value or with 0 is
+ * initialised by NAME_new() and a global is left to static zeroing */
+static void lower_init(struct tree *t, bool global) {
+  bool indirect;
+  struct tree *decl = find_container(t->var_decl.type, &indirect);
+  struct tree *value = t->var_decl.value;
+  if (decl == NULL || indirect ||
+      (value != NULL &&
+       (value->type != REFERENCE_EXPR ||
+        value->reference_expr.type != INTEGER_CST ||
+        value->reference_expr.ival != 0)))
+    return;
+  destroy_tree(value);
+  t->var_decl.value =
+      global ? NULL : build_fn_call(t->loc, helper_name(decl, "new"), NULL);
+}
+
+static void lower(struct tree **slot) {
+  struct tree *t = *slot;
+  if (t == NULL)
+    return;
+  int saved = n_scope;
+  switch (t->type) {
+  case VAR_DECL:
+    lower_init(t, false);
+    // fall through
+  case PARM_DECL:
+    lower(&t->var_decl.value);
+    push_scope(t->var_decl.name, t->var_decl.type);
+    // declarations stay visible for the rest of the enclosing body
+    return;
+  case SET_EXPR:
+    lower(&t->set_expr.var);
+    lower(&t->set_expr.value);
+    break;
+  case AREF_EXPR:
+    lower(&t->ref_expr.expr);
+    lower_chain(&t->ref_expr.indices);
+    break;
+  case ADDR_EXPR:
+    lower(&t->ref_expr.expr);
+    break;
+  case FIELD_EXPR:
+    lower(&t->field_expr.expr);
+    break;
+  case CAST_EXPR:
+    lower(&t->cast_expr.expr);
+    break;
+  case LIST_EXPR:
+    lower_chain(&t->list_expr.elems);
+    break;
+  case BINOP_EXPR:
+    lower_chain(&t->binop_expr.body);
+    break;
+  case COMPARE_EXPR:
+    lower(&t->compare_expr.lhs);
+    lower(&t->compare_expr.rhs);
+    break;
+  case REFERENCE_EXPR:
+    if (t->reference_expr.type == FN_CALL)
+      lower_call(slot);
+    break;
+  case LET_STMT:
+    lower_chain(&t->let_stmt.vars);
+    lower_chain(&t->let_stmt.body);
+    break;
+  case IF_STMT:
+    lower(&t->if_else_stmt.condition);
+    lower_chain(&t->if_else_stmt.if_block);
+    n_scope = saved;
+    lower_chain(&t->if_else_stmt.else_block);
+    break;
+  case COND_STMT:
+    for (struct tree *expr = t->cond_stmt.exprs; expr != NULL;
+         expr = expr->next) {
+      lower(&expr->cond_expr.condition);
+      lower_chain(&expr->cond_expr.body);
+      n_scope = saved;
+    }
+    break;
+  case CASE_STMT:
+    lower(&t->case_stmt.expr);
+    for (struct tree *c = t->case_stmt.cases; c != NULL; c = c->next) {
+      lower_chain(&c->case_expr.body);
+      n_scope = saved;
+    }
+    break;
+  case WHILE_STMT:
+  case DOWHILE_STMT:
+    lower(&t->while_stmt.condition);
+    lower_chain(&t->while_stmt.body);
+    break;
+  case FOR_STMT:
+    lower_chain(&t->for_stmt.vars);
+    lower(&t->for_stmt.condition);
+    lower(&t->for_stmt.loop_eval);
+    lower_chain(&t->for_stmt.body);
+    break;
+  case FOREACH_STMT:
+    lower_foreach(slot);
+    break;
+  default:
+    break;
+  }
+  n_scope = saved;
+}
+
+static void lower_params(struct tree *chain) {
+  for (struct tree *parm = chain; parm != NULL; parm = parm->next) {
+    struct tree *decl = parm->type == LAMBDA_KEY ? parm->lambda_key.expr : parm;
+    if (decl != NULL &&
+        (decl->type == VAR_DECL || decl->type == PARM_DECL)) {
+      lower(&decl->var_decl.value);
+      push_scope(decl->var_decl.name, decl->var_decl.type);
+    }
+  }
+}
+
+/* placement, a declaration follows the structures and containers named in
+ * its element types */
+
+static bool names_type(struct tree *decl, const char *name) {
+  struct tree *types[] = {decl->container_decl.key, decl->container_decl.value};
+  for (int i = 0; i < 2; i++) {
+    if (types[i] != NULL && types[i]->type_expr.id->name != NULL &&
+        strcmp(types[i]->type_expr.id->name, name) == 0)
+      return true;
+  }
+  return false;
+}
+
+static struct tree *place(struct tree *t, struct tree *decl) {
+  struct tree *after = NULL;
+  for (struct tree *head = t; head != NULL; head = head->next) {
+    if ((head->type == STRUCT_DECL &&
+         names_type(decl, head->struct_decl.name)) ||
+        (head->type == CONTAINER_DECL &&
+         names_type(decl, head->container_decl.name)))
+      after = head;
+  }
+  if (after == NULL) {
+    decl->next = t;
+    return decl;
+  }
+  decl->next = after->next;
+  after->next = decl;
+  return t;
+}
+
+struct tree *lower_containers(struct tree *t) {
+  if (decls == NULL)
+    return t;
+  functions = t;
+  containers_used = true;
+
+  for (struct tree *head = t; head != NULL; head = head->next) {
+    if (head->type == VAR_DECL)
+      push_scope(head->var_decl.name, head->var_decl.type);
+  }
+  int globals = n_scope;
+  for (struct tree *head = t; head != NULL; head = head->next) {
+    if (head->type == VAR_DECL) {
+      lower_init(head, true);
+      lower(&head->var_decl.value);
+      continue;
+    }
+    if (head->type != FN_DECL || head->fn_decl.arglist == NULL)
+      continue;
+    struct tree *list = head->fn_decl.arglist;
+    lower_params(list->lambda_list.args);
+    lower_params(list->lambda_list.optionals);
+    lower_params(list->lambda_list.keys);
+    lower_params(list->lambda_list.aux);
+    lower_chain(&head->fn_decl.body);
+    n_scope = globals;
+  }
+  free(scope);
+  scope = NULL;
+  n_scope = cap_scope = 0;
+
+  // the declarations are printed with the program, in dependency order
+  for (struct tree *decl = decls, *next; decl != NULL; decl = next) {
+    next = decl->next;
+    t = place(t, decl);
+  }
+  decls = decls_end = NULL;
+  hashmap_destroy(&containers);
+  containers_created = false;
+  return t;
+}
+
+void print_container_header(bool emit_asm) {
+  if (containers_used && !emit_asm)
+    fprintf(stdout, "#include <stddef.h>\n#include <stdlib.h>\n");
+}
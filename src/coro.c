@@ -0,0 +1,653 @@
+#include "debug.h"
+#include "opt.h"
+#include "tree.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hashmap.h"
+
+/*
+ * Stackless coroutines.
+ *
+ *   (defcoro count (n)
+ *     (declare (type i32 n count))
+ *     (for ((i 0)) (< i n) (inc i)
+ *       (yield i)))
+ *
+ * (count 3) allocates a frame and returns a pointer to it without running
+ * the body, (count-at storage 3) builds the frame in storage instead, memory
+ * from (alloc a count-frame) for example. (resume c) runs the coroutine up to
+ * its next suspension and returns 1, or 0 once it has finished, (yielded c)
+ * is the last value it yielded, of the type declared for the coroutine, and
+ * (done c) tells whether it has finished. Heap frames are released with
+ * free.
+ *
+ * (yield [x]) suspends the coroutine and (await fd events) suspends it until
+ * fd is ready for the epoll events, EPOLLIN or EPOLLOUT. (schedule c) hands a
+ * coroutine to the scheduler of the runtime and (run-scheduler) resumes
+ * scheduled coroutines until all of them have finished, waiting in
+ * epoll_wait while every one of them awaits a descriptor. The scheduler
+ * frees the heap frames of the coroutines that finish.
+ *
+ * The body becomes a switch on the state saved by the last suspension, with a
+ * case label after each one, and every parameter and local lives in the
+ * frame so that it survives suspensions. Locals therefore need a declared
+ * type or an initial value whose type is known, and a coroutine cannot
+ * suspend inside case, whose own switch would capture the labels.
+ */
+
+extern const char *lcc_current_file;
+
+static struct hashmap_s coros;
+static bool coros_created = false;
+static bool coros_used = false;
+static struct tree *functions;
+
+struct tree *build_coro(struct location loc, char *name, struct tree *type,
+                        struct tree *lambda_list, struct tree *body) {
+  struct tree *list = lambda_list;
+  if (list->lambda_list.optionals != NULL || list->lambda_list.rest != NULL ||
+      list->lambda_list.keys != NULL || list->lambda_list.aux != NULL) {
+    errorat("defcoro takes required arguments only", lcc_current_file,
+            loc.first_line, loc.first_column);
+  }
+  struct tree *fn = build_fn(loc, name, type, lambda_list, body);
+  if (!coros_created) {
+    if (hashmap_create(32, &coros) != 0)
+      error("Failed to create hashmap.");
+    coros_created = true;
+  }
+  hashmap_put(&coros, fn->fn_decl.name, strlen(fn->fn_decl.name), fn);
+  coros_used = true;
+  return fn;
+}
+
+static struct tree *copy_type(struct tree *type) {
+  struct tree *copy = build_type_expr(type->loc, build_tid(NULL, MOD_NONE));
+  copy_type_to_type(copy, type);
+  return copy;
+}
+
+static bool is_call(struct tree *t, const char *name) {
+  return t->type == REFERENCE_EXPR && t->reference_expr.type == FN_CALL &&
+         strcmp(t->reference_expr.call.name, name) == 0;
+}
+
+static struct tree *find_fn(const char *name) {
+  for (struct tree *head = functions; head != NULL; head = head->next) {
+    if (head->type == FN_DECL && strcmp(head->fn_decl.name, name) == 0)
+      return head;
+  }
+  return NULL;
+}
+
+/* the coroutine being lowered */
+
+struct local {
+  char *name;
+  struct tree *field;
+};
+
+static struct tree *coro = NULL;
+static struct tree *frame = NULL;
+static struct local *scope = NULL;
+static int n_scope = 0, cap_scope = 0;
+static int n_states = 0;
+
+static void push_scope(char *name, struct tree *field) {
+  if (n_scope >= cap_scope) {
+    cap_scope = cap_scope == 0 ? 32 : cap_scope * 2;
+    scope = realloc(scope, cap_scope * sizeof(struct local));
+  }
+  scope[n_scope++] = (struct local){strdup(name), field};
+}
+
+static void pop_scope(int n) {
+  while (n_scope > n)
+    free(scope[--n_scope].name);
+}
+
+static struct tree *lookup(const char *name) {
+  for (int i = n_scope - 1; i >= 0; i--) {
+    if (strcmp(scope[i].name, name) == 0)
+      return scope[i].field;
+  }
+  return NULL;
+}
+
+static bool in_frame(const char *name) {
+  for (struct tree *field = frame; field != NULL; field = field->next) {
+    if (strcmp(field->var_decl.name, name) == 0)
+      return true;
+  }
+  return false;
+}
+
+/* locals of sibling scopes may share a name, each gets a field of its own */
+static struct tree *add_field(struct tree *var, struct tree *type) {
+  size_t len = strlen(var->var_decl.name) + 16;
+  char *name = malloc(len);
+  snprintf(name, len, "%s", var->var_decl.name);
+  for (int i = 1; in_frame(name); i++)
+    snprintf(name, len, "%s_%d", var->var_decl.name, i);
+  struct tree *field = build_var(var->loc, VAR_DECL, name, type, NULL);
+  frame = append_tree(field, frame);
+  push_scope(var->var_decl.name, field);
+  return field;
+}
+
+static struct tree *frame_ref(struct location loc, const char *field) {
+  return build_field_ref(loc, build_var_ref(loc, strdup("_f")), strdup(field),
+                         true);
+}
+
+static struct tree *state_ref(struct location loc) {
+  return build_field_ref(loc, frame_ref(loc, "_co"), strdup("state"), false);
+}
+
+/* the type of a local declared without one, from its initial value */
+static struct tree *infer_type(struct tree *value) {
+  if (value == NULL)
+    return NULL;
+  struct tree *type = NULL;
+  const char *name = NULL;
+  switch (value->type) {
+  case BINOP_EXPR:
+    return infer_type(value->binop_expr.body);
+  case COMPARE_EXPR:
+    name = "int";
+    break;
+  case CAST_EXPR:
+    type = value->cast_expr.type;
+    break;
+  case REFERENCE_EXPR:
+    switch (value->reference_expr.type) {
+    case INTEGER_CST:
+    case BOOL_CST:
+      name = "int";
+      break;
+    case FLOAT_CST:
+      name = "double";
+      break;
+    case CHAR_CST:
+      name = "char";
+      break;
+    case STRING_CST:;
+      struct tree *string =
+          build_type_expr(value->loc, build_tid(strdup("char"), MOD_NONE));
+      add_type_ptr(string, SINGLE_PTR, 0);
+      return string;
+    case VAR_REF:;
+      struct tree *field = lookup(value->reference_expr.symbol);
+      type = field == NULL ? NULL : field->var_decl.type;
+      break;
+    case FN_CALL:;
+      struct tree *fn = find_fn(value->reference_expr.call.name);
+      type = fn == NULL ? NULL : fn->fn_decl.type;
+      break;
+    }
+    break;
+  default:
+    break;
+  }
+  if (name != NULL)
+    return build_type_expr(value->loc, build_tid(strdup(name), MOD_NONE));
+  if (type == NULL || is_monomorph(type))
+    return NULL;
+  return copy_type(type);
+}
+
+static void replace(struct tree **slot, struct tree *t) {
+  struct tree *old = *slot;
+  t->next = old->next;
+  old->next = NULL;
+  destroy_tree(old);
+  *slot = t;
+}
+
+static bool is_suspend(struct tree *t) {
+  return is_call(t, "yield") || is_call(t, "await");
+}
+
+static bool find_suspend(struct tree *t, void *data) {
+  if (is_suspend(t))
+    *(bool *)data = true;
+  return true;
+}
+
+/* before; _f->_co.state = N; return 1; case N: */
+static struct tree *suspend(struct location loc, struct tree *before) {
+  int state = ++n_states;
+  struct tree *body = build_set_expr(loc, state_ref(loc),
+                                     build_int_cst(loc, state), 0);
+  body = append_tree(
+      build_fn_call(loc, strdup("return"), build_int_cst(loc, 1)), body);
+  body = append_tree(build_resume_stmt(loc, state), body);
+  if (before != NULL) {
+    before->next = body;
+    body = before;
+  }
+  return build_let_stmt(loc, NULL, body);
+}
+
+static struct tree *lower_yield(struct tree *t) {
+  struct tree *value = t->reference_expr.call.args;
+  t->reference_expr.call.args = NULL;
+  if (value != NULL && value->next != NULL) {
+    errorat("yield takes at most one value", lcc_current_file,
+            t->loc.first_line, t->loc.first_column);
+  } else if (value != NULL && coro->fn_decl.type == NULL) {
+    errorat("%s does not declare the type of the values it yields",
+            lcc_current_file, t->loc.first_line, t->loc.first_column,
+            coro->fn_decl.name);
+  } else if (value != NULL) {
+    return suspend(t->loc,
+                   build_set_expr(t->loc, frame_ref(t->loc, "_value"), value,
+                                  0));
+  }
+  destroy_tree(value);
+  return suspend(t->loc, NULL);
+}
+
+static struct tree *lower_await(struct tree *t) {
+  struct tree *args = t->reference_expr.call.args;
+  if (args == NULL || args->next == NULL || args->next->next != NULL) {
+    errorat("await takes a file descriptor and epoll events",
+            lcc_current_file, t->loc.first_line, t->loc.first_column);
+    return suspend(t->loc, NULL);
+  }
+  t->reference_expr.call.args = NULL;
+  struct tree *self = build_var_ref(t->loc, strdup("_f"));
+  self->next = args;
+  return suspend(t->loc, build_fn_call(t->loc, strdup("lcc_await"), self));
+}
+
+/* [_f->_value = x;] _f->_co.state = -1; return 0; */
+static struct tree *lower_return(struct tree *t) {
+  struct location loc = t->loc;
+  struct tree *body = build_set_expr(loc, state_ref(loc),
+                                     build_int_cst(loc, -1), 0);
+  body = append_tree(build_fn_call(loc, strdup("return"), build_int_cst(loc, 0)),
+                     body);
+  struct tree *value = t->reference_expr.call.args;
+  t->reference_expr.call.args = NULL;
+  if (value != NULL && coro->fn_decl.type != NULL) {
+    struct tree *set =
+        build_set_expr(loc, frame_ref(loc, "_value"), value, 0);
+    set->next = body;
+    body = set;
+  } else if (value != NULL) {
+    errorat("%s does not declare the type of the values it yields",
+            lcc_current_file, loc.first_line, loc.first_column,
+            coro->fn_decl.name);
+    destroy_tree(value);
+  }
+  return build_let_stmt(loc, NULL, body);
+}
+
+/* operations on coroutines, unless the program defines functions of the
+ * same names */
+static void lower_op(struct tree **slot) {
+  struct tree *t = *slot;
+  static const struct {
+    const char *name, *runtime;
+  } ops[] = {
+      {"resume", "lcc_coro_resume"},
+      {"done", "lcc_coro_done"},
+      {"schedule", "lcc_schedule"},
+      {"run_scheduler", "lcc_run"},
+  };
+  char *name = t->reference_expr.call.name;
+  if (find_fn(name) != NULL)
+    return;
+  if (strcmp(name, "yielded") == 0) {
+    struct tree *arg = t->reference_expr.call.args;
+    if (arg == NULL || arg->next != NULL) {
+      errorat("yielded takes one coroutine", lcc_current_file,
+              t->loc.first_line, t->loc.first_column);
+      return;
+    }
+    t->reference_expr.call.args = NULL;
+    replace(slot, build_field_ref(t->loc, arg, strdup("_value"), true));
+    return;
+  }
+  for (size_t i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+    if (strcmp(name, ops[i].name) == 0) {
+      free(t->reference_expr.call.name);
+      t->reference_expr.call.name = strdup(ops[i].runtime);
+      return;
+    }
+  }
+}
+
+static void rewrite(struct tree **slot, bool stmt);
+
+/* a local of the coroutine becomes an assignment to its field, a local
+ * without an initial value disappears, returns false when it did */
+static bool declare(struct tree **slot) {
+  struct tree *var = *slot;
+  struct tree *type = is_monomorph(var->var_decl.type)
+                          ? infer_type(var->var_decl.value)
+                          : copy_type(var->var_decl.type);
+  if (type == NULL) {
+    errorat("coroutine local '%s' needs a declared type", lcc_current_file,
+            var->loc.first_line, var->loc.first_column, var->var_decl.name);
+    type = build_type_expr(var->loc, build_tid(NULL, MOD_MONOMORPH));
+  }
+  rewrite(&var->var_decl.value, false);
+  struct tree *field = add_field(var, type);
+  if (var->var_decl.value != NULL) {
+    struct tree *value = var->var_decl.value;
+    var->var_decl.value = NULL;
+    replace(slot, build_set_expr(var->loc,
+                                 frame_ref(var->loc, field->var_decl.name),
+                                 value, 0));
+    return true;
+  }
+  *slot = var->next;
+  var->next = NULL;
+  destroy_tree(var);
+  return false;
+}
+
+static void rewrite_chain(struct tree **chain, bool stmt) {
+  for (struct tree **slot = chain; *slot != NULL;) {
+    if (coro != NULL && (*slot)->type == VAR_DECL && !declare(slot))
+      continue;
+    rewrite(slot, stmt);
+    slot = &(*slot)->next;
+  }
+}
+
+static void rewrite(struct tree **slot, bool stmt) {
+  struct tree *t = *slot;
+  if (t == NULL)
+    return;
+  int saved = n_scope;
+  bool suspends = false;
+  switch (t->type) {
+  case REFERENCE_EXPR:
+    if (t->reference_expr.type == VAR_REF) {
+      struct tree *field =
+          coro == NULL ? NULL : lookup(t->reference_expr.symbol);
+      if (field != NULL)
+        replace(slot, frame_ref(t->loc, field->var_decl.name));
+      break;
+    }
+    if (t->reference_expr.type != FN_CALL)
+      break;
+    for (struct tree **arg = &t->reference_expr.call.args; *arg != NULL;
+         arg = &(*arg)->next) {
+      if ((*arg)->type == LAMBDA_KEY)
+        rewrite(&(*arg)->lambda_key.expr, false);
+      else
+        rewrite(arg, false);
+    }
+    if (is_suspend(t) && coro == NULL) {
+      errorat("%s outside of a coroutine", lcc_current_file,
+              t->loc.first_line, t->loc.first_column,
+              t->reference_expr.call.name);
+    } else if (is_suspend(t) && !stmt) {
+      errorat("%s is a statement, it has no value", lcc_current_file,
+              t->loc.first_line, t->loc.first_column,
+              t->reference_expr.call.name);
+    } else if (is_call(t, "yield")) {
+      replace(slot, lower_yield(t));
+    } else if (is_call(t, "await")) {
+      replace(slot, lower_await(t));
+    } else if (is_call(t, "return") && coro != NULL) {
+      replace(slot, lower_return(t));
+    } else {
+      lower_op(slot);
+    }
+    break;
+  case VAR_DECL:
+  case PARM_DECL:
+    rewrite(&t->var_decl.value, false);
+    break;
+  case SET_EXPR:
+    rewrite(&t->set_expr.var, false);
+    rewrite(&t->set_expr.value, false);
+    break;
+  case AREF_EXPR:
+    rewrite(&t->ref_expr.expr, false);
+    rewrite_chain(&t->ref_expr.indices, false);
+    break;
+  case ADDR_EXPR:
+    rewrite(&t->ref_expr.expr, false);
+    break;
+  case FIELD_EXPR:
+    rewrite(&t->field_expr.expr, false);
+    break;
+  case CAST_EXPR:
+    rewrite(&t->cast_expr.expr, false);
+    break;
+  case LIST_EXPR:
+    rewrite_chain(&t->list_expr.elems, false);
+    break;
+  case BINOP_EXPR:
+    rewrite_chain(&t->binop_expr.body, false);
+    break;
+  case COMPARE_EXPR:
+    rewrite(&t->compare_expr.lhs, false);
+    rewrite(&t->compare_expr.rhs, false);
+    break;
+  case LET_STMT:
+    if (coro != NULL) {
+      // the variables are fields now, their initialisation comes first
+      t->let_stmt.body = append_tree(t->let_stmt.body, t->let_stmt.vars);
+      t->let_stmt.vars = NULL;
+    }
+    rewrite_chain(&t->let_stmt.vars, false);
+    rewrite_chain(&t->let_stmt.body, true);
+    break;
+  case IF_STMT:
+    rewrite(&t->if_else_stmt.condition, false);
+    rewrite_chain(&t->if_else_stmt.if_block, true);
+    pop_scope(saved);
+    rewrite_chain(&t->if_else_stmt.else_block, true);
+    break;
+  case COND_STMT:
+    for (struct tree *expr = t->cond_stmt.exprs; expr != NULL;
+         expr = expr->next) {
+      rewrite(&expr->cond_expr.condition, false);
+      rewrite_chain(&expr->cond_expr.body, true);
+      pop_scope(saved);
+    }
+    break;
+  case CASE_STMT:
+    walk_tree(t->case_stmt.cases, find_suspend, &suspends);
+    if (suspends && coro != NULL) {
+      errorat("a coroutine cannot suspend inside case, use cond",
+              lcc_current_file, t->loc.first_line, t->loc.first_column);
+      break;
+    }
+    rewrite(&t->case_stmt.expr, false);
+    for (struct tree *c = t->case_stmt.cases; c != NULL; c = c->next) {
+      rewrite_chain(&c->case_expr.body, true);
+      pop_scope(saved);
+    }
+    break;
+  case WHILE_STMT:
+  case DOWHILE_STMT:
+    rewrite(&t->while_stmt.condition, false);
+    rewrite_chain(&t->while_stmt.body, true);
+    break;
+  case FOR_STMT:
+    rewrite_chain(&t->for_stmt.vars, false);
+    rewrite(&t->for_stmt.condition, false);
+    rewrite(&t->for_stmt.loop_eval, false);
+    rewrite_chain(&t->for_stmt.body, true);
+    break;
+  case FOREACH_STMT:
+    if (coro != NULL)
+      errorat("for over a collection is not supported in coroutines",
+              lcc_current_file, t->loc.first_line, t->loc.first_column);
+    break;
+  default:
+    break;
+  }
+  pop_scope(saved);
+}
+
+static struct tree *lower_coro(struct tree *fn) {
+  coro = fn;
+  frame = NULL;
+  n_states = 0;
+  if (is_monomorph(fn->fn_decl.type) ||
+      (fn->fn_decl.type->type_expr.ptr == NULL &&
+       strcmp(fn->fn_decl.type->type_expr.id->name, "void") == 0)) {
+    destroy_tree(fn->fn_decl.type);
+    fn->fn_decl.type = NULL;
+  }
+
+  struct tree *params = fn->fn_decl.arglist->lambda_list.args;
+  fn->fn_decl.arglist->lambda_list.args = NULL;
+  for (struct tree *parm = params; parm != NULL; parm = parm->next) {
+    if (is_monomorph(parm->var_decl.type)) {
+      errorat("coroutine argument '%s' needs a declared type",
+              lcc_current_file, parm->loc.first_line, parm->loc.first_column,
+              parm->var_decl.name);
+    }
+    add_field(parm, copy_type(parm->var_decl.type));
+  }
+  rewrite_chain(&fn->fn_decl.body, true);
+  pop_scope(0);
+
+  struct tree *decl =
+      build_coro_decl(fn->loc, fn->fn_decl.name, fn->fn_decl.type, params,
+                      frame, fn->fn_decl.body);
+  decl->coro_decl.source_name = fn->fn_decl.source_name;
+  fn->fn_decl.name = NULL;
+  fn->fn_decl.source_name = NULL;
+  fn->fn_decl.type = NULL;
+  fn->fn_decl.body = NULL;
+  coro = NULL;
+  frame = NULL;
+  return decl;
+}
+
+struct tree *lower_coroutines(struct tree *t) {
+  if (!coros_used)
+    return t;
+  functions = t;
+  for (struct tree *head = t; head != NULL; head = head->next) {
+    if (head->type == FN_DECL &&
+        hashmap_get(&coros, head->fn_decl.name,
+                    strlen(head->fn_decl.name)) == NULL)
+      rewrite_chain(&head->fn_decl.body, true);
+  }
+  for (struct tree **slot = &t; *slot != NULL; slot = &(*slot)->next) {
+    struct tree *head = *slot;
+    if (head->type == FN_DECL &&
+        hashmap_get(&coros, head->fn_decl.name,
+                    strlen(head->fn_decl.name)) == head)
+      replace(slot, lower_coro(head));
+  }
+  free(scope);
+  scope = NULL;
+  n_scope = cap_scope = 0;
+  hashmap_destroy(&coros);
+  coros_created = false;
+  return t;
+}
+
+void print_coro_runtime(bool emit_asm) {
+  if (!coros_used || emit_asm)
+    return;
+  fprintf(stdout,
+          "#include <errno.h>\n"
+          "#include <stddef.h>\n"
+          "#include <stdio.h>\n"
+          "#include <stdlib.h>\n"
+          "#include <string.h>\n"
+          "#include <sys/epoll.h>\n"
+          "typedef struct lcc_coro {\n"
+          "  int state; // 0 before the first resume, -1 once finished\n"
+          "  int owned, waiting;\n"
+          "  int (*resume)(void *);\n"
+          "  struct lcc_coro *next;\n"
+          "} lcc_coro;\n"
+          "static struct {\n"
+          "  lcc_coro *head, *tail;\n"
+          "  int epfd, n_waiting;\n"
+          "} lcc_sched = {NULL, NULL, -1, 0};\n"
+          "static void lcc_coro_fail(const char *what) {\n"
+          "  fprintf(stderr, \"%s: %%s: %%s\\n\", what, strerror(errno));\n"
+          "  abort();\n"
+          "}\n"
+          "static void *lcc_coro_new(size_t size, int (*resume)(void *)) {\n"
+          "  lcc_coro *c = calloc(1, size);\n"
+          "  if (c == NULL)\n"
+          "    lcc_coro_fail(\"coroutine frame\");\n"
+          "  c->resume = resume;\n"
+          "  c->owned = 1;\n"
+          "  return c;\n"
+          "}\n"
+          "static inline void *lcc_coro_init(void *frame, size_t size,\n"
+          "                                  int (*resume)(void *)) {\n"
+          "  memset(frame, 0, size);\n"
+          "  ((lcc_coro *)frame)->resume = resume;\n"
+          "  return frame;\n"
+          "}\n"
+          "static inline int lcc_coro_resume(void *c) {\n"
+          "  lcc_coro *co = c;\n"
+          "  return co->state >= 0 && co->resume(co);\n"
+          "}\n"
+          "static inline int lcc_coro_done(void *c) {\n"
+          "  return ((lcc_coro *)c)->state < 0;\n"
+          "}\n"
+          "static inline void lcc_schedule(void *c) {\n"
+          "  lcc_coro *co = c;\n"
+          "  co->next = NULL;\n"
+          "  if (lcc_sched.tail != NULL)\n"
+          "    lcc_sched.tail->next = co;\n"
+          "  else\n"
+          "    lcc_sched.head = co;\n"
+          "  lcc_sched.tail = co;\n"
+          "}\n"
+          "static void lcc_await(void *c, int fd, unsigned events) {\n"
+          "  if (lcc_sched.epfd < 0 &&\n"
+          "      (lcc_sched.epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)\n"
+          "    lcc_coro_fail(\"epoll_create1\");\n"
+          "  struct epoll_event ev = {.events = events | EPOLLONESHOT,\n"
+          "                          .data.ptr = c};\n"
+          "  if (epoll_ctl(lcc_sched.epfd, EPOLL_CTL_MOD, fd, &ev) != 0 &&\n"
+          "      epoll_ctl(lcc_sched.epfd, EPOLL_CTL_ADD, fd, &ev) != 0)\n"
+          "    lcc_coro_fail(\"epoll_ctl\");\n"
+          "  ((lcc_coro *)c)->waiting = 1;\n"
+          "  lcc_sched.n_waiting++;\n"
+          "}\n"
+          "static void lcc_run(void) {\n"
+          "  struct epoll_event events[64];\n"
+          "  for (;;) {\n"
+          "    while (lcc_sched.head != NULL) {\n"
+          "      lcc_coro *co = lcc_sched.head;\n"
+          "      if ((lcc_sched.head = co->next) == NULL)\n"
+          "        lcc_sched.tail = NULL;\n"
+          "      if (co->resume(co)) {\n"
+          "        if (!co->waiting)\n"
+          "          lcc_schedule(co);\n"
+          "      } else if (co->owned) {\n"
+          "        free(co);\n"
+          "      }\n"
+          "    }\n"
+          "    if (lcc_sched.n_waiting == 0)\n"
+          "      return;\n"
+          "    int n = epoll_wait(lcc_sched.epfd, events, 64, -1);\n"
+          "    if (n < 0 && errno != EINTR)\n"
+          "      lcc_coro_fail(\"epoll_wait\");\n"
+          "    for (int i = 0; i < n; i++) {\n"
+          "      lcc_coro *co = events[i].data.ptr;\n"
+          "      co->waiting = 0;\n"
+          "      lcc_sched.n_waiting--;\n"
+          "      lcc_schedule(co);\n"
+          "    }\n"
+          "  }\n"
+          "}\n",
+          lcc_current_file);
+}
@@ -0,0 +1,578 @@
+#include "debug.h"
+#include "opt.h"
+#include "tree.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hashmap.h"
+
+/*
+ * Loop fusion. Two adjacent for loops with the same induction variables,
+ * initial values, condition and step are merged into one loop running the
+ * first body followed by the second:
+ *
+ *   (for ((i 0)) (< i n) (inc i) (inc (aref a i)))
+ *   (for ((j 0)) (< j n) (inc j) (inc (aref b (aref a j))))
+ *   => (for ((i 0)) (< i n) (inc i) (inc (aref a i)) (inc (aref b ...)))
+ *
+ * The loops are only fused when doing so cannot reorder a dependency. Scalars
+ * written by one loop must not be used by the other. Array accesses are
+ * compared through their indices: for the same array, an element written by
+ * one loop at index i+c1 and used by the other at i+c2 keeps its order as
+ * long as the first loop gets there no later than the second (c1 >= c2 for an
+ * increasing induction variable). Different arrays are only assumed not to
+ * overlap if at least one of them is a sized array variable or both are
+ * restrict pointers. Bodies with calls to functions that are not pure/const,
+ * returns or address-of are never fused.
+ */
+
+extern const char *lcc_current_file;
+
+struct access {
+  struct tree *aref;
+  bool write;
+};
+
+struct loop_body {
+  struct access *accesses;
+  int n_accesses, cap_accesses;
+  struct hashmap_s decls;
+  struct hashmap_s reads;
+  struct hashmap_s writes;
+  bool blocked;
+  bool pure_calls;
+  bool writes_memory;
+};
+
+struct fusion_fn {
+  struct hashmap_s decls;
+  struct hashmap_s *globals;
+};
+
+static bool is_var_ref(struct tree *t) {
+  return t != NULL && t->type == REFERENCE_EXPR &&
+         t->reference_expr.type == VAR_REF;
+}
+
+static void put_name(struct hashmap_s *map, char *name, struct tree *t) {
+  hashmap_put(map, name, strlen(name), t);
+}
+
+static bool in_map(struct hashmap_s *map, char *name) {
+  return hashmap_get(map, name, strlen(name)) != NULL;
+}
+
+static void add_access(struct loop_body *body, struct tree *aref, bool write) {
+  if (body->n_accesses >= body->cap_accesses) {
+    body->cap_accesses = body->cap_accesses == 0 ? 16 : body->cap_accesses * 2;
+    body->accesses = realloc(body->accesses,
+                             body->cap_accesses * sizeof(struct access));
+  }
+  body->accesses[body->n_accesses++] = (struct access){aref, write};
+  if (write)
+    body->writes_memory = true;
+}
+
+/* variables declared in a body are private to it */
+static void put_scalar(struct loop_body *body, struct hashmap_s *map,
+                       char *name, struct tree *t) {
+  if (!in_map(&body->decls, name))
+    put_name(map, name, t);
+}
+
+static bool collect_body_decls(struct tree *t, void *data) {
+  struct loop_body *body = data;
+  if (t->type == VAR_DECL)
+    put_name(&body->decls, t->var_decl.name, t);
+  return true;
+}
+
+static bool scan_body(struct tree *t, void *data) {
+  struct loop_body *body = data;
+  switch (t->type) {
+  case SET_EXPR:
+    if (is_var_ref(t->set_expr.var)) {
+      put_scalar(body, &body->writes, t->set_expr.var->reference_expr.symbol,
+                 t);
+    } else if (t->set_expr.var->type == AREF_EXPR) {
+      struct tree *aref = t->set_expr.var;
+      add_access(body, aref, true);
+      walk_tree(aref->ref_expr.expr, scan_body, body);
+      walk_tree(aref->ref_expr.indices, scan_body, body);
+    } else {
+      body->blocked = true;
+    }
+    walk_tree(t->set_expr.value, scan_body, body);
+    return false;
+  case AREF_EXPR:
+    add_access(body, t, false);
+    break;
+  case ADDR_EXPR:
+    body->blocked = true;
+    break;
+  case FIELD_EXPR:
+    // fields reached through a pointer are memory that is not tracked
+    if (t->field_expr.indirect)
+      body->blocked = true;
+    break;
+  case REFERENCE_EXPR:
+    switch (t->reference_expr.type) {
+    case VAR_REF:
+      put_scalar(body, &body->reads, t->reference_expr.symbol, t);
+      break;
+    case FN_CALL:
+      if (strcmp(t->reference_expr.call.name, "return") == 0)
+        body->blocked = true;
+      switch (get_fn_attr(t->reference_expr.call.name)) {
+      case FN_ATTR_CONST:
+        break;
+      case FN_ATTR_PURE:
+        body->pure_calls = true;
+        break;
+      default:
+        body->blocked = true;
+        break;
+      }
+      break;
+    default:
+      break;
+    }
+    break;
+  default:
+    break;
+  }
+  return true;
+}
+
+static void destroy_body(struct loop_body *body) {
+  free(body->accesses);
+  hashmap_destroy(&body->decls);
+  hashmap_destroy(&body->reads);
+  hashmap_destroy(&body->writes);
+}
+
+static bool init_body(struct loop_body *body, struct tree *t) {
+  memset(body, 0, sizeof(*body));
+  if (hashmap_create(32, &body->decls) != 0 ||
+      hashmap_create(32, &body->reads) != 0 ||
+      hashmap_create(32, &body->writes) != 0) {
+    error("Failed to create hashmap.");
+    return false;
+  }
+  walk_tree(t, collect_body_decls, body);
+  walk_tree(t, scan_body, body);
+  return true;
+}
+
+/* structural equality, with the induction variables of b renamed to a's */
+struct rename {
+  struct tree *from, *to;
+};
+
+static bool same_expr(struct tree *a, struct tree *b, struct rename *map) {
+  if (a == NULL || b == NULL)
+    return a == b;
+  if (a->type != b->type)
+    return false;
+  switch (a->type) {
+  case REFERENCE_EXPR:
+    if (a->reference_expr.type != b->reference_expr.type)
+      return false;
+    switch (a->reference_expr.type) {
+    case INTEGER_CST:
+      return a->reference_expr.ival == b->reference_expr.ival;
+    case FLOAT_CST:
+      return a->reference_expr.fval == b->reference_expr.fval;
+    case CHAR_CST:
+      return a->reference_expr.cval == b->reference_expr.cval;
+    case BOOL_CST:
+      return a->reference_expr.bval == b->reference_expr.bval;
+    case STRING_CST:
+      return strcmp(a->reference_expr.symbol, b->reference_expr.symbol) == 0;
+    case VAR_REF:;
+      char *name = b->reference_expr.symbol;
+      for (struct rename *r = map; r != NULL && r->from != NULL; r++) {
+        if (strcmp(name, r->from->var_decl.name) == 0) {
+          name = r->to->var_decl.name;
+          break;
+        }
+      }
+      return strcmp(a->reference_expr.symbol, name) == 0;
+    case FN_CALL:
+      if (strcmp(a->reference_expr.call.name, b->reference_expr.call.name) !=
+          0)
+        return false;
+      struct tree *arg_a = a->reference_expr.call.args;
+      struct tree *arg_b = b->reference_expr.call.args;
+      for (; arg_a != NULL && arg_b != NULL;
+           arg_a = arg_a->next, arg_b = arg_b->next) {
+        if (!same_expr(arg_a, arg_b, map))
+          return false;
+      }
+      return arg_a == arg_b;
+    }
+    return false;
+  case SET_EXPR:
+    return a->set_expr.mod == b->set_expr.mod &&
+           same_expr(a->set_expr.var, b->set_expr.var, map) &&
+           same_expr(a->set_expr.value, b->set_expr.value, map);
+  case BINOP_EXPR:
+    if (a->binop_expr.op != b->binop_expr.op)
+      return false;
+    struct tree *body_a = a->binop_expr.body, *body_b = b->binop_expr.body;
+    for (; body_a != NULL && body_b != NULL;
+         body_a = body_a->next, body_b = body_b->next) {
+      if (!same_expr(body_a, body_b, map))
+        return false;
+    }
+    return body_a == body_b;
+  case COMPARE_EXPR:
+    return a->compare_expr.op == b->compare_expr.op &&
+           same_expr(a->compare_expr.lhs, b->compare_expr.lhs, map) &&
+           same_expr(a->compare_expr.rhs, b->compare_expr.rhs, map);
+  case CAST_EXPR:
+    return same_type(a->cast_expr.type, b->cast_expr.type) &&
+           same_expr(a->cast_expr.expr, b->cast_expr.expr, map);
+  default:
+    return false;
+  }
+}
+
+static int count_vars(struct tree *vars) {
+  int n = 0;
+  for (; vars != NULL; vars = vars->next)
+    n++;
+  return n;
+}
+
+/* the loop header may only read variables the bodies leave alone */
+static bool header_reads(struct tree *t, void *data) {
+  struct loop_body *body = data;
+  if (t->type == REFERENCE_EXPR && t->reference_expr.type == FN_CALL &&
+      get_fn_attr(t->reference_expr.call.name) != FN_ATTR_CONST)
+    body->blocked = true;
+  if (is_var_ref(t) && in_map(&body->writes, t->reference_expr.symbol))
+    body->blocked = true;
+  if (t->type == AREF_EXPR && body->writes_memory)
+    body->blocked = true;
+  return true;
+}
+
+static bool header_safe(struct tree *loop, struct loop_body *body) {
+  bool blocked = body->blocked;
+  for (struct tree *var = loop->for_stmt.vars; var != NULL; var = var->next)
+    walk_tree(var->var_decl.value, header_reads, body);
+  walk_tree(loop->for_stmt.condition, header_reads, body);
+  // the induction variables themselves are only written by the step
+  for (struct tree *var = loop->for_stmt.vars; var != NULL; var = var->next) {
+    if (in_map(&body->writes, var->var_decl.name))
+      body->blocked = true;
+  }
+  bool safe = !body->blocked;
+  body->blocked = blocked;
+  return safe;
+}
+
+/* +1 for i += c, -1 for i -= c with c a positive constant, 0 otherwise */
+static int step_direction(struct tree *loop) {
+  struct tree *step = loop->for_stmt.loop_eval;
+  if (step == NULL || step->type != SET_EXPR || step->next != NULL ||
+      count_vars(loop->for_stmt.vars) != 1 ||
+      !is_var_ref(step->set_expr.var) ||
+      strcmp(step->set_expr.var->reference_expr.symbol,
+             loop->for_stmt.vars->var_decl.name) != 0)
+    return 0;
+  struct tree *amount = step->set_expr.value;
+  if (amount->type != REFERENCE_EXPR ||
+      amount->reference_expr.type != INTEGER_CST ||
+      amount->reference_expr.ival <= 0)
+    return 0;
+  if (step->set_expr.mod == '+')
+    return 1;
+  if (step->set_expr.mod == '-')
+    return -1;
+  return 0;
+}
+
+/* index of the form i, (+ i c), (+ c i) or (- i c) */
+static bool affine_index(struct tree *index, char *var, int *offset) {
+  if (is_var_ref(index) && strcmp(index->reference_expr.symbol, var) == 0) {
+    *offset = 0;
+    return true;
+  }
+  if (index->type != BINOP_EXPR ||
+      (index->binop_expr.op != '+' && index->binop_expr.op != '-'))
+    return false;
+  struct tree *lhs = index->binop_expr.body;
+  struct tree *rhs = lhs == NULL ? NULL : lhs->next;
+  if (rhs == NULL || rhs->next != NULL)
+    return false;
+  if (index->binop_expr.op == '+' && !is_var_ref(lhs)) {
+    struct tree *tmp = lhs;
+    lhs = rhs;
+    rhs = tmp;
+  }
+  if (!is_var_ref(lhs) || strcmp(lhs->reference_expr.symbol, var) != 0 ||
+      rhs->type != REFERENCE_EXPR || rhs->reference_expr.type != INTEGER_CST)
+    return false;
+  *offset = index->binop_expr.op == '+' ? rhs->reference_expr.ival
+                                        : -rhs->reference_expr.ival;
+  return true;
+}
+
+struct name_search {
+  const char *name;
+  bool found;
+};
+
+static bool find_name(struct tree *t, void *data) {
+  struct name_search *search = data;
+  if ((is_var_ref(t) &&
+       strcmp(t->reference_expr.symbol, search->name) == 0) ||
+      ((t->type == VAR_DECL || t->type == PARM_DECL) &&
+       strcmp(t->var_decl.name, search->name) == 0))
+    search->found = true;
+  return !search->found;
+}
+
+static bool mentions(struct tree *t, const char *name) {
+  struct name_search search = {name, false};
+  walk_tree_node(t, find_name, &search);
+  return search.found;
+}
+
+static bool is_array_var(struct tree *decl) {
+  struct type_ptr *ptr = decl->var_decl.type->type_expr.ptr;
+  // a sized array parameter is a pointer in C
+  return decl->type == VAR_DECL && ptr != NULL && ptr->type == SIZED_PTR;
+}
+
+/* two distinct sized arrays never overlap, nor do two restrict pointers. A
+ * pointer may point into an array, so anything else may alias */
+static bool may_alias(struct fusion_fn *fn, char *a, char *b) {
+  if (strcmp(a, b) == 0)
+    return true;
+  struct tree *decl_a = hashmap_get(&fn->decls, a, strlen(a));
+  struct tree *decl_b = hashmap_get(&fn->decls, b, strlen(b));
+  if (decl_a == NULL)
+    decl_a = hashmap_get(fn->globals, a, strlen(a));
+  if (decl_b == NULL)
+    decl_b = hashmap_get(fn->globals, b, strlen(b));
+  if (decl_a == NULL || decl_b == NULL)
+    return true;
+  if (is_array_var(decl_a) && is_array_var(decl_b))
+    return false;
+  struct tree *type_a = decl_a->var_decl.type, *type_b = decl_b->var_decl.type;
+  return type_a->type_expr.id->modifier != MOD_RESTRICT ||
+         type_b->type_expr.id->modifier != MOD_RESTRICT;
+}
+
+static bool ordered(struct fusion_fn *fn, struct access *first,
+                    struct access *second, struct rename *vars,
+                    int direction) {
+  char *var_a = vars->to->var_decl.name, *var_b = vars->from->var_decl.name;
+  struct tree *a = first->aref, *b = second->aref;
+  if (!is_var_ref(a->ref_expr.expr) || !is_var_ref(b->ref_expr.expr))
+    return false;
+  char *base_a = a->ref_expr.expr->reference_expr.symbol;
+  char *base_b = b->ref_expr.expr->reference_expr.symbol;
+  if (!may_alias(fn, base_a, base_b))
+    return true;
+  if (strcmp(base_a, base_b) != 0)
+    return false;
+
+  // exactly one index may follow the induction variable, the others are equal
+  struct tree *index_a = a->ref_expr.indices, *index_b = b->ref_expr.indices;
+  int n_affine = 0, offset_a = 0, offset_b = 0;
+  for (; index_a != NULL && index_b != NULL;
+       index_a = index_a->next, index_b = index_b->next) {
+    if (mentions(index_a, var_a) || mentions(index_b, var_b)) {
+      if (n_affine++ > 0 || !affine_index(index_a, var_a, &offset_a) ||
+          !affine_index(index_b, var_b, &offset_b))
+        return false;
+    } else if (!same_expr(index_a, index_b, NULL)) {
+      return false;
+    }
+  }
+  if (index_a != index_b || n_affine != 1)
+    return false;
+  return direction > 0 ? offset_a >= offset_b : offset_a <= offset_b;
+}
+
+struct conflict {
+  struct hashmap_s *reads, *writes;
+};
+
+static int scalar_conflict(void *const context,
+                           struct hashmap_element_s *const e) {
+  struct conflict *c = context;
+  if (hashmap_get(c->reads, e->key, e->key_len) != NULL)
+    return 1;
+  if (c->writes != NULL && hashmap_get(c->writes, e->key, e->key_len) != NULL)
+    return 1;
+  return 0;
+}
+
+static bool dependencies_allow(struct fusion_fn *fn, struct loop_body *a,
+                               struct loop_body *b, struct rename *vars,
+                               int direction) {
+  if ((a->pure_calls && b->writes_memory) ||
+      (b->pure_calls && a->writes_memory))
+    return false;
+
+  struct conflict a_writes = {&b->reads, &b->writes};
+  struct conflict b_writes = {&a->reads, NULL};
+  if (hashmap_iterate_pairs(&a->writes, scalar_conflict, &a_writes) != 0 ||
+      hashmap_iterate_pairs(&b->writes, scalar_conflict, &b_writes) != 0)
+    return false;
+
+  for (int i = 0; i < a->n_accesses; i++) {
+    for (int j = 0; j < b->n_accesses; j++) {
+      if (!a->accesses[i].write && !b->accesses[j].write)
+        continue;
+      if (!ordered(fn, &a->accesses[i], &b->accesses[j], vars, direction))
+        return false;
+    }
+  }
+  return true;
+}
+
+static bool rename_var(struct tree *t, void *data) {
+  struct rename *r = data;
+  if (is_var_ref(t) &&
+      strcmp(t->reference_expr.symbol, r->from->var_decl.name) == 0) {
+    free(t->reference_expr.symbol);
+    t->reference_expr.symbol = strdup(r->to->var_decl.name);
+  }
+  return true;
+}
+
+static bool try_fuse(struct fusion_fn *fn, struct tree *a, struct tree *b) {
+  if (b->type != FOR_STMT)
+    return false;
+  struct tree *var_a = a->for_stmt.vars, *var_b = b->for_stmt.vars;
+  int direction = step_direction(a);
+  if (direction == 0 || step_direction(b) != direction ||
+      count_vars(var_b) != 1 || !same_type(var_a->var_decl.type,
+                                           var_b->var_decl.type) ||
+      !same_expr(var_a->var_decl.value, var_b->var_decl.value, NULL))
+    return false;
+
+  struct rename map[2] = {{var_b, var_a}, {NULL, NULL}};
+  if (!same_expr(a->for_stmt.condition, b->for_stmt.condition, map) ||
+      !same_expr(a->for_stmt.loop_eval, b->for_stmt.loop_eval, map))
+    return false;
+  // renaming must not capture a variable of the same name in the second body
+  if (strcmp(var_a->var_decl.name, var_b->var_decl.name) != 0) {
+    for (struct tree *stmt = b->for_stmt.body; stmt != NULL; stmt = stmt->next)
+      if (mentions(stmt, var_a->var_decl.name))
+        return false;
+  }
+
+  struct loop_body body_a, body_b;
+  if (!init_body(&body_a, a->for_stmt.body))
+    return false;
+  if (!init_body(&body_b, b->for_stmt.body)) {
+    destroy_body(&body_a);
+    return false;
+  }
+  bool legal = !body_a.blocked && !body_b.blocked && header_safe(a, &body_a) &&
+               header_safe(b, &body_b) &&
+               dependencies_allow(fn, &body_a, &body_b, map, direction);
+  destroy_body(&body_a);
+  destroy_body(&body_b);
+  if (!legal)
+    return false;
+
+  walk_tree(b->for_stmt.body, rename_var, map);
+  a->for_stmt.body = append_tree(b->for_stmt.body, a->for_stmt.body);
+  b->for_stmt.body = NULL;
+  a->next = b->next;
+  b->next = NULL;
+  destroy_tree(b);
+  return true;
+}
+
+static void fuse_chain(struct tree *t, struct fusion_fn *fn);
+static void fuse_stmt(struct tree *t, struct fusion_fn *fn) {
+  switch (t->type) {
+  case LET_STMT:
+    fuse_chain(t->let_stmt.body, fn);
+    break;
+  case IF_STMT:
+    fuse_chain(t->if_else_stmt.if_block, fn);
+    fuse_chain(t->if_else_stmt.else_block, fn);
+    break;
+  case COND_STMT:
+    for (struct tree *expr = t->cond_stmt.exprs; expr != NULL;
+         expr = expr->next)
+      fuse_chain(expr->cond_expr.body, fn);
+    break;
+  case CASE_STMT:
+    for (struct tree *c = t->case_stmt.cases; c != NULL; c = c->next)
+      fuse_chain(c->case_expr.body, fn);
+    break;
+  case WHILE_STMT:
+  case DOWHILE_STMT:
+    fuse_chain(t->while_stmt.body, fn);
+    break;
+  case FOR_STMT:
+    fuse_chain(t->for_stmt.body, fn);
+    break;
+  default:
+    break;
+  }
+}
+
+static void fuse_chain(struct tree *t, struct fusion_fn *fn) {
+  for (; t != NULL; t = t->next) {
+    fuse_stmt(t, fn);
+    if (t->type != FOR_STMT || count_vars(t->for_stmt.vars) != 1)
+      continue;
+    int line = t->loc.first_line;
+    while (t->next != NULL) {
+      int next_line = t->next->loc.first_line;
+      fuse_stmt(t->next, fn);
+      if (!try_fuse(fn, t, t->next))
+        break;
+      info("%s:%d: fused loop at line %d into it", lcc_current_file, line,
+           next_line);
+    }
+  }
+}
+
+static bool collect_decls(struct tree *t, void *data) {
+  struct fusion_fn *fn = data;
+  if (t->type == VAR_DECL || t->type == PARM_DECL)
+    put_name(&fn->decls, t->var_decl.name, t);
+  return true;
+}
+
+void fusion_pass(struct tree *t) {
+  struct hashmap_s globals;
+  if (hashmap_create(128, &globals) != 0) {
+    error("Failed to create hashmap.");
+    return;
+  }
+  for (struct tree *head = t; head != NULL; head = head->next) {
+    if (head->type == VAR_DECL)
+      put_name(&globals, head->var_decl.name, head);
+  }
+
+  for (struct tree *head = t; head != NULL; head = head->next) {
+    if (head->type != FN_DECL)
+      continue;
+    struct fusion_fn fn = {.globals = &globals};
+    if (hashmap_create(64, &fn.decls) != 0) {
+      error("Failed to create hashmap.");
+      break;
+    }
+    walk_tree_node(head, collect_decls, &fn);
+    fuse_chain(head->fn_decl.body, &fn);
+    hashmap_destroy(&fn.decls);
+  }
+  hashmap_destroy(&globals);
+}
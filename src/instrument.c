@@ -0,0 +1,254 @@
+#include "debug.h"
+#include "opt.h"
+#include "tree.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Function instrumentation. With --instrument every function of the program
+ * opens with
+ *
+ *   LCC_INSTRUMENT(id);
+ *
+ * which declares a variable whose cleanup attribute closes the activation
+ * when the function returns, on any path and after the returned value has
+ * been evaluated. Each thread counts calls and time in a buffer of its own,
+ * read with rdtsc on x86 and clock_gettime elsewhere: inclusive time, once
+ * per outermost activation so that recursion is not counted twice, and
+ * exclusive time, without the callees.
+ *
+ * At exit the program prints a table of the functions that ran, by
+ * exclusive time, on stderr, and writes the same numbers as JSON to
+ * <source>.instrument.json unless the option names another file or
+ * LCC_INSTRUMENT does at run time. Functions keep the names and positions
+ * they have in the LCC source.
+ */
+
+extern const char *lcc_current_file;
+
+const char *instrument_output = NULL;
+
+static struct tree **functions = NULL;
+static int n_functions = 0, cap_functions = 0;
+
+void instrument_functions(struct tree *t) {
+  if (instrument_output == NULL)
+    return;
+  for (struct tree *head = t; head != NULL; head = head->next) {
+    if (head->type != FN_DECL || head->fn_decl.arglist == NULL)
+      continue;
+    if (head->fn_decl.body == NULL &&
+        head->fn_decl.arglist->lambda_list.aux == NULL)
+      continue; // a prototype
+    if (n_functions >= cap_functions) {
+      cap_functions = cap_functions == 0 ? 64 : cap_functions * 2;
+      functions = realloc(functions, cap_functions * sizeof(struct tree *));
+    }
+    struct location loc = head->loc;
+    struct tree *enter = build_fn_call(loc, strdup("LCC_INSTRUMENT"),
+                                       build_int_cst(loc, n_functions));
+    enter->next = head->fn_decl.body;
+    head->fn_decl.body = enter;
+    functions[n_functions++] = head;
+  }
+}
+
+static const char *json_path(void) {
+  static char buf[4096];
+  if (instrument_output[0] != '\0')
+    return instrument_output;
+  snprintf(buf, sizeof(buf), "%s.instrument.json",
+           lcc_current_file != NULL ? lcc_current_file : "lcc");
+  return buf;
+}
+
+void print_instrument_runtime(bool emit_asm) {
+  if (instrument_output == NULL || emit_asm)
+    return;
+  const char *file = lcc_current_file != NULL ? lcc_current_file : "stdin";
+  int n = n_functions > 0 ? n_functions : 1;
+  fprintf(stdout,
+          "#include <pthread.h>\n"
+          "#include <stdint.h>\n"
+          "#include <stdio.h>\n"
+          "#include <stdlib.h>\n"
+          "#include <time.h>\n"
+          "#if defined(__x86_64__) || defined(__i386__)\n"
+          "#include <x86intrin.h>\n"
+          "#define lcc_inst_ticks() __rdtsc()\n"
+          "#else\n"
+          "static inline uint64_t lcc_inst_ticks(void) {\n"
+          "  struct timespec ts;\n"
+          "  clock_gettime(CLOCK_MONOTONIC, &ts);\n"
+          "  return ts.tv_sec * 1000000000ull + ts.tv_nsec;\n"
+          "}\n"
+          "#endif\n"
+          "#define LCC_INST_FNS %d\n"
+          "#define LCC_INST_DEPTH 256\n"
+          "static const struct {\n"
+          "  const char *name;\n"
+          "  int line, column;\n"
+          "} lcc_inst_fns[LCC_INST_FNS] = {\n",
+          n);
+  for (int i = 0; i < n_functions; i++) {
+    struct tree *fn = functions[i];
+    fprintf(stdout, "  {\"%s\", %d, %d},\n",
+            fn->fn_decl.source_name != NULL ? fn->fn_decl.source_name
+                                            : fn->fn_decl.name,
+            fn->loc.first_line, fn->loc.first_column);
+  }
+  if (n_functions == 0)
+    fprintf(stdout, "  {\"\", 0, 0},\n");
+  fprintf(
+      stdout,
+      "};\n"
+      "typedef struct {\n"
+      "  uint64_t calls, inclusive, exclusive;\n"
+      "  int active;\n"
+      "} lcc_inst_count;\n"
+      "typedef struct lcc_inst_buffer {\n"
+      "  lcc_inst_count counts[LCC_INST_FNS];\n"
+      "  struct {\n"
+      "    int id;\n"
+      "    uint64_t start, children;\n"
+      "  } stack[LCC_INST_DEPTH];\n"
+      "  int depth;\n"
+      "  struct lcc_inst_buffer *next; // outlives its thread\n"
+      "} lcc_inst_buffer;\n"
+      "static lcc_inst_buffer *lcc_inst_buffers = NULL;\n"
+      "static pthread_mutex_t lcc_inst_lock = PTHREAD_MUTEX_INITIALIZER;\n"
+      "static _Thread_local lcc_inst_buffer *lcc_inst_self = NULL;\n"
+      "static uint64_t lcc_inst_t0;\n"
+      "static struct timespec lcc_inst_ts0;\n"
+      "static lcc_inst_buffer *lcc_inst_buffer_new(void) {\n"
+      "  lcc_inst_buffer *b = calloc(1, sizeof(lcc_inst_buffer));\n"
+      "  if (b == NULL) {\n"
+      "    fprintf(stderr, \"%s: instrumentation out of memory\\n\");\n"
+      "    abort();\n"
+      "  }\n"
+      "  pthread_mutex_lock(&lcc_inst_lock);\n"
+      "  b->next = lcc_inst_buffers;\n"
+      "  lcc_inst_buffers = b;\n"
+      "  pthread_mutex_unlock(&lcc_inst_lock);\n"
+      "  return lcc_inst_self = b;\n"
+      "}\n"
+      "static inline int lcc_inst_enter(int id) {\n"
+      "  lcc_inst_buffer *b = lcc_inst_self;\n"
+      "  if (b == NULL)\n"
+      "    b = lcc_inst_buffer_new();\n"
+      "  b->counts[id].calls++;\n"
+      "  b->counts[id].active++;\n"
+      "  if (b->depth < LCC_INST_DEPTH) {\n"
+      "    b->stack[b->depth].id = id;\n"
+      "    b->stack[b->depth].children = 0;\n"
+      "    b->stack[b->depth].start = lcc_inst_ticks();\n"
+      "  }\n"
+      "  b->depth++;\n"
+      "  return id;\n"
+      "}\n"
+      "static inline void lcc_inst_exit(int *id) {\n"
+      "  uint64_t now = lcc_inst_ticks();\n"
+      "  lcc_inst_buffer *b = lcc_inst_self;\n"
+      "  lcc_inst_count *c = &b->counts[*id];\n"
+      "  c->active--;\n"
+      "  if (--b->depth >= LCC_INST_DEPTH)\n"
+      "    return; // too deep to be timed\n"
+      "  uint64_t elapsed = now - b->stack[b->depth].start;\n"
+      "  c->exclusive += elapsed - b->stack[b->depth].children;\n"
+      "  if (c->active == 0)\n"
+      "    c->inclusive += elapsed;\n"
+      "  if (b->depth > 0)\n"
+      "    b->stack[b->depth - 1].children += elapsed;\n"
+      "}\n"
+      "#define LCC_INSTRUMENT(id)                                          "
+      "   \\\n"
+      "  int _lcc_inst __attribute__((cleanup(lcc_inst_exit), unused)) =  "
+      "   \\\n"
+      "      lcc_inst_enter(id)\n"
+      "static lcc_inst_count lcc_inst_total[LCC_INST_FNS];\n"
+      "static int lcc_inst_by_exclusive(const void *a, const void *b) {\n"
+      "  uint64_t x = lcc_inst_total[*(const int *)a].exclusive;\n"
+      "  uint64_t y = lcc_inst_total[*(const int *)b].exclusive;\n"
+      "  return x < y ? 1 : x > y ? -1 : 0;\n"
+      "}\n"
+      "static void lcc_inst_report(void) {\n"
+      "  struct timespec ts;\n"
+      "  clock_gettime(CLOCK_MONOTONIC, &ts);\n"
+      "  uint64_t ticks = lcc_inst_ticks() - lcc_inst_t0;\n"
+      "  double ns = (ts.tv_sec - lcc_inst_ts0.tv_sec) * 1e9 +\n"
+      "              (ts.tv_nsec - lcc_inst_ts0.tv_nsec);\n"
+      "  double ns_per_tick = ticks > 0 ? ns / ticks : 1.0;\n"
+      "  uint64_t total = 0;\n"
+      "  int order[LCC_INST_FNS];\n"
+      "  pthread_mutex_lock(&lcc_inst_lock);\n"
+      "  for (int i = 0; i < LCC_INST_FNS; i++) {\n"
+      "    order[i] = i;\n"
+      "    for (lcc_inst_buffer *b = lcc_inst_buffers; b != NULL; b = "
+      "b->next) {\n"
+      "      lcc_inst_total[i].calls += b->counts[i].calls;\n"
+      "      lcc_inst_total[i].inclusive += b->counts[i].inclusive;\n"
+      "      lcc_inst_total[i].exclusive += b->counts[i].exclusive;\n"
+      "    }\n"
+      "    total += lcc_inst_total[i].exclusive;\n"
+      "  }\n"
+      "  pthread_mutex_unlock(&lcc_inst_lock);\n"
+      "  qsort(order, LCC_INST_FNS, sizeof(int), lcc_inst_by_exclusive);\n"
+      "  fprintf(stderr, \"%%-32s %%12s %%14s %%14s %%7s  %%s\\n\", "
+      "\"function\",\n"
+      "          \"calls\", \"inclusive ms\", \"exclusive ms\", \"excl%%\",\n"
+      "          \"location\");\n"
+      "  for (int k = 0; k < LCC_INST_FNS; k++) {\n"
+      "    int i = order[k];\n"
+      "    lcc_inst_count *c = &lcc_inst_total[i];\n"
+      "    if (c->calls == 0)\n"
+      "      continue;\n"
+      "    fprintf(stderr, \"%%-32s %%12llu %%14.3f %%14.3f %%6.2f%%%%  "
+      "%s:%%d:%%d\\n\",\n"
+      "            lcc_inst_fns[i].name, (unsigned long long)c->calls,\n"
+      "            c->inclusive * ns_per_tick / 1e6,\n"
+      "            c->exclusive * ns_per_tick / 1e6,\n"
+      "            total > 0 ? 100.0 * c->exclusive / total : 0.0,\n"
+      "            lcc_inst_fns[i].line, lcc_inst_fns[i].column);\n"
+      "  }\n"
+      "  const char *path = getenv(\"LCC_INSTRUMENT\");\n"
+      "  if (path == NULL)\n"
+      "    path = \"%s\";\n"
+      "  FILE *f = fopen(path, \"w\");\n"
+      "  if (f == NULL) {\n"
+      "    perror(path);\n"
+      "    return;\n"
+      "  }\n"
+      "  fprintf(f, \"{\\\"file\\\": \\\"%s\\\", \\\"functions\\\": [\");\n"
+      "  const char *sep = \"\";\n"
+      "  for (int k = 0; k < LCC_INST_FNS; k++) {\n"
+      "    int i = order[k];\n"
+      "    lcc_inst_count *c = &lcc_inst_total[i];\n"
+      "    if (c->calls == 0)\n"
+      "      continue;\n"
+      "    fprintf(f,\n"
+      "            \"%%s\\n  {\\\"name\\\": \\\"%%s\\\", \\\"line\\\": %%d, "
+      "\\\"column\\\": %%d, \"\n"
+      "            \"\\\"calls\\\": %%llu, \\\"inclusive_ns\\\": %%.0f, \"\n"
+      "            \"\\\"exclusive_ns\\\": %%.0f}\",\n"
+      "            sep, lcc_inst_fns[i].name, lcc_inst_fns[i].line,\n"
+      "            lcc_inst_fns[i].column, (unsigned long long)c->calls,\n"
+      "            c->inclusive * ns_per_tick, c->exclusive * ns_per_tick);\n"
+      "    sep = \",\";\n"
+      "  }\n"
+      "  fprintf(f, \"\\n]}\\n\");\n"
+      "  fclose(f);\n"
+      "}\n"
+      "__attribute__((constructor)) static void lcc_inst_start(void) {\n"
+      "  clock_gettime(CLOCK_MONOTONIC, &lcc_inst_ts0);\n"
+      "  lcc_inst_t0 = lcc_inst_ticks();\n"
+      "  atexit(lcc_inst_report);\n"
+      "}\n",
+      file, file, json_path(), file);
+  free(functions);
+  functions = NULL;
+  n_functions = cap_functions = 0;
+}
@@ -0,0 +1,1263 @@
+#include "ir.h"
+#include "debug.h"
+#include "tree.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hashmap.h"
+
+/*
+ * Lowering from the resolved tree into SSA form. SSA is built on the fly
+ * while lowering, following Braun et al., "Simple and Efficient Construction
+ * of Static Single Assignment Form": every block keeps the current definition
+ * of each variable, reads walk up the predecessors, and blocks whose
+ * predecessors are not all known yet get incomplete phis that are filled in
+ * when the block is sealed.
+ *
+ * Variables whose address is taken, arrays and globals are not promoted and
+ * are accessed through IR_LOAD/IR_STORE instead.
+ */
+
+extern const char *lcc_current_file;
+
+static const int op_flags[] = {
+#define DEFIRCODE(NAME, STR, FLAGS) FLAGS,
+#include "ir.def"
+#undef DEFIRCODE
+};
+
+static const char *op_names[] = {
+#define DEFIRCODE(NAME, STR, FLAGS) STR,
+#include "ir.def"
+#undef DEFIRCODE
+};
+
+int ir_flags(enum ir_op op) { return op_flags[op]; }
+const char *ir_op_name(enum ir_op op) { return op_names[op]; }
+
+struct scope_entry {
+  char *name;
+  struct ir_var *var;
+};
+
+static struct ir_function *fn = NULL;
+static struct ir_block *block = NULL;
+static struct scope_entry *scope = NULL;
+static int n_scope = 0, cap_scope = 0;
+static struct hashmap_s addr_taken;
+static bool failed = false;
+
+static struct tree *type_int = NULL;
+static struct tree *type_double = NULL;
+static struct tree *type_char = NULL;
+static struct tree *type_string = NULL;
+static struct tree *type_bool = NULL;
+
+/* the caller falls back to the tree emitter, so this is not an error */
+#define ir_errorat(t, msg, ...)                                                \
+  {                                                                            \
+    warning("%s:%d:%d: " msg, lcc_current_file, (t)->loc.first_line,          \
+            (t)->loc.first_column __VA_OPT__(, ) __VA_ARGS__);                 \
+    failed = true;                                                             \
+  }
+
+/* values and use lists */
+
+static struct ir_value *new_value(enum ir_op op, struct tree *type) {
+  struct ir_value *v = calloc(1, sizeof(struct ir_value));
+  v->op = op;
+  v->type = type;
+  v->id = fn->n_values++;
+  return v;
+}
+
+static void add_use(struct ir_value *v, struct ir_value *user) {
+  struct ir_use *use = calloc(1, sizeof(struct ir_use));
+  use->user = user;
+  use->next = v->uses;
+  v->uses = use;
+}
+
+static void remove_use(struct ir_value *v, struct ir_value *user) {
+  for (struct ir_use **use = &v->uses; *use != NULL; use = &(*use)->next) {
+    if ((*use)->user == user) {
+      struct ir_use *next = (*use)->next;
+      free(*use);
+      *use = next;
+      return;
+    }
+  }
+}
+
+void ir_add_arg(struct ir_value *user, struct ir_value *arg) {
+  if (user->n_args >= user->cap_args) {
+    user->cap_args = user->cap_args == 0 ? 2 : user->cap_args * 2;
+    user->args =
+        realloc(user->args, user->cap_args * sizeof(struct ir_value *));
+  }
+  user->args[user->n_args++] = arg;
+  add_use(arg, user);
+}
+
+void ir_replace_all_uses(struct ir_value *from, struct ir_value *to) {
+  for (struct ir_use *use = from->uses, *next; use != NULL; use = next) {
+    next = use->next;
+    struct ir_value *user = use->user;
+    for (int i = 0; i < user->n_args; i++) {
+      if (user->args[i] == from) {
+        user->args[i] = to;
+        add_use(to, user);
+        break;
+      }
+    }
+    free(use);
+  }
+  from->uses = NULL;
+}
+
+static void unlink_value(struct ir_value *v) {
+  if (v->block == NULL)
+    return;
+  if (v->prev != NULL)
+    v->prev->next = v->next;
+  else
+    v->block->first = v->next;
+  if (v->next != NULL)
+    v->next->prev = v->prev;
+  else
+    v->block->last = v->prev;
+  v->prev = v->next = NULL;
+  v->block = NULL;
+}
+
+void ir_remove_value(struct ir_function *f, struct ir_value *v) {
+  unlink_value(v);
+  for (int i = 0; i < v->n_args; i++)
+    remove_use(v->args[i], v);
+  v->n_args = 0;
+  v->dead_next = f->dead;
+  f->dead = v;
+}
+
+static void append_value(struct ir_block *b, struct ir_value *v) {
+  v->block = b;
+  v->prev = b->last;
+  v->next = NULL;
+  if (b->last != NULL)
+    b->last->next = v;
+  else
+    b->first = v;
+  b->last = v;
+}
+
+static void prepend_value(struct ir_block *b, struct ir_value *v) {
+  v->block = b;
+  v->prev = NULL;
+  v->next = b->first;
+  if (b->first != NULL)
+    b->first->prev = v;
+  else
+    b->last = v;
+  b->first = v;
+}
+
+/* blocks */
+
+static struct ir_block *new_block(void) {
+  struct ir_block *b = calloc(1, sizeof(struct ir_block));
+  b->id = fn->n_blocks++;
+  if (fn->blocks_tail != NULL)
+    fn->blocks_tail->next = b;
+  else
+    fn->blocks = b;
+  fn->blocks_tail = b;
+  return b;
+}
+
+static void add_pred(struct ir_block *b, struct ir_block *pred) {
+  if (b->n_preds >= b->cap_preds) {
+    b->cap_preds = b->cap_preds == 0 ? 2 : b->cap_preds * 2;
+    b->preds = realloc(b->preds, b->cap_preds * sizeof(struct ir_block *));
+  }
+  b->preds[b->n_preds++] = pred;
+}
+
+static bool terminated(struct ir_block *b) {
+  return b->last != NULL && (ir_flags(b->last->op) & IR_TERMINATOR);
+}
+
+struct ir_block **ir_successors(struct ir_block *b, int *n) {
+  if (!terminated(b)) {
+    *n = 0;
+    return NULL;
+  }
+  *n = b->last->n_targets;
+  return b->last->targets;
+}
+
+static void set_targets(struct ir_value *term, int n) {
+  term->n_targets = n;
+  term->targets = calloc(n, sizeof(struct ir_block *));
+}
+
+/* after a terminator, following code is unreachable and goes into a block
+ * without predecessors, which is pruned before emission */
+static struct ir_block *current_block(void) {
+  if (terminated(block)) {
+    block = new_block();
+    block->sealed = true;
+  }
+  return block;
+}
+
+static struct ir_value *emit_value(struct ir_value *v) {
+  append_value(current_block(), v);
+  return v;
+}
+
+static void jump(struct ir_block *target) {
+  struct ir_block *from = current_block();
+  struct ir_value *term = new_value(IR_JUMP, NULL);
+  set_targets(term, 1);
+  term->targets[0] = target;
+  append_value(from, term);
+  add_pred(target, from);
+}
+
+static void branch(struct ir_value *cond, struct ir_block *then_block,
+                   struct ir_block *else_block) {
+  struct ir_block *from = current_block();
+  struct ir_value *term = new_value(IR_BRANCH, NULL);
+  ir_add_arg(term, cond);
+  set_targets(term, 2);
+  term->targets[0] = then_block;
+  term->targets[1] = else_block;
+  append_value(from, term);
+  add_pred(then_block, from);
+  add_pred(else_block, from);
+}
+
+/* SSA construction */
+
+static struct ir_value *resolve(struct ir_value *v) {
+  while (v != NULL && v->replaced != NULL)
+    v = v->replaced;
+  return v;
+}
+
+static void write_var(struct ir_var *var, struct ir_block *b,
+                      struct ir_value *v) {
+  if (var->index >= b->n_defs) {
+    int n = fn->n_vars > var->index ? fn->n_vars : var->index + 1;
+    b->defs = realloc(b->defs, n * sizeof(struct ir_value *));
+    memset(b->defs + b->n_defs, 0, (n - b->n_defs) * sizeof(struct ir_value *));
+    b->n_defs = n;
+  }
+  b->defs[var->index] = v;
+}
+
+static struct ir_value *read_var(struct ir_var *var, struct ir_block *b);
+
+static struct ir_value *new_phi(struct ir_var *var, struct ir_block *b) {
+  struct ir_value *phi = new_value(IR_PHI, var == NULL ? NULL : var->type);
+  phi->var = var;
+  prepend_value(b, phi);
+  return phi;
+}
+
+static struct ir_value *new_undef(struct tree *type) {
+  struct ir_value *undef = new_value(IR_UNDEF, type);
+  prepend_value(fn->entry, undef);
+  return undef;
+}
+
+static struct ir_value *try_remove_trivial_phi(struct ir_value *phi) {
+  struct ir_value *same = NULL;
+  for (int i = 0; i < phi->n_args; i++) {
+    struct ir_value *op = phi->args[i];
+    if (op == same || op == phi)
+      continue;
+    if (same != NULL)
+      return phi;
+    same = op;
+  }
+  if (same == NULL)
+    same = new_undef(phi->type);
+
+  struct ir_value **users = NULL;
+  int n_users = 0;
+  for (struct ir_use *use = phi->uses; use != NULL; use = use->next) {
+    if (use->user == phi || use->user->op != IR_PHI)
+      continue;
+    users = realloc(users, (n_users + 1) * sizeof(struct ir_value *));
+    users[n_users++] = use->user;
+  }
+
+  // self references are rewritten too, so the phi only uses other values
+  ir_replace_all_uses(phi, same);
+  for (int i = 0; i < phi->n_args; i++)
+    remove_use(phi->args[i], phi);
+  phi->n_args = 0;
+  unlink_value(phi);
+  phi->replaced = same;
+  phi->dead_next = fn->dead;
+  fn->dead = phi;
+
+  for (int i = 0; i < n_users; i++) {
+    if (users[i]->replaced == NULL && users[i]->block != NULL)
+      try_remove_trivial_phi(users[i]);
+  }
+  free(users);
+  // removing the users may have removed same as well
+  return resolve(same);
+}
+
+static struct ir_value *add_phi_operands(struct ir_var *var,
+                                         struct ir_value *phi) {
+  struct ir_block *b = phi->block;
+  for (int i = 0; i < b->n_preds; i++)
+    ir_add_arg(phi, read_var(var, b->preds[i]));
+  return try_remove_trivial_phi(phi);
+}
+
+static struct ir_value *read_var_recursive(struct ir_var *var,
+                                           struct ir_block *b) {
+  struct ir_value *v;
+  if (!b->sealed) {
+    v = new_phi(var, b);
+    b->incomplete =
+        realloc(b->incomplete, (b->n_incomplete + 1) * sizeof(*b->incomplete));
+    b->incomplete[b->n_incomplete++] = v;
+  } else if (b->n_preds == 0) {
+    v = new_undef(var->type);
+  } else if (b->n_preds == 1) {
+    v = read_var(var, b->preds[0]);
+  } else {
+    v = new_phi(var, b);
+    write_var(var, b, v);
+    v = add_phi_operands(var, v);
+  }
+  write_var(var, b, v);
+  return v;
+}
+
+static struct ir_value *read_var(struct ir_var *var, struct ir_block *b) {
+  if (var->index < b->n_defs && b->defs[var->index] != NULL) {
+    struct ir_value *v = resolve(b->defs[var->index]);
+    b->defs[var->index] = v;
+    return v;
+  }
+  return read_var_recursive(var, b);
+}
+
+static void seal_block(struct ir_block *b) {
+  for (int i = 0; i < b->n_incomplete; i++) {
+    struct ir_value *phi = b->incomplete[i];
+    add_phi_operands(phi->var, phi);
+  }
+  free(b->incomplete);
+  b->incomplete = NULL;
+  b->n_incomplete = 0;
+  b->sealed = true;
+}
+
+/* variables */
+
+static struct tree *known_type(struct tree *type) {
+  if (type == NULL || type->type != TYPE_EXPR || is_monomorph(type))
+    return NULL;
+  return type;
+}
+
+static bool is_array(struct tree *type) {
+  return type != NULL && type->type_expr.ptr != NULL &&
+         type->type_expr.ptr->type == SIZED_PTR;
+}
+
+/* every access to these has to stay a load or store */
+static bool is_shared(struct tree *type) {
+  return type != NULL && type->type_expr.ptr == NULL &&
+         (type->type_expr.id->modifier == MOD_ATOMIC ||
+          type->type_expr.id->modifier == MOD_VOLATILE);
+}
+
+static struct ir_var *new_var(char *name, struct tree *type) {
+  struct ir_var *var = calloc(1, sizeof(struct ir_var));
+  var->name = name;
+  var->type = known_type(type);
+  var->index = fn->n_vars++;
+
+  int n_same = 0;
+  for (struct ir_var *v = fn->vars; v != NULL; v = v->next) {
+    if (strcmp(v->name, name) == 0)
+      n_same++;
+  }
+  if (n_same == 0) {
+    var->c_name = strdup(name);
+  } else {
+    size_t len = strlen(name) + 16;
+    var->c_name = malloc(len);
+    snprintf(var->c_name, len, "%s_%d", name, n_same);
+  }
+  var->next = fn->vars;
+  fn->vars = var;
+  return var;
+}
+
+static void push_scope(char *name, struct ir_var *var) {
+  if (n_scope >= cap_scope) {
+    cap_scope = cap_scope == 0 ? 32 : cap_scope * 2;
+    scope = realloc(scope, cap_scope * sizeof(struct scope_entry));
+  }
+  scope[n_scope].name = name;
+  scope[n_scope].var = var;
+  n_scope++;
+}
+
+static struct ir_var *lookup(char *name) {
+  for (int i = n_scope - 1; i >= 0; i--) {
+    if (strcmp(scope[i].name, name) == 0)
+      return scope[i].var;
+  }
+  // anything not declared in the function lives outside of it
+  struct ir_var *var = new_var(name, NULL);
+  var->memory = true;
+  var->global = true;
+  free(var->c_name);
+  var->c_name = strdup(name);
+  push_scope(name, var);
+  return var;
+}
+
+static struct ir_value *cast_to(struct tree *type, struct ir_value *v) {
+  if (type == NULL || v == NULL || same_type(type, v->type))
+    return v;
+  struct ir_value *cast = new_value(IR_CAST, type);
+  ir_add_arg(cast, v);
+  return emit_value(cast);
+}
+
+static void assign(struct ir_var *var, struct ir_value *v) {
+  v = cast_to(var->type, v);
+  if (var->memory) {
+    struct ir_value *store = new_value(IR_STORE, NULL);
+    store->var = var;
+    ir_add_arg(store, v);
+    emit_value(store);
+    return;
+  }
+  write_var(var, current_block(), v);
+}
+
+static struct ir_value *read(struct ir_var *var) {
+  if (var->memory) {
+    struct ir_value *load = new_value(IR_LOAD, var->type);
+    load->var = var;
+    return emit_value(load);
+  }
+  return read_var(var, current_block());
+}
+
+/* lowering */
+
+static struct ir_value *lower_expr(struct tree *t);
+static void lower_stmt(struct tree *t);
+static void lower_body(struct tree *t) {
+  for (struct tree *body = t; body != NULL; body = body->next)
+    lower_stmt(body);
+}
+
+static void declare_var(struct tree *t) {
+  struct ir_value *value = NULL;
+  if (is_array(t->var_decl.type)) {
+    // arrays are zero initialised where they are declared
+    struct tree *init = t->var_decl.value;
+    if (init != NULL &&
+        (init->type != REFERENCE_EXPR ||
+         init->reference_expr.type != INTEGER_CST ||
+         init->reference_expr.ival != 0))
+      ir_errorat(t, "array '%s' can only be initialised with 0",
+                 t->var_decl.name);
+  } else if (t->var_decl.value != NULL) {
+    value = lower_expr(t->var_decl.value);
+  }
+
+  struct ir_var *var = new_var(t->var_decl.name, t->var_decl.type);
+  if (var->type == NULL && value != NULL)
+    var->type = value->type;
+  var->align = t->var_decl.align;
+  var->memory =
+      var->align != 0 || is_array(var->type) || is_shared(var->type) ||
+      hashmap_get(&addr_taken, var->name, strlen(var->name)) != NULL;
+  push_scope(var->name, var);
+
+  if (value != NULL)
+    assign(var, value);
+}
+
+static void declare_param(struct tree *t) {
+  if (t->type == LAMBDA_KEY)
+    t = t->lambda_key.expr;
+  struct ir_var *var = new_var(t->var_decl.name, t->var_decl.type);
+  var->param = true;
+  var->memory = is_shared(var->type) ||
+                hashmap_get(&addr_taken, var->name, strlen(var->name)) != NULL;
+  push_scope(var->name, var);
+  if (var->memory)
+    return;
+  struct ir_value *param = new_value(IR_PARAM, var->type);
+  param->var = var;
+  write_var(var, block, emit_value(param));
+}
+
+static struct ir_value *lower_const(struct tree *t) {
+  struct tree *type = NULL;
+  switch (t->reference_expr.type) {
+  case INTEGER_CST:
+    type = type_int;
+    break;
+  case FLOAT_CST:
+    type = type_double;
+    break;
+  case STRING_CST:
+    type = type_string;
+    break;
+  case CHAR_CST:
+    type = type_char;
+    break;
+  case BOOL_CST:
+    type = type_bool;
+    break;
+  default:
+    break;
+  }
+  struct ir_value *v = new_value(IR_CONST, type);
+  v->cst = t;
+  return emit_value(v);
+}
+
+/* the operand of sizeof or _Alignof is not evaluated: a global is printed
+ * as written and a local stands for its declared type, which a temporary
+ * holding its value would not have */
+static struct ir_value *lower_unevaluated(struct tree *t) {
+  if (t->type != REFERENCE_EXPR || t->reference_expr.type != VAR_REF)
+    return lower_expr(t);
+  struct ir_var *var = lookup(t->reference_expr.symbol);
+  if (!var->global && var->type == NULL)
+    return lower_expr(t);
+  struct ir_value *v = new_value(IR_CONST, NULL);
+  v->cst = var->global ? t : var->type;
+  return emit_value(v);
+}
+
+static struct ir_value *lower_call(struct tree *t) {
+  char *name = t->reference_expr.call.name;
+  if (strcmp(name, "return") == 0) {
+    struct ir_value *ret = new_value(IR_RETURN, NULL);
+    if (t->reference_expr.call.args != NULL) {
+      struct ir_value *v = lower_expr(t->reference_expr.call.args);
+      v = cast_to(known_type(fn->decl->fn_decl.type), v);
+      if (v != NULL)
+        ir_add_arg(ret, v);
+    }
+    emit_value(ret);
+    return NULL;
+  }
+
+  bool unevaluated =
+      strcmp(name, "sizeof") == 0 || strcmp(name, "_Alignof") == 0;
+  struct ir_value *call = new_value(IR_CALL, NULL);
+  call->name = name;
+  for (struct tree *arg = t->reference_expr.call.args; arg != NULL;
+       arg = arg->next) {
+    struct tree *expr = arg->type == LAMBDA_KEY ? arg->lambda_key.expr : arg;
+    struct ir_value *v =
+        unevaluated ? lower_unevaluated(expr) : lower_expr(expr);
+    if (v == NULL) {
+      ir_errorat(arg, "argument to %s has no value", name);
+      return NULL;
+    }
+    ir_add_arg(call, v);
+  }
+  return emit_value(call);
+}
+
+static struct ir_value *lower_aref_addr(struct tree *t) {
+  struct ir_value *base = lower_expr(t->ref_expr.expr);
+  if (base == NULL)
+    return NULL;
+  for (struct tree *index = t->ref_expr.indices; index != NULL;
+       index = index->next) {
+    struct ir_value *i = lower_expr(index);
+    if (i == NULL)
+      return NULL;
+    struct ir_value *addr = new_value(IR_INDEX, NULL);
+    ir_add_arg(addr, base);
+    ir_add_arg(addr, i);
+    base = emit_value(addr);
+    if (index->next != NULL) {
+      struct ir_value *deref = new_value(IR_DEREF, NULL);
+      ir_add_arg(deref, base);
+      base = emit_value(deref);
+    }
+  }
+  return base;
+}
+
+/* the elements of a typed &rest are stored into an array of their own,
+ * which is passed by its address */
+static struct ir_value *lower_list(struct tree *t) {
+  int n = 0;
+  for (struct tree *elem = t->list_expr.elems; elem != NULL; elem = elem->next)
+    n++;
+  struct tree *type = build_type_expr(t->loc, build_tid(NULL, MOD_NONE));
+  copy_type_to_type(type, t->list_expr.type);
+  add_type_ptr(type, SIZED_PTR, n);
+  type->next = fn->owned;
+  fn->owned = type;
+  struct ir_var *var = new_var("_rest", type);
+  var->memory = true;
+
+  int i = 0;
+  for (struct tree *elem = t->list_expr.elems; elem != NULL;
+       elem = elem->next) {
+    struct ir_value *v = lower_expr(elem);
+    if (v == NULL) {
+      ir_errorat(elem, "&rest argument has no value");
+      return NULL;
+    }
+    struct tree *cst = build_int_cst(elem->loc, i++);
+    cst->next = fn->owned;
+    fn->owned = cst;
+    struct ir_value *addr = new_value(IR_INDEX, NULL);
+    ir_add_arg(addr, read(var));
+    ir_add_arg(addr, lower_const(cst));
+    emit_value(addr);
+    struct ir_value *store = new_value(IR_STORE_PTR, NULL);
+    ir_add_arg(store, addr);
+    ir_add_arg(store, v);
+    emit_value(store);
+  }
+  return read(var);
+}
+
+static struct ir_value *lower_place_addr(struct tree *t);
+
+/* the address of a field, computed from the address of the structure or
+ * from the pointer it is reached through */
+static struct ir_value *lower_field_addr(struct tree *t) {
+  struct ir_value *base = t->field_expr.indirect
+                              ? lower_expr(t->field_expr.expr)
+                              : lower_place_addr(t->field_expr.expr);
+  if (base == NULL)
+    return NULL;
+  struct ir_value *field = new_value(IR_FIELD, NULL);
+  field->name = t->field_expr.field;
+  ir_add_arg(field, base);
+  return emit_value(field);
+}
+
+static struct ir_value *lower_place_addr(struct tree *t) {
+  struct ir_value *v;
+  switch (t->type) {
+  case AREF_EXPR:
+    return lower_aref_addr(t);
+  case FIELD_EXPR:
+    return lower_field_addr(t);
+  case REFERENCE_EXPR:
+    if (t->reference_expr.type != VAR_REF)
+      break;
+    v = new_value(IR_ADDR, NULL);
+    v->var = lookup(t->reference_expr.symbol);
+    return emit_value(v);
+  default:
+    break;
+  }
+  ir_errorat(t, "%s is not an lvalue", get_tree_type(t));
+  return NULL;
+}
+
+/* Only types that survive the usual arithmetic conversions unchanged are
+ * tracked. Anything else is left unknown, which makes assignments cast. */
+static struct tree *binop_type(struct tree *lhs, struct tree *rhs) {
+  static const char *closed[] = {"int",    "unsigned int",  "long",
+                                 "double", "unsigned long", "long long",
+                                 "float",  "size_t"};
+  if (!same_type(lhs, rhs) || lhs == NULL || lhs->type_expr.ptr != NULL)
+    return NULL;
+  for (size_t i = 0; i < sizeof(closed) / sizeof(closed[0]); i++) {
+    if (strcmp(lhs->type_expr.id->name, closed[i]) == 0)
+      return lhs;
+  }
+  return NULL;
+}
+
+static struct ir_value *lower_binop(char op, struct ir_value *lhs,
+                                    struct ir_value *rhs) {
+  struct ir_value *v = new_value(IR_BINOP, binop_type(lhs->type, rhs->type));
+  v->binop = op;
+  ir_add_arg(v, lhs);
+  ir_add_arg(v, rhs);
+  return emit_value(v);
+}
+
+static struct ir_value *to_bool(struct ir_value *v) {
+  struct ir_value *not = new_value(IR_NOT, type_int);
+  ir_add_arg(not, v);
+  emit_value(not);
+  struct ir_value *not_not = new_value(IR_NOT, type_int);
+  ir_add_arg(not_not, not);
+  return emit_value(not_not);
+}
+
+static struct ir_value *lower_logical(struct tree *t) {
+  bool is_and = t->compare_expr.op == OP_AND;
+  struct ir_value *lhs = lower_expr(t->compare_expr.lhs);
+  if (lhs == NULL)
+    return NULL;
+  struct ir_block *rhs_block = new_block();
+  struct ir_block *join = new_block();
+
+  // the constant has no tree of its own, the function keeps the one made here
+  struct tree *cst = build_int_cst(t->loc, is_and ? 0 : 1);
+  cst->next = fn->owned;
+  fn->owned = cst;
+  struct ir_value *shortcut = lower_const(cst);
+
+  if (is_and)
+    branch(lhs, rhs_block, join);
+  else
+    branch(lhs, join, rhs_block);
+  seal_block(rhs_block);
+
+  block = rhs_block;
+  struct ir_value *rhs = lower_expr(t->compare_expr.rhs);
+  if (rhs == NULL)
+    return NULL;
+  rhs = to_bool(rhs);
+  jump(join);
+  seal_block(join);
+
+  block = join;
+  struct ir_value *phi = new_phi(NULL, join);
+  phi->type = type_int;
+  for (int i = 0; i < join->n_preds; i++)
+    ir_add_arg(phi, join->preds[i] == rhs->block ? rhs : shortcut);
+  return phi;
+}
+
+static struct ir_value *lower_expr(struct tree *t) {
+  if (t == NULL)
+    return NULL;
+  struct ir_value *v, *lhs, *rhs;
+  switch (t->type) {
+  case REFERENCE_EXPR:
+    switch (t->reference_expr.type) {
+    case VAR_REF:
+      return read(lookup(t->reference_expr.symbol));
+    case FN_CALL:
+      return lower_call(t);
+    default:
+      return lower_const(t);
+    }
+  case TYPE_EXPR:
+    // an operand of sizeof or _Alignof, printed as it is
+    v = new_value(IR_CONST, NULL);
+    v->cst = t;
+    return emit_value(v);
+  case AREF_EXPR:
+  case FIELD_EXPR:
+    v = lower_place_addr(t);
+    if (v == NULL)
+      return NULL;
+    struct ir_value *deref = new_value(IR_DEREF, NULL);
+    ir_add_arg(deref, v);
+    return emit_value(deref);
+  case ADDR_EXPR:
+    if (t->ref_expr.expr->type == AREF_EXPR ||
+        t->ref_expr.expr->type == FIELD_EXPR)
+      return lower_place_addr(t->ref_expr.expr);
+    if (t->ref_expr.expr->type == REFERENCE_EXPR &&
+        t->ref_expr.expr->reference_expr.type == VAR_REF) {
+      v = new_value(IR_ADDR, NULL);
+      v->var = lookup(t->ref_expr.expr->reference_expr.symbol);
+      return emit_value(v);
+    }
+    ir_errorat(t, "cannot take the address of %s",
+               get_tree_type(t->ref_expr.expr));
+    return NULL;
+  case CAST_EXPR:
+    lhs = lower_expr(t->cast_expr.expr);
+    if (lhs == NULL)
+      return NULL;
+    v = new_value(IR_CAST, t->cast_expr.type);
+    ir_add_arg(v, lhs);
+    return emit_value(v);
+  case LIST_EXPR:
+    return lower_list(t);
+  case BINOP_EXPR:
+    v = lower_expr(t->binop_expr.body);
+    for (struct tree *body = t->binop_expr.body->next; body != NULL && v;
+         body = body->next) {
+      rhs = lower_expr(body);
+      if (rhs == NULL)
+        return NULL;
+      v = lower_binop(t->binop_expr.op, v, rhs);
+    }
+    return v;
+  case COMPARE_EXPR:
+    switch (t->compare_expr.op) {
+    case OP_AND:
+    case OP_OR:
+      return lower_logical(t);
+    case OP_NOT:
+      lhs = lower_expr(t->compare_expr.lhs);
+      if (lhs == NULL)
+        return NULL;
+      v = new_value(IR_NOT, type_int);
+      ir_add_arg(v, lhs);
+      return emit_value(v);
+    default:
+      break;
+    }
+    lhs = lower_expr(t->compare_expr.lhs);
+    rhs = lower_expr(t->compare_expr.rhs);
+    if (lhs == NULL || rhs == NULL)
+      return NULL;
+    v = new_value(IR_CMP, type_int);
+    v->cmp = t->compare_expr.op;
+    ir_add_arg(v, lhs);
+    ir_add_arg(v, rhs);
+    return emit_value(v);
+  case SET_EXPR:;
+    struct tree *var = t->set_expr.var;
+    struct ir_value *value = lower_expr(t->set_expr.value);
+    if (value == NULL)
+      return NULL;
+    if (var->type == REFERENCE_EXPR && var->reference_expr.type == VAR_REF) {
+      struct ir_var *ir_var = lookup(var->reference_expr.symbol);
+      if (t->set_expr.mod != 0)
+        value = lower_binop(t->set_expr.mod, read(ir_var), value);
+      assign(ir_var, value);
+      return value;
+    }
+    if (var->type != AREF_EXPR && var->type != FIELD_EXPR) {
+      ir_errorat(var, "%s is not an lvalue", get_tree_type(var));
+      return NULL;
+    }
+    struct ir_value *addr = lower_place_addr(var);
+    if (addr == NULL)
+      return NULL;
+    if (t->set_expr.mod != 0) {
+      struct ir_value *old = new_value(IR_DEREF, NULL);
+      ir_add_arg(old, addr);
+      value = lower_binop(t->set_expr.mod, emit_value(old), value);
+    }
+    struct ir_value *store = new_value(IR_STORE_PTR, NULL);
+    ir_add_arg(store, addr);
+    ir_add_arg(store, value);
+    emit_value(store);
+    return value;
+  default:
+    lower_stmt(t);
+    return NULL;
+  }
+}
+
+static void lower_cond(struct tree *condition, struct ir_block *then_block,
+                       struct ir_block *else_block) {
+  struct ir_value *cond = lower_expr(condition);
+  if (cond == NULL) {
+    ir_errorat(condition, "condition has no value");
+    return;
+  }
+  branch(cond, then_block, else_block);
+}
+
+static void lower_stmt(struct tree *t) {
+  if (t == NULL)
+    return;
+  int saved_scope = n_scope;
+  struct ir_block *then_block, *else_block, *header, *body, *end;
+  switch (t->type) {
+  case VAR_DECL:
+    declare_var(t);
+    return;
+  case LET_STMT:
+    for (struct tree *var = t->let_stmt.vars; var != NULL; var = var->next)
+      declare_var(var);
+    lower_body(t->let_stmt.body);
+    break;
+  case IF_STMT:
+    then_block = new_block();
+    else_block = new_block();
+    end = new_block();
+    lower_cond(t->if_else_stmt.condition, then_block, else_block);
+    seal_block(then_block);
+    seal_block(else_block);
+    block = then_block;
+    lower_body(t->if_else_stmt.if_block);
+    jump(end);
+    block = else_block;
+    lower_body(t->if_else_stmt.else_block);
+    jump(end);
+    seal_block(end);
+    block = end;
+    break;
+  case COND_STMT:
+    end = new_block();
+    for (struct tree *expr = t->cond_stmt.exprs; expr != NULL;
+         expr = expr->next) {
+      if (get_bool(expr->cond_expr.condition) == 1) {
+        lower_body(expr->cond_expr.body);
+        jump(end);
+        break;
+      }
+      then_block = new_block();
+      else_block = new_block();
+      lower_cond(expr->cond_expr.condition, then_block, else_block);
+      seal_block(then_block);
+      seal_block(else_block);
+      block = then_block;
+      lower_body(expr->cond_expr.body);
+      jump(end);
+      block = else_block;
+    }
+    if (!terminated(block))
+      jump(end);
+    seal_block(end);
+    block = end;
+    break;
+  case CASE_STMT:;
+    struct ir_value *value = lower_expr(t->case_stmt.expr);
+    if (value == NULL) {
+      ir_errorat(t, "case expression has no value");
+      break;
+    }
+    int n_cases = 0;
+    for (struct tree *c = t->case_stmt.cases; c != NULL; c = c->next)
+      n_cases++;
+    end = new_block();
+    struct ir_block *from = current_block();
+    struct ir_value *term = new_value(IR_SWITCH, NULL);
+    ir_add_arg(term, value);
+    // the last target is the default
+    set_targets(term, n_cases + 1);
+    term->cases = calloc(n_cases, sizeof(struct tree *));
+    term->targets[n_cases] = end;
+    int i = 0;
+    for (struct tree *c = t->case_stmt.cases; c != NULL; c = c->next, i++) {
+      term->targets[i] = new_block();
+      if (get_bool(c->case_expr.expr) == 1)
+        term->targets[n_cases] = term->targets[i];
+      else
+        term->cases[i] = c->case_expr.expr;
+    }
+    append_value(from, term);
+    for (i = 0; i < n_cases; i++) {
+      if (term->cases[i] != NULL)
+        add_pred(term->targets[i], from);
+    }
+    add_pred(term->targets[n_cases], from);
+    i = 0;
+    for (struct tree *c = t->case_stmt.cases; c != NULL; c = c->next, i++) {
+      seal_block(term->targets[i]);
+      block = term->targets[i];
+      lower_body(c->case_expr.body);
+      jump(end);
+    }
+    seal_block(end);
+    block = end;
+    break;
+  case WHILE_STMT:
+    header = new_block();
+    body = new_block();
+    end = new_block();
+    jump(header);
+    block = header;
+    lower_cond(t->while_stmt.condition, body, end);
+    seal_block(body);
+    block = body;
+    lower_body(t->while_stmt.body);
+    jump(header);
+    seal_block(header);
+    seal_block(end);
+    block = end;
+    break;
+  case DOWHILE_STMT:
+    body = new_block();
+    end = new_block();
+    jump(body);
+    block = body;
+    lower_body(t->while_stmt.body);
+    lower_cond(t->while_stmt.condition, body, end);
+    seal_block(body);
+    seal_block(end);
+    block = end;
+    break;
+  case FOR_STMT:
+    for (struct tree *var = t->for_stmt.vars; var != NULL; var = var->next)
+      declare_var(var);
+    header = new_block();
+    body = new_block();
+    end = new_block();
+    jump(header);
+    block = header;
+    lower_cond(t->for_stmt.condition, body, end);
+    seal_block(body);
+    block = body;
+    lower_body(t->for_stmt.body);
+    lower_expr(t->for_stmt.loop_eval);
+    jump(header);
+    seal_block(header);
+    seal_block(end);
+    block = end;
+    break;
+  case TYPE_DECL:
+  case ATTR_DECL:
+  case INCLUDE_STMT:
+    break;
+  case FN_DECL:
+    ir_errorat(t, "nested functions are not supported by the IR");
+    break;
+  default:
+    lower_expr(t);
+    break;
+  }
+  n_scope = saved_scope;
+}
+
+static bool collect_addr_taken(struct tree *t, void *data) {
+  if (t->type != ADDR_EXPR && (t->type != FIELD_EXPR || t->field_expr.indirect))
+    return true;
+  // fields are reached through the address of their structure
+  struct tree *expr =
+      t->type == ADDR_EXPR ? t->ref_expr.expr : t->field_expr.expr;
+  if (expr->type == REFERENCE_EXPR && expr->reference_expr.type == VAR_REF)
+    hashmap_put(&addr_taken, expr->reference_expr.symbol,
+                strlen(expr->reference_expr.symbol), expr);
+  return true;
+}
+
+static struct tree *make_type(const char *name, bool pointer) {
+  struct tree *type =
+      build_type_expr((struct location){0}, build_tid(strdup(name), MOD_NONE));
+  if (pointer)
+    add_type_ptr(type, SINGLE_PTR, 0);
+  return type;
+}
+
+static void init_types(void) {
+  if (type_int != NULL)
+    return;
+  type_int = make_type("int", false);
+  type_double = make_type("double", false);
+  type_char = make_type("char", false);
+  type_string = make_type("char", true);
+  type_bool = make_type("_Bool", false);
+}
+
+struct ir_function *ir_lower_fn(struct tree *t) {
+  struct tree *args = t->fn_decl.arglist;
+  if (args == NULL || args->type != LAMBDA_LIST)
+    return NULL;
+  init_types();
+
+  fn = calloc(1, sizeof(struct ir_function));
+  fn->decl = t;
+  failed = false;
+  n_scope = 0;
+  if (hashmap_create(64, &addr_taken) != 0) {
+    error("Failed to create hashmap.");
+    free(fn);
+    return NULL;
+  }
+  walk_tree(t->fn_decl.body, collect_addr_taken, NULL);
+  walk_tree(args->lambda_list.aux, collect_addr_taken, NULL);
+
+  fn->entry = block = new_block();
+  block->sealed = true;
+  for (struct tree *arg = args->lambda_list.args; arg != NULL; arg = arg->next)
+    declare_param(arg);
+  for (struct tree *arg = args->lambda_list.optionals; arg != NULL;
+       arg = arg->next)
+    declare_param(arg);
+  for (struct tree *arg = args->lambda_list.keys; arg != NULL; arg = arg->next)
+    declare_param(arg);
+  struct tree *rest = args->lambda_list.rest;
+  if (rest != NULL && rest->next == NULL)
+    ir_errorat(t, "untyped &rest functions are not supported by the IR");
+  for (; rest != NULL; rest = rest->next)
+    declare_param(rest);
+
+  for (struct tree *aux = args->lambda_list.aux; aux != NULL; aux = aux->next)
+    declare_var(aux);
+  lower_body(t->fn_decl.body);
+  if (!terminated(current_block()))
+    emit_value(new_value(IR_RETURN, NULL));
+
+  hashmap_destroy(&addr_taken);
+  struct ir_function *result = fn;
+  fn = NULL;
+  block = NULL;
+  if (failed) {
+    ir_destroy_function(result);
+    return NULL;
+  }
+  ir_compute_order(result);
+  return result;
+}
+
+/* ordering and dominators */
+
+static void remove_pred(struct ir_block *b, int index) {
+  for (struct ir_value *v = b->first; v != NULL && v->op == IR_PHI;
+       v = v->next) {
+    remove_use(v->args[index], v);
+    memmove(&v->args[index], &v->args[index + 1],
+            (v->n_args - index - 1) * sizeof(struct ir_value *));
+    v->n_args--;
+  }
+  memmove(&b->preds[index], &b->preds[index + 1],
+          (b->n_preds - index - 1) * sizeof(struct ir_block *));
+  b->n_preds--;
+}
+
+static void visit_block(struct ir_block *b, struct ir_block **post, int *n) {
+  b->rpo = 0;
+  int n_succ;
+  struct ir_block **succ = ir_successors(b, &n_succ);
+  // visiting the last successor first keeps the first one next in the order
+  for (int i = n_succ - 1; i >= 0; i--) {
+    if (succ[i]->rpo == -1)
+      visit_block(succ[i], post, n);
+  }
+  post[(*n)++] = b;
+}
+
+static void free_value(struct ir_value *v) {
+  for (struct ir_use *use = v->uses, *next; use != NULL; use = next) {
+    next = use->next;
+    free(use);
+  }
+  free(v->args);
+  free(v->targets);
+  free(v->cases);
+  free(v);
+}
+
+/* computes reverse post order and drops unreachable blocks */
+void ir_compute_order(struct ir_function *f) {
+  for (struct ir_block *b = f->blocks; b != NULL; b = b->next)
+    b->rpo = -1;
+  struct ir_block **post = calloc(f->n_blocks, sizeof(struct ir_block *));
+  int n = 0;
+  visit_block(f->entry, post, &n);
+
+  for (struct ir_block *b = f->blocks; b != NULL; b = b->next) {
+    for (int i = 0; i < b->n_preds; i++) {
+      if (b->preds[i]->rpo == -1)
+        remove_pred(b, i--);
+    }
+  }
+  struct ir_block **link = &f->blocks;
+  f->blocks_tail = NULL;
+  for (struct ir_block *b = f->blocks, *next; b != NULL; b = next) {
+    next = b->next;
+    if (b->rpo != -1) {
+      *link = b;
+      link = &b->next;
+      f->blocks_tail = b;
+      continue;
+    }
+    for (struct ir_value *v = b->first; v != NULL; v = v->next) {
+      for (int i = 0; i < v->n_args; i++)
+        remove_use(v->args[i], v);
+      v->n_args = 0;
+    }
+    for (struct ir_value *v = b->first, *vnext; v != NULL; v = vnext) {
+      vnext = v->next;
+      free_value(v);
+    }
+    free(b->preds);
+    free(b->defs);
+    free(b->incomplete);
+    free(b);
+  }
+  *link = NULL;
+
+  free(f->order);
+  f->order = calloc(n, sizeof(struct ir_block *));
+  f->n_order = n;
+  for (int i = 0; i < n; i++) {
+    f->order[i] = post[n - 1 - i];
+    f->order[i]->rpo = i;
+  }
+  free(post);
+}
+
+static struct ir_block *intersect(struct ir_block *a, struct ir_block *b) {
+  while (a != b) {
+    while (a->rpo > b->rpo)
+      a = a->idom;
+    while (b->rpo > a->rpo)
+      b = b->idom;
+  }
+  return a;
+}
+
+/* Cooper, Harvey and Kennedy, "A Simple, Fast Dominance Algorithm" */
+void ir_compute_dominators(struct ir_function *f) {
+  for (int i = 0; i < f->n_order; i++)
+    f->order[i]->idom = NULL;
+  f->entry->idom = f->entry;
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (int i = 1; i < f->n_order; i++) {
+      struct ir_block *b = f->order[i];
+      struct ir_block *idom = NULL;
+      for (int p = 0; p < b->n_preds; p++) {
+        struct ir_block *pred = b->preds[p];
+        if (pred->idom == NULL)
+          continue;
+        idom = idom == NULL ? pred : intersect(pred, idom);
+      }
+      if (idom != b->idom) {
+        b->idom = idom;
+        changed = true;
+      }
+    }
+  }
+}
+
+void ir_destroy_function(struct ir_function *f) {
+  if (f == NULL)
+    return;
+  for (struct ir_block *b = f->blocks, *next; b != NULL; b = next) {
+    next = b->next;
+    for (struct ir_value *v = b->first, *vnext; v != NULL; v = vnext) {
+      vnext = v->next;
+      free_value(v);
+    }
+    free(b->preds);
+    free(b->defs);
+    free(b->incomplete);
+    free(b);
+  }
+  for (struct ir_value *v = f->dead, *next; v != NULL; v = next) {
+    next = v->dead_next;
+    free_value(v);
+  }
+  for (struct ir_var *var = f->vars, *next; var != NULL; var = next) {
+    next = var->next;
+    free(var->c_name);
+    free(var);
+  }
+  destroy_tree(f->owned);
+  free(f->order);
+  free(f);
+}
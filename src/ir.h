@@ -0,0 +1,135 @@
+#pragma once
+
+#include "tree.h"
+
+#include <stdbool.h>
+
+/*
+ * Typed SSA intermediate representation.
+ *
+ * A function is a list of basic blocks, each holding a doubly linked list of
+ * instructions that ends in exactly one terminator. Phi nodes sit at the
+ * front of their block and have one operand per entry in block->preds.
+ * Every value keeps the list of instructions that use it.
+ */
+
+enum ir_op {
+#define DEFIRCODE(NAME, STR, FLAGS) NAME,
+#include "ir.def"
+#undef DEFIRCODE
+};
+
+enum ir_flags {
+  IR_PURE = 1 << 0,
+  IR_READS = 1 << 1,
+  IR_SIDE_EFFECT = 1 << 2,
+  IR_TERMINATOR = 1 << 3,
+};
+
+struct ir_value;
+struct ir_block;
+
+struct ir_var {
+  char *name;
+  char *c_name;
+  struct tree *type;
+  int index;
+  int align; // from (declare (align N ...)), 0 for the natural alignment
+  bool memory;
+  bool global;
+  bool param;
+  struct ir_var *next;
+};
+
+struct ir_use {
+  struct ir_value *user;
+  struct ir_use *next;
+};
+
+struct ir_value {
+  enum ir_op op;
+  int id;
+  struct tree *type;
+  struct ir_block *block;
+  struct ir_value *prev, *next;
+
+  struct ir_value **args;
+  int n_args, cap_args;
+  struct ir_use *uses;
+
+  union {
+    struct tree *cst;
+    struct ir_var *var;
+    char *name;
+    char binop;
+    enum compare_op cmp;
+  };
+
+  /* terminators */
+  struct ir_block **targets;
+  int n_targets;
+  struct tree **cases;
+
+  /* phis that were found to be trivial forward to their replacement */
+  struct ir_value *replaced;
+  struct ir_value *dead_next;
+};
+
+struct ir_block {
+  int id;
+  struct ir_value *first, *last;
+  struct ir_block **preds;
+  int n_preds, cap_preds;
+
+  bool sealed;
+  struct ir_value **defs;
+  int n_defs;
+  struct ir_value **incomplete;
+  int n_incomplete;
+
+  int rpo;
+  struct ir_block *idom;
+  struct ir_block *next;
+};
+
+struct ir_function {
+  struct tree *decl;
+  struct ir_block *entry;
+  struct ir_block *blocks, *blocks_tail;
+  int n_blocks;
+  int n_values;
+  struct ir_var *vars;
+  int n_vars;
+  struct ir_value *dead;
+  struct tree *owned;
+
+  /* blocks in reverse post order, valid after ir_compute_order */
+  struct ir_block **order;
+  int n_order;
+};
+
+struct ir_pass {
+  const char *name;
+  bool (*run)(struct ir_function *fn);
+  bool enabled;
+};
+
+struct ir_function *ir_lower_fn(struct tree *fn);
+void ir_destroy_function(struct ir_function *fn);
+
+int ir_flags(enum ir_op op);
+const char *ir_op_name(enum ir_op op);
+void ir_add_arg(struct ir_value *user, struct ir_value *arg);
+void ir_replace_all_uses(struct ir_value *from, struct ir_value *to);
+void ir_remove_value(struct ir_function *fn, struct ir_value *v);
+struct ir_block **ir_successors(struct ir_block *block, int *n);
+void ir_compute_order(struct ir_function *fn);
+void ir_compute_dominators(struct ir_function *fn);
+
+bool ir_set_pass_enabled(const char *name, bool enabled);
+void ir_run_passes(struct ir_function *fn);
+
+extern bool ir_dump_enabled;
+void ir_dump(struct ir_function *fn);
+void ir_print_function(struct ir_function *fn);
+void print_ir(struct tree *t);
@@ -0,0 +1,252 @@
+#include "debug.h"
+#include "ir.h"
+#include "timer.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hashmap.h"
+
+/* dead code elimination: everything not reachable from a side effect or a
+ * terminator through operands is removed. Unlike a use count based DCE this
+ * also removes dead phi cycles such as an unused loop counter. */
+static void mark_live(struct ir_value *v, bool *live) {
+  if (live[v->id])
+    return;
+  live[v->id] = true;
+  for (int i = 0; i < v->n_args; i++)
+    mark_live(v->args[i], live);
+}
+
+static bool ir_dce(struct ir_function *fn) {
+  bool *live = calloc(fn->n_values, sizeof(bool));
+  for (struct ir_block *b = fn->blocks; b != NULL; b = b->next) {
+    for (struct ir_value *v = b->first; v != NULL; v = v->next) {
+      if (ir_flags(v->op) & (IR_SIDE_EFFECT | IR_TERMINATOR))
+        mark_live(v, live);
+    }
+  }
+
+  // dead values may still use each other, removal order does not matter
+  bool changed = false;
+  for (struct ir_block *b = fn->blocks; b != NULL; b = b->next) {
+    for (struct ir_value *v = b->first, *next; v != NULL; v = next) {
+      next = v->next;
+      if (live[v->id])
+        continue;
+      ir_remove_value(fn, v);
+      changed = true;
+    }
+  }
+  free(live);
+  return changed;
+}
+
+/* global value numbering over the dominator tree: a pure instruction that
+ * computes the same operation on the same operands as one in a dominating
+ * block is replaced by it. */
+struct gvn_state {
+  struct hashmap_s table;
+  struct ir_block ***children;
+  int *n_children;
+  char **keys;
+  bool changed;
+};
+
+static bool is_commutative(struct ir_value *v) {
+  if (v->op == IR_BINOP)
+    return v->binop == '+' || v->binop == '*';
+  if (v->op == IR_CMP)
+    return v->cmp == OP_EQL;
+  return false;
+}
+
+/* types are compared structurally, every declaration has its own tree */
+static void type_key(FILE *key, struct tree *type) {
+  if (type == NULL) {
+    fprintf(key, "?");
+    return;
+  }
+  fprintf(key, "%d%s x%d", type->type_expr.id->modifier,
+          type->type_expr.id->name, type->type_expr.id->lanes);
+  for (struct type_ptr *ptr = type->type_expr.ptr; ptr != NULL; ptr = ptr->next)
+    fprintf(key, "/%d.%d", ptr->type, ptr->size);
+}
+
+/* the key names the operation, its type and every operand, it grows with
+ * them so that wide phis and long types never collide */
+static char *gvn_key(struct ir_value *v) {
+  char *buf = NULL;
+  size_t size = 0;
+  FILE *key = open_memstream(&buf, &size);
+  if (key == NULL)
+    return NULL;
+  bool keyed = true;
+  switch (v->op) {
+  case IR_CONST:
+    if (v->cst->type == TYPE_EXPR) {
+      keyed = false;
+      break;
+    }
+    switch (v->cst->reference_expr.type) {
+    case INTEGER_CST:
+      fprintf(key, "c:i%d", v->cst->reference_expr.ival);
+      break;
+    case CHAR_CST:
+      fprintf(key, "c:c%d", v->cst->reference_expr.cval);
+      break;
+    case BOOL_CST:
+      fprintf(key, "c:b%d", v->cst->reference_expr.bval);
+      break;
+    case FLOAT_CST:
+      fprintf(key, "c:f%a", v->cst->reference_expr.fval);
+      break;
+    default:
+      // string literals are distinct objects
+      keyed = false;
+    }
+    break;
+  case IR_PARAM:
+  case IR_ADDR:
+    fprintf(key, "%s:%p", ir_op_name(v->op), (void *)v->var);
+    break;
+  case IR_PHI:
+    fprintf(key, "phi:%d", v->block->id);
+    break;
+  case IR_BINOP:
+    fprintf(key, "binop:%c:", v->binop);
+    type_key(key, v->type);
+    break;
+  case IR_CMP:
+    fprintf(key, "cmp:%d", v->cmp);
+    break;
+  case IR_CAST:
+    fprintf(key, "cast:");
+    type_key(key, v->type);
+    break;
+  case IR_NOT:
+  case IR_INDEX:
+    fprintf(key, "%s", ir_op_name(v->op));
+    break;
+  case IR_FIELD:
+    fprintf(key, "field:%s", v->name);
+    break;
+  default:
+    keyed = false;
+  }
+
+  if (keyed && v->op != IR_CONST && v->op != IR_PARAM && v->op != IR_ADDR) {
+    int a = 0, b = v->n_args > 1 ? 1 : 0;
+    if (is_commutative(v) && v->n_args == 2 &&
+        v->args[0]->id > v->args[1]->id) {
+      a = 1;
+      b = 0;
+    }
+    for (int i = 0; i < v->n_args; i++) {
+      int arg = i == 0 ? a : (i == 1 ? b : i);
+      fprintf(key, ",%d", v->args[arg]->id);
+    }
+  }
+  fclose(key);
+  if (!keyed) {
+    free(buf);
+    return NULL;
+  }
+  return buf;
+}
+
+static void gvn_block(struct gvn_state *state, struct ir_function *fn,
+                      struct ir_block *b) {
+  struct ir_value **inserted = NULL;
+  int n_inserted = 0;
+
+  for (struct ir_value *v = b->first, *next; v != NULL; v = next) {
+    next = v->next;
+    if (!(ir_flags(v->op) & IR_PURE) || v->op == IR_UNDEF)
+      continue;
+    char *key = gvn_key(v);
+    if (key == NULL)
+      continue;
+    struct ir_value *same = hashmap_get(&state->table, key, strlen(key));
+    if (same != NULL) {
+      free(key);
+      ir_replace_all_uses(v, same);
+      ir_remove_value(fn, v);
+      state->changed = true;
+      continue;
+    }
+    state->keys[v->id] = key;
+    hashmap_put(&state->table, key, strlen(key), v);
+    inserted = realloc(inserted, (n_inserted + 1) * sizeof(*inserted));
+    inserted[n_inserted++] = v;
+  }
+
+  for (int i = 0; i < state->n_children[b->rpo]; i++)
+    gvn_block(state, fn, state->children[b->rpo][i]);
+
+  for (int i = 0; i < n_inserted; i++) {
+    char *key = state->keys[inserted[i]->id];
+    hashmap_remove(&state->table, key, strlen(key));
+  }
+  free(inserted);
+}
+
+static bool ir_gvn(struct ir_function *fn) {
+  struct gvn_state state = {0};
+  if (hashmap_create(256, &state.table) != 0) {
+    error("Failed to create hashmap.");
+    return false;
+  }
+  ir_compute_dominators(fn);
+  state.children = calloc(fn->n_order, sizeof(struct ir_block **));
+  state.n_children = calloc(fn->n_order, sizeof(int));
+  state.keys = calloc(fn->n_values, sizeof(char *));
+  for (int i = 1; i < fn->n_order; i++) {
+    struct ir_block *b = fn->order[i];
+    int parent = b->idom->rpo;
+    state.children[parent] =
+        realloc(state.children[parent],
+                (state.n_children[parent] + 1) * sizeof(struct ir_block *));
+    state.children[parent][state.n_children[parent]++] = b;
+  }
+
+  gvn_block(&state, fn, fn->entry);
+
+  for (int i = 0; i < fn->n_values; i++)
+    free(state.keys[i]);
+  for (int i = 0; i < fn->n_order; i++)
+    free(state.children[i]);
+  free(state.keys);
+  free(state.children);
+  free(state.n_children);
+  hashmap_destroy(&state.table);
+  return state.changed;
+}
+
+static struct ir_pass ir_passes[] = {
+    {"gvn", ir_gvn, true},
+    {"dce", ir_dce, true},
+};
+
+bool ir_set_pass_enabled(const char *name, bool enabled) {
+  for (size_t i = 0; i < sizeof(ir_passes) / sizeof(ir_passes[0]); i++) {
+    if (strcmp(ir_passes[i].name, name) == 0) {
+      ir_passes[i].enabled = enabled;
+      return true;
+    }
+  }
+  return false;
+}
+
+void ir_run_passes(struct ir_function *fn) {
+  for (size_t i = 0; i < sizeof(ir_passes) / sizeof(ir_passes[0]); i++) {
+    if (!ir_passes[i].enabled)
+      continue;
+    timer_begin(ir_passes[i].name);
+    ir_passes[i].run(fn);
+    timer_end();
+  }
+}
@@ -0,0 +1,418 @@
+#include "debug.h"
+#include "ir.h"
+#include "timer.h"
+#include "tree.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * C emission from the IR. The function body is emitted flat, one label per
+ * block in reverse post order, so every definition textually precedes the
+ * uses it dominates and SSA values can be declared with __auto_type where
+ * they are defined. Phis are declared at the top of the function and are
+ * assigned on the incoming edges.
+ *
+ * The output is not structured back into if and while. Once the passes have
+ * merged and removed blocks the graph no longer follows the source forms,
+ * and C has no break out of several loops, so gotos would remain for early
+ * exits anyway. The C compiler rebuilds the same graph from either form.
+ */
+
+extern const char *lcc_current_file;
+
+bool ir_dump_enabled = false;
+
+static bool is_array(struct tree *type) {
+  return type->type_expr.ptr != NULL &&
+         type->type_expr.ptr->type == SIZED_PTR;
+}
+
+static struct tree *value_type(struct ir_value *v) {
+  if (v->type != NULL || v->op != IR_PHI || v->replaced != NULL)
+    return v->type;
+  // guards against phi cycles while inferring
+  v->replaced = v;
+  struct tree *type = NULL;
+  for (int i = 0; i < v->n_args && type == NULL; i++)
+    type = value_type(v->args[i]);
+  v->replaced = NULL;
+  return type;
+}
+
+static void print_const(struct tree *cst) {
+  if (cst->type == TYPE_EXPR) {
+    print_expr(cst);
+    return;
+  }
+  switch (cst->reference_expr.type) {
+  case CHAR_CST:
+    fprintf(stdout, "'\\x%02x'", (unsigned char)cst->reference_expr.cval);
+    break;
+  case BOOL_CST:
+    fprintf(stdout, "((_Bool)%d)", cst->reference_expr.bval ? 1 : 0);
+    break;
+  default:
+    print_expr(cst);
+    break;
+  }
+}
+
+static void print_operand(struct ir_value *v) {
+  switch (v->op) {
+  case IR_CONST:
+    print_const(v->cst);
+    break;
+  case IR_PARAM:
+    fprintf(stdout, "%s", v->var->c_name);
+    break;
+  case IR_UNDEF:
+    fprintf(stdout, "0");
+    break;
+  default:
+    fprintf(stdout, "_v%d", v->id);
+    break;
+  }
+}
+
+/* constants, parameters and undefined values are printed at their uses */
+static bool materialized(struct ir_value *v) {
+  switch (v->op) {
+  case IR_CONST:
+  case IR_PARAM:
+  case IR_UNDEF:
+  case IR_PHI:
+    return false;
+  default:
+    return true;
+  }
+}
+
+static int pred_index(struct ir_block *b, struct ir_block *pred) {
+  for (int i = 0; i < b->n_preds; i++) {
+    if (b->preds[i] == pred)
+      return i;
+  }
+  return -1;
+}
+
+static bool has_phis(struct ir_block *b) {
+  return b->first != NULL && b->first->op == IR_PHI;
+}
+
+/* phi copies are parallel: every source is read before any phi is written */
+static void print_edge(struct ir_block *from, struct ir_block *to,
+                       struct ir_block *next) {
+  int index = pred_index(to, from);
+  if (has_phis(to) && index >= 0) {
+    fprintf(stdout, "{ ");
+    for (struct ir_value *phi = to->first; phi && phi->op == IR_PHI;
+         phi = phi->next) {
+      if (phi->args[index]->op == IR_UNDEF)
+        continue;
+      fprintf(stdout, "__auto_type _c%d = ", phi->id);
+      print_operand(phi->args[index]);
+      fprintf(stdout, "; ");
+    }
+    for (struct ir_value *phi = to->first; phi && phi->op == IR_PHI;
+         phi = phi->next) {
+      if (phi->args[index]->op != IR_UNDEF)
+        fprintf(stdout, "_v%d = _c%d; ", phi->id, phi->id);
+    }
+  }
+  if (to != next || has_phis(to))
+    fprintf(stdout, "goto _L%d; ", to->id);
+  if (has_phis(to) && index >= 0)
+    fprintf(stdout, "}");
+}
+
+static void print_value(struct ir_value *v, struct ir_block *next) {
+  if (!materialized(v))
+    return;
+  if (ir_flags(v->op) & IR_TERMINATOR) {
+    fprintf(stdout, "  ");
+    switch (v->op) {
+    case IR_JUMP:
+      print_edge(v->block, v->targets[0], next);
+      break;
+    case IR_BRANCH:
+      fprintf(stdout, "if (");
+      print_operand(v->args[0]);
+      fprintf(stdout, ") ");
+      print_edge(v->block, v->targets[0], NULL);
+      fprintf(stdout, " else ");
+      print_edge(v->block, v->targets[1], NULL);
+      break;
+    case IR_SWITCH:
+      fprintf(stdout, "switch (");
+      print_operand(v->args[0]);
+      fprintf(stdout, ") {\n");
+      for (int i = 0; i < v->n_targets - 1; i++) {
+        if (v->cases[i] == NULL)
+          continue;
+        fprintf(stdout, "  case ");
+        print_expr(v->cases[i]);
+        fprintf(stdout, ": ");
+        print_edge(v->block, v->targets[i], NULL);
+        fputc('\n', stdout);
+      }
+      fprintf(stdout, "  default: ");
+      print_edge(v->block, v->targets[v->n_targets - 1], NULL);
+      fprintf(stdout, "\n  }");
+      break;
+    case IR_RETURN:
+      fprintf(stdout, "return");
+      if (v->n_args > 0) {
+        fputc(' ', stdout);
+        print_operand(v->args[0]);
+      }
+      fputc(';', stdout);
+      break;
+    default:
+      break;
+    }
+    fputc('\n', stdout);
+    return;
+  }
+
+  fprintf(stdout, "  ");
+  if (v->uses != NULL)
+    fprintf(stdout, "__auto_type _v%d = ", v->id);
+  switch (v->op) {
+  case IR_BINOP:
+    print_operand(v->args[0]);
+    fprintf(stdout, " %c ", v->binop);
+    print_operand(v->args[1]);
+    break;
+  case IR_CMP:
+    print_operand(v->args[0]);
+    switch (v->cmp) {
+    case OP_LT:
+      fprintf(stdout, " < ");
+      break;
+    case OP_GT:
+      fprintf(stdout, " > ");
+      break;
+    case OP_LE:
+      fprintf(stdout, " <= ");
+      break;
+    case OP_GE:
+      fprintf(stdout, " >= ");
+      break;
+    default:
+      fprintf(stdout, " == ");
+      break;
+    }
+    print_operand(v->args[1]);
+    break;
+  case IR_NOT:
+    fputc('!', stdout);
+    print_operand(v->args[0]);
+    break;
+  case IR_CAST:
+    fputc('(', stdout);
+    print_expr(v->type);
+    fputc(')', stdout);
+    print_operand(v->args[0]);
+    break;
+  case IR_ADDR:
+    fprintf(stdout, "&%s", v->var->c_name);
+    break;
+  case IR_INDEX:
+    fputc('&', stdout);
+    print_operand(v->args[0]);
+    fputc('[', stdout);
+    print_operand(v->args[1]);
+    fputc(']', stdout);
+    break;
+  case IR_FIELD:
+    fputc('&', stdout);
+    print_operand(v->args[0]);
+    fprintf(stdout, "->%s", v->name);
+    break;
+  case IR_LOAD:
+    fprintf(stdout, "%s", v->var->c_name);
+    break;
+  case IR_DEREF:
+    fputc('*', stdout);
+    print_operand(v->args[0]);
+    break;
+  case IR_STORE:
+    fprintf(stdout, "%s = ", v->var->c_name);
+    print_operand(v->args[0]);
+    break;
+  case IR_STORE_PTR:
+    fputc('*', stdout);
+    print_operand(v->args[0]);
+    fprintf(stdout, " = ");
+    print_operand(v->args[1]);
+    break;
+  case IR_CALL:
+    fprintf(stdout, "%s(", v->name);
+    for (int i = 0; i < v->n_args; i++) {
+      print_operand(v->args[i]);
+      if (i + 1 < v->n_args)
+        fprintf(stdout, ", ");
+    }
+    fputc(')', stdout);
+    break;
+  default:
+    break;
+  }
+  fprintf(stdout, ";\n");
+}
+
+void ir_print_function(struct ir_function *fn) {
+  print_fn_header(fn->decl);
+  fprintf(stdout, " {\n");
+
+  for (struct ir_var *var = fn->vars; var != NULL; var = var->next) {
+    if (!var->memory || var->global || var->param)
+      continue;
+    if (var->type == NULL) {
+      errorat("type of '%s' is unknown. Add a type declaration",
+              lcc_current_file, fn->decl->loc.first_line,
+              fn->decl->loc.first_column, var->name);
+      continue;
+    }
+    fprintf(stdout, "  ");
+    if (var->align != 0)
+      fprintf(stdout, "_Alignas(%d) ", var->align);
+    print_decl(var->type, var->c_name);
+    if (is_array(var->type))
+      fprintf(stdout, " = {0}");
+    fprintf(stdout, ";\n");
+  }
+  for (struct ir_block *b = fn->blocks; b != NULL; b = b->next) {
+    for (struct ir_value *phi = b->first; phi && phi->op == IR_PHI;
+         phi = phi->next) {
+      struct tree *type = value_type(phi);
+      char name[32];
+      snprintf(name, sizeof(name), "_v%d", phi->id);
+      if (type == NULL) {
+        errorat("type of '%s' is unknown. Add a type declaration",
+                lcc_current_file, fn->decl->loc.first_line,
+                fn->decl->loc.first_column,
+                phi->var != NULL ? phi->var->name : name);
+        continue;
+      }
+      fprintf(stdout, "  ");
+      print_decl(type, name);
+      fprintf(stdout, ";\n");
+    }
+  }
+
+  for (int i = 0; i < fn->n_order; i++) {
+    struct ir_block *b = fn->order[i];
+    struct ir_block *next = i + 1 < fn->n_order ? fn->order[i + 1] : NULL;
+    if (b->n_preds > 0)
+      fprintf(stdout, "_L%d:;\n", b->id);
+    for (struct ir_value *v = b->first; v != NULL; v = v->next)
+      print_value(v, next);
+  }
+  fprintf(stdout, "}\n");
+}
+
+void ir_dump(struct ir_function *fn) {
+  fprintf(stderr, "function %s\n", fn->decl->fn_decl.name);
+  for (int i = 0; i < fn->n_order; i++) {
+    struct ir_block *b = fn->order[i];
+    fprintf(stderr, "bb%d:", b->id);
+    if (b->n_preds > 0) {
+      fprintf(stderr, " ; preds");
+      for (int p = 0; p < b->n_preds; p++)
+        fprintf(stderr, " bb%d", b->preds[p]->id);
+    }
+    fputc('\n', stderr);
+    for (struct ir_value *v = b->first; v != NULL; v = v->next) {
+      fprintf(stderr, "  ");
+      if (!(ir_flags(v->op) & (IR_TERMINATOR | IR_SIDE_EFFECT)) ||
+          v->uses != NULL)
+        fprintf(stderr, "v%d = ", v->id);
+      fprintf(stderr, "%s", ir_op_name(v->op));
+      switch (v->op) {
+      case IR_CONST:
+        if (v->cst->type == TYPE_EXPR) {
+          fprintf(stderr, " type");
+          break;
+        }
+        switch (v->cst->reference_expr.type) {
+        case INTEGER_CST:
+          fprintf(stderr, " %d", v->cst->reference_expr.ival);
+          break;
+        case FLOAT_CST:
+          fprintf(stderr, " %g", v->cst->reference_expr.fval);
+          break;
+        case CHAR_CST:
+          fprintf(stderr, " '%c'", v->cst->reference_expr.cval);
+          break;
+        case BOOL_CST:
+          fprintf(stderr, " %s", v->cst->reference_expr.bval ? "t" : "nil");
+          break;
+        default:
+          fprintf(stderr, " %s", v->cst->reference_expr.symbol);
+          break;
+        }
+        break;
+      case IR_PARAM:
+      case IR_LOAD:
+      case IR_STORE:
+      case IR_ADDR:
+        fprintf(stderr, " %s", v->var->c_name);
+        break;
+      case IR_PHI:
+        if (v->var != NULL)
+          fprintf(stderr, " %s", v->var->c_name);
+        break;
+      case IR_BINOP:
+        fprintf(stderr, " '%c'", v->binop);
+        break;
+      case IR_CMP:
+        fprintf(stderr, " %d", v->cmp);
+        break;
+      case IR_CALL:
+        fprintf(stderr, " %s", v->name);
+        break;
+      default:
+        break;
+      }
+      for (int a = 0; a < v->n_args; a++)
+        fprintf(stderr, " v%d", v->args[a]->id);
+      for (int t = 0; t < v->n_targets; t++)
+        fprintf(stderr, " -> bb%d", v->targets[t]->id);
+      fputc('\n', stderr);
+    }
+  }
+}
+
+static void print_ir_node(struct tree *head) {
+  if (head->type != FN_DECL || head->fn_decl.body == NULL) {
+    print_tree_node(head);
+    return;
+  }
+  timer_begin("ir-lower");
+  struct ir_function *fn = ir_lower_fn(head);
+  timer_end();
+  if (fn == NULL) {
+    warning("%s: falling back to tree emission for %s", lcc_current_file,
+            head->fn_decl.name);
+    print_tree_node(head);
+    return;
+  }
+  ir_run_passes(fn);
+  if (ir_dump_enabled)
+    ir_dump(fn);
+  ir_print_function(fn);
+  ir_destroy_function(fn);
+}
+
+void print_ir(struct tree *t) {
+  for (struct tree *head = t; head != NULL; head = head->next) {
+    timer_begin_form("emit", head);
+    print_ir_node(head);
+    timer_end();
+  }
+}
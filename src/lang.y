@@ -1,20 +1,56 @@
 %{
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
 #include "debug.h"
 #include "tree.h"
+#include "ir.h"
+#include "opt.h"
+#include "mem.h"
+#include "timer.h"
 
 void lccerror(void *lloc, const char*msg);
 int lcclex (void *, void *);
+static int timed_lex (void *, void *);
+#define lcclex timed_lex
 int c_main (char *const);
 
 extern FILE* lccin;
+extern const char *lcc_current_file;
 
 struct tree *head = NULL;
 #define NOTYPE build_type_expr((struct location){0, 0, 0, 0}, build_tid(NULL, MOD_MONOMORPH))
 
 int n_errors = 0;
+
+/* values and lambda are not reserved words but forms recognised at the head
+ * of a list, so that they remain valid names for variables and functions */
+static int is_lambda(const char *symbol) {
+  return strcmp(symbol, "lambda") == 0;
+}
+
+/* (values T...), (vector T) or (hash-table K V) */
+static struct tree *build_type_form(struct location loc, char *name,
+                                    struct tree *types) {
+  if (strcmp(name, "values") == 0) {
+    free(name);
+    return build_values_type(loc, types);
+  }
+  struct tree *key = NULL;
+  if (types->next != NULL) {
+    key = types;
+    types = types->next;
+    key->next = NULL;
+  }
+  if (types->next != NULL) {
+    errorat("too many types for type constructor '%s'", lcc_current_file,
+            loc.first_line, loc.first_column, name);
+    destroy_tree(types->next);
+    types->next = NULL;
+  }
+  return build_container_type(loc, name, key, types);
+}
 %}
 
 %locations
@@ -24,6 +60,8 @@ int n_errors = 0;
 %define parse.error detailed
 %code requires { #include "tree.h" }
 %glr-parser
+// the exp and the type (lambda ...), chosen by their head symbol
+%expect 2
 
 %union {
   int ival;
@@ -47,11 +85,11 @@ int n_errors = 0;
 
 %token CONST VOLATILE RESTRICT ATOMIC
 %token IF WHILE DOWHILE CASE COND FOR LET
-%token DEFUN DEFMETHOD DEFGENERIC DEFVAR
+%token DEFUN DEFMETHOD DEFGENERIC DEFVAR DEFSTRUCT DEFCORO
 %token DECLARE DECLAIM PROCLAIM TYPE
 %token T NIL
 %token INCLUDE
-%token ADDR AREF INC DEC CAST
+%token ADDR AREF SETF INC DEC CAST WITH_ARENA ALLOC MULTIPLE_VALUE_BIND
 %token LT GT LE GE AND OR NOT
 %token OPTIONAL KEY REST AUX
 
@@ -64,14 +102,16 @@ int n_errors = 0;
 
 %type <ast> include
 %type <ast> defvar fndecl //arglist arglist_fields
+%type <ast> defstruct struct_options struct_fields
 %type <ast> let_stmt let_arg_list
 %type <ast> control_stmt while_stmt do_while_stmt for_stmt for_assign_body if_stmt
 %type <ast> cond_stmt cond_body case_stmt case_body
 %type <ast> lambda_list lambda_rest_arg lambda_regular_args lambda_key_args lambda_aux_args lambda_optional_args
 %type <ast> lambda_optional_body lambda_key_body lambda_aux_body
 
-%type <ast> declare_expr declaim_expr declarations symbol_list string_list
-%type <ast> type
+%type <ast> declare_expr declaim_expr declarations attribute symbol_list string_list
+%type <ast> type type_list closure_args
+%type <ival> ranks
 %type <symbol> typename
 %type <tid> modified_typename
 %%
@@ -82,10 +122,12 @@ input:
 | fndecl input { head = append_tree(head, $1); }
 | include input { head = append_tree(head, $1); }
 | declaim_expr input { head = append_tree(head, $1); }
+| defstruct input { head = append_tree(head, $1); }
 ;
 
 exp:
    INTEGER { $$ = build_int_cst(@1, $1); }
+| FLOAT { $$ = build_float_cst(@1, $1); }
 | SYMBOL { $$ = build_var_ref(@1, $1); }
 | STRING { $$ = build_string_cst(@1, $1); }
 | CHAR   { $$ = build_char_cst(@1, $1); }
@@ -100,7 +142,7 @@ exp_list:
 condition: exp { $$ = $1; };
 
 call:
-  '(' SYMBOL call_body ')' { $$ = build_fn_call(@1, $2, $3); }
+  '(' SYMBOL call_body ')' { $$ = note_atomic_call(build_fn_call(@1, $2, $3)); }
 | '(' '+' exp_list ')' { $$ = build_binop(@1, '+', $3); }
 | '(' '-' exp_list ')' { $$ = build_binop(@1, '-', $3); }
 | '(' '*' exp_list ')' { $$ = build_binop(@1, '*', $3); }
@@ -115,9 +157,13 @@ call:
 | '(' NOT exp ')' { $$ = build_compare(@1, OP_NOT, $3, NULL); }
 | '(' AREF exp body ')' { $$ = build_aref(@1, $3, $4); }
 | '(' ADDR exp ')' { $$ = build_addr(@1, $3); }
+| '(' SETF exp exp ')' { $$ = build_set_expr(@1, $3, $4, 0); }
 | '(' INC exp ')' { $$ = build_inc(@1, $3); }
 | '(' DEC exp ')' { $$ = build_dec(@1, $3); }
 | '(' CAST type exp ')' { $$ = build_cast(@1, $3, $4); }
+| '(' ALLOC exp type ')' { $$ = build_alloc(@1, $3, $4, NULL); }
+| '(' ALLOC exp type exp ')' { $$ = build_alloc(@1, $3, $4, $5); }
+| '(' SYMBOL %?{ is_lambda($2) } lambda_list ':' type body ')' { free($2); $$ = build_lambda(@1, $4, $6, $7); }
 ;
 
 call_body:
@@ -130,12 +176,26 @@ declaim_expr: '(' DECLAIM declarations ')' { $$ = $3; };
 
 fndecl:
   '(' DEFUN SYMBOL lambda_list body ')' { $$ = build_fn(@1, $3, NOTYPE, $4, $5); }
+| '(' DEFCORO SYMBOL lambda_list body ')' { $$ = build_coro(@1, $3, NOTYPE, $4, $5); }
 ;
 defvar:
   '(' DEFVAR SYMBOL ':' type exp ')' { $$ = build_var(@1, VAR_DECL, $3, $5, $6); }
 | '(' DEFVAR SYMBOL ':' type ')' { $$ = build_var(@1, VAR_DECL, $3, $5, NULL); }
 ;
 
+defstruct:
+  '(' DEFSTRUCT SYMBOL struct_fields ')' { $$ = build_struct(@1, $3, NULL, $4); }
+| '(' DEFSTRUCT '(' SYMBOL struct_options ')' struct_fields ')' { $$ = build_struct(@1, $4, $5, $7); }
+;
+struct_options:
+  %empty { $$ = NULL; }
+| attribute struct_options { $$ = append_tree($2, $1); }
+;
+struct_fields:
+  '(' SYMBOL ':' type ')' { $$ = build_var(@1, VAR_DECL, $2, $4, NULL); }
+| '(' SYMBOL ':' type ')' struct_fields { $$ = append_tree($6, build_var(@1, VAR_DECL, $2, $4, NULL)); }
+;
+
 include: '(' INCLUDE string_list ')' { $$ = build_include(@1, $3); };
 
 
@@ -165,6 +225,28 @@ type: modified_typename { $$ = build_type_expr(@1, $1); }
 | '*' type { $$ = $2; add_type_ptr($$, SINGLE_PTR, 0); }
 | '[' ']' type { $$ = $3; add_type_ptr($$, MULTI_PTR, 0);}
 | '[' INTEGER ']' type { $$ = $4; add_type_ptr($$, SIZED_PTR, $2); }
+| '[' ranks ']' type { $$ = $4; add_type_ptr($$, STRIDED_PTR, $2); }
+| '(' SYMBOL typename INTEGER ')' {
+  if(strcmp($2, "vec") != 0) {
+    errorat("unknown type constructor '%s'", lcc_current_file, @2.first_line, @2.first_column, $2);
+  }
+  free($2);
+  $$ = build_vector_type(@1, $3, $4);
+}
+| '(' SYMBOL type_list ')' { $$ = build_type_form(@1, $2, $3); }
+| '(' SYMBOL %?{ is_lambda($2) } '(' closure_args ')' type ')' { free($2); $$ = build_closure_type(@1, $5, $7); }
+;
+closure_args:
+  %empty { $$ = NULL; }
+| type_list { $$ = $1; }
+;
+type_list:
+  type { $$ = $1; }
+| type type_list { $$ = append_tree($2, $1); }
+;
+
+ranks: ',' { $$ = 2; }
+| ranks ',' { $$ = $1 + 1; }
 ;
 
 typename: SYMBOL { $$ = $1; }
@@ -214,7 +296,10 @@ while_stmt: '(' WHILE condition body ')' {$$ = build_while_stmt(@1, WHILE_STMT,
 
 do_while_stmt: '(' DOWHILE condition body ')' {$$ = build_while_stmt(@1, DOWHILE_STMT, $3, $4);};
 
-for_stmt: '(' FOR '(' for_assign_body ')' condition exp body ')' { $$ = build_for_stmt(@1, NOTYPE, $4, $6, $7, $8);};
+for_stmt: '(' FOR '(' for_assign_body ')' condition exp body ')' { $$ = build_for_stmt(@1, NOTYPE, $4, $6, $7, $8);}
+| '(' FOR '(' SYMBOL ':' exp ')' body ')' { $$ = build_foreach_stmt(@1, build_var(@4, VAR_DECL, $4, NOTYPE, NULL), $6, $8); }
+| '(' FOR '(' SYMBOL SYMBOL ':' exp ')' body ')' { $$ = build_foreach_stmt(@1, append_tree(build_var(@5, VAR_DECL, $5, NOTYPE, NULL), build_var(@4, VAR_DECL, $4, NOTYPE, NULL)), $7, $9); }
+;
 for_assign_body:
                %empty { $$ = NULL; }
 | SYMBOL for_assign_body { $$ = append_tree($2, build_var(@1, VAR_DECL, $1, NOTYPE, NULL));}
@@ -228,7 +313,10 @@ control_stmt: if_stmt {$$ = $1;}
 | do_while_stmt {$$ = $1;}
 | for_stmt{$$ = $1;};
 
-let_stmt: '(' LET '(' let_arg_list ')' body ')' {$$ = build_let_stmt(@1, $4, $6);};
+let_stmt: '(' LET '(' let_arg_list ')' body ')' {$$ = build_let_stmt(@1, $4, $6);}
+| '(' WITH_ARENA '(' SYMBOL exp ')' body ')' { $$ = build_with_arena(@1, $4, $5, $7); }
+| '(' MULTIPLE_VALUE_BIND '(' symbol_list ')' exp body ')' { $$ = build_values_bind(@1, $4, $6, $7); }
+;
 let_arg_list:
   '(' SYMBOL exp ')' { $$ = build_var(@1, VAR_DECL, $2, NOTYPE, $3);  }
 | '(' SYMBOL exp ')' let_arg_list { $$ = append_tree($5, build_var(@1, VAR_DECL, $2, NOTYPE, $3)); }
@@ -253,7 +341,7 @@ lambda_optional_body:
 
 lambda_rest_arg:
   %empty { $$ = NULL; }
-| REST SYMBOL { $$ = build_var_ref(@2, $2); }
+| REST SYMBOL { $$ = build_var(@2, PARM_DECL, $2, NOTYPE, NULL); }
 ;
 
 
@@ -283,6 +371,13 @@ declare_expr: '(' DECLARE declarations ')' { $$ = $3; };
 declarations:
   '(' TYPE type symbol_list ')' { $$ = build_type_decl(@1, $3, $4); }
 | '(' TYPE type symbol_list ')' declarations { $$ = append_tree($6, build_type_decl(@1, $3, $4)); }
+| attribute { $$ = $1; }
+| attribute declarations { $$ = append_tree($2, $1); }
+;
+
+attribute:
+  '(' SYMBOL call_body ')' { $$ = build_attr_decl(@1, $2, $3); }
+| '(' CONST call_body ')' { $$ = build_attr_decl(@1, strdup("const"), $3); }
 ;
 
 symbol_list:
@@ -306,9 +401,55 @@ LCCLTYPE* llocp = locp;
 
 extern FILE *c_in;
 
+#undef lcclex
+static int timed_lex(void *lval, void *lloc) {
+  if(!timers_enabled()) return lcclex(lval, lloc);
+  double start = timer_now();
+  int token = lcclex(lval, lloc);
+  timer_account("lex", start, 1);
+  return token;
+}
+
+#define PHASE(name, ...) do { timer_begin(name); __VA_ARGS__; timer_end(); } while(0)
+
 int main(int argc, char *const argv[]) {
+  bool emit_asm = false;
+  bool emit_ir = false;
   argc--;
   argv++;
+  for(; argc > 0 && argv[0][0] == '-' && argv[0][1] != '\0'; argc--, argv++) {
+    if(strcmp(argv[0], "-S") == 0) emit_asm = true;
+    else if(strcmp(argv[0], "-fir") == 0) emit_ir = true;
+    else if(strcmp(argv[0], "-fdump-ir") == 0) ir_dump_enabled = true;
+    else if(strcmp(argv[0], "-g") == 0) line_directives = true;
+    else if(strcmp(argv[0], "-ftime-report") == 0) time_report = true;
+    else if(strcmp(argv[0], "--mem-report") == 0) mem_report = true;
+    else if(strcmp(argv[0], "-ftime-trace") == 0) time_trace = "";
+    else if(strncmp(argv[0], "-ftime-trace=", 13) == 0) time_trace = &argv[0][13];
+    else if(strcmp(argv[0], "--symbol-map") == 0) symbol_map = "";
+    else if(strncmp(argv[0], "--symbol-map=", 13) == 0) symbol_map = &argv[0][13];
+    else if(strcmp(argv[0], "--profile-generate") == 0) profile_generate = "";
+    else if(strncmp(argv[0], "--profile-generate=", 19) == 0) profile_generate = &argv[0][19];
+    else if(strcmp(argv[0], "--instrument") == 0) instrument_output = "";
+    else if(strncmp(argv[0], "--instrument=", 13) == 0) instrument_output = &argv[0][13];
+    else if(strcmp(argv[0], "--profile-use") == 0) profile_use = "";
+    else if(strncmp(argv[0], "--profile-use=", 14) == 0) profile_use = &argv[0][14];
+    else if(strncmp(argv[0], "-fno-", 5) == 0 && set_pass_enabled(&argv[0][5], false));
+    else if(strncmp(argv[0], "-f", 2) == 0 && set_pass_enabled(&argv[0][2], true));
+    else {
+      error("unknown option '%s'", argv[0]);
+      return 1;
+    }
+  }
+  if(emit_asm && profile_generate != NULL) {
+    error("--profile-generate is not supported by the asm backend");
+    return 1;
+  }
+  if(emit_asm && instrument_output != NULL) {
+    error("--instrument is not supported by the asm backend");
+    return 1;
+  }
+  if(line_directives && symbol_map == NULL) symbol_map = "";
   if(argc > 0) {
     lcc_current_file = argv[0];
     fprintf(stderr, "Open %s\n", argv[0]);
@@ -317,19 +458,56 @@ int main(int argc, char *const argv[]) {
   else lccin = stdin;
 
   n_errors = 0;
-  int ret = lccparse();
+  timers_start();
+  int ret;
+  PHASE("parse", ret = lccparse());
 
 
   //head = reverse_tree(head);
-  resolve_pass(head);
+  PHASE("resolve", resolve_pass(head));
+  timer_begin("lower");
+  if(n_errors == 0) PHASE("branch-hints", lower_branch_hints(head));
+  if(n_errors == 0) PHASE("closures", head = lower_closures(head));
+  if(n_errors == 0) PHASE("tasks", head = lower_tasks(head));
+  if(n_errors == 0) PHASE("values", head = lower_values(head));
+  if(n_errors == 0) PHASE("containers", head = lower_containers(head));
+  if(n_errors == 0) PHASE("structs", lower_structs(head));
+  if(n_errors == 0) PHASE("arrays", lower_arrays(head));
+  if(n_errors == 0) PHASE("vectors", lower_vectors(head));
+  if(n_errors == 0) PHASE("atomics", lower_atomics(head));
+  if(n_errors == 0) PHASE("coroutines", head = lower_coroutines(head));
+  timer_end();
 
   if(n_errors > 0) {
     error("compiler generated %d error(s)", n_errors);
     destroy_tree(head);
     return 1;
   }
-  print_tree(head);
-  destroy_tree(head);
+  PHASE("optimize", optimize_tree(head));
+  PHASE("instrument", instrument_functions(head));
+  PHASE("symbol-map", write_symbol_map(head));
+  timer_begin("runtimes");
+  print_instrument_runtime(emit_asm);
+  print_profile_runtime(emit_asm);
+  print_coro_runtime(emit_asm);
+  print_task_runtime(emit_asm);
+  print_closure_header(emit_asm);
+  print_atomic_header(emit_asm);
+  print_struct_header(emit_asm);
+  print_container_header(emit_asm);
+  print_arena_runtime(emit_asm);
+  print_bounds_check_helper(emit_asm);
+  print_vector_helpers(emit_asm);
+  timer_end();
+  if(emit_asm) PHASE("emit", print_asm(head));
+  else if(emit_ir) PHASE("emit", print_ir(head));
+  else PHASE("emit", print_tree(head));
+  PHASE("destroy", destroy_tree(head));
+  // the backends report what they cannot emit
+  if(n_errors > 0) {
+    error("compiler generated %d error(s)", n_errors);
+    return 1;
+  }
 
   /*if(argc > 1) {
     c_main(argv[1]);
@@ -0,0 +1,519 @@
+#include "debug.h"
+#include "opt.h"
+#include "tree.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hashmap.h"
+
+/*
+ * Loop invariant code motion on the tree. For every for/while/do-while loop,
+ * innermost first, the largest subexpressions that compute the same value on
+ * every iteration are moved into temporaries of a let wrapped around the loop:
+ *
+ *   (for ((i 0)) (< i (strlen s)) (inc i) ...)
+ *   => (let ((_licm0 (strlen s))) (for ((i 0)) (< i _licm0) (inc i) ...))
+ *
+ * A variable is loop carried if it is declared in the loop or written by a
+ * set/inc/dec inside it. Variables that live in memory (globals and locals
+ * whose address is taken) are only invariant if the loop has no stores through
+ * memory and no calls to functions that are not pure or const. Loads and
+ * divisions by non-constants are never hoisted since the loop may not run.
+ *
+ * Pure functions read memory through their arguments and may fault, as
+ * strlen does on NULL. A call to one is only hoisted from code that runs
+ * whenever the loop is reached: the first test of the loop, or the body of
+ * a loop known to run at least once, outside of if/cond/case, the right of
+ * and/or, nested loop bodies and anything after a return.
+ */
+
+extern const char *lcc_current_file;
+
+struct licm_fn {
+  struct hashmap_s locals;
+  struct hashmap_s addr_taken;
+  struct hashmap_s *globals;
+};
+
+struct licm_loop {
+  struct licm_fn *fn;
+  struct hashmap_s variant;
+  bool clobbers;
+  struct tree *temps, *temps_end;
+  int n_hoisted;
+  int guarded; // > 0 in code that may not run when the loop is reached
+};
+
+static int n_temps = 0;
+
+static bool is_var_ref(struct tree *t) {
+  return t != NULL && t->type == REFERENCE_EXPR &&
+         t->reference_expr.type == VAR_REF;
+}
+
+static bool in_map(struct hashmap_s *map, char *name) {
+  return hashmap_get(map, name, strlen(name)) != NULL;
+}
+
+/* a local that is never addressed can only change through its own name */
+static bool in_register(struct licm_fn *fn, char *name) {
+  return in_map(&fn->locals, name) && !in_map(&fn->addr_taken, name) &&
+         !in_map(fn->globals, name);
+}
+
+static bool collect_locals(struct tree *t, void *data) {
+  struct licm_fn *fn = data;
+  switch (t->type) {
+  case VAR_DECL:
+  case PARM_DECL:
+    hashmap_put(&fn->locals, t->var_decl.name, strlen(t->var_decl.name), t);
+    break;
+  case ADDR_EXPR:
+    if (is_var_ref(t->ref_expr.expr))
+      hashmap_put(&fn->addr_taken, t->ref_expr.expr->reference_expr.symbol,
+                  strlen(t->ref_expr.expr->reference_expr.symbol), t);
+    break;
+  case FIELD_EXPR:
+    // a structure whose fields are written changes without a set of its name
+    if (!t->field_expr.indirect && is_var_ref(t->field_expr.expr))
+      hashmap_put(&fn->addr_taken, t->field_expr.expr->reference_expr.symbol,
+                  strlen(t->field_expr.expr->reference_expr.symbol), t);
+    break;
+  default:
+    break;
+  }
+  return true;
+}
+
+static bool scan_loop(struct tree *t, void *data) {
+  struct licm_loop *loop = data;
+  switch (t->type) {
+  case VAR_DECL:
+  case PARM_DECL:
+    hashmap_put(&loop->variant, t->var_decl.name, strlen(t->var_decl.name),
+                t);
+    break;
+  case SET_EXPR:
+    if (!is_var_ref(t->set_expr.var)) {
+      loop->clobbers = true;
+      break;
+    }
+    char *name = t->set_expr.var->reference_expr.symbol;
+    hashmap_put(&loop->variant, name, strlen(name), t);
+    if (!in_register(loop->fn, name))
+      loop->clobbers = true;
+    break;
+  case REFERENCE_EXPR:
+    if (t->reference_expr.type == FN_CALL &&
+        strcmp(t->reference_expr.call.name, "return") != 0 &&
+        get_fn_attr(t->reference_expr.call.name) == FN_ATTR_NONE)
+      loop->clobbers = true;
+    break;
+  default:
+    break;
+  }
+  return true;
+}
+
+struct call_search {
+  bool returns; // look for a return instead of a pure call
+  bool found;
+};
+
+static bool find_call(struct tree *t, void *data) {
+  struct call_search *search = data;
+  if (t->type == REFERENCE_EXPR && t->reference_expr.type == FN_CALL &&
+      (search->returns
+           ? strcmp(t->reference_expr.call.name, "return") == 0
+           : get_fn_attr(t->reference_expr.call.name) == FN_ATTR_PURE))
+    search->found = true;
+  return !search->found;
+}
+
+/* pure calls read memory through their arguments, which may be the NULL
+ * pointer the surrounding code checked for */
+static bool may_trap(struct tree *t) {
+  struct call_search search = {false, false};
+  walk_tree_node(t, find_call, &search);
+  return search.found;
+}
+
+static bool may_return(struct tree *chain) {
+  struct call_search search = {true, false};
+  walk_tree(chain, find_call, &search);
+  return search.found;
+}
+
+static bool constant_int(struct tree *t, struct tree *vars, int *value) {
+  if (t->type != REFERENCE_EXPR)
+    return false;
+  if (t->reference_expr.type == INTEGER_CST) {
+    *value = t->reference_expr.ival;
+    return true;
+  }
+  if (t->reference_expr.type != VAR_REF)
+    return false;
+  for (struct tree *var = vars; var != NULL; var = var->next) {
+    if (strcmp(var->var_decl.name, t->reference_expr.symbol) == 0)
+      return var->var_decl.value != NULL &&
+             constant_int(var->var_decl.value, NULL, value);
+  }
+  return false;
+}
+
+/* (while t ...) and (for ((i 0)) (< i 10) ...) run their body at least once
+ * when they are reached, loops bounded by variables may not run at all */
+static bool enters_body(struct tree *t) {
+  if (t->type == DOWHILE_STMT)
+    return true;
+  struct tree *cond = t->type == FOR_STMT ? t->for_stmt.condition
+                                          : t->while_stmt.condition;
+  struct tree *vars = t->type == FOR_STMT ? t->for_stmt.vars : NULL;
+  if (cond == NULL)
+    return t->type == FOR_STMT;
+  if (cond->type == REFERENCE_EXPR && cond->reference_expr.type == BOOL_CST)
+    return cond->reference_expr.bval;
+  int lhs, rhs;
+  if (cond->type != COMPARE_EXPR || cond->compare_expr.rhs == NULL ||
+      !constant_int(cond->compare_expr.lhs, vars, &lhs) ||
+      !constant_int(cond->compare_expr.rhs, vars, &rhs))
+    return false;
+  switch (cond->compare_expr.op) {
+  case OP_LT:
+    return lhs < rhs;
+  case OP_GT:
+    return lhs > rhs;
+  case OP_LE:
+    return lhs <= rhs;
+  case OP_GE:
+    return lhs >= rhs;
+  case OP_EQL:
+    return lhs == rhs;
+  default:
+    return false;
+  }
+}
+
+static bool nonzero_constant(struct tree *t) {
+  if (t->type != REFERENCE_EXPR)
+    return false;
+  switch (t->reference_expr.type) {
+  case INTEGER_CST:
+    return t->reference_expr.ival != 0;
+  case FLOAT_CST:
+    return t->reference_expr.fval != 0;
+  default:
+    return false;
+  }
+}
+
+static bool invariant(struct tree *t, struct licm_loop *loop) {
+  switch (t->type) {
+  case REFERENCE_EXPR:
+    switch (t->reference_expr.type) {
+    case VAR_REF:
+      if (in_map(&loop->variant, t->reference_expr.symbol))
+        return false;
+      return !loop->clobbers ||
+             in_register(loop->fn, t->reference_expr.symbol);
+    case FN_CALL:
+      switch (get_fn_attr(t->reference_expr.call.name)) {
+      case FN_ATTR_CONST:
+        break;
+      case FN_ATTR_PURE:
+        if (loop->clobbers)
+          return false;
+        break;
+      default:
+        return false;
+      }
+      for (struct tree *arg = t->reference_expr.call.args; arg != NULL;
+           arg = arg->next) {
+        if (!invariant(arg, loop))
+          return false;
+      }
+      return true;
+    default:
+      return true;
+    }
+  case BINOP_EXPR:
+    for (struct tree *body = t->binop_expr.body; body != NULL;
+         body = body->next) {
+      if (!invariant(body, loop))
+        return false;
+      if (t->binop_expr.op == '/' && body != t->binop_expr.body &&
+          !nonzero_constant(body))
+        return false;
+    }
+    return true;
+  case COMPARE_EXPR:
+    return invariant(t->compare_expr.lhs, loop) &&
+           (t->compare_expr.rhs == NULL ||
+            invariant(t->compare_expr.rhs, loop));
+  case CAST_EXPR:
+    return invariant(t->cast_expr.expr, loop);
+  default:
+    return false;
+  }
+}
+
+/* variables and constants are as cheap as the temporary that would hold them */
+static bool worth_hoisting(struct tree *t) {
+  switch (t->type) {
+  case BINOP_EXPR:
+  case COMPARE_EXPR:
+    return true;
+  case CAST_EXPR:
+    return worth_hoisting(t->cast_expr.expr);
+  case REFERENCE_EXPR:
+    return t->reference_expr.type == FN_CALL;
+  default:
+    return false;
+  }
+}
+
+static void hoist(struct tree **slot, struct licm_loop *loop, bool value);
+static void hoist_chain(struct tree **chain, struct licm_loop *loop,
+                        bool value) {
+  int guarded = loop->guarded;
+  for (struct tree **slot = chain; *slot != NULL; slot = &(*slot)->next) {
+    hoist(slot, loop, value);
+    // what follows a return only runs when it was not taken
+    if (!value && may_return(*slot))
+      loop->guarded = guarded + 1;
+  }
+  loop->guarded = guarded;
+}
+
+/* a value, or a chain of statements, that may not run whenever the loop is
+ * reached if guarded */
+static void hoist_guarded(struct tree **slot, struct licm_loop *loop,
+                          bool value, bool guarded) {
+  loop->guarded += guarded;
+  if (value)
+    hoist(slot, loop, value);
+  else
+    hoist_chain(slot, loop, value);
+  loop->guarded -= guarded;
+}
+
+static void hoist_lvalue(struct tree *t, struct licm_loop *loop) {
+  if (t->type != AREF_EXPR)
+    return;
+  hoist(&t->ref_expr.expr, loop, true);
+  hoist_chain(&t->ref_expr.indices, loop, true);
+}
+
+static void hoist(struct tree **slot, struct licm_loop *loop, bool value) {
+  struct tree *t = *slot;
+  if (t == NULL)
+    return;
+  if (value && worth_hoisting(t) && invariant(t, loop) &&
+      (loop->guarded == 0 || !may_trap(t))) {
+    char name[32];
+    snprintf(name, sizeof(name), "_licm%d", n_temps++);
+    struct tree *ref = build_var_ref(t->loc, strdup(name));
+    ref->next = t->next;
+    t->next = NULL;
+    *slot = ref;
+
+    struct tree *temp = build_var(
+        t->loc, VAR_DECL, strdup(name),
+        build_type_expr(t->loc, build_tid(NULL, MOD_MONOMORPH)), t);
+    if (loop->temps_end == NULL)
+      loop->temps = loop->temps_end = temp;
+    else
+      loop->temps_end = loop->temps_end->next = temp;
+    loop->n_hoisted++;
+    return;
+  }
+
+  switch (t->type) {
+  case VAR_DECL:
+    hoist(&t->var_decl.value, loop, true);
+    break;
+  case SET_EXPR:
+    hoist_lvalue(t->set_expr.var, loop);
+    hoist(&t->set_expr.value, loop, true);
+    break;
+  case AREF_EXPR:
+    hoist_lvalue(t, loop);
+    break;
+  case ADDR_EXPR:
+    hoist_lvalue(t->ref_expr.expr, loop);
+    break;
+  case CAST_EXPR:
+    hoist(&t->cast_expr.expr, loop, true);
+    break;
+  case LIST_EXPR:
+    hoist_chain(&t->list_expr.elems, loop, true);
+    break;
+  case BINOP_EXPR:
+    hoist_chain(&t->binop_expr.body, loop, true);
+    break;
+  case COMPARE_EXPR:
+    hoist(&t->compare_expr.lhs, loop, true);
+    hoist_guarded(&t->compare_expr.rhs, loop, true,
+                  t->compare_expr.op == OP_AND || t->compare_expr.op == OP_OR);
+    break;
+  case REFERENCE_EXPR:
+    if (t->reference_expr.type == FN_CALL)
+      hoist_chain(&t->reference_expr.call.args, loop, true);
+    break;
+  case LET_STMT:
+    hoist_chain(&t->let_stmt.vars, loop, false);
+    hoist_chain(&t->let_stmt.body, loop, false);
+    break;
+  case IF_STMT:
+    hoist(&t->if_else_stmt.condition, loop, true);
+    hoist_guarded(&t->if_else_stmt.if_block, loop, false, true);
+    hoist_guarded(&t->if_else_stmt.else_block, loop, false, true);
+    break;
+  case COND_STMT:
+    // only the first test always runs
+    for (struct tree *expr = t->cond_stmt.exprs; expr != NULL;
+         expr = expr->next) {
+      hoist_guarded(&expr->cond_expr.condition, loop, true,
+                    expr != t->cond_stmt.exprs);
+      hoist_guarded(&expr->cond_expr.body, loop, false, true);
+    }
+    break;
+  case CASE_STMT:
+    hoist(&t->case_stmt.expr, loop, true);
+    for (struct tree *c = t->case_stmt.cases; c != NULL; c = c->next)
+      hoist_guarded(&c->case_expr.body, loop, false, true);
+    break;
+  case WHILE_STMT:
+    hoist(&t->while_stmt.condition, loop, true);
+    hoist_guarded(&t->while_stmt.body, loop, false, true);
+    break;
+  case DOWHILE_STMT:
+    hoist_chain(&t->while_stmt.body, loop, false);
+    hoist_guarded(&t->while_stmt.condition, loop, true,
+                  may_return(t->while_stmt.body));
+    break;
+  case FOR_STMT:
+    hoist_chain(&t->for_stmt.vars, loop, false);
+    hoist(&t->for_stmt.condition, loop, true);
+    hoist_guarded(&t->for_stmt.loop_eval, loop, false, true);
+    hoist_guarded(&t->for_stmt.body, loop, false, true);
+    break;
+  default:
+    break;
+  }
+}
+
+/* the loop node becomes the let so the enclosing chain stays intact */
+static void wrap_in_let(struct tree *t, struct tree *vars) {
+  struct tree *copy = alloc_tree(1);
+  memcpy(copy, t, sizeof(struct tree));
+  copy->next = NULL;
+
+  memset(&t->let_stmt, 0, sizeof(t->let_stmt));
+  t->type = LET_STMT;
+  t->let_stmt.vars = vars;
+  t->let_stmt.body = copy;
+}
+
+static void licm_loop(struct tree *t, struct licm_fn *fn) {
+  struct licm_loop loop = {0};
+  loop.fn = fn;
+  if (hashmap_create(64, &loop.variant) != 0) {
+    error("Failed to create hashmap.");
+    return;
+  }
+  walk_tree_node(t, scan_loop, &loop);
+
+  // the first test runs whenever the loop is reached, the body only if the
+  // loop is known to run once and nothing before it returned
+  bool enters = enters_body(t);
+  if (t->type == FOR_STMT) {
+    // the initial values are computed once already
+    hoist(&t->for_stmt.condition, &loop, true);
+    hoist_guarded(&t->for_stmt.body, &loop, false, !enters);
+    hoist_guarded(&t->for_stmt.loop_eval, &loop, false,
+                  !enters || may_return(t->for_stmt.body));
+  } else if (t->type == WHILE_STMT) {
+    hoist(&t->while_stmt.condition, &loop, true);
+    hoist_guarded(&t->while_stmt.body, &loop, false, !enters);
+  } else {
+    hoist_chain(&t->while_stmt.body, &loop, false);
+    hoist_guarded(&t->while_stmt.condition, &loop, true,
+                  may_return(t->while_stmt.body));
+  }
+  hashmap_destroy(&loop.variant);
+
+  if (loop.temps == NULL)
+    return;
+  info("%s:%d: hoisted %d loop invariant expression(s)", lcc_current_file,
+       t->loc.first_line, loop.n_hoisted);
+  wrap_in_let(t, loop.temps);
+}
+
+/* inner loops are visited first so their temporaries can move further out */
+static void licm_stmt(struct tree *t, struct licm_fn *fn) {
+  for (; t != NULL; t = t->next) {
+    switch (t->type) {
+    case LET_STMT:
+      licm_stmt(t->let_stmt.body, fn);
+      break;
+    case IF_STMT:
+      licm_stmt(t->if_else_stmt.if_block, fn);
+      licm_stmt(t->if_else_stmt.else_block, fn);
+      break;
+    case COND_STMT:
+      for (struct tree *expr = t->cond_stmt.exprs; expr != NULL;
+           expr = expr->next)
+        licm_stmt(expr->cond_expr.body, fn);
+      break;
+    case CASE_STMT:
+      for (struct tree *c = t->case_stmt.cases; c != NULL; c = c->next)
+        licm_stmt(c->case_expr.body, fn);
+      break;
+    case WHILE_STMT:
+    case DOWHILE_STMT:
+      licm_stmt(t->while_stmt.body, fn);
+      licm_loop(t, fn);
+      break;
+    case FOR_STMT:
+      licm_stmt(t->for_stmt.body, fn);
+      licm_loop(t, fn);
+      break;
+    default:
+      break;
+    }
+  }
+}
+
+void licm_pass(struct tree *t) {
+  struct hashmap_s globals;
+  if (hashmap_create(128, &globals) != 0) {
+    error("Failed to create hashmap.");
+    return;
+  }
+  for (struct tree *head = t; head != NULL; head = head->next) {
+    if (head->type == VAR_DECL)
+      hashmap_put(&globals, head->var_decl.name, strlen(head->var_decl.name),
+                  head);
+  }
+
+  for (struct tree *head = t; head != NULL; head = head->next) {
+    if (head->type != FN_DECL)
+      continue;
+    struct licm_fn fn = {.globals = &globals};
+    if (hashmap_create(64, &fn.locals) != 0 ||
+        hashmap_create(16, &fn.addr_taken) != 0) {
+      error("Failed to create hashmap.");
+      break;
+    }
+    walk_tree_node(head, collect_locals, &fn);
+    licm_stmt(head->fn_decl.body, &fn);
+    hashmap_destroy(&fn.locals);
+    hashmap_destroy(&fn.addr_taken);
+  }
+  hashmap_destroy(&globals);
+}
@@ -0,0 +1,127 @@
+#include "mem.h"
+#include "debug.h"
+#include "tree.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+/*
+ * Trees, type ids and type pointers are counted where they are allocated
+ * and freed, so their live bytes and peak are exact. A tree node is counted
+ * under its type when destroy_tree releases it, as the lowerings retype
+ * nodes in place; the strings a node owns are counted at the same time.
+ * Hash maps grow without telling, pass.c counts each table at its largest,
+ * when it is destroyed. Sizes are those of the structures, without the
+ * overhead of malloc.
+ */
+
+extern const char *lcc_current_file;
+
+bool mem_report = false;
+
+static const char *tree_type_names[] = {
+#define DEFTREECODE(NAME, STR, ...) #NAME,
+#include "tree.def"
+#undef DEFTREECODE
+};
+
+#define N_TREE_TYPES (sizeof(tree_type_names) / sizeof(tree_type_names[0]))
+
+static const char *kind_names[N_MEM_KINDS] = {
+    [MEM_TREE] = "tree nodes",       [MEM_TYPE_ID] = "type ids",
+    [MEM_TYPE_PTR] = "type pointers", [MEM_STRING] = "strings",
+    [MEM_HASHMAP] = "hash maps",
+};
+
+static struct {
+  long allocs, frees;
+  size_t bytes, live, peak;
+} kinds[N_MEM_KINDS];
+
+static long tree_types[N_TREE_TYPES];
+static size_t live = 0, peak = 0;
+
+void mem_count(enum mem_kind kind, size_t bytes, int n) {
+  if (n < 0) {
+    kinds[kind].frees++;
+    kinds[kind].live -= bytes;
+    if (kind <= MEM_TYPE_PTR)
+      live -= bytes;
+    return;
+  }
+  kinds[kind].allocs++;
+  kinds[kind].bytes += bytes;
+  if (kind > MEM_TYPE_PTR)
+    return;
+  kinds[kind].live += bytes;
+  if (kinds[kind].live > kinds[kind].peak)
+    kinds[kind].peak = kinds[kind].live;
+  live += bytes;
+  if (live > peak)
+    peak = live;
+}
+
+void mem_count_tree(enum tree_type type) {
+  if (mem_report && (size_t)type < N_TREE_TYPES)
+    tree_types[type]++;
+}
+
+void mem_sample(struct mem_sample *s) {
+  long pages = 0, resident = 0;
+  FILE *f = fopen("/proc/self/statm", "r");
+  if (f != NULL) {
+    if (fscanf(f, "%ld %ld", &pages, &resident) != 2)
+      resident = 0;
+    fclose(f);
+  }
+  s->rss_kb = resident * (sysconf(_SC_PAGESIZE) / 1024);
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  s->peak_kb = usage.ru_maxrss;
+  s->live = live;
+}
+
+static int by_count(const void *a, const void *b) {
+  long x = tree_types[*(const int *)a], y = tree_types[*(const int *)b];
+  return x < y ? 1 : x > y ? -1 : 0;
+}
+
+void print_mem_report(void) {
+  fprintf(stderr, "\nMemory report for %s\n%-16s %12s %12s %12s %12s\n",
+          lcc_current_file, "kind", "allocations", "freed", "total MB",
+          "peak MB");
+  for (int i = 0; i < N_MEM_KINDS; i++) {
+    fprintf(stderr, "%-16s %12ld ", kind_names[i], kinds[i].allocs);
+    if (i <= MEM_TYPE_PTR)
+      fprintf(stderr, "%12ld %12.3f %12.3f\n", kinds[i].frees,
+              kinds[i].bytes / 1048576.0, kinds[i].peak / 1048576.0);
+    else
+      fprintf(stderr, "%12s %12.3f %12s\n", "-", kinds[i].bytes / 1048576.0,
+              "-");
+  }
+  fprintf(stderr, "%-16s %12s %12s %12s %12.3f\n", "tracked", "", "", "",
+          peak / 1048576.0);
+
+  int order[N_TREE_TYPES];
+  long released = 0;
+  for (size_t i = 0; i < N_TREE_TYPES; i++) {
+    order[i] = i;
+    released += tree_types[i];
+  }
+  qsort(order, N_TREE_TYPES, sizeof(int), by_count);
+  fprintf(stderr, "\n%-24s %12s %12s %7s\n", "tree nodes by type", "count",
+          "MB", "share");
+  for (size_t i = 0; i < N_TREE_TYPES && tree_types[order[i]] > 0; i++) {
+    long count = tree_types[order[i]];
+    fprintf(stderr, "%-24s %12ld %12.3f %6.2f%%\n", tree_type_names[order[i]],
+            count, count * sizeof(struct tree) / 1048576.0,
+            100.0 * count / released);
+  }
+  if (kinds[MEM_TREE].allocs > released)
+    fprintf(stderr, "%-24s %12ld\n", "never released",
+            kinds[MEM_TREE].allocs - released);
+}
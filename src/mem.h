@@ -0,0 +1,43 @@
+#pragma once
+
+#include "tree.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * --mem-report: what the compiler allocates, by kind and by tree node type,
+ * and the resident set size after each phase. The counters cost a branch
+ * when the option is off.
+ */
+
+extern bool mem_report;
+
+enum mem_kind {
+  MEM_TREE,
+  MEM_TYPE_ID,
+  MEM_TYPE_PTR,
+  MEM_STRING,  // counted when the tree releases it
+  MEM_HASHMAP, // the tables of pass.c, at their largest
+  N_MEM_KINDS,
+};
+
+struct mem_sample {
+  long rss_kb, peak_kb;
+  size_t live; // bytes of trees, type ids and type pointers
+};
+
+void mem_count(enum mem_kind kind, size_t bytes, int n);
+void mem_count_tree(enum tree_type type);
+void mem_sample(struct mem_sample *s);
+void print_mem_report(void);
+
+static inline void mem_alloc(enum mem_kind kind, size_t bytes) {
+  if (mem_report)
+    mem_count(kind, bytes, 1);
+}
+
+static inline void mem_free(enum mem_kind kind, size_t bytes) {
+  if (mem_report)
+    mem_count(kind, bytes, -1);
+}
@@ -0,0 +1,139 @@
+#include "opt.h"
+#include "debug.h"
+#include "ir.h"
+#include "timer.h"
+#include "tree.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "hashmap.h"
+
+extern const char *lcc_current_file;
+
+/* functions from the C library that are known to be free of side effects */
+static const struct {
+  const char *name;
+  enum fn_attr attr;
+} builtin_attrs[] = {
+    {"abs", FN_ATTR_CONST},     {"labs", FN_ATTR_CONST},
+    {"fabs", FN_ATTR_CONST},    {"fabsf", FN_ATTR_CONST},
+    {"sqrt", FN_ATTR_CONST},    {"sqrtf", FN_ATTR_CONST},
+    {"sin", FN_ATTR_CONST},     {"cos", FN_ATTR_CONST},
+    {"tan", FN_ATTR_CONST},     {"exp", FN_ATTR_CONST},
+    {"log", FN_ATTR_CONST},     {"pow", FN_ATTR_CONST},
+    {"floor", FN_ATTR_CONST},   {"ceil", FN_ATTR_CONST},
+    {"strlen", FN_ATTR_PURE},   {"strcmp", FN_ATTR_PURE},
+    {"strncmp", FN_ATTR_PURE},  {"memcmp", FN_ATTR_PURE},
+};
+
+static struct hashmap_s fn_attrs;
+static bool fn_attrs_created = false;
+
+static enum fn_attr attr_of(const char *name) {
+  if (strcmp(name, "pure") == 0)
+    return FN_ATTR_PURE;
+  if (strcmp(name, "const") == 0)
+    return FN_ATTR_CONST;
+  return FN_ATTR_NONE;
+}
+
+static void put_fn_attr(char *name, enum fn_attr attr) {
+  hashmap_put(&fn_attrs, name, strlen(name), (void *)(uintptr_t)attr);
+}
+
+/* (declaim (pure f g)) names the functions, (declare (pure)) in a defun body
+ * applies to that function */
+static void collect_attr(struct tree *attr, struct tree *fn) {
+  enum fn_attr kind = attr_of(attr->attr_decl.name);
+  if (kind == FN_ATTR_NONE)
+    return;
+  if (attr->attr_decl.args == NULL) {
+    if (fn == NULL) {
+      errorat("'%s' without function names outside of a defun",
+              lcc_current_file, attr->loc.first_line, attr->loc.first_column,
+              attr->attr_decl.name);
+      return;
+    }
+    put_fn_attr(fn->fn_decl.name, kind);
+    return;
+  }
+  for (struct tree *arg = attr->attr_decl.args; arg != NULL; arg = arg->next) {
+    if (arg->type != REFERENCE_EXPR || arg->reference_expr.type != VAR_REF) {
+      errorat("expected function name", lcc_current_file, arg->loc.first_line,
+              arg->loc.first_column);
+      continue;
+    }
+    put_fn_attr(arg->reference_expr.symbol, kind);
+  }
+}
+
+static bool collect_body_attrs(struct tree *t, void *data) {
+  if (t->type == ATTR_DECL)
+    collect_attr(t, data);
+  return true;
+}
+
+void collect_fn_attrs(struct tree *t) {
+  if (!fn_attrs_created) {
+    if (hashmap_create(64, &fn_attrs) != 0) {
+      error("Failed to create hashmap.");
+      return;
+    }
+    fn_attrs_created = true;
+    for (size_t i = 0; i < sizeof(builtin_attrs) / sizeof(builtin_attrs[0]);
+         i++)
+      put_fn_attr((char *)builtin_attrs[i].name, builtin_attrs[i].attr);
+  }
+
+  for (struct tree *head = t; head != NULL; head = head->next) {
+    if (head->type == ATTR_DECL)
+      collect_attr(head, NULL);
+    else if (head->type == FN_DECL)
+      walk_tree(head->fn_decl.body, collect_body_attrs, head);
+  }
+}
+
+void destroy_fn_attrs(void) {
+  if (!fn_attrs_created)
+    return;
+  hashmap_destroy(&fn_attrs);
+  fn_attrs_created = false;
+}
+
+enum fn_attr get_fn_attr(const char *name) {
+  if (!fn_attrs_created)
+    return FN_ATTR_NONE;
+  return (enum fn_attr)(uintptr_t)hashmap_get(&fn_attrs, name, strlen(name));
+}
+
+static struct tree_pass tree_passes[] = {
+    {"fusion", fusion_pass, true},
+    {"licm", licm_pass, true},
+    // not an optimisation, checks are only inserted with -fbounds-check
+    {"bounds-check", bounds_check_pass, false},
+};
+
+bool set_pass_enabled(const char *name, bool enabled) {
+  for (size_t i = 0; i < sizeof(tree_passes) / sizeof(tree_passes[0]); i++) {
+    if (strcmp(tree_passes[i].name, name) == 0) {
+      tree_passes[i].enabled = enabled;
+      return true;
+    }
+  }
+  return ir_set_pass_enabled(name, enabled);
+}
+
+void optimize_tree(struct tree *t) {
+  collect_fn_attrs(t);
+  for (size_t i = 0; i < sizeof(tree_passes) / sizeof(tree_passes[0]); i++) {
+    if (!tree_passes[i].enabled)
+      continue;
+    timer_begin(tree_passes[i].name);
+    tree_passes[i].run(t);
+    timer_end();
+  }
+  destroy_fn_attrs();
+}
@@ -0,0 +1,96 @@
+#pragma once
+
+#include "tree.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Optimisation passes that rewrite the tree after resolve_pass, before any of
+ * the backends see it. Each pass can be toggled with -f<name>/-fno-<name>.
+ */
+
+struct tree_pass {
+  const char *name;
+  void (*run)(struct tree *t);
+  bool enabled;
+};
+
+enum fn_attr {
+  FN_ATTR_NONE,
+  FN_ATTR_PURE,  // no side effects, may read memory
+  FN_ATTR_CONST, // result depends on the arguments only
+};
+
+/* runs first, on the tree as written: --profile-generate counts the arms of
+ * if, cond and case, --profile-use lays them out by the counts, and
+ * (likely x) and (unlikely x) become __builtin_expect */
+extern const char *profile_generate;
+extern const char *profile_use;
+void lower_branch_hints(struct tree *t);
+void print_profile_runtime(bool emit_asm);
+
+/* always run before optimize_tree, lifts lambdas into functions, turns spawns
+ * into tasks, rewrites multiple values and container operations into
+ * structures, defstruct accessors into field references, [,]T arrays into
+ * pointers, and vector and atomic builtins into calls the C backends can
+ * print */
+struct tree *build_lambda(struct location loc, struct tree *lambda_list,
+                          struct tree *type, struct tree *body);
+struct tree *build_closure_type(struct location loc, struct tree *args,
+                                struct tree *type);
+struct tree *lower_closures(struct tree *t);
+void print_closure_header(bool emit_asm);
+struct tree *lower_tasks(struct tree *t);
+void print_task_runtime(bool emit_asm);
+struct tree *build_values_type(struct location loc, struct tree *types);
+struct tree *build_values_bind(struct location loc, struct tree *symbols,
+                               struct tree *expr, struct tree *body);
+struct tree *lower_values(struct tree *t);
+bool mangle_type(struct tree *type, char *buf, size_t size);
+struct tree *build_container_type(struct location loc, char *kind,
+                                  struct tree *key, struct tree *value);
+struct tree *lower_containers(struct tree *t);
+void print_container_header(bool emit_asm);
+struct tree *build_with_arena(struct location loc, char *name,
+                              struct tree *size, struct tree *body);
+struct tree *build_alloc(struct location loc, struct tree *arena,
+                         struct tree *type, struct tree *count);
+void print_arena_runtime(bool emit_asm);
+void lower_structs(struct tree *t);
+void print_struct_header(bool emit_asm);
+void lower_arrays(struct tree *t);
+void lower_vectors(struct tree *t);
+void print_vector_helpers(bool emit_asm);
+/* the parser passes every call through note_atomic_call, a program that
+ * calls no atomic builtin skips lower_atomics */
+struct tree *note_atomic_call(struct tree *call);
+void lower_atomics(struct tree *t);
+void print_atomic_header(bool emit_asm);
+
+/* runs last, after the other lowerings and before optimize_tree, which
+ * leaves the resulting state machines alone */
+struct tree *build_coro(struct location loc, char *name, struct tree *type,
+                        struct tree *lambda_list, struct tree *body);
+struct tree *lower_coroutines(struct tree *t);
+void print_coro_runtime(bool emit_asm);
+
+/* --instrument, after optimize_tree so that the passes see the program as
+ * written */
+extern const char *instrument_output;
+void instrument_functions(struct tree *t);
+void print_instrument_runtime(bool emit_asm);
+
+void fusion_pass(struct tree *t);
+void licm_pass(struct tree *t);
+void bounds_check_pass(struct tree *t);
+
+extern int bounds_checks_emitted;
+void print_bounds_check_helper(bool emit_asm);
+
+void collect_fn_attrs(struct tree *t);
+void destroy_fn_attrs(void);
+enum fn_attr get_fn_attr(const char *name);
+
+bool set_pass_enabled(const char *name, bool enabled);
+void optimize_tree(struct tree *t);
@@ -1,8 +1,12 @@
 #include "debug.h"
+#include "mem.h"
+#include "timer.h"
 #include "tree.h"
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -30,9 +34,18 @@ static struct hashmap_chain *create_hashmap_chain(hashmap_uint32_t size,
   return chain;
 }
 
+/* --mem-report: a table only grows, it is counted once at its largest */
+static void count_hashmap(struct hashmap_s *map, size_t extra) {
+  mem_alloc(MEM_HASHMAP,
+            extra + (((size_t)1 << map->log2_capacity) +
+                     HASHMAP_LINEAR_PROBE_LENGTH) *
+                        sizeof(struct hashmap_element_s));
+}
+
 static void destroy_hashmap_chain(struct hashmap_chain *chain) {
   if (chain == NULL)
     return;
+  count_hashmap(&chain->map, sizeof(struct hashmap_chain));
   hashmap_destroy(&chain->map);
   chain->next = NULL;
   free(chain);
@@ -73,19 +86,384 @@ static struct tree *hashmap_get_recurse(char *key, struct hashmap_chain *env) {
   return NULL;
 }
 
+/* the variable declaring key and whether it lives in the global scope */
+static struct tree *lookup_var(char *key, struct hashmap_chain *env,
+                               bool *global) {
+  size_t key_size = strlen(key);
+  for (struct hashmap_chain *chain = env; chain != NULL; chain = chain->next) {
+    struct tree *value = hashmap_get(&chain->map, key, key_size);
+    if (value != NULL) {
+      *global = chain->next == NULL;
+      return value;
+    }
+  }
+  return NULL;
+}
+
+/* the &key parameters of a function in the order they are passed, so that
+ * each call site looks its keys up instead of comparing every pair */
+struct key_table {
+  struct hashmap_s index; // key name -> position + 1
+  int n_keys;
+  struct tree *keys[];
+};
+
+static struct hashmap_s key_tables;
+
+static int free_key_table(void *const context, void *const value) {
+  struct key_table *table = value;
+  count_hashmap(&table->index, sizeof(struct key_table) +
+                                   table->n_keys * sizeof(struct tree *));
+  hashmap_destroy(&table->index);
+  free(table);
+  return 1;
+}
+
+static void build_key_table(struct tree *fn) {
+  struct tree *list = fn->fn_decl.arglist;
+  if (list == NULL || list->type != LAMBDA_LIST ||
+      list->lambda_list.keys == NULL)
+    return;
+  int n_keys = 0;
+  for (struct tree *key = list->lambda_list.keys; key != NULL; key = key->next)
+    n_keys++;
+
+  struct key_table *table =
+      malloc(sizeof(struct key_table) + n_keys * sizeof(struct tree *));
+  if (hashmap_create(16, &table->index) != 0) {
+    error("Failed to create hashmap.");
+    free(table);
+    return;
+  }
+  table->n_keys = 0;
+  // a declaration followed by the definition builds the table twice
+  struct key_table *old =
+      hashmap_get(&key_tables, fn->fn_decl.name, strlen(fn->fn_decl.name));
+  if (old != NULL)
+    free_key_table(NULL, old);
+  for (struct tree *key = list->lambda_list.keys; key != NULL;
+       key = key->next) {
+    char *name = key->lambda_key.key_name;
+    if (hashmap_get(&table->index, name, strlen(name)) != NULL) {
+      errorat("key :%s appears twice in %s", lcc_current_file,
+              key->loc.first_line, key->loc.first_column, name,
+              fn->fn_decl.name);
+      continue;
+    }
+    table->keys[table->n_keys++] = key;
+    hashmap_put(&table->index, name, strlen(name),
+                (void *)(uintptr_t)table->n_keys);
+  }
+  hashmap_put(&key_tables, fn->fn_decl.name, strlen(fn->fn_decl.name), table);
+}
+
+/* (optimize ...), (target ...), (hot), (cold), (flatten) and (fast-math)
+ * in a defun are printed as GCC attributes of the function, only their
+ * arguments are checked here */
+static void resolve_fn_attr(struct tree *t) {
+  char *name = t->attr_decl.name;
+  struct location loc = t->loc;
+  if (strcmp(name, "optimize") == 0) {
+    if (optimize_level(t) == NULL)
+      errorat("optimize expects speed, size, debug or (speed 0-3)",
+              lcc_current_file, loc.first_line, loc.first_column);
+  } else if (strcmp(name, "target") == 0) {
+    bool valid = t->attr_decl.args != NULL;
+    for (struct tree *arg = t->attr_decl.args; arg != NULL; arg = arg->next)
+      valid = valid && arg->type == REFERENCE_EXPR &&
+              arg->reference_expr.type == STRING_CST;
+    if (!valid)
+      errorat("target expects strings such as \"avx2\"", lcc_current_file,
+              loc.first_line, loc.first_column);
+  } else if ((strcmp(name, "hot") == 0 || strcmp(name, "cold") == 0 ||
+              strcmp(name, "flatten") == 0 ||
+              strcmp(name, "fast-math") == 0) &&
+             t->attr_decl.args != NULL) {
+    errorat("'%s' takes no arguments", lcc_current_file, loc.first_line,
+            loc.first_column, name);
+  }
+}
+
+/* a function cannot be both hot and cold, nor optimized at two levels */
+static void check_fn_attrs(struct tree *fn) {
+  struct tree *temperature = NULL, *optimize = NULL;
+  for (struct tree *t = fn->fn_decl.body; t != NULL; t = t->next) {
+    if (t->type != ATTR_DECL)
+      continue;
+    char *name = t->attr_decl.name;
+    struct location loc = t->loc;
+    if (strcmp(name, "hot") == 0 || strcmp(name, "cold") == 0) {
+      if (temperature == NULL)
+        temperature = t;
+      else if (strcmp(temperature->attr_decl.name, name) != 0)
+        errorat("%s is declared both hot and cold", lcc_current_file,
+                loc.first_line, loc.first_column, fn->fn_decl.source_name);
+    } else if (strcmp(name, "optimize") == 0 && optimize_level(t) != NULL) {
+      if (optimize == NULL)
+        optimize = t;
+      else if (strcmp(optimize_level(optimize), optimize_level(t)) != 0)
+        errorat("%s is optimized for -%s and -%s", lcc_current_file,
+                loc.first_line, loc.first_column, fn->fn_decl.source_name,
+                optimize_level(optimize), optimize_level(t));
+    }
+  }
+}
+
+#define CACHE_LINE_SIZE 64
+
+/* (thread-local x...), (align N x...) and (cacheline x...) set the storage of
+ * variables declared earlier. Counters updated by different threads are
+ * declared cacheline so that each one gets a line of its own */
+static void resolve_storage_attr(struct tree *t, struct hashmap_chain *env) {
+  char *name = t->attr_decl.name;
+  bool thread_local = strcmp(name, "thread-local") == 0;
+  bool cacheline = strcmp(name, "cacheline") == 0;
+  if (!thread_local && !cacheline && strcmp(name, "align") != 0)
+    return;
+
+  struct tree *symbols = t->attr_decl.args;
+  int align = cacheline ? CACHE_LINE_SIZE : 0;
+  if (strcmp(name, "align") == 0) {
+    if (symbols == NULL || symbols->type != REFERENCE_EXPR ||
+        symbols->reference_expr.type != INTEGER_CST ||
+        symbols->reference_expr.ival <= 0 ||
+        (symbols->reference_expr.ival & (symbols->reference_expr.ival - 1))) {
+      errorat("align expects a power of two followed by variable names",
+              lcc_current_file, t->loc.first_line, t->loc.first_column);
+      return;
+    }
+    align = symbols->reference_expr.ival;
+    symbols = symbols->next;
+  }
+
+  for (struct tree *symbol = symbols; symbol != NULL; symbol = symbol->next) {
+    if (symbol->type != REFERENCE_EXPR ||
+        symbol->reference_expr.type != VAR_REF) {
+      errorat("expected symbol", lcc_current_file, symbol->loc.first_line,
+              symbol->loc.first_column);
+      continue;
+    }
+    bool global = false;
+    struct tree *var = lookup_var(symbol->reference_expr.symbol, env, &global);
+    if (var == NULL || var->type != VAR_DECL) {
+      errorat("'%s' is not a variable", lcc_current_file,
+              symbol->loc.first_line, symbol->loc.first_column,
+              symbol->reference_expr.symbol);
+      continue;
+    }
+    if (thread_local) {
+      if (!global) {
+        errorat("'%s' is not a global, only defvar can be thread-local",
+                lcc_current_file, symbol->loc.first_line,
+                symbol->loc.first_column, symbol->reference_expr.symbol);
+        continue;
+      }
+      var->var_decl.thread_local = true;
+    }
+    if (align > var->var_decl.align)
+      var->var_decl.align = align;
+    var->var_decl.cacheline |= cacheline;
+  }
+}
+
+/*
+ * A &rest parameter declared as []T (or *T) is passed as a pointer to its
+ * first element followed by a count, named xs and xs-len in the body. Each
+ * call site builds the array on its own stack, see rest_args. Untyped &rest
+ * parameters stay C varargs, which is what externs such as printf want.
+ */
+static bool typed_rest(struct tree *lambda_list, bool report) {
+  if (lambda_list == NULL || lambda_list->type != LAMBDA_LIST)
+    return false;
+  struct tree *rest = lambda_list->lambda_list.rest;
+  if (rest == NULL || is_monomorph(rest->var_decl.type))
+    return false;
+  if (rest->next != NULL)
+    return true;
+  struct type_ptr *ptr = rest->var_decl.type->type_expr.ptr;
+  if (ptr == NULL || (ptr->type != MULTI_PTR && ptr->type != SINGLE_PTR)) {
+    if (report) {
+      errorat("&rest argument '%s' must be declared as []T", lcc_current_file,
+              rest->loc.first_line, rest->loc.first_column,
+              rest->var_decl.name);
+    }
+    return false;
+  }
+  ptr->type = SINGLE_PTR;
+
+  size_t len = strlen(rest->var_decl.name) + sizeof("_len");
+  char *name = malloc(len);
+  snprintf(name, len, "%s_len", rest->var_decl.name);
+  rest->next = build_var(
+      rest->loc, PARM_DECL, name,
+      build_type_expr(rest->loc, build_tid(strdup("unsigned long"), MOD_NONE)),
+      NULL);
+  return true;
+}
+
+/* the collected rest arguments become a compound literal and its length */
+static struct tree *rest_args(struct location loc, struct tree *rest_decl,
+                              struct tree *rest) {
+  struct tree *type = rest_decl->var_decl.type;
+  struct tree *elem_type = build_type_expr(loc, build_tid(NULL, MOD_NONE));
+  copy_type_to_type(elem_type, type);
+  int n = 0;
+  for (struct tree *arg = rest; arg != NULL; arg = arg->next)
+    n++;
+
+  struct tree *array;
+  if (n == 0) {
+    // (T *)0, an empty compound literal is not valid C
+    array = build_cast(loc, elem_type, build_int_cst(loc, 0));
+  } else {
+    struct type_ptr *ptr = elem_type->type_expr.ptr;
+    elem_type->type_expr.ptr = ptr->next;
+    mem_free(MEM_TYPE_PTR, sizeof(struct type_ptr));
+    free(ptr);
+    array = build_list(loc, elem_type, rest);
+  }
+  array->next = build_int_cst(loc, n);
+  return array;
+}
+
+static void add_opt_wrappers(struct tree *fn);
+
 static void resolve_fn_decl(struct tree *t, struct hashmap_chain *env) {
   struct hashmap_chain *block_env = create_hashmap_chain(128, env);
+  bool first = hashmap_get(&env->map, t->fn_decl.name,
+                           strlen(t->fn_decl.name)) == NULL;
   if (hashmap_put(&env->map, t->fn_decl.name, strlen(t->fn_decl.name),
                   (void *)t) != 0) {
     error("failed to add '%s' to hashmap", t->fn_decl.name);
   }
+  build_key_table(t);
 
   resolve_tree_chain(t->fn_decl.arglist, block_env);
   resolve_tree_chain(t->fn_decl.body, block_env);
+  check_fn_attrs(t);
+  typed_rest(t->fn_decl.arglist, true);
+  if (first)
+    add_opt_wrappers(t);
 
   destroy_hashmap_chain(block_env);
 }
 
+/*
+ * An &optional default that names an earlier parameter is computed in the
+ * callee. A call that leaves out the optionals from the k-th on goes to
+ * NAME_optk instead, which takes the arguments given, binds the missing
+ * optionals to their defaults and calls NAME with all of them. Defaults that
+ * name no parameter are copied to the call site.
+ */
+struct param_search {
+  struct tree *lambda_list;
+  bool found;
+};
+
+static bool find_param(struct tree *t, void *data) {
+  struct param_search *search = data;
+  if (t->type != REFERENCE_EXPR || t->reference_expr.type != VAR_REF)
+    return !search->found;
+  char *name = t->reference_expr.symbol;
+  for (struct tree *p = search->lambda_list->lambda_list.args; p != NULL;
+       p = p->next)
+    search->found |= strcmp(p->var_decl.name, name) == 0;
+  for (struct tree *p = search->lambda_list->lambda_list.optionals; p != NULL;
+       p = p->next)
+    search->found |= strcmp(p->var_decl.name, name) == 0;
+  return !search->found;
+}
+
+/* the last optional whose default names a parameter, -1 if there is none */
+static int last_scoped_default(struct tree *lambda_list) {
+  int last = -1, i = 0;
+  for (struct tree *opt = lambda_list->lambda_list.optionals; opt != NULL;
+       opt = opt->next, i++) {
+    struct param_search search = {lambda_list, false};
+    walk_tree_node(opt->var_decl.value, find_param, &search);
+    if (search.found)
+      last = i;
+  }
+  return last;
+}
+
+static char *opt_wrapper_name(const char *name, int k) {
+  size_t len = strlen(name) + sizeof("_opt") + 11;
+  char *wrapper = malloc(len);
+  snprintf(wrapper, len, "%s_opt%d", name, k);
+  return wrapper;
+}
+
+static struct tree *copy_param(struct tree *param) {
+  struct tree *copy = copy_tree(param);
+  destroy_tree(copy->var_decl.value);
+  copy->var_decl.value = NULL;
+  return copy;
+}
+
+static struct tree *build_opt_wrapper(struct tree *fn, int k) {
+  struct location loc = fn->loc;
+  struct tree *list = fn->fn_decl.arglist;
+  struct tree *params = NULL, *vars = NULL, *args = NULL;
+  for (struct tree *p = list->lambda_list.args; p != NULL; p = p->next) {
+    params = append_tree(copy_param(p), params);
+    args = append_tree(build_var_ref(loc, strdup(p->var_decl.name)), args);
+  }
+  int i = 0;
+  for (struct tree *opt = list->lambda_list.optionals; opt != NULL;
+       opt = opt->next, i++) {
+    if (i < k) {
+      params = append_tree(copy_param(opt), params);
+    } else {
+      vars = append_tree(build_var(loc, VAR_DECL, strdup(opt->var_decl.name),
+                                   copy_tree(opt->var_decl.type),
+                                   copy_tree(opt->var_decl.value)),
+                         vars);
+    }
+    args = append_tree(build_var_ref(loc, strdup(opt->var_decl.name)), args);
+  }
+  // call sites pass the keys in the order of the key table
+  for (struct tree *key = list->lambda_list.keys; key != NULL;
+       key = key->next) {
+    struct tree *param = key->lambda_key.expr;
+    params = append_tree(copy_param(param), params);
+    args = append_tree(
+        build_lambda_key(loc, strdup(key->lambda_key.key_name),
+                         build_var_ref(loc, strdup(param->var_decl.name))),
+        args);
+  }
+
+  struct tree *ret = fn->fn_decl.type;
+  struct tree *body = build_fn_call(loc, strdup(fn->fn_decl.name), args);
+  if (ret->type != TYPE_EXPR || ret->type_expr.ptr != NULL ||
+      ret->type_expr.id->name == NULL ||
+      strcmp(ret->type_expr.id->name, "void") != 0)
+    body = build_fn_call(loc, strdup("return"), body);
+  return build_fn(loc, opt_wrapper_name(fn->fn_decl.name, k), copy_tree(ret),
+                  build_lambda_list(loc, params, NULL, NULL, NULL, NULL),
+                  build_let_stmt(loc, vars, body));
+}
+
+/* the wrappers follow the first declaration of fn, once its parameters have
+ * their types */
+static void add_opt_wrappers(struct tree *fn) {
+  struct tree *list = fn->fn_decl.arglist;
+  if (list == NULL || list->type != LAMBDA_LIST)
+    return;
+  int last = last_scoped_default(list);
+  if (last >= 0 && list->lambda_list.rest != NULL) {
+    errorat("defaults naming other parameters cannot be combined with &rest "
+            "in %s",
+            lcc_current_file, fn->loc.first_line, fn->loc.first_column,
+            fn->fn_decl.source_name);
+    return;
+  }
+  struct tree *wrappers = NULL;
+  for (int k = 0; k <= last; k++)
+    wrappers = append_tree(build_opt_wrapper(fn, k), wrappers);
+  fn->next = append_tree(fn->next, wrappers);
+}
+
 static void resolve_reference(struct tree *t, struct hashmap_chain *env) {
   if (t == NULL)
     return;
@@ -135,7 +513,7 @@ static void resolve_reference(struct tree *t, struct hashmap_chain *env) {
     struct tree *keys = NULL, *key_end = NULL;
     struct tree *args = NULL, *arg_end = NULL;
     struct tree *rest = NULL, *rest_end = NULL;
-    int n_args = 0, n_keys = 0;
+    int n_args = 0;
     for (struct tree *arg = t->reference_expr.call.args; arg != NULL;) {
       struct tree *next = arg == NULL ? NULL : arg->next;
       arg->next = NULL;
@@ -146,7 +524,6 @@ static void resolve_reference(struct tree *t, struct hashmap_chain *env) {
           key_end->next = arg;
           key_end = arg;
         }
-        n_keys++;
       } else if (n_args < n_regular_args + n_optional_args) {
         if (arg_end == NULL)
           args = arg_end = arg;
@@ -167,7 +544,7 @@ static void resolve_reference(struct tree *t, struct hashmap_chain *env) {
       arg = next;
     }
 
-    if (n_args < n_regular_args || n_keys < n_key_args) {
+    if (n_args < n_regular_args) {
       errorat("incorrect number of arguments for %s", lcc_current_file,
               t->loc.first_line, t->loc.first_column,
               t->reference_expr.call.name);
@@ -175,15 +552,19 @@ static void resolve_reference(struct tree *t, struct hashmap_chain *env) {
     }
     n_args -= n_regular_args;
 
+    // the wrapper fills in every missing optional, see add_opt_wrappers
+    bool wrapped = n_args <= last_scoped_default(lambda_list);
     int i = 0;
-    for (struct tree *opt = lambda_list->lambda_list.optionals; opt != NULL;
-         opt = opt->next) {
+    for (struct tree *opt = lambda_list->lambda_list.optionals;
+         opt != NULL && !wrapped; opt = opt->next) {
       if (i < n_args) {
         i++;
         continue;
       }
 
-      struct tree *expr = opt->var_decl.value;
+      // every call site gets its own copy of the default
+      struct tree *expr = copy_tree(opt->var_decl.value);
+      resolve_tree(expr, env);
       if (args == NULL) {
         args = arg_end = expr;
         args->next = NULL;
@@ -194,43 +575,63 @@ static void resolve_reference(struct tree *t, struct hashmap_chain *env) {
       arg_end->next = NULL;
     }
 
-    for (struct tree *key = lambda_list->lambda_list.keys; key != NULL;
-         key = key->next) {
-      if (key->lambda_key.key_name == NULL)
+    struct key_table *table =
+        n_key_args == 0 ? NULL
+                        : hashmap_get(&key_tables, fn_decl->fn_decl.name,
+                                      strlen(fn_decl->fn_decl.name));
+    struct tree **slots = calloc(n_key_args + 1, sizeof(struct tree *));
+    for (struct tree *arg = keys; arg != NULL; arg = arg->next) {
+      char *name = arg->lambda_key.key_name;
+      uintptr_t pos =
+          table == NULL || name == NULL
+              ? 0
+              : (uintptr_t)hashmap_get(&table->index, name, strlen(name));
+      if (pos == 0) {
+        errorat("%s has no key :%s", lcc_current_file, arg->loc.first_line,
+                arg->loc.first_column, t->reference_expr.call.name,
+                name == NULL ? "" : name);
         continue;
-      info("Test for key %s", key->lambda_key.key_name);
-      for (struct tree *arg = keys; arg != NULL; arg = arg->next) {
-        if (arg == NULL)
-          continue;
-        if (arg->type != LAMBDA_KEY)
-          continue;
-        if (arg->lambda_key.key_name == NULL)
-          continue;
-        info("Test against %s", arg->lambda_key.key_name);
-        if (strcmp(arg->lambda_key.key_name, key->lambda_key.key_name) == 0) {
-          info("Append %s", arg->lambda_key.key_name);
-          if (arg_end != NULL) {
-            arg_end->next = arg->lambda_key.expr;
-            arg_end = arg_end->next;
-          } else {
-            args = arg_end = arg->lambda_key.expr;
-          }
-          arg->lambda_key.expr = NULL;
-        }
       }
+      if (slots[pos - 1] != NULL) {
+        errorat("key :%s is given twice", lcc_current_file,
+                arg->loc.first_line, arg->loc.first_column, name);
+        continue;
+      }
+      slots[pos - 1] = arg->lambda_key.expr;
+      arg->lambda_key.expr = NULL;
     }
+    for (int k = 0; table != NULL && k < table->n_keys; k++) {
+      if (slots[k] == NULL) {
+        errorat("missing key :%s for %s", lcc_current_file, t->loc.first_line,
+                t->loc.first_column, table->keys[k]->lambda_key.key_name,
+                t->reference_expr.call.name);
+        continue;
+      }
+      if (arg_end != NULL)
+        arg_end = arg_end->next = slots[k];
+      else
+        args = arg_end = slots[k];
+    }
+    free(slots);
     destroy_tree(keys);
 
+    if (typed_rest(lambda_list, false))
+      rest = rest_args(t->loc, lambda_list->lambda_list.rest, rest);
     if (arg_end) {
       arg_end->next = rest;
     } else {
       args = rest;
     }
     t->reference_expr.call.args = args;
+    if (wrapped) {
+      free(t->reference_expr.call.name);
+      t->reference_expr.call.name =
+          opt_wrapper_name(fn_decl->fn_decl.name, n_args);
+    }
 
     break;
   default:
-    warning("Un-implemented resolve for reference type");
+    // constants and variable references have nothing to resolve
     break;
   }
 }
@@ -243,6 +644,15 @@ static void resolve_tree(struct tree *t, struct hashmap_chain *env) {
   case FN_DECL:
     resolve_fn_decl(t, env);
     break;
+  case LAMBDA_EXPR:
+    // the parameters of a lambda see the enclosing scope, its name does not
+    block_env = create_hashmap_chain(128, env);
+
+    resolve_tree_chain(t->lambda_expr.decl->fn_decl.arglist, block_env);
+    resolve_tree_chain(t->lambda_expr.decl->fn_decl.body, block_env);
+
+    destroy_hashmap_chain(block_env);
+    break;
   case LET_STMT:;
     block_env = create_hashmap_chain(128, env);
 
@@ -264,8 +674,19 @@ static void resolve_tree(struct tree *t, struct hashmap_chain *env) {
     block_env = create_hashmap_chain(128, env);
 
     resolve_tree_chain(t->for_stmt.vars, block_env);
+    resolve_tree(t->for_stmt.condition, block_env);
+    resolve_tree_chain(t->for_stmt.loop_eval, block_env);
     resolve_tree_chain(t->for_stmt.body, block_env);
 
+    destroy_hashmap_chain(block_env);
+    break;
+  case FOREACH_STMT:
+    block_env = create_hashmap_chain(128, env);
+
+    resolve_tree(t->foreach_stmt.expr, env);
+    resolve_tree_chain(t->foreach_stmt.vars, block_env);
+    resolve_tree_chain(t->foreach_stmt.body, block_env);
+
     destroy_hashmap_chain(block_env);
     break;
   case COND_STMT:
@@ -303,6 +724,9 @@ static void resolve_tree(struct tree *t, struct hashmap_chain *env) {
     break;
   case VAR_DECL:
   case PARM_DECL:
+    // optional defaults are resolved at each call site instead
+    if (t->type == VAR_DECL)
+      resolve_tree(t->var_decl.value, env);
     if (key_exists(t->var_decl.name, env)) {
       errorat("symbol '%s' already exists", lcc_current_file, t->loc.first_line,
               t->loc.first_column, t->var_decl.name);
@@ -359,8 +783,43 @@ static void resolve_tree(struct tree *t, struct hashmap_chain *env) {
     resolve_reference(t, env);
     break;
   case BINOP_EXPR:
-  case INCLUDE_STMT:
+    resolve_tree_chain(t->binop_expr.body, env);
+    break;
   case COMPARE_EXPR:
+    resolve_tree(t->compare_expr.lhs, env);
+    resolve_tree(t->compare_expr.rhs, env);
+    break;
+  case SET_EXPR:
+    resolve_tree(t->set_expr.var, env);
+    resolve_tree(t->set_expr.value, env);
+    break;
+  case IF_STMT:
+    resolve_tree(t->if_else_stmt.condition, env);
+    resolve_tree_chain(t->if_else_stmt.if_block, env);
+    resolve_tree_chain(t->if_else_stmt.else_block, env);
+    break;
+  case AREF_EXPR:
+  case ADDR_EXPR:
+    resolve_tree(t->ref_expr.expr, env);
+    resolve_tree_chain(t->ref_expr.indices, env);
+    break;
+  case FIELD_EXPR:
+    resolve_tree(t->field_expr.expr, env);
+    break;
+  case CAST_EXPR:
+    resolve_tree(t->cast_expr.expr, env);
+    break;
+  case LIST_EXPR:
+    resolve_tree_chain(t->list_expr.elems, env);
+    break;
+  case INCLUDE_STMT:
+    break;
+  case ATTR_DECL:
+    resolve_storage_attr(t, env);
+    resolve_fn_attr(t);
+    break;
+  case STRUCT_DECL:
+  case CONTAINER_DECL:
     break;
   default:
     warning("Un-implemented resolve for tree type %s", get_tree_type(t));
@@ -374,10 +833,20 @@ void resolve_pass(struct tree *t) {
     error("Failed to initialize environment hashmap.");
     return;
   }
+  if (hashmap_create(64, &key_tables) != 0) {
+    error("Failed to create hashmap.");
+    destroy_hashmap_chain(env);
+    return;
+  }
 
   for (struct tree *head = t; head != NULL; head = head->next) {
+    timer_begin_form("resolve", head);
     resolve_tree(head, env);
+    timer_end();
   }
 
+  hashmap_iterate(&key_tables, free_key_table, NULL);
+  count_hashmap(&key_tables, 0);
+  hashmap_destroy(&key_tables);
   destroy_hashmap_chain_recurse(env);
 }
@@ -0,0 +1,465 @@
+#include "debug.h"
+#include "opt.h"
+#include "tree.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hashmap.h"
+
+/*
+ * Branch hints. (likely x) and (unlikely x) become __builtin_expect(!!(x), 1)
+ * and __builtin_expect(!!(x), 0), wherever they appear.
+ *
+ * Profile-guided branch layout. With --profile-generate every arm of if,
+ * cond and case counts how often it runs, and the program adds the counts
+ * to a profile when it exits, <source>.profile unless the option names
+ * another file or LCC_PROFILE does at run time. Each line of the profile is
+ *
+ *   <line>:<column of the statement> <arm> <count>
+ *
+ * where arm is then or else for if, and the position of the arm for cond and
+ * case, so that the profile survives the reordering below.
+ *
+ * With --profile-use, the leading arms of a cond that compare the same
+ * expression with different constants are mutually exclusive and are sorted
+ * by frequency, the conditions of if and cond become likely or unlikely when
+ * at least four in five executions reaching them take one side, and a case
+ * dominated by one arm expects its key.
+ */
+
+extern const char *lcc_current_file;
+
+const char *profile_generate = NULL;
+const char *profile_use = NULL;
+
+static struct hashmap_s profile;
+static char **keys = NULL;
+static int n_keys = 0, cap_keys = 0;
+
+static char **arms = NULL; // the arm of each counter
+static int n_counters = 0, cap_counters = 0;
+
+static bool is_call(struct tree *t, const char *name) {
+  return t != NULL && t->type == REFERENCE_EXPR &&
+         t->reference_expr.type == FN_CALL &&
+         strcmp(t->reference_expr.call.name, name) == 0;
+}
+
+static char *arm_key(struct tree *site, struct tree *arm, const char *which) {
+  char key[64];
+  if (which != NULL)
+    snprintf(key, sizeof(key), "%d:%d %s", site->loc.first_line,
+             site->loc.first_column, which);
+  else
+    snprintf(key, sizeof(key), "%d:%d %d:%d", site->loc.first_line,
+             site->loc.first_column, arm->loc.first_line,
+             arm->loc.first_column);
+  return strdup(key);
+}
+
+/* --profile-use */
+
+static bool load_profile(const char *path) {
+  FILE *f = fopen(path, "r");
+  if (f == NULL) {
+    error("cannot read the profile %s", path);
+    return false;
+  }
+  if (hashmap_create(256, &profile) != 0) {
+    error("Failed to create hashmap.");
+    fclose(f);
+    return false;
+  }
+  char line[256];
+  if (fgets(line, sizeof(line), f) == NULL ||
+      strncmp(line, "lcc-profile ", 12) != 0) {
+    error("%s is not an lcc profile", path);
+    fclose(f);
+    return true;
+  }
+  char site[32], arm[32];
+  unsigned long count;
+  while (fgets(line, sizeof(line), f) != NULL) {
+    if (sscanf(line, "%31s %31s %lu", site, arm, &count) != 3)
+      continue;
+    size_t len = strlen(site) + strlen(arm) + 2;
+    char *key = malloc(len);
+    snprintf(key, len, "%s %s", site, arm);
+    if (n_keys >= cap_keys) {
+      cap_keys = cap_keys == 0 ? 64 : cap_keys * 2;
+      keys = realloc(keys, cap_keys * sizeof(char *));
+    }
+    keys[n_keys++] = key;
+    hashmap_put(&profile, key, strlen(key), (void *)(uintptr_t)(count + 1));
+  }
+  fclose(f);
+  return true;
+}
+
+/* the count of an arm, -1 when the profile does not know it */
+static long arm_count(struct tree *site, struct tree *arm, const char *which) {
+  char *key = arm_key(site, arm, which);
+  uintptr_t count = (uintptr_t)hashmap_get(&profile, key, strlen(key));
+  free(key);
+  return (long)count - 1;
+}
+
+static void hint(struct tree **condition, long hits, long total) {
+  if (total <= 0 || is_call(*condition, "likely") ||
+      is_call(*condition, "unlikely"))
+    return;
+  const char *name = NULL;
+  if (hits * 5 >= total * 4)
+    name = "likely";
+  else if (hits * 5 <= total)
+    name = "unlikely";
+  if (name == NULL)
+    return;
+  struct tree *rest = (*condition)->next;
+  (*condition)->next = NULL;
+  *condition = build_fn_call((*condition)->loc, strdup(name), *condition);
+  (*condition)->next = rest;
+}
+
+static bool is_constant(struct tree *t) {
+  return t != NULL && t->type == REFERENCE_EXPR &&
+         (t->reference_expr.type == INTEGER_CST ||
+          t->reference_expr.type == CHAR_CST ||
+          t->reference_expr.type == BOOL_CST);
+}
+
+static long constant(struct tree *t) {
+  switch (t->reference_expr.type) {
+  case CHAR_CST:
+    return t->reference_expr.cval;
+  case BOOL_CST:
+    return t->reference_expr.bval;
+  default:
+    return t->reference_expr.ival;
+  }
+}
+
+/* the expressions dispatched on, without side effects */
+static bool same_operand(struct tree *a, struct tree *b) {
+  if (a->type != b->type)
+    return false;
+  switch (a->type) {
+  case REFERENCE_EXPR:
+    if (a->reference_expr.type != VAR_REF ||
+        b->reference_expr.type != VAR_REF)
+      return false;
+    return strcmp(a->reference_expr.symbol, b->reference_expr.symbol) == 0;
+  case FIELD_EXPR:
+    return a->field_expr.indirect == b->field_expr.indirect &&
+           strcmp(a->field_expr.field, b->field_expr.field) == 0 &&
+           same_operand(a->field_expr.expr, b->field_expr.expr);
+  case AREF_EXPR:;
+    struct tree *i = a->ref_expr.indices, *j = b->ref_expr.indices;
+    for (; i != NULL && j != NULL; i = i->next, j = j->next) {
+      if (is_constant(i) && is_constant(j)) {
+        if (constant(i) != constant(j))
+          return false;
+      } else if (!same_operand(i, j)) {
+        return false;
+      }
+    }
+    return i == j && same_operand(a->ref_expr.expr, b->ref_expr.expr);
+  default:
+    return false;
+  }
+}
+
+/* (= operand constant), either way round */
+static bool dispatch(struct tree *condition, struct tree **operand,
+                     struct tree **constant) {
+  if (condition->type != COMPARE_EXPR || condition->compare_expr.op != OP_EQL)
+    return false;
+  struct tree *lhs = condition->compare_expr.lhs;
+  struct tree *rhs = condition->compare_expr.rhs;
+  if (is_constant(rhs)) {
+    *operand = lhs;
+    *constant = rhs;
+  } else if (is_constant(lhs)) {
+    *operand = rhs;
+    *constant = lhs;
+  } else {
+    return false;
+  }
+  // a variable, field or element, which reads the same in every arm
+  return same_operand(*operand, *operand);
+}
+
+/* the number of leading arms that are mutually exclusive */
+static int exclusive_arms(struct tree *exprs) {
+  struct tree *operand = NULL;
+  int n = 0;
+  for (struct tree *arm = exprs; arm != NULL; arm = arm->next, n++) {
+    struct tree *o, *c;
+    if (!dispatch(arm->cond_expr.condition, &o, &c))
+      break;
+    if (operand != NULL && !same_operand(operand, o))
+      break;
+    operand = o;
+    for (struct tree *prev = exprs; prev != arm; prev = prev->next) {
+      struct tree *po, *pc;
+      dispatch(prev->cond_expr.condition, &po, &pc);
+      if (constant(pc) == constant(c))
+        return n;
+    }
+  }
+  return n;
+}
+
+struct arm {
+  struct tree *t;
+  long count;
+  int index;
+};
+
+static int by_count(const void *a, const void *b) {
+  const struct arm *x = a, *y = b;
+  if (x->count != y->count)
+    return x->count < y->count ? 1 : -1;
+  return x->index - y->index;
+}
+
+static void use_cond(struct tree *t) {
+  int n = 0;
+  for (struct tree *arm = t->cond_stmt.exprs; arm != NULL; arm = arm->next)
+    n++;
+  struct arm *counts = malloc(n * sizeof(struct arm));
+  int i = 0;
+  for (struct tree *arm = t->cond_stmt.exprs; arm != NULL; arm = arm->next) {
+    counts[i] = (struct arm){arm, arm_count(t, arm, NULL), i};
+    if (counts[i++].count < 0) {
+      free(counts);
+      return;
+    }
+  }
+
+  int exclusive = exclusive_arms(t->cond_stmt.exprs);
+  if (exclusive > 1) {
+    bool sorted = true;
+    for (i = 1; i < exclusive; i++)
+      sorted = sorted && counts[i - 1].count >= counts[i].count;
+    if (!sorted) {
+      qsort(counts, exclusive, sizeof(struct arm), by_count);
+      info("%s:%d: reordered %d cond arms by profile", lcc_current_file,
+           t->loc.first_line, exclusive);
+    }
+    for (i = 0; i < n - 1; i++)
+      counts[i].t->next = counts[i + 1].t;
+    counts[n - 1].t->next = NULL;
+    t->cond_stmt.exprs = counts[0].t;
+  }
+
+  long remaining = 0;
+  for (i = 0; i < n; i++)
+    remaining += counts[i].count;
+  for (i = 0; i < n; i++) {
+    struct tree *arm = counts[i].t;
+    if (get_bool(arm->cond_expr.condition) != 1)
+      hint(&arm->cond_expr.condition, counts[i].count, remaining);
+    remaining -= counts[i].count;
+  }
+  free(counts);
+}
+
+static void use_case(struct tree *t) {
+  long total = 0, best = -1;
+  struct tree *dominant = NULL;
+  for (struct tree *arm = t->case_stmt.cases; arm != NULL; arm = arm->next) {
+    long count = arm_count(t, arm, NULL);
+    if (count < 0)
+      return;
+    total += count;
+    if (count > best) {
+      best = count;
+      dominant = arm;
+    }
+  }
+  struct tree *key = dominant == NULL ? NULL : dominant->case_expr.expr;
+  if (total == 0 || best * 2 < total || get_bool(key) == 1 ||
+      !is_constant(key))
+    return;
+  struct tree *expr = t->case_stmt.expr;
+  expr->next = copy_tree(key);
+  t->case_stmt.expr =
+      build_fn_call(expr->loc, strdup("__builtin_expect"), expr);
+}
+
+static bool use_walk(struct tree *t, void *data) {
+  switch (t->type) {
+  case IF_STMT:;
+    long then = arm_count(t, NULL, "then"), other = arm_count(t, NULL, "else");
+    if (then >= 0 && other >= 0)
+      hint(&t->if_else_stmt.condition, then, then + other);
+    break;
+  case COND_STMT:
+    use_cond(t);
+    break;
+  case CASE_STMT:
+    use_case(t);
+    break;
+  default:
+    break;
+  }
+  return true;
+}
+
+/* --profile-generate */
+
+static struct tree *counter(struct tree *site, struct tree *arm,
+                            const char *which) {
+  if (n_counters >= cap_counters) {
+    cap_counters = cap_counters == 0 ? 64 : cap_counters * 2;
+    arms = realloc(arms, cap_counters * sizeof(char *));
+  }
+  arms[n_counters] = arm_key(site, arm, which);
+  struct location loc = site->loc;
+  return build_set_expr(loc,
+                        build_aref(loc, build_var_ref(loc, strdup("lcc_prof")),
+                                   build_int_cst(loc, n_counters++)),
+                        build_int_cst(loc, 1), '+');
+}
+
+static struct tree *count_arm(struct tree *body, struct tree *site,
+                              struct tree *arm, const char *which) {
+  struct tree *inc = counter(site, arm, which);
+  inc->next = body;
+  return inc;
+}
+
+static bool generate_walk(struct tree *t, void *data) {
+  switch (t->type) {
+  case IF_STMT:
+    t->if_else_stmt.if_block =
+        count_arm(t->if_else_stmt.if_block, t, NULL, "then");
+    t->if_else_stmt.else_block =
+        count_arm(t->if_else_stmt.else_block, t, NULL, "else");
+    break;
+  case COND_STMT:
+    for (struct tree *arm = t->cond_stmt.exprs; arm != NULL; arm = arm->next)
+      arm->cond_expr.body = count_arm(arm->cond_expr.body, t, arm, NULL);
+    break;
+  case CASE_STMT:
+    for (struct tree *arm = t->case_stmt.cases; arm != NULL; arm = arm->next)
+      arm->case_expr.body = count_arm(arm->case_expr.body, t, arm, NULL);
+    break;
+  default:
+    break;
+  }
+  return true;
+}
+
+/* (likely x) and (unlikely x) */
+static bool hint_walk(struct tree *t, void *data) {
+  bool likely = is_call(t, "likely");
+  if (!likely && !is_call(t, "unlikely"))
+    return true;
+  struct tree *x = t->reference_expr.call.args;
+  if (x == NULL || x->next != NULL) {
+    errorat("%s takes one condition", lcc_current_file, t->loc.first_line,
+            t->loc.first_column, t->reference_expr.call.name);
+    return true;
+  }
+  struct tree *truth = build_compare(
+      t->loc, OP_NOT, build_compare(t->loc, OP_NOT, x, NULL), NULL);
+  truth->next = build_int_cst(t->loc, likely);
+  free(t->reference_expr.call.name);
+  t->reference_expr.call.name = strdup("__builtin_expect");
+  t->reference_expr.call.args = truth;
+  return false;
+}
+
+static const char *profile_path(const char *path) {
+  static char buf[4096];
+  if (path[0] != '\0')
+    return path;
+  snprintf(buf, sizeof(buf), "%s.profile",
+           lcc_current_file != NULL ? lcc_current_file : "lcc");
+  return buf;
+}
+
+void lower_branch_hints(struct tree *t) {
+  if (profile_use != NULL && load_profile(profile_path(profile_use))) {
+    for (struct tree *head = t; head != NULL; head = head->next) {
+      if (head->type == FN_DECL)
+        walk_tree(head->fn_decl.body, use_walk, NULL);
+    }
+    hashmap_destroy(&profile);
+    for (int i = 0; i < n_keys; i++)
+      free(keys[i]);
+    free(keys);
+    keys = NULL;
+    n_keys = cap_keys = 0;
+  }
+  for (struct tree *head = t; head != NULL; head = head->next) {
+    if (head->type != FN_DECL)
+      continue;
+    if (profile_generate != NULL)
+      walk_tree(head->fn_decl.body, generate_walk, NULL);
+    walk_tree(head->fn_decl.body, hint_walk, NULL);
+  }
+}
+
+void print_profile_runtime(bool emit_asm) {
+  if (profile_generate == NULL || emit_asm)
+    return;
+  int n = n_counters > 0 ? n_counters : 1;
+  fprintf(stdout,
+          "#include <stdio.h>\n"
+          "#include <stdlib.h>\n"
+          "#include <string.h>\n"
+          "static unsigned long lcc_prof[%d];\n"
+          "static const char *const lcc_prof_arms[%d] = {\n",
+          n, n);
+  for (int i = 0; i < n_counters; i++)
+    fprintf(stdout, "  \"%s\",\n", arms[i]);
+  if (n_counters == 0)
+    fprintf(stdout, "  \"\",\n");
+  fprintf(stdout,
+          "};\n"
+          "/* adds the counts to those of earlier runs */\n"
+          "static void lcc_prof_dump(void) {\n"
+          "  const char *path = getenv(\"LCC_PROFILE\");\n"
+          "  if (path == NULL)\n"
+          "    path = \"%s\";\n"
+          "  char line[256];\n"
+          "  FILE *f = fopen(path, \"r\");\n"
+          "  if (f != NULL && fgets(line, sizeof(line), f) != NULL) {\n"
+          "    for (int i = 0; i < %d && fgets(line, sizeof(line), f); i++) "
+          "{\n"
+          "      size_t n = strlen(lcc_prof_arms[i]);\n"
+          "      if (strncmp(line, lcc_prof_arms[i], n) == 0 && line[n] == "
+          "' ')\n"
+          "        lcc_prof[i] += strtoul(line + n + 1, NULL, 10);\n"
+          "    }\n"
+          "  }\n"
+          "  if (f != NULL)\n"
+          "    fclose(f);\n"
+          "  if ((f = fopen(path, \"w\")) == NULL) {\n"
+          "    perror(path);\n"
+          "    return;\n"
+          "  }\n"
+          "  fprintf(f, \"lcc-profile %s\\n\");\n"
+          "  for (int i = 0; i < %d; i++)\n"
+          "    fprintf(f, \"%%s %%lu\\n\", lcc_prof_arms[i], lcc_prof[i]);\n"
+          "  fclose(f);\n"
+          "}\n"
+          "__attribute__((constructor)) static void lcc_prof_start(void) {\n"
+          "  atexit(lcc_prof_dump);\n"
+          "}\n",
+          profile_path(profile_generate), n_counters,
+          lcc_current_file != NULL ? lcc_current_file : "stdin", n_counters);
+  for (int i = 0; i < n_counters; i++)
+    free(arms[i]);
+  free(arms);
+  arms = NULL;
+  n_counters = cap_counters = 0;
+}
@@ -0,0 +1,888 @@
+#include "debug.h"
+#include "opt.h"
+#include "tree.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hashmap.h"
+
+/*
+ * Lowering of defstruct. A structure is declared with typed fields and an
+ * optional list of layout options:
+ *
+ *   (defstruct (particle (soa 64)) (x : f64) (y : f64) (alive : u8))
+ *
+ * Every field gets an accessor (particle-x p) that works on a structure or a
+ * pointer to one and can be used as a place, (setf (particle-x p) 1.0), and
+ * (make-particle :x 1.0 :y 2.0) builds a value with missing fields set to 0.
+ *
+ * Fields are sorted by decreasing alignment to remove padding unless the
+ * structure is (ordered) or (packed); (align N) raises the alignment of the
+ * whole structure. (hot a b) keeps only the named fields in the structure and
+ * moves the others to a NAME_cold structure allocated by make-NAME and
+ * released by (destroy-NAME v), so that arrays of the structure only carry
+ * the fields touched on the fast path.
+ *
+ * With (soa N) arrays of the structure are stored as blocks of N elements,
+ * each block holding one array per field, and (particle-x (aref ps i))
+ * becomes ps[i / N].x[i % N]. A block size at least as large as the
+ * collection gives a plain structure of arrays.
+ */
+
+extern const char *lcc_current_file;
+
+struct struct_info {
+  struct tree *decl;
+  int size, align; // size is -1 when a field has a type of unknown size
+};
+
+struct accessor {
+  char *name;
+  struct struct_info *info;
+  struct tree *field;
+  bool cold;
+};
+
+struct struct_scope {
+  char *name;
+  struct tree *type;
+};
+
+/* a type without owning a tree, so that elements of arrays can be named */
+struct type_view {
+  struct type_id *id;
+  struct type_ptr *ptr;
+};
+
+static struct hashmap_s structs;
+static struct hashmap_s accessors;
+static struct tree *functions;
+static bool cold_used = false;
+
+static struct struct_scope *scope = NULL;
+static int n_scope = 0, cap_scope = 0;
+
+static void push_scope(char *name, struct tree *type) {
+  if (n_scope >= cap_scope) {
+    cap_scope = cap_scope == 0 ? 32 : cap_scope * 2;
+    scope = realloc(scope, cap_scope * sizeof(struct struct_scope));
+  }
+  scope[n_scope++] = (struct struct_scope){name, type};
+}
+
+static struct tree *lookup(char *name) {
+  for (int i = n_scope - 1; i >= 0; i--) {
+    if (strcmp(scope[i].name, name) == 0)
+      return scope[i].type;
+  }
+  return NULL;
+}
+
+static struct struct_info *find_struct(const char *name) {
+  if (name == NULL)
+    return NULL;
+  return hashmap_get(&structs, name, strlen(name));
+}
+
+static struct tree *find_field(struct tree *decl, const char *name,
+                               bool *cold) {
+  *cold = false;
+  for (struct tree *list = decl->struct_decl.fields; list != NULL;
+       list = list == decl->struct_decl.fields ? decl->struct_decl.cold
+                                               : NULL) {
+    for (struct tree *field = list; field != NULL; field = field->next) {
+      if (strcmp(field->var_decl.name, name) == 0)
+        return field;
+    }
+    *cold = true;
+  }
+  return NULL;
+}
+
+/* layout */
+
+static bool field_layout(struct tree *type, int *size, int *align) {
+  int count = 1;
+  for (struct type_ptr *ptr = type->type_expr.ptr; ptr != NULL;
+       ptr = ptr->next) {
+    if (ptr->type != SIZED_PTR) {
+      *size = count * 8;
+      *align = 8;
+      return true;
+    }
+    count *= ptr->size;
+  }
+  int elem = type_id_size(type->type_expr.id);
+  int elem_align = elem;
+  if (elem <= 0) {
+    struct struct_info *info = find_struct(type->type_expr.id->name);
+    if (info == NULL || info->size < 0)
+      return false;
+    elem = info->size;
+    elem_align = info->align;
+  }
+  *size = count * elem;
+  *align = elem_align;
+  return true;
+}
+
+static int round_up(int n, int align) { return (n + align - 1) / align * align; }
+
+/* the size of a structure holding the fields, -1 if one of them is unknown */
+static int layout_size(struct tree *fields, bool cold_ptr, bool packed,
+                       int *align_out) {
+  int offset = 0, align = 1;
+  for (struct tree *field = fields; field != NULL; field = field->next) {
+    int size, field_align;
+    if (!field_layout(field->var_decl.type, &size, &field_align))
+      return -1;
+    if (packed)
+      field_align = 1;
+    offset = round_up(offset, field_align) + size;
+    if (field_align > align)
+      align = field_align;
+  }
+  if (cold_ptr) {
+    int ptr_align = packed ? 1 : 8;
+    offset = round_up(offset, ptr_align) + 8;
+    if (ptr_align > align)
+      align = ptr_align;
+  }
+  if (align_out != NULL)
+    *align_out = align;
+  return round_up(offset, align);
+}
+
+/* a stable sort by decreasing alignment leaves no padding between fields
+ * whose sizes are multiples of their power of two alignments */
+static struct tree *sort_fields(struct tree *fields) {
+  int n = 0;
+  for (struct tree *field = fields; field != NULL; field = field->next)
+    n++;
+  if (n < 2)
+    return fields;
+  struct tree **sorted = malloc(n * sizeof(struct tree *));
+  int *aligns = malloc(n * sizeof(int));
+  int i = 0;
+  for (struct tree *field = fields; field != NULL; field = field->next, i++) {
+    int size, align;
+    field_layout(field->var_decl.type, &size, &align);
+    int j = i;
+    for (; j > 0 && aligns[j - 1] < align; j--) {
+      sorted[j] = sorted[j - 1];
+      aligns[j] = aligns[j - 1];
+    }
+    sorted[j] = field;
+    aligns[j] = align;
+  }
+  for (i = 0; i < n - 1; i++)
+    sorted[i]->next = sorted[i + 1];
+  sorted[n - 1]->next = NULL;
+  fields = sorted[0];
+  free(sorted);
+  free(aligns);
+  return fields;
+}
+
+static bool option_int(struct tree *attr, int *value) {
+  struct tree *arg = attr->attr_decl.args;
+  if (arg == NULL || arg->next != NULL || arg->type != REFERENCE_EXPR ||
+      arg->reference_expr.type != INTEGER_CST ||
+      arg->reference_expr.ival <= 0) {
+    errorat("%s expects a positive integer", lcc_current_file,
+            attr->loc.first_line, attr->loc.first_column,
+            attr->attr_decl.name);
+    return false;
+  }
+  *value = arg->reference_expr.ival;
+  return true;
+}
+
+static bool check_fields(struct tree *t) {
+  bool ok = true;
+  for (struct tree *field = t->struct_decl.fields; field != NULL;
+       field = field->next) {
+    for (struct tree *other = field->next; other != NULL;
+         other = other->next) {
+      if (strcmp(field->var_decl.name, other->var_decl.name) == 0) {
+        errorat("field '%s' is defined twice", lcc_current_file,
+                other->loc.first_line, other->loc.first_column,
+                other->var_decl.name);
+        ok = false;
+      }
+    }
+    bool pointer = false;
+    for (struct type_ptr *ptr = field->var_decl.type->type_expr.ptr;
+         ptr != NULL; ptr = ptr->next) {
+      if (ptr->type == STRIDED_PTR || (pointer && ptr->type == SIZED_PTR)) {
+        errorat("field '%s' cannot hold strided arrays or pointers to arrays",
+                lcc_current_file, field->loc.first_line,
+                field->loc.first_column, field->var_decl.name);
+        ok = false;
+        break;
+      }
+      pointer |= ptr->type != SIZED_PTR;
+    }
+    struct struct_info *info =
+        find_struct(field->var_decl.type->type_expr.id->name);
+    if (info != NULL && info->decl->struct_decl.soa > 0) {
+      errorat("field '%s' cannot hold the soa structure %s", lcc_current_file,
+              field->loc.first_line, field->loc.first_column,
+              field->var_decl.name, info->decl->struct_decl.name);
+      ok = false;
+    }
+  }
+  return ok;
+}
+
+static bool is_listed(struct tree *symbols, const char *name) {
+  for (struct tree *symbol = symbols; symbol != NULL; symbol = symbol->next) {
+    if (symbol->type == REFERENCE_EXPR &&
+        symbol->reference_expr.type == VAR_REF &&
+        strcmp(symbol->reference_expr.symbol, name) == 0)
+      return true;
+  }
+  return false;
+}
+
+/* moves the fields not named by (hot ...) to the cold list */
+static void split_cold(struct tree *t, struct tree *hot) {
+  for (struct tree *symbol = hot->attr_decl.args; symbol != NULL;
+       symbol = symbol->next) {
+    bool cold;
+    if (symbol->type != REFERENCE_EXPR ||
+        symbol->reference_expr.type != VAR_REF ||
+        find_field(t, symbol->reference_expr.symbol, &cold) == NULL) {
+      errorat("hot expects fields of %s", lcc_current_file,
+              symbol->loc.first_line, symbol->loc.first_column,
+              t->struct_decl.name);
+      return;
+    }
+  }
+  struct tree *fields = NULL, *cold = NULL;
+  for (struct tree *field = t->struct_decl.fields, *next; field != NULL;
+       field = next) {
+    next = field->next;
+    field->next = NULL;
+    if (is_listed(hot->attr_decl.args, field->var_decl.name))
+      fields = append_tree(field, fields);
+    else
+      cold = append_tree(field, cold);
+  }
+  t->struct_decl.fields = fields;
+  t->struct_decl.cold = cold;
+}
+
+static void add_accessor(struct struct_info *info, struct tree *field,
+                         bool cold) {
+  size_t len = strlen(info->decl->struct_decl.name) +
+               strlen(field->var_decl.name) + 2;
+  struct accessor *acc = calloc(1, sizeof(struct accessor));
+  acc->name = malloc(len);
+  snprintf(acc->name, len, "%s_%s", info->decl->struct_decl.name,
+           field->var_decl.name);
+  acc->info = info;
+  acc->field = field;
+  acc->cold = cold;
+  hashmap_put(&accessors, acc->name, strlen(acc->name), acc);
+}
+
+static void layout_struct(struct tree *t) {
+  char *name = t->struct_decl.name;
+  if (find_struct(name) != NULL) {
+    errorat("structure '%s' is already defined", lcc_current_file,
+            t->loc.first_line, t->loc.first_column, name);
+    return;
+  }
+  if (!check_fields(t))
+    return;
+
+  bool ordered = false;
+  struct tree *hot = NULL;
+  for (struct tree *attr = t->struct_decl.attrs; attr != NULL;
+       attr = attr->next) {
+    char *option = attr->attr_decl.name;
+    if (strcmp(option, "packed") == 0 && attr->attr_decl.args == NULL) {
+      t->struct_decl.packed = true;
+    } else if (strcmp(option, "ordered") == 0 &&
+               attr->attr_decl.args == NULL) {
+      ordered = true;
+    } else if (strcmp(option, "align") == 0) {
+      int align;
+      if (!option_int(attr, &align))
+        continue;
+      if (align & (align - 1)) {
+        errorat("align expects a power of two", lcc_current_file,
+                attr->loc.first_line, attr->loc.first_column);
+        continue;
+      }
+      t->struct_decl.align = align;
+    } else if (strcmp(option, "soa") == 0) {
+      option_int(attr, &t->struct_decl.soa);
+    } else if (strcmp(option, "hot") == 0) {
+      hot = attr;
+    } else {
+      errorat("unknown defstruct option '%s'", lcc_current_file,
+              attr->loc.first_line, attr->loc.first_column, option);
+    }
+  }
+  if (hot != NULL && t->struct_decl.soa > 0) {
+    errorat("the fields of the soa structure %s are already split",
+            lcc_current_file, hot->loc.first_line, hot->loc.first_column, name);
+    hot = NULL;
+  }
+  if (hot != NULL)
+    split_cold(t, hot);
+  if (t->struct_decl.cold != NULL)
+    cold_used = true;
+
+  bool cold_ptr = t->struct_decl.cold != NULL;
+  int before = layout_size(t->struct_decl.fields, cold_ptr,
+                           t->struct_decl.packed, NULL);
+  if (!ordered && !t->struct_decl.packed && t->struct_decl.soa == 0 &&
+      before > 0) {
+    t->struct_decl.fields = sort_fields(t->struct_decl.fields);
+    if (layout_size(t->struct_decl.cold, false, false, NULL) > 0)
+      t->struct_decl.cold = sort_fields(t->struct_decl.cold);
+    int after = layout_size(t->struct_decl.fields, cold_ptr, false, NULL);
+    if (after < before)
+      info("%s:%d: reordered the fields of %s, %d -> %d bytes",
+           lcc_current_file, t->loc.first_line, name, before, after);
+  }
+
+  struct struct_info *info = calloc(1, sizeof(struct struct_info));
+  info->decl = t;
+  info->size = layout_size(t->struct_decl.fields, cold_ptr,
+                           t->struct_decl.packed, &info->align);
+  if (t->struct_decl.align > info->align)
+    info->align = t->struct_decl.align;
+  if (info->size > 0)
+    info->size = round_up(info->size, info->align);
+  hashmap_put(&structs, name, strlen(name), info);
+
+  for (struct tree *field = t->struct_decl.fields; field != NULL;
+       field = field->next)
+    add_accessor(info, field, false);
+  for (struct tree *field = t->struct_decl.cold; field != NULL;
+       field = field->next)
+    add_accessor(info, field, true);
+}
+
+/* types of expressions */
+
+static struct type_view view_of(struct tree *type) {
+  struct type_view view = {NULL, NULL};
+  if (type != NULL && type->type == TYPE_EXPR &&
+      type->type_expr.id->modifier != MOD_MONOMORPH) {
+    view.id = type->type_expr.id;
+    view.ptr = type->type_expr.ptr;
+  }
+  return view;
+}
+
+static struct tree *find_fn(const char *name) {
+  for (struct tree *head = functions; head != NULL; head = head->next) {
+    if (head->type == FN_DECL && strcmp(head->fn_decl.name, name) == 0)
+      return head;
+  }
+  return NULL;
+}
+
+static struct type_view type_of(struct tree *t) {
+  struct type_view view = {NULL, NULL};
+  switch (t->type) {
+  case REFERENCE_EXPR:
+    if (t->reference_expr.type == VAR_REF)
+      return view_of(lookup(t->reference_expr.symbol));
+    if (t->reference_expr.type == FN_CALL) {
+      struct tree *fn = find_fn(t->reference_expr.call.name);
+      if (fn != NULL)
+        return view_of(fn->fn_decl.type);
+    }
+    return view;
+  case AREF_EXPR:
+    view = type_of(t->ref_expr.expr);
+    int n_indices = 0;
+    for (struct tree *index = t->ref_expr.indices; index != NULL;
+         index = index->next)
+      n_indices++;
+    for (int i = 0; i < (n_indices == 0 ? 1 : n_indices); i++) {
+      if (view.ptr == NULL)
+        return (struct type_view){NULL, NULL};
+      view.ptr = view.ptr->next;
+    }
+    return view;
+  case FIELD_EXPR:
+    view = type_of(t->field_expr.expr);
+    struct struct_info *info = view.id != NULL ? find_struct(view.id->name)
+                                               : NULL;
+    bool cold;
+    struct tree *field = info != NULL ? find_field(info->decl,
+                                                   t->field_expr.field, &cold)
+                                      : NULL;
+    return view_of(field != NULL ? field->var_decl.type : NULL);
+  case CAST_EXPR:
+    return view_of(t->cast_expr.type);
+  default:
+    return view;
+  }
+}
+
+/* accessors and constructors */
+
+static void lower(struct tree **slot);
+static void lower_chain(struct tree **chain) {
+  for (struct tree **slot = chain; *slot != NULL; slot = &(*slot)->next)
+    lower(slot);
+}
+
+static void replace(struct tree **slot, struct tree *t) {
+  struct tree *old = *slot;
+  t->next = old->next;
+  old->next = NULL;
+  destroy_tree(old);
+  *slot = t;
+}
+
+static bool simple_index(struct tree *t) {
+  switch (t->type) {
+  case REFERENCE_EXPR:
+    return t->reference_expr.type == VAR_REF ||
+           t->reference_expr.type == INTEGER_CST;
+  case BINOP_EXPR:
+    for (struct tree *body = t->binop_expr.body; body != NULL;
+         body = body->next) {
+      if (!simple_index(body))
+        return false;
+    }
+    return true;
+  default:
+    return false;
+  }
+}
+
+static struct tree *copy_index(struct tree *t) {
+  if (t->type == BINOP_EXPR) {
+    struct tree *body = NULL;
+    for (struct tree *operand = t->binop_expr.body; operand != NULL;
+         operand = operand->next)
+      body = append_tree(copy_index(operand), body);
+    return build_binop(t->loc, t->binop_expr.op, body);
+  }
+  if (t->reference_expr.type == INTEGER_CST)
+    return build_int_cst(t->loc, t->reference_expr.ival);
+  return build_var_ref(t->loc, strdup(t->reference_expr.symbol));
+}
+
+static bool is_soa_collection(struct type_view view, struct tree *decl) {
+  return view.id != NULL && view.id->name != NULL &&
+         strcmp(view.id->name, decl->struct_decl.name) == 0 &&
+         view.ptr != NULL && view.ptr->next == NULL &&
+         view.ptr->type != STRIDED_PTR;
+}
+
+/* (NAME-f (aref ps i)) => ps[i / N].f[i % N] */
+static void lower_soa_access(struct tree **slot, struct accessor *acc) {
+  struct tree *t = *slot;
+  struct tree *aref = t->reference_expr.call.args;
+  struct tree *decl = acc->info->decl;
+  if (aref->type != AREF_EXPR || aref->ref_expr.indices == NULL ||
+      aref->ref_expr.indices->next != NULL ||
+      !is_soa_collection(type_of(aref->ref_expr.expr), decl)) {
+    errorat("%s is stored as a structure of arrays, use (%s (aref "
+            "collection index))",
+            lcc_current_file, t->loc.first_line, t->loc.first_column,
+            decl->struct_decl.name, acc->name);
+    return;
+  }
+  lower(&aref->ref_expr.indices);
+  struct tree *index = aref->ref_expr.indices;
+  if (!simple_index(index)) {
+    errorat("the index into a soa collection must be a variable, a constant "
+            "or arithmetic on them",
+            lcc_current_file, index->loc.first_line, index->loc.first_column);
+    return;
+  }
+
+  struct location loc = t->loc;
+  int n = decl->struct_decl.soa;
+  struct tree *lane = build_binop(
+      loc, '%', append_tree(build_int_cst(loc, n), copy_index(index)));
+  struct tree *block =
+      build_binop(loc, '/', append_tree(build_int_cst(loc, n), index));
+  struct tree *elem = build_aref(loc, aref->ref_expr.expr, block);
+  aref->ref_expr.expr = NULL;
+  aref->ref_expr.indices = NULL;
+  struct tree *field =
+      build_field_ref(loc, elem, strdup(acc->field->var_decl.name), false);
+  replace(slot, build_aref(loc, field, lane));
+}
+
+static void lower_accessor(struct tree **slot, struct accessor *acc) {
+  struct tree *t = *slot;
+  struct tree *arg = t->reference_expr.call.args;
+  struct tree *decl = acc->info->decl;
+  if (arg == NULL || arg->next != NULL || arg->type == LAMBDA_KEY) {
+    errorat("%s takes one argument", lcc_current_file, t->loc.first_line,
+            t->loc.first_column, acc->name);
+    return;
+  }
+  if (decl->struct_decl.soa > 0) {
+    lower_soa_access(slot, acc);
+    return;
+  }
+  lower(&t->reference_expr.call.args);
+  arg = t->reference_expr.call.args;
+
+  // values of unknown type are taken to be structures
+  bool indirect = false;
+  struct type_view view = type_of(arg);
+  if (view.id != NULL) {
+    if (view.id->name == NULL ||
+        strcmp(view.id->name, decl->struct_decl.name) != 0 ||
+        (view.ptr != NULL &&
+         (view.ptr->next != NULL || view.ptr->type == SIZED_PTR))) {
+      errorat("%s expects a %s or a pointer to one", lcc_current_file,
+              arg->loc.first_line, arg->loc.first_column, acc->name,
+              decl->struct_decl.name);
+      return;
+    }
+    indirect = view.ptr != NULL;
+  }
+
+  t->reference_expr.call.args = NULL;
+  struct tree *ref = arg;
+  if (acc->cold) {
+    ref = build_field_ref(t->loc, ref, strdup("_cold"), indirect);
+    indirect = true;
+  }
+  replace(slot, build_field_ref(t->loc, ref, strdup(acc->field->var_decl.name),
+                                indirect));
+}
+
+static struct tree *take_key(struct tree **args, const char *name) {
+  for (struct tree *arg = *args; arg != NULL; arg = arg->next) {
+    if (arg->type != LAMBDA_KEY || arg->lambda_key.expr == NULL)
+      continue;
+    char *key = strdup(arg->lambda_key.key_name);
+    translate_to_var_name(key);
+    bool found = strcmp(key, name) == 0;
+    free(key);
+    if (found) {
+      struct tree *value = arg->lambda_key.expr;
+      arg->lambda_key.expr = NULL;
+      return value;
+    }
+  }
+  return NULL;
+}
+
+/* (make-NAME :f v ...) passes every field that is not an array in order */
+static void lower_constructor(struct tree *t, struct struct_info *info) {
+  struct tree *decl = info->decl;
+  struct tree *args = t->reference_expr.call.args;
+  if (decl->struct_decl.soa > 0) {
+    errorat("%s is stored as a structure of arrays and has no element values",
+            lcc_current_file, t->loc.first_line, t->loc.first_column,
+            decl->struct_decl.name);
+    return;
+  }
+  for (struct tree *arg = args; arg != NULL; arg = arg->next) {
+    bool cold;
+    char *key = arg->type == LAMBDA_KEY ? strdup(arg->lambda_key.key_name)
+                                        : NULL;
+    if (key != NULL)
+      translate_to_var_name(key);
+    struct tree *field = key != NULL ? find_field(decl, key, &cold) : NULL;
+    if (arg->type != LAMBDA_KEY) {
+      errorat("make-%s takes :field value pairs", lcc_current_file,
+              arg->loc.first_line, arg->loc.first_column,
+              decl->struct_decl.name);
+    } else if (field == NULL) {
+      errorat("%s has no field '%s'", lcc_current_file, arg->loc.first_line,
+              arg->loc.first_column, decl->struct_decl.name, key);
+    } else if (field->var_decl.type->type_expr.ptr != NULL &&
+               field->var_decl.type->type_expr.ptr->type == SIZED_PTR) {
+      errorat("array field '%s' is zero initialised", lcc_current_file,
+              arg->loc.first_line, arg->loc.first_column, key);
+    }
+    free(key);
+  }
+  if (n_errors > 0)
+    return;
+
+  struct tree *values = NULL;
+  for (struct tree *list = decl->struct_decl.fields; list != NULL;
+       list = list == decl->struct_decl.fields ? decl->struct_decl.cold
+                                               : NULL) {
+    for (struct tree *field = list; field != NULL; field = field->next) {
+      struct type_ptr *ptr = field->var_decl.type->type_expr.ptr;
+      if (ptr != NULL && ptr->type == SIZED_PTR)
+        continue;
+      struct tree *value = take_key(&args, field->var_decl.name);
+      if (value == NULL && ptr == NULL &&
+          find_struct(field->var_decl.type->type_expr.id->name) != NULL) {
+        errorat("make-%s needs a value for the structure field '%s'",
+                lcc_current_file, t->loc.first_line, t->loc.first_column,
+                decl->struct_decl.name, field->var_decl.name);
+        continue;
+      }
+      if (value == NULL)
+        value = build_int_cst(t->loc, 0);
+      lower(&value);
+      values = append_tree(value, values);
+    }
+  }
+  destroy_tree(args);
+  t->reference_expr.call.args = values;
+}
+
+static void lower_call(struct tree **slot) {
+  struct tree *t = *slot;
+  char *name = t->reference_expr.call.name;
+  if (find_fn(name) == NULL) {
+    struct accessor *acc = hashmap_get(&accessors, name, strlen(name));
+    if (acc != NULL) {
+      lower_accessor(slot, acc);
+      return;
+    }
+    if (strncmp(name, "make_", 5) == 0) {
+      struct struct_info *info = find_struct(&name[5]);
+      if (info != NULL) {
+        lower_constructor(t, info);
+        return;
+      }
+    }
+  }
+  for (struct tree **arg = &t->reference_expr.call.args; *arg != NULL;
+       arg = &(*arg)->next) {
+    if ((*arg)->type == LAMBDA_KEY)
+      lower(&(*arg)->lambda_key.expr);
+    else
+      lower(arg);
+  }
+}
+
+static void check_element(struct tree *t) {
+  struct type_view view = type_of(t->ref_expr.expr);
+  if (view.id == NULL)
+    return;
+  struct struct_info *info = find_struct(view.id->name);
+  if (info != NULL && info->decl->struct_decl.soa > 0 &&
+      is_soa_collection(view, info->decl))
+    errorat("elements of the soa collection are only reached through the "
+            "accessors of %s",
+            lcc_current_file, t->loc.first_line, t->loc.first_column,
+            info->decl->struct_decl.name);
+}
+
+static void lower(struct tree **slot) {
+  struct tree *t = *slot;
+  if (t == NULL)
+    return;
+  int saved = n_scope;
+  switch (t->type) {
+  case VAR_DECL:
+  case PARM_DECL:
+    lower(&t->var_decl.value);
+    push_scope(t->var_decl.name, t->var_decl.type);
+    // declarations stay visible for the rest of the enclosing body
+    return;
+  case SET_EXPR:
+    lower(&t->set_expr.var);
+    lower(&t->set_expr.value);
+    break;
+  case AREF_EXPR:
+    check_element(t);
+    lower(&t->ref_expr.expr);
+    lower_chain(&t->ref_expr.indices);
+    break;
+  case ADDR_EXPR:
+    lower(&t->ref_expr.expr);
+    break;
+  case CAST_EXPR:
+    lower(&t->cast_expr.expr);
+    break;
+  case LIST_EXPR:
+    lower_chain(&t->list_expr.elems);
+    break;
+  case BINOP_EXPR:
+    lower_chain(&t->binop_expr.body);
+    break;
+  case COMPARE_EXPR:
+    lower(&t->compare_expr.lhs);
+    lower(&t->compare_expr.rhs);
+    break;
+  case REFERENCE_EXPR:
+    if (t->reference_expr.type == FN_CALL)
+      lower_call(slot);
+    break;
+  case LET_STMT:
+    lower_chain(&t->let_stmt.vars);
+    lower_chain(&t->let_stmt.body);
+    break;
+  case IF_STMT:
+    lower(&t->if_else_stmt.condition);
+    lower_chain(&t->if_else_stmt.if_block);
+    n_scope = saved;
+    lower_chain(&t->if_else_stmt.else_block);
+    break;
+  case COND_STMT:
+    for (struct tree *expr = t->cond_stmt.exprs; expr != NULL;
+         expr = expr->next) {
+      lower(&expr->cond_expr.condition);
+      lower_chain(&expr->cond_expr.body);
+      n_scope = saved;
+    }
+    break;
+  case CASE_STMT:
+    lower(&t->case_stmt.expr);
+    for (struct tree *c = t->case_stmt.cases; c != NULL; c = c->next) {
+      lower_chain(&c->case_expr.body);
+      n_scope = saved;
+    }
+    break;
+  case WHILE_STMT:
+  case DOWHILE_STMT:
+    lower(&t->while_stmt.condition);
+    lower_chain(&t->while_stmt.body);
+    break;
+  case FOR_STMT:
+    lower_chain(&t->for_stmt.vars);
+    lower(&t->for_stmt.condition);
+    lower(&t->for_stmt.loop_eval);
+    lower_chain(&t->for_stmt.body);
+    break;
+  default:
+    break;
+  }
+  n_scope = saved;
+}
+
+static void lower_params(struct tree *chain) {
+  for (struct tree *parm = chain; parm != NULL; parm = parm->next) {
+    struct tree *decl = parm->type == LAMBDA_KEY ? parm->lambda_key.expr : parm;
+    if (decl != NULL &&
+        (decl->type == VAR_DECL || decl->type == PARM_DECL)) {
+      lower(&decl->var_decl.value);
+      push_scope(decl->var_decl.name, decl->var_decl.type);
+    }
+  }
+}
+
+/* [M]NAME of a soa structure becomes [ceil(M / N)]NAME_soa */
+static void rewrite_type(struct tree *type) {
+  if (type == NULL || type->type != TYPE_EXPR)
+    return;
+  struct struct_info *info = find_struct(type->type_expr.id->name);
+  if (info == NULL || info->decl->struct_decl.soa == 0)
+    return;
+  struct type_ptr *ptr = type->type_expr.ptr;
+  if (ptr == NULL || ptr->next != NULL || ptr->type == STRIDED_PTR) {
+    errorat("the soa structure %s is only stored in one dimensional arrays",
+            lcc_current_file, type->loc.first_line, type->loc.first_column,
+            info->decl->struct_decl.name);
+    return;
+  }
+  int n = info->decl->struct_decl.soa;
+  if (ptr->type == SIZED_PTR)
+    ptr->size = (ptr->size + n - 1) / n;
+  size_t len = strlen(type->type_expr.id->name) + sizeof("_soa");
+  char *name = malloc(len);
+  snprintf(name, len, "%s_soa", type->type_expr.id->name);
+  free(type->type_expr.id->name);
+  type->type_expr.id->name = name;
+}
+
+static bool rewrite_types(struct tree *t, void *data) {
+  switch (t->type) {
+  case FN_DECL:
+    rewrite_type(t->fn_decl.type);
+    break;
+  case VAR_DECL:
+  case PARM_DECL:
+    rewrite_type(t->var_decl.type);
+    break;
+  case CAST_EXPR:
+    rewrite_type(t->cast_expr.type);
+    break;
+  case LIST_EXPR:
+    rewrite_type(t->list_expr.type);
+    break;
+  default:
+    break;
+  }
+  return true;
+}
+
+static int free_struct_info(void *const context, void *const value) {
+  free(value);
+  return 1;
+}
+
+static int free_accessor(void *const context, void *const value) {
+  struct accessor *acc = value;
+  free(acc->name);
+  free(acc);
+  return 1;
+}
+
+void lower_structs(struct tree *t) {
+  bool any = false;
+  for (struct tree *head = t; head != NULL && !any; head = head->next)
+    any = head->type == STRUCT_DECL;
+  if (!any)
+    return;
+  if (hashmap_create(64, &structs) != 0 ||
+      hashmap_create(256, &accessors) != 0) {
+    error("Failed to create hashmap.");
+    return;
+  }
+  functions = t;
+
+  for (struct tree *head = t; head != NULL; head = head->next) {
+    if (head->type == STRUCT_DECL)
+      layout_struct(head);
+  }
+  if (n_errors == 0) {
+    for (struct tree *head = t; head != NULL; head = head->next) {
+      if (head->type == VAR_DECL)
+        push_scope(head->var_decl.name, head->var_decl.type);
+    }
+    int globals = n_scope;
+    for (struct tree **slot = &t; *slot != NULL; slot = &(*slot)->next) {
+      struct tree *head = *slot;
+      if (head->type == VAR_DECL) {
+        lower(&head->var_decl.value);
+        continue;
+      }
+      if (head->type != FN_DECL || head->fn_decl.arglist == NULL)
+        continue;
+      struct tree *list = head->fn_decl.arglist;
+      lower_params(list->lambda_list.args);
+      lower_params(list->lambda_list.optionals);
+      lower_params(list->lambda_list.keys);
+      lower_params(list->lambda_list.aux);
+      lower_chain(&head->fn_decl.body);
+      n_scope = globals;
+    }
+    walk_tree(t, rewrite_types, NULL);
+  }
+  free(scope);
+  scope = NULL;
+  n_scope = cap_scope = 0;
+
+  hashmap_iterate(&accessors, free_accessor, NULL);
+  hashmap_destroy(&accessors);
+  hashmap_iterate(&structs, free_struct_info, NULL);
+  hashmap_destroy(&structs);
+}
+
+void print_struct_header(bool emit_asm) {
+  if (cold_used && !emit_asm)
+    fprintf(stdout, "#include <stdlib.h>\n");
+}
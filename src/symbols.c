@@ -0,0 +1,67 @@
+#include "debug.h"
+#include "tree.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/*
+ * The symbol map written next to the output with -g or --symbol-map: one
+ * line per function of the program, tab separated,
+ *
+ *   <C symbol>  <LCC name>  <file>:<line>:<column>
+ *
+ * so that the names perf, gdb and the like print for the generated C, where
+ * my-fn became my_fn and lambdas and spawns became functions of their own,
+ * can be taken back to the .lc source.
+ */
+
+extern const char *lcc_current_file;
+
+const char *symbol_map = NULL;
+
+static void write_symbol(FILE *f, const char *symbol, const char *name,
+                         const char *suffix, struct location loc) {
+  fprintf(f, "%s%s\t%s%s\t%s:%d:%d\n", symbol, suffix,
+          name != NULL ? name : symbol, suffix[0] != '\0' ? " (resume)" : "",
+          lcc_current_file, loc.first_line, loc.first_column);
+}
+
+void write_symbol_map(struct tree *t) {
+  if (symbol_map == NULL)
+    return;
+  char buf[4096];
+  const char *path = symbol_map;
+  if (path[0] == '\0') {
+    snprintf(buf, sizeof(buf), "%s.symbols", lcc_current_file);
+    path = buf;
+  }
+  FILE *f = fopen(path, "w");
+  if (f == NULL) {
+    error("cannot write the symbol map to '%s'", path);
+    return;
+  }
+  fprintf(f, "# C symbol\tLCC name\tlocation\n");
+  for (struct tree *head = t; head != NULL; head = head->next) {
+    switch (head->type) {
+    case FN_DECL:
+      if (head->fn_decl.arglist == NULL ||
+          (head->fn_decl.body == NULL &&
+           head->fn_decl.arglist->lambda_list.aux == NULL))
+        break; // a prototype
+      write_symbol(f, head->fn_decl.name, head->fn_decl.source_name, "",
+                   head->loc);
+      break;
+    case CORO_DECL:
+      write_symbol(f, head->coro_decl.name, head->coro_decl.source_name, "",
+                   head->loc);
+      write_symbol(f, head->coro_decl.name, head->coro_decl.source_name,
+                   "_resume", head->loc);
+      break;
+    default:
+      break;
+    }
+  }
+  fclose(f);
+}
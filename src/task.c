@@ -0,0 +1,745 @@
+#include "debug.h"
+#include "opt.h"
+#include "tree.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hashmap.h"
+
+/*
+ * Fork-join parallelism.
+ *
+ *   (defun fib (n)
+ *     (declare (type i32 n fib) (grain 8))
+ *     (if (< n 2) (return n))
+ *     (let ((a 0) (b 0))
+ *       (declare (type i32 a b))
+ *       (setf a (spawn (fib (- n 1))))
+ *       (setf b (fib (- n 2)))
+ *       (sync)
+ *       (return (+ a b))))
+ *
+ * (spawn (f args...)) evaluates the arguments, packs them into a task and
+ * pushes it on the deque of the current worker, where idle workers can steal
+ * it, and (setf x (spawn ...)) stores the result of f in x. (sync) waits for
+ * every task the function has spawned, running queued tasks meanwhile, and
+ * is implied before each return and at the end of the function, as well as
+ * at the end of the let or for that declares a variable receiving a result.
+ * (declare (grain N)) calls f directly instead while the worker already has
+ * N tasks waiting, which stops the splitting near the leaves of a recursion.
+ *
+ * Every spawn becomes a (ordered) defstruct _spawnN, holding the task header,
+ * where the result goes and the arguments, and a function _spawnN_run that
+ * makes the call. The runtime is printed ahead of the program: one
+ * Chase-Lev deque per worker and a pthread per core, or per LCC_WORKERS, the
+ * thread that spawns first becoming worker 0. Link with -pthread.
+ */
+
+extern const char *lcc_current_file;
+
+static struct tree *pending = NULL, *pending_end = NULL;
+static struct hashmap_s declared;
+static bool tasks_used = false;
+static int n_spawns = 0;
+static struct tree *functions;
+
+static struct tree *current_fn = NULL;
+static struct tree *grain = NULL;
+
+struct binding {
+  const char *name;
+  struct tree *owner;
+};
+
+static struct binding *scope = NULL;
+static int n_scope = 0, cap_scope = 0;
+static struct tree **synced = NULL;
+static int n_synced = 0, cap_synced = 0;
+
+static void add_pending(struct tree *t) {
+  t->next = NULL;
+  if (pending_end == NULL)
+    pending = pending_end = t;
+  else
+    pending_end = pending_end->next = t;
+}
+
+static void replace(struct tree **slot, struct tree *t) {
+  struct tree *old = *slot;
+  t->next = old->next;
+  old->next = NULL;
+  destroy_tree(old);
+  *slot = t;
+}
+
+static struct tree *copy_type(struct tree *type) {
+  struct tree *copy = build_type_expr(type->loc, build_tid(NULL, MOD_NONE));
+  copy_type_to_type(copy, type);
+  return copy;
+}
+
+static struct tree *named_type(struct location loc, const char *name,
+                               bool ptr) {
+  struct tree *type = build_type_expr(loc, build_tid(strdup(name), MOD_NONE));
+  if (ptr)
+    add_type_ptr(type, SINGLE_PTR, 0);
+  return type;
+}
+
+static bool is_call(struct tree *t, const char *name) {
+  return t != NULL && t->type == REFERENCE_EXPR &&
+         t->reference_expr.type == FN_CALL &&
+         strcmp(t->reference_expr.call.name, name) == 0;
+}
+
+static bool is_void(struct tree *type) {
+  return type->type_expr.ptr == NULL && type->type_expr.id->name != NULL &&
+         strcmp(type->type_expr.id->name, "void") == 0;
+}
+
+static struct tree *find_fn(const char *name) {
+  for (struct tree *head = functions; head != NULL; head = head->next) {
+    if (head->type == FN_DECL && strcmp(head->fn_decl.name, name) == 0)
+      return head;
+  }
+  return NULL;
+}
+
+static void push_scope(struct tree *vars, struct tree *owner) {
+  for (struct tree *var = vars; var != NULL; var = var->next) {
+    if (var->type != VAR_DECL)
+      continue;
+    if (n_scope >= cap_scope) {
+      cap_scope = cap_scope == 0 ? 32 : cap_scope * 2;
+      scope = realloc(scope, cap_scope * sizeof(struct binding));
+    }
+    scope[n_scope++] = (struct binding){var->var_decl.name, owner};
+  }
+}
+
+/* the let or for declaring the variable a result is stored in syncs before
+ * the variable goes out of scope */
+static void need_sync(struct tree *target) {
+  if (target->type != REFERENCE_EXPR ||
+      target->reference_expr.type != VAR_REF)
+    return;
+  for (int i = n_scope - 1; i >= 0; i--) {
+    if (strcmp(scope[i].name, target->reference_expr.symbol) != 0)
+      continue;
+    if (n_synced >= cap_synced) {
+      cap_synced = cap_synced == 0 ? 16 : cap_synced * 2;
+      synced = realloc(synced, cap_synced * sizeof(struct tree *));
+    }
+    synced[n_synced++] = scope[i].owner;
+    return;
+  }
+}
+
+static bool needs_sync(struct tree *owner) {
+  for (int i = 0; i < n_synced; i++) {
+    if (synced[i] == owner)
+      return true;
+  }
+  return false;
+}
+
+static struct tree *build_sync(struct location loc) {
+  return build_fn_call(loc, strdup("lcc_sync"),
+                       build_addr(loc, build_var_ref(loc, strdup("_spawns"))));
+}
+
+static struct tree *task_field(struct location loc, const char *field) {
+  return build_field_ref(loc, build_var_ref(loc, strdup("_s")), strdup(field),
+                         true);
+}
+
+/* _spawnN *_s = (_spawnN *)value */
+static struct tree *task_var(struct location loc, const char *name,
+                             struct tree *value) {
+  return build_var(loc, VAR_DECL, strdup("_s"), named_type(loc, name, true),
+                   build_cast(loc, named_type(loc, name, true), value));
+}
+
+static char *arg_name(int i) {
+  char name[16];
+  snprintf(name, sizeof(name), "a%d", i);
+  return strdup(name);
+}
+
+/* callees defined after the spawning function, itself included, are
+ * declared before the task that calls them */
+static void declare_callee(struct tree *callee) {
+  for (struct tree *head = functions; head != current_fn; head = head->next) {
+    if (head == callee)
+      return;
+  }
+  char *name = callee->fn_decl.name;
+  if (hashmap_get(&declared, name, strlen(name)) != NULL)
+    return;
+  hashmap_put(&declared, name, strlen(name), callee);
+  struct tree *args = callee->fn_decl.arglist;
+  struct tree *params = NULL;
+  for (struct tree *parm = args->lambda_list.args; parm != NULL;
+       parm = parm->next)
+    params = append_tree(copy_tree(parm), params);
+  add_pending(build_fn(callee->loc, strdup(name),
+                       copy_type(callee->fn_decl.type),
+                       build_lambda_list(args->loc, params, NULL, NULL, NULL,
+                                         NULL),
+                       NULL));
+}
+
+/* the task structure and the function running it */
+static bool build_task(struct location loc, const char *name,
+                       struct tree *callee, bool result) {
+  struct tree *fields = build_var(loc, VAR_DECL, strdup("_task"),
+                                  named_type(loc, "lcc_task", false), NULL);
+  if (result) {
+    struct tree *out = copy_type(callee->fn_decl.type);
+    add_type_ptr(out, SINGLE_PTR, 0);
+    fields = append_tree(build_var(loc, VAR_DECL, strdup("_out"), out, NULL),
+                         fields);
+  }
+  struct tree *args = NULL;
+  int i = 0;
+  for (struct tree *parm = callee->fn_decl.arglist->lambda_list.args;
+       parm != NULL; parm = parm->next, i++) {
+    if (is_monomorph(parm->var_decl.type)) {
+      errorat("argument '%s' of %s needs a declared type to be spawned",
+              lcc_current_file, loc.first_line, loc.first_column,
+              parm->var_decl.name, callee->fn_decl.name);
+      destroy_tree(fields);
+      destroy_tree(args);
+      return false;
+    }
+    char *arg = arg_name(i);
+    args = append_tree(task_field(loc, arg), args);
+    fields = append_tree(build_var(loc, VAR_DECL, arg,
+                                   copy_type(parm->var_decl.type), NULL),
+                         fields);
+  }
+  add_pending(build_struct(loc, strdup(name),
+                           build_attr_decl(loc, strdup("ordered"), NULL),
+                           fields));
+  declare_callee(callee);
+
+  struct tree *call =
+      build_fn_call(loc, strdup(callee->fn_decl.name), args);
+  if (result) {
+    call = build_set_expr(
+        loc, build_aref(loc, task_field(loc, "_out"), build_int_cst(loc, 0)),
+        call, 0);
+  }
+  size_t len = strlen(name) + sizeof("_run");
+  char *run = malloc(len);
+  snprintf(run, len, "%s_run", name);
+  struct tree *parm = build_var(loc, PARM_DECL, strdup("_t"),
+                                named_type(loc, "void", true), NULL);
+  struct tree *body = build_let_stmt(
+      loc, task_var(loc, name, build_var_ref(loc, strdup("_t"))), call);
+  struct tree *fn =
+      build_fn(loc, run, named_type(loc, "void", false),
+               build_lambda_list(loc, parm, NULL, NULL, NULL, NULL), body);
+  // named after the spawned function in reports and the symbol map
+  const char *callee_name = callee->fn_decl.source_name;
+  len = strlen(callee_name) + sizeof("spawn ");
+  free(fn->fn_decl.source_name);
+  fn->fn_decl.source_name = malloc(len);
+  snprintf(fn->fn_decl.source_name, len, "spawn %s", callee_name);
+  add_pending(fn);
+  return true;
+}
+
+/* (setf target (spawn (f args...))), target is NULL for a bare spawn */
+static struct tree *lower_spawn(struct tree *spawn, struct tree *target) {
+  struct location loc = spawn->loc;
+  struct tree *call = spawn->reference_expr.call.args;
+  if (call == NULL || call->next != NULL || call->type != REFERENCE_EXPR ||
+      call->reference_expr.type != FN_CALL) {
+    errorat("spawn expects a function call", lcc_current_file,
+            loc.first_line, loc.first_column);
+    return NULL;
+  }
+  struct tree *callee = find_fn(call->reference_expr.call.name);
+  if (callee == NULL) {
+    errorat("cannot spawn %s, only functions of the program can be spawned",
+            lcc_current_file, loc.first_line, loc.first_column,
+            call->reference_expr.call.name);
+    return NULL;
+  }
+  struct tree *list = callee->fn_decl.arglist;
+  if (list->lambda_list.optionals != NULL || list->lambda_list.rest != NULL ||
+      list->lambda_list.keys != NULL || list->lambda_list.aux != NULL) {
+    errorat("cannot spawn %s, spawned functions take required arguments only",
+            lcc_current_file, loc.first_line, loc.first_column,
+            callee->fn_decl.name);
+    return NULL;
+  }
+  int n_params = 0, n_args = 0;
+  for (struct tree *parm = list->lambda_list.args; parm != NULL;
+       parm = parm->next)
+    n_params++;
+  for (struct tree *arg = call->reference_expr.call.args; arg != NULL;
+       arg = arg->next)
+    n_args++;
+  if (n_args != n_params) {
+    errorat("%s takes %d arguments, not %d", lcc_current_file, loc.first_line,
+            loc.first_column, callee->fn_decl.name, n_params, n_args);
+    return NULL;
+  }
+  if (target != NULL && (is_monomorph(callee->fn_decl.type) ||
+                         is_void(callee->fn_decl.type))) {
+    errorat("%s does not declare the type of its result", lcc_current_file,
+            loc.first_line, loc.first_column, callee->fn_decl.name);
+    return NULL;
+  }
+
+  char name[32];
+  snprintf(name, sizeof(name), "_spawn%d", n_spawns++);
+  if (!build_task(loc, name, callee, target != NULL))
+    return NULL;
+
+  // the direct call for small work, before the arguments move to the task
+  struct tree *direct = NULL;
+  if (grain != NULL) {
+    direct = copy_tree(call);
+    if (target != NULL)
+      direct = build_set_expr(loc, copy_tree(target), direct, 0);
+  }
+
+  size_t len = strlen(name) + sizeof("_run");
+  char *run = malloc(len);
+  snprintf(run, len, "%s_run", name);
+  struct tree *new = build_fn_call(loc, strdup("sizeof"),
+                                   named_type(loc, name, false));
+  new->next = build_var_ref(loc, run);
+  new->next->next = build_addr(loc, build_var_ref(loc, strdup("_spawns")));
+  struct tree *body = NULL;
+  if (target != NULL) {
+    need_sync(target);
+    body = build_set_expr(loc, task_field(loc, "_out"),
+                          build_addr(loc, target), 0);
+  }
+  int i = 0;
+  for (struct tree *arg = call->reference_expr.call.args, *next; arg != NULL;
+       arg = next, i++) {
+    next = arg->next;
+    arg->next = NULL;
+    char *field = arg_name(i);
+    body = append_tree(build_set_expr(loc, task_field(loc, field), arg, 0),
+                       body);
+    free(field);
+  }
+  call->reference_expr.call.args = NULL;
+  body = append_tree(build_fn_call(loc, strdup("lcc_spawn"),
+                                   build_var_ref(loc, strdup("_s"))),
+                     body);
+  struct tree *task = build_let_stmt(
+      loc,
+      task_var(loc, name,
+               build_fn_call(loc, strdup("lcc_task_new"), new)),
+      body);
+  if (grain == NULL)
+    return task;
+  return build_if_else_stmt(
+      loc, build_fn_call(loc, strdup("lcc_split"), copy_tree(grain)), task,
+      direct);
+}
+
+static void lower_chain(struct tree **chain);
+
+static void lower_stmt(struct tree **slot) {
+  struct tree *t = *slot;
+  int saved = n_scope;
+  switch (t->type) {
+  case REFERENCE_EXPR:
+    if (is_call(t, "spawn")) {
+      // a spawn that failed is dropped, it was reported already
+      struct tree *task = lower_spawn(t, NULL);
+      replace(slot, task != NULL ? task : build_let_stmt(t->loc, NULL, NULL));
+    } else if (is_call(t, "sync")) {
+      replace(slot, build_sync(t->loc));
+    } else if (is_call(t, "return")) {
+      // the returned value may read results, it follows the sync
+      struct tree *sync = build_sync(t->loc);
+      struct tree *let = build_let_stmt(t->loc, NULL, sync);
+      let->next = t->next;
+      t->next = NULL;
+      sync->next = t;
+      *slot = let;
+    }
+    break;
+  case SET_EXPR:
+    if (t->set_expr.mod == 0 && is_call(t->set_expr.value, "spawn")) {
+      struct tree *target = t->set_expr.var;
+      t->set_expr.var = NULL;
+      struct tree *task = lower_spawn(t->set_expr.value, target);
+      if (task == NULL) {
+        destroy_tree(target);
+        task = build_let_stmt(t->loc, NULL, NULL);
+      }
+      replace(slot, task);
+    }
+    break;
+  case LET_STMT:
+    push_scope(t->let_stmt.vars, t);
+    lower_chain(&t->let_stmt.body);
+    if (needs_sync(t))
+      t->let_stmt.body = append_tree(build_sync(t->loc), t->let_stmt.body);
+    break;
+  case IF_STMT:
+    lower_chain(&t->if_else_stmt.if_block);
+    lower_chain(&t->if_else_stmt.else_block);
+    break;
+  case COND_STMT:
+    for (struct tree *expr = t->cond_stmt.exprs; expr != NULL;
+         expr = expr->next)
+      lower_chain(&expr->cond_expr.body);
+    break;
+  case CASE_STMT:
+    for (struct tree *c = t->case_stmt.cases; c != NULL; c = c->next)
+      lower_chain(&c->case_expr.body);
+    break;
+  case WHILE_STMT:
+  case DOWHILE_STMT:
+    lower_chain(&t->while_stmt.body);
+    break;
+  case FOR_STMT:
+    push_scope(t->for_stmt.vars, t);
+    lower_chain(&t->for_stmt.body);
+    break;
+  case FOREACH_STMT:
+    push_scope(t->foreach_stmt.vars, t);
+    lower_chain(&t->foreach_stmt.body);
+    break;
+  default:
+    break;
+  }
+  n_scope = saved;
+}
+
+static void lower_chain(struct tree **chain) {
+  for (struct tree **slot = chain; *slot != NULL; slot = &(*slot)->next) {
+    lower_stmt(slot);
+    struct tree *t = *slot;
+    if ((t->type == FOR_STMT || t->type == FOREACH_STMT) && needs_sync(t)) {
+      struct tree *sync = build_sync(t->loc);
+      sync->next = t->next;
+      t->next = sync;
+      slot = &t->next;
+    }
+  }
+}
+
+static bool find_tasks(struct tree *t, void *data) {
+  if (is_call(t, "spawn") || is_call(t, "sync"))
+    *(bool *)data = true;
+  return true;
+}
+
+static bool find_spawn(struct tree *t, void *data) {
+  if (is_call(t, "spawn")) {
+    errorat("spawn must be a statement or the value of setf",
+            lcc_current_file, t->loc.first_line, t->loc.first_column);
+  }
+  return true;
+}
+
+static struct tree *find_grain(struct tree *fn) {
+  for (struct tree *t = fn->fn_decl.body; t != NULL; t = t->next) {
+    if (t->type != ATTR_DECL || strcmp(t->attr_decl.name, "grain") != 0)
+      continue;
+    struct tree *n = t->attr_decl.args;
+    if (n == NULL || n->next != NULL || n->type != REFERENCE_EXPR ||
+        n->reference_expr.type != INTEGER_CST ||
+        n->reference_expr.ival < 1) {
+      errorat("grain expects a positive integer", lcc_current_file,
+              t->loc.first_line, t->loc.first_column);
+      return NULL;
+    }
+    return n;
+  }
+  return NULL;
+}
+
+static void lower_fn(struct tree *fn) {
+  bool uses = false;
+  walk_tree(fn->fn_decl.body, find_tasks, &uses);
+  if (!uses)
+    return;
+  current_fn = fn;
+  grain = find_grain(fn);
+  lower_chain(&fn->fn_decl.body);
+  walk_tree(fn->fn_decl.body, find_spawn, NULL);
+
+  struct location loc = fn->loc;
+  struct tree *spawns =
+      build_var(loc, VAR_DECL, strdup("_spawns"),
+                named_type(loc, "lcc_group", false), build_int_cst(loc, 0));
+  spawns->next = fn->fn_decl.body;
+  fn->fn_decl.body = append_tree(build_sync(loc), spawns);
+  n_scope = n_synced = 0;
+  current_fn = NULL;
+  grain = NULL;
+  tasks_used = true;
+}
+
+struct tree *lower_tasks(struct tree *t) {
+  functions = t;
+  if (hashmap_create(16, &declared) != 0)
+    error("Failed to create hashmap.");
+  // the tasks of a function and their callees go before it
+  for (struct tree **slot = &t; *slot != NULL; slot = &(*slot)->next) {
+    struct tree *head = *slot;
+    if (head->type != FN_DECL)
+      continue;
+    lower_fn(head);
+    if (pending != NULL) {
+      pending_end->next = head;
+      *slot = pending;
+      slot = &pending_end->next;
+      pending = pending_end = NULL;
+      functions = t;
+    }
+  }
+  hashmap_destroy(&declared);
+  free(scope);
+  free(synced);
+  scope = NULL;
+  synced = NULL;
+  cap_scope = cap_synced = 0;
+  return t;
+}
+
+void print_task_runtime(bool emit_asm) {
+  if (!tasks_used || emit_asm)
+    return;
+  fprintf(
+      stdout,
+      "#include <pthread.h>\n"
+      "#include <sched.h>\n"
+      "#include <stdatomic.h>\n"
+      "#include <stdint.h>\n"
+      "#include <stdio.h>\n"
+      "#include <stdlib.h>\n"
+      "#include <unistd.h>\n"
+      "typedef atomic_long lcc_group; // tasks spawned and not finished\n"
+      "typedef struct lcc_task {\n"
+      "  void (*run)(void *);\n"
+      "  lcc_group *group;\n"
+      "} lcc_task;\n"
+      "typedef struct lcc_deque_array {\n"
+      "  long size;\n"
+      "  struct lcc_deque_array *prev; // thieves may still read it\n"
+      "  _Atomic(lcc_task *) buf[];\n"
+      "} lcc_deque_array;\n"
+      "typedef struct {\n"
+      "  _Alignas(64) atomic_long top;\n"
+      "  _Alignas(64) atomic_long bottom;\n"
+      "  _Atomic(lcc_deque_array *) array;\n"
+      "} lcc_deque;\n"
+      "static struct {\n"
+      "  int n_workers;\n"
+      "  lcc_deque *deques;\n"
+      "  atomic_long queued; // pushed and not yet taken\n"
+      "  atomic_int sleeping;\n"
+      "  pthread_mutex_t lock;\n"
+      "  pthread_cond_t wake;\n"
+      "} lcc_pool = {0, NULL, 0, 0, PTHREAD_MUTEX_INITIALIZER,\n"
+      "              PTHREAD_COND_INITIALIZER};\n"
+      "static _Thread_local int lcc_worker = -1;\n"
+      "static pthread_once_t lcc_pool_once = PTHREAD_ONCE_INIT;\n"
+      "static void lcc_task_fail(const char *what) {\n"
+      "  fprintf(stderr, \"%s: %%s failed\\n\", what);\n"
+      "  abort();\n"
+      "}\n"
+      "static lcc_deque_array *lcc_deque_array_new(long size) {\n"
+      "  lcc_deque_array *a =\n"
+      "      malloc(sizeof(lcc_deque_array) + size * sizeof(lcc_task *));\n"
+      "  if (a == NULL)\n"
+      "    lcc_task_fail(\"task deque allocation\");\n"
+      "  a->size = size;\n"
+      "  a->prev = NULL;\n"
+      "  return a;\n"
+      "}\n"
+      "static lcc_deque_array *lcc_deque_grow(lcc_deque *d, lcc_deque_array "
+      "*a,\n"
+      "                                       long top, long bottom) {\n"
+      "  lcc_deque_array *b = lcc_deque_array_new(2 * a->size);\n"
+      "  b->prev = a;\n"
+      "  for (long i = top; i < bottom; i++)\n"
+      "    atomic_store_explicit(\n"
+      "        &b->buf[i %% b->size],\n"
+      "        atomic_load_explicit(&a->buf[i %% a->size], "
+      "memory_order_relaxed),\n"
+      "        memory_order_relaxed);\n"
+      "  atomic_store_explicit(&d->array, b, memory_order_release);\n"
+      "  return b;\n"
+      "}\n"
+      "static void lcc_deque_push(lcc_deque *d, lcc_task *t) {\n"
+      "  long b = atomic_load_explicit(&d->bottom, memory_order_relaxed);\n"
+      "  long top = atomic_load_explicit(&d->top, memory_order_acquire);\n"
+      "  lcc_deque_array *a =\n"
+      "      atomic_load_explicit(&d->array, memory_order_relaxed);\n"
+      "  if (b - top > a->size - 1)\n"
+      "    a = lcc_deque_grow(d, a, top, b);\n"
+      "  atomic_store_explicit(&a->buf[b %% a->size], t, "
+      "memory_order_relaxed);\n"
+      "  atomic_thread_fence(memory_order_release);\n"
+      "  atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);\n"
+      "}\n"
+      "static lcc_task *lcc_deque_take(lcc_deque *d) {\n"
+      "  long b = atomic_load_explicit(&d->bottom, memory_order_relaxed) - "
+      "1;\n"
+      "  lcc_deque_array *a =\n"
+      "      atomic_load_explicit(&d->array, memory_order_relaxed);\n"
+      "  atomic_store_explicit(&d->bottom, b, memory_order_relaxed);\n"
+      "  atomic_thread_fence(memory_order_seq_cst);\n"
+      "  long top = atomic_load_explicit(&d->top, memory_order_relaxed);\n"
+      "  if (top > b) {\n"
+      "    atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);\n"
+      "    return NULL;\n"
+      "  }\n"
+      "  lcc_task *t =\n"
+      "      atomic_load_explicit(&a->buf[b %% a->size], "
+      "memory_order_relaxed);\n"
+      "  if (top == b) {\n"
+      "    // the last task, a thief may be taking it\n"
+      "    if (!atomic_compare_exchange_strong_explicit(\n"
+      "            &d->top, &top, top + 1, memory_order_seq_cst,\n"
+      "            memory_order_relaxed))\n"
+      "      t = NULL;\n"
+      "    atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);\n"
+      "  }\n"
+      "  return t;\n"
+      "}\n"
+      "static lcc_task *lcc_deque_steal(lcc_deque *d) {\n"
+      "  long top = atomic_load_explicit(&d->top, memory_order_acquire);\n"
+      "  atomic_thread_fence(memory_order_seq_cst);\n"
+      "  long b = atomic_load_explicit(&d->bottom, memory_order_acquire);\n"
+      "  if (top >= b)\n"
+      "    return NULL;\n"
+      "  lcc_deque_array *a =\n"
+      "      atomic_load_explicit(&d->array, memory_order_acquire);\n"
+      "  lcc_task *t =\n"
+      "      atomic_load_explicit(&a->buf[top %% a->size], "
+      "memory_order_relaxed);\n"
+      "  if (!atomic_compare_exchange_strong_explicit(\n"
+      "          &d->top, &top, top + 1, memory_order_seq_cst,\n"
+      "          memory_order_relaxed))\n"
+      "    return NULL;\n"
+      "  return t;\n"
+      "}\n"
+      "static void lcc_run_task(lcc_task *t) {\n"
+      "  lcc_group *group = t->group;\n"
+      "  t->run(t);\n"
+      "  free(t);\n"
+      "  atomic_fetch_sub_explicit(group, 1, memory_order_release);\n"
+      "}\n"
+      "static lcc_task *lcc_find_task(unsigned *seed) {\n"
+      "  lcc_task *t = lcc_deque_take(&lcc_pool.deques[lcc_worker]);\n"
+      "  for (int i = 0; t == NULL && i < lcc_pool.n_workers; i++) {\n"
+      "    *seed = *seed * 1103515245u + 12345u;\n"
+      "    int victim = (*seed >> 16) %% lcc_pool.n_workers;\n"
+      "    if (victim != lcc_worker)\n"
+      "      t = lcc_deque_steal(&lcc_pool.deques[victim]);\n"
+      "  }\n"
+      "  if (t != NULL)\n"
+      "    atomic_fetch_sub(&lcc_pool.queued, 1);\n"
+      "  return t;\n"
+      "}\n"
+      "static void *lcc_worker_main(void *arg) {\n"
+      "  lcc_worker = (int)(intptr_t)arg;\n"
+      "  unsigned seed = lcc_worker * 2654435761u;\n"
+      "  for (;;) {\n"
+      "    lcc_task *t = lcc_find_task(&seed);\n"
+      "    if (t != NULL) {\n"
+      "      lcc_run_task(t);\n"
+      "      continue;\n"
+      "    }\n"
+      "    if (atomic_load(&lcc_pool.queued) > 0) {\n"
+      "      sched_yield();\n"
+      "      continue;\n"
+      "    }\n"
+      "    // the spawner counts queued before it reads sleeping\n"
+      "    pthread_mutex_lock(&lcc_pool.lock);\n"
+      "    atomic_fetch_add(&lcc_pool.sleeping, 1);\n"
+      "    while (atomic_load(&lcc_pool.queued) == 0)\n"
+      "      pthread_cond_wait(&lcc_pool.wake, &lcc_pool.lock);\n"
+      "    atomic_fetch_sub(&lcc_pool.sleeping, 1);\n"
+      "    pthread_mutex_unlock(&lcc_pool.lock);\n"
+      "  }\n"
+      "  return NULL;\n"
+      "}\n"
+      "static void lcc_pool_start(void) {\n"
+      "  const char *env = getenv(\"LCC_WORKERS\");\n"
+      "  long n = env != NULL ? atol(env) : sysconf(_SC_NPROCESSORS_ONLN);\n"
+      "  if (n < 1)\n"
+      "    n = 1;\n"
+      "  lcc_pool.deques = aligned_alloc(64, n * sizeof(lcc_deque));\n"
+      "  if (lcc_pool.deques == NULL)\n"
+      "    lcc_task_fail(\"task deque allocation\");\n"
+      "  for (long i = 0; i < n; i++) {\n"
+      "    atomic_init(&lcc_pool.deques[i].top, 0);\n"
+      "    atomic_init(&lcc_pool.deques[i].bottom, 0);\n"
+      "    atomic_init(&lcc_pool.deques[i].array, lcc_deque_array_new(64));\n"
+      "  }\n"
+      "  lcc_pool.n_workers = n;\n"
+      "  lcc_worker = 0;\n"
+      "  for (long i = 1; i < n; i++) {\n"
+      "    pthread_t thread;\n"
+      "    if (pthread_create(&thread, NULL, lcc_worker_main,\n"
+      "                       (void *)(intptr_t)i) != 0)\n"
+      "      lcc_task_fail(\"pthread_create\");\n"
+      "    pthread_detach(thread);\n"
+      "  }\n"
+      "}\n"
+      "static void *lcc_task_new(size_t size, void (*run)(void *),\n"
+      "                          lcc_group *group) {\n"
+      "  lcc_task *t = malloc(size);\n"
+      "  if (t == NULL)\n"
+      "    lcc_task_fail(\"task allocation\");\n"
+      "  t->run = run;\n"
+      "  t->group = group;\n"
+      "  atomic_fetch_add_explicit(group, 1, memory_order_relaxed);\n"
+      "  return t;\n"
+      "}\n"
+      "static void lcc_spawn(void *task) {\n"
+      "  pthread_once(&lcc_pool_once, lcc_pool_start);\n"
+      "  if (lcc_worker < 0) {\n"
+      "    lcc_run_task(task); // not a worker, run it now\n"
+      "    return;\n"
+      "  }\n"
+      "  atomic_fetch_add(&lcc_pool.queued, 1);\n"
+      "  lcc_deque_push(&lcc_pool.deques[lcc_worker], task);\n"
+      "  if (atomic_load(&lcc_pool.sleeping) > 0) {\n"
+      "    pthread_mutex_lock(&lcc_pool.lock);\n"
+      "    pthread_cond_signal(&lcc_pool.wake);\n"
+      "    pthread_mutex_unlock(&lcc_pool.lock);\n"
+      "  }\n"
+      "}\n"
+      "static inline int lcc_split(long grain) {\n"
+      "  pthread_once(&lcc_pool_once, lcc_pool_start);\n"
+      "  if (lcc_worker < 0)\n"
+      "    return 0;\n"
+      "  lcc_deque *d = &lcc_pool.deques[lcc_worker];\n"
+      "  return atomic_load_explicit(&d->bottom, memory_order_relaxed) -\n"
+      "             atomic_load_explicit(&d->top, memory_order_relaxed) <\n"
+      "         grain;\n"
+      "}\n"
+      "static void lcc_sync(lcc_group *group) {\n"
+      "  unsigned seed = lcc_worker * 2654435761u + 1;\n"
+      "  while (atomic_load_explicit(group, memory_order_acquire) > 0) {\n"
+      "    lcc_task *t = lcc_find_task(&seed);\n"
+      "    if (t != NULL)\n"
+      "      lcc_run_task(t);\n"
+      "    else\n"
+      "      sched_yield();\n"
+      "  }\n"
+      "}\n",
+      lcc_current_file);
+}
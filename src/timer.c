@@ -0,0 +1,315 @@
+#include "timer.h"
+#include "debug.h"
+#include "mem.h"
+#include "tree.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "hashmap.h"
+
+/*
+ * Every timer_begin opens an event, timer_end closes the innermost one. The
+ * events are kept in the order they were opened, which is the order the
+ * trace lists them in; the table sums the phases by name and the forms by
+ * label. A few hundred thousand events for the largest inputs is a few
+ * megabytes, and nothing is recorded unless an option asks for it.
+ */
+
+extern const char *lcc_current_file;
+
+bool time_report = false;
+const char *time_trace = NULL;
+
+struct event {
+  const char *name;
+  char *form; // the top-level form timed, NULL for a phase
+  int depth, parent;
+  double start, wall, cpu; // ns, cpu is negative when not measured
+  long count;              // tokens of an accumulated event, 0 otherwise
+  struct mem_sample before, after; // --mem-report, phases of depth 0 and 1
+};
+
+static struct event *events = NULL;
+static int n_events = 0, cap_events = 0;
+static int innermost = -1; // the open event timer_end closes
+static int depth = 0;
+static double t0 = 0.0;
+
+static double clock_ns(clockid_t clock) {
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+double timer_now(void) { return clock_ns(CLOCK_MONOTONIC) - t0; }
+
+bool timers_enabled(void) {
+  return time_report || time_trace != NULL || mem_report;
+}
+
+static bool sampled(struct event *e) {
+  return mem_report && e->form == NULL && e->count == 0 && e->depth <= 1;
+}
+
+static struct event *new_event(const char *name, char *form) {
+  if (n_events >= cap_events) {
+    cap_events = cap_events == 0 ? 256 : cap_events * 2;
+    events = realloc(events, cap_events * sizeof(struct event));
+  }
+  struct event *e = &events[n_events++];
+  *e = (struct event){name, form, depth, innermost, 0.0, 0.0, -1.0, 0};
+  e->before = e->after = (struct mem_sample){0, 0, 0};
+  return e;
+}
+
+static void begin(const char *name, char *form) {
+  struct event *e = new_event(name, form);
+  if (sampled(e))
+    mem_sample(&e->before);
+  e->cpu = -clock_ns(CLOCK_PROCESS_CPUTIME_ID);
+  e->start = timer_now();
+  innermost = n_events - 1;
+  depth++;
+}
+
+void timer_begin(const char *name) {
+  if (timers_enabled())
+    begin(name, NULL);
+}
+
+void timer_begin_form(const char *name, struct tree *form) {
+  if (!timers_enabled())
+    return;
+  const char *label = get_tree_type(form);
+  switch (form->type) {
+  case FN_DECL:
+    if (form->fn_decl.source_name != NULL)
+      label = form->fn_decl.source_name;
+    break;
+  case VAR_DECL:
+    label = form->var_decl.name;
+    break;
+  case CORO_DECL:
+    if (form->coro_decl.source_name != NULL)
+      label = form->coro_decl.source_name;
+    break;
+  case STRUCT_DECL:
+    label = form->struct_decl.name;
+    break;
+  default:
+    break;
+  }
+  int len = snprintf(NULL, 0, "%s %s:%d", label, lcc_current_file,
+                     form->loc.first_line);
+  char *buf = malloc(len + 1);
+  snprintf(buf, len + 1, "%s %s:%d", label, lcc_current_file,
+           form->loc.first_line);
+  begin(name, buf);
+}
+
+void timer_end(void) {
+  if (!timers_enabled() || innermost < 0)
+    return;
+  struct event *e = &events[innermost];
+  e->wall = timer_now() - e->start;
+  e->cpu += clock_ns(CLOCK_PROCESS_CPUTIME_ID);
+  if (sampled(e))
+    mem_sample(&e->after);
+  innermost = e->parent;
+  depth--;
+}
+
+void timer_account(const char *name, double start, long count) {
+  double wall = timer_now() - start;
+  struct event *e = NULL;
+  for (int i = innermost + 1; i < n_events; i++) {
+    if (events[i].parent == innermost && events[i].count > 0 &&
+        strcmp(events[i].name, name) == 0) {
+      e = &events[i];
+      break;
+    }
+  }
+  if (e == NULL) {
+    e = new_event(name, NULL);
+    e->start = start;
+  }
+  e->wall += wall;
+  e->count += count;
+}
+
+struct phase {
+  const char *name;
+  int depth;
+  long calls, count;
+  double wall, cpu;
+};
+
+static int by_wall(const void *a, const void *b) {
+  double x = ((const struct phase *)a)->wall;
+  double y = ((const struct phase *)b)->wall;
+  return x < y ? 1 : x > y ? -1 : 0;
+}
+
+/* phases with the same name add up, forms with the same label do */
+static struct phase *sum_events(bool forms, int *n) {
+  struct phase *sums = calloc(n_events + 1, sizeof(struct phase));
+  struct hashmap_s index;
+  *n = 0;
+  if (hashmap_create(256, &index) != 0) {
+    error("Failed to create hashmap.");
+    return sums;
+  }
+  for (int i = 0; i < n_events; i++) {
+    struct event *e = &events[i];
+    if ((e->form != NULL) != forms)
+      continue;
+    const char *key = forms ? e->form : e->name;
+    uintptr_t slot = (uintptr_t)hashmap_get(&index, key, strlen(key));
+    if (slot == 0) {
+      slot = ++*n;
+      hashmap_put(&index, key, strlen(key), (void *)slot);
+      sums[slot - 1] = (struct phase){key, e->depth, 0, 0, 0.0, 0.0};
+    }
+    struct phase *p = &sums[slot - 1];
+    p->calls++;
+    p->count += e->count;
+    p->wall += e->wall;
+    p->cpu += e->cpu >= 0.0 ? e->cpu : 0.0;
+  }
+  hashmap_destroy(&index);
+  return sums;
+}
+
+static void print_time_report(void) {
+  double total = 0.0;
+  for (int i = 0; i < n_events; i++) {
+    if (events[i].depth == 0)
+      total += events[i].wall;
+  }
+  int n;
+  struct phase *phases = sum_events(false, &n);
+  fprintf(stderr, "\nTime report for %s\n%-36s %8s %12s %12s %7s\n",
+          lcc_current_file, "phase", "calls", "wall ms", "cpu ms", "wall%");
+  for (int i = 0; i < n; i++) {
+    struct phase *p = &phases[i];
+    char name[64];
+    snprintf(name, sizeof(name), "%*s%s", 2 * p->depth, "", p->name);
+    fprintf(stderr, "%-36s %8ld %12.3f ", name,
+            p->count > 0 ? p->count : p->calls, p->wall / 1e6);
+    if (p->count > 0)
+      fprintf(stderr, "%12s", "-"); // accumulated, wall clock only
+    else
+      fprintf(stderr, "%12.3f", p->cpu / 1e6);
+    fprintf(stderr, " %6.2f%%\n", total > 0.0 ? 100.0 * p->wall / total : 0.0);
+  }
+  fprintf(stderr, "%-36s %8s %12.3f\n", "total", "", total / 1e6);
+  free(phases);
+
+  struct phase *forms = sum_events(true, &n);
+  if (n > 0) {
+    qsort(forms, n, sizeof(struct phase), by_wall);
+    fprintf(stderr, "\nSlowest top-level forms\n%-45s %12s %12s\n", "form",
+            "wall ms", "cpu ms");
+    for (int i = 0; i < n && i < 10; i++) {
+      fprintf(stderr, "%-45s %12.3f %12.3f\n", forms[i].name,
+              forms[i].wall / 1e6, forms[i].cpu / 1e6);
+    }
+  }
+  free(forms);
+}
+
+/* the resident set after each phase, and how much the peak grew in it */
+static void print_mem_phases(void) {
+  fprintf(stderr, "\n%-24s %12s %12s %12s %12s\n", "phase", "rss MB",
+          "peak rss MB", "peak +MB", "tracked MB");
+  for (int i = 0; i < n_events; i++) {
+    struct event *e = &events[i];
+    if (!sampled(e))
+      continue;
+    char name[64];
+    snprintf(name, sizeof(name), "%*s%s", 2 * e->depth, "", e->name);
+    fprintf(stderr, "%-24s %12.1f %12.1f %12.1f %12.3f\n", name,
+            e->after.rss_kb / 1024.0, e->after.peak_kb / 1024.0,
+            (e->after.peak_kb - e->before.peak_kb) / 1024.0,
+            e->after.live / 1048576.0);
+  }
+}
+
+static void print_json_string(FILE *f, const char *s) {
+  fputc('"', f);
+  for (; *s != '\0'; s++) {
+    if (*s == '"' || *s == '\\')
+      fputc('\\', f);
+    fputc(*s, f);
+  }
+  fputc('"', f);
+}
+
+static void write_time_trace(void) {
+  char buf[4096];
+  const char *path = time_trace;
+  if (path[0] == '\0') {
+    snprintf(buf, sizeof(buf), "%s.trace.json", lcc_current_file);
+    path = buf;
+  }
+  FILE *f = fopen(path, "w");
+  if (f == NULL) {
+    error("cannot write the time trace to '%s'", path);
+    return;
+  }
+  fprintf(f, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n"
+             "  {\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, "
+             "\"args\": {\"name\": \"lcc\"}}");
+  for (int i = 0; i < n_events; i++) {
+    struct event *e = &events[i];
+    fprintf(f, ",\n  {\"name\": ");
+    print_json_string(f, e->form != NULL ? e->form : e->name);
+    fprintf(f,
+            ", \"cat\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": 1, "
+            "\"ts\": %.3f, \"dur\": %.3f, \"args\": {",
+            e->form != NULL ? "form" : "phase", e->start / 1e3, e->wall / 1e3);
+    if (e->form != NULL)
+      fprintf(f, "\"phase\": \"%s\", ", e->name);
+    if (sampled(e))
+      fprintf(f, "\"rss_kb\": %ld, \"peak_rss_kb\": %ld, ", e->after.rss_kb,
+              e->after.peak_kb);
+    if (e->count > 0)
+      fprintf(f, "\"tokens\": %ld, \"accumulated\": true}}", e->count);
+    else
+      fprintf(f, "\"cpu_ms\": %.3f}}", e->cpu / 1e6);
+  }
+  fprintf(f, "\n]}\n");
+  fclose(f);
+}
+
+static void timers_finish(void) {
+  while (innermost >= 0)
+    timer_end();
+  if (time_report)
+    print_time_report();
+  if (time_trace != NULL)
+    write_time_trace();
+  if (mem_report) {
+    print_mem_report();
+    print_mem_phases();
+  }
+  for (int i = 0; i < n_events; i++)
+    free(events[i].form);
+  free(events);
+  events = NULL;
+  n_events = cap_events = 0;
+}
+
+/* the report is written at exit, so that it covers runs stopped by errors */
+void timers_start(void) {
+  if (!timers_enabled())
+    return;
+  t0 = clock_ns(CLOCK_MONOTONIC);
+  atexit(timers_finish);
+}
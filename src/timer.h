@@ -0,0 +1,27 @@
+#pragma once
+
+#include "tree.h"
+
+#include <stdbool.h>
+
+/*
+ * Phase timers for -ftime-report, -ftime-trace and --mem-report. timer_begin
+ * and timer_end nest: each phase records its wall and CPU time, and with
+ * --mem-report the resident set, top-level forms are timed inside the phases
+ * that walk them one at a time. Everything is reported once, at exit, as
+ * tables on stderr and as a Chrome trace (chrome://tracing, Perfetto).
+ */
+
+extern bool time_report;
+extern const char *time_trace; // "" is <source>.trace.json
+
+bool timers_enabled(void);
+void timers_start(void);
+void timer_begin(const char *name);
+void timer_begin_form(const char *name, struct tree *form);
+void timer_end(void);
+
+/* the lexer runs a token at a time inside the parser, its time is summed
+ * and shown below the phase it ran in */
+double timer_now(void);
+void timer_account(const char *name, double start, long count);
@@ -1,5 +1,7 @@
 #include "tree.h"
 #include "debug.h"
+#include "mem.h"
+#include "timer.h"
 
 #include <stdbool.h>
 #include <stddef.h>
@@ -42,6 +44,7 @@ struct tree *reverse_tree(struct tree *tree) {
 
 struct tree *alloc_tree(size_t n) {
   struct tree *t = calloc(n, sizeof(struct tree));
+  mem_alloc(MEM_TREE, n * sizeof(struct tree));
   t->valid = true;
   return t;
 }
@@ -52,6 +55,8 @@ struct tree *build_fn(struct location loc, char *name, struct tree *type,
   fn->loc = loc;
   fn->type = FN_DECL;
 
+  // the name as written, for reports and the symbol map
+  fn->fn_decl.source_name = strdup(name);
   translate_to_var_name(name);
   fn->fn_decl.name = name;
   fn->fn_decl.arglist = arglist;
@@ -97,6 +102,27 @@ struct tree *build_type_expr(struct location loc, struct type_id *id) {
   return type;
 }
 
+struct tree *build_vector_type(struct location loc, char *elem, int lanes) {
+  struct type_id *id = build_tid(elem, MOD_NONE);
+  int size = type_id_size(id);
+  if (size < 0 || strstr(elem, "complex") != NULL) {
+    errorat("vector elements must be integer or floating point, not '%s'",
+            lcc_current_file, loc.first_line, loc.first_column, elem);
+  } else if (lanes <= 0 || (lanes & (lanes - 1)) != 0) {
+    errorat("vector length %d is not a power of two", lcc_current_file,
+            loc.first_line, loc.first_column, lanes);
+  }
+  id->lanes = lanes;
+  return build_type_expr(loc, id);
+}
+
+/* the strings a node owns, for --mem-report */
+static void free_string(char *s) {
+  if (s != NULL)
+    mem_alloc(MEM_STRING, strlen(s) + 1);
+  free(s);
+}
+
 void _destroy_tree(struct tree *t) {
   if (t == NULL)
     return;
@@ -107,7 +133,8 @@ void _destroy_tree(struct tree *t) {
   switch (t->type) {
   case FN_DECL:
     if (t->fn_decl.name)
-      free(t->fn_decl.name);
+      free_string(t->fn_decl.name);
+    free_string(t->fn_decl.source_name);
 
     destroy_tree(t->fn_decl.body);
     destroy_tree(t->fn_decl.arglist);
@@ -116,7 +143,7 @@ void _destroy_tree(struct tree *t) {
   case PARM_DECL:
   case VAR_DECL:
     if (t->var_decl.name)
-      free(t->var_decl.name);
+      free_string(t->var_decl.name);
     destroy_tree(t->var_decl.type);
     destroy_tree(t->var_decl.value);
     break;
@@ -137,6 +164,13 @@ void _destroy_tree(struct tree *t) {
     destroy_tree(t->cast_expr.type);
     destroy_tree(t->cast_expr.expr);
     break;
+  case LIST_EXPR:
+    destroy_tree(t->list_expr.type);
+    destroy_tree(t->list_expr.elems);
+    break;
+  case LAMBDA_EXPR:
+    destroy_tree(t->lambda_expr.decl);
+    break;
   case BINOP_EXPR:
     destroy_tree(t->binop_expr.body);
     break;
@@ -168,6 +202,11 @@ void _destroy_tree(struct tree *t) {
     destroy_tree(t->while_stmt.condition);
     destroy_tree(t->while_stmt.body);
     break;
+  case FOREACH_STMT:
+    destroy_tree(t->foreach_stmt.vars);
+    destroy_tree(t->foreach_stmt.expr);
+    destroy_tree(t->foreach_stmt.body);
+    break;
   case FOR_STMT:
     destroy_tree(t->for_stmt.type);
     destroy_tree(t->for_stmt.vars);
@@ -185,11 +224,11 @@ void _destroy_tree(struct tree *t) {
     case STRING_CST:
     case VAR_REF:
       if (t->reference_expr.symbol != NULL)
-        free(t->reference_expr.symbol);
+        free_string(t->reference_expr.symbol);
       break;
     case FN_CALL:
       if (t->reference_expr.call.name != NULL)
-        free(t->reference_expr.call.name);
+        free_string(t->reference_expr.call.name);
       destroy_tree(t->reference_expr.call.args);
     default:
       break;
@@ -207,18 +246,55 @@ void _destroy_tree(struct tree *t) {
     break;
   case LAMBDA_KEY:
     if (t->lambda_key.key_name)
-      free(t->lambda_key.key_name);
+      free_string(t->lambda_key.key_name);
     destroy_tree(t->lambda_key.expr);
     break;
   case TYPE_DECL:
     destroy_tree(t->type_decl.type);
     destroy_tree(t->type_decl.symbol_list);
     break;
+  case ATTR_DECL:
+    if (t->attr_decl.name)
+      free_string(t->attr_decl.name);
+    destroy_tree(t->attr_decl.args);
+    break;
+  case STRUCT_DECL:
+    free_string(t->struct_decl.name);
+    destroy_tree(t->struct_decl.fields);
+    destroy_tree(t->struct_decl.cold);
+    destroy_tree(t->struct_decl.attrs);
+    break;
+  case FIELD_EXPR:
+    free_string(t->field_expr.field);
+    destroy_tree(t->field_expr.expr);
+    break;
+  case CONTAINER_DECL:
+    free_string(t->container_decl.name);
+    destroy_tree(t->container_decl.key);
+    destroy_tree(t->container_decl.value);
+    break;
+  case CLOSURE_DECL:
+    free_string(t->closure_decl.name);
+    destroy_tree(t->closure_decl.type);
+    destroy_tree(t->closure_decl.args);
+    break;
+  case CORO_DECL:
+    free_string(t->coro_decl.name);
+    free_string(t->coro_decl.source_name);
+    destroy_tree(t->coro_decl.type);
+    destroy_tree(t->coro_decl.params);
+    destroy_tree(t->coro_decl.frame);
+    destroy_tree(t->coro_decl.body);
+    break;
+  case RESUME_STMT:
+    break;
   default:
     warning("Destroying unimplemented tree type %d", t->type);
     break;
   }
 
+  mem_count_tree(t->type);
+  mem_free(MEM_TREE, sizeof(struct tree));
   free(t);
 }
 
@@ -231,6 +307,119 @@ void destroy_tree(struct tree *t) {
   }
 }
 
+static void walk_children(struct tree *t, walk_fn fn, void *data) {
+  switch (t->type) {
+  case FN_DECL:
+    walk_tree(t->fn_decl.arglist, fn, data);
+    walk_tree(t->fn_decl.body, fn, data);
+    break;
+  case PARM_DECL:
+  case VAR_DECL:
+    walk_tree(t->var_decl.value, fn, data);
+    break;
+  case SET_EXPR:
+    walk_tree(t->set_expr.var, fn, data);
+    walk_tree(t->set_expr.value, fn, data);
+    break;
+  case AREF_EXPR:
+  case ADDR_EXPR:
+    walk_tree(t->ref_expr.expr, fn, data);
+    walk_tree(t->ref_expr.indices, fn, data);
+    break;
+  case FIELD_EXPR:
+    walk_tree(t->field_expr.expr, fn, data);
+    break;
+  case CAST_EXPR:
+    walk_tree(t->cast_expr.expr, fn, data);
+    break;
+  case LIST_EXPR:
+    walk_tree(t->list_expr.elems, fn, data);
+    break;
+  case LAMBDA_EXPR:
+    walk_tree(t->lambda_expr.decl, fn, data);
+    break;
+  case CORO_DECL:
+    walk_tree(t->coro_decl.body, fn, data);
+    break;
+  case BINOP_EXPR:
+    walk_tree(t->binop_expr.body, fn, data);
+    break;
+  case COMPARE_EXPR:
+    walk_tree(t->compare_expr.lhs, fn, data);
+    walk_tree(t->compare_expr.rhs, fn, data);
+    break;
+  case COND_EXPR:
+    walk_tree(t->cond_expr.condition, fn, data);
+    walk_tree(t->cond_expr.body, fn, data);
+    break;
+  case COND_STMT:
+    walk_tree(t->cond_stmt.exprs, fn, data);
+    break;
+  case CASE_EXPR:
+    walk_tree(t->case_expr.expr, fn, data);
+    walk_tree(t->case_expr.body, fn, data);
+    break;
+  case CASE_STMT:
+    walk_tree(t->case_stmt.expr, fn, data);
+    walk_tree(t->case_stmt.cases, fn, data);
+    break;
+  case LET_STMT:
+    walk_tree(t->let_stmt.vars, fn, data);
+    walk_tree(t->let_stmt.body, fn, data);
+    break;
+  case WHILE_STMT:
+  case DOWHILE_STMT:
+    walk_tree(t->while_stmt.condition, fn, data);
+    walk_tree(t->while_stmt.body, fn, data);
+    break;
+  case FOREACH_STMT:
+    walk_tree(t->foreach_stmt.vars, fn, data);
+    walk_tree(t->foreach_stmt.expr, fn, data);
+    walk_tree(t->foreach_stmt.body, fn, data);
+    break;
+  case FOR_STMT:
+    walk_tree(t->for_stmt.vars, fn, data);
+    walk_tree(t->for_stmt.condition, fn, data);
+    walk_tree(t->for_stmt.loop_eval, fn, data);
+    walk_tree(t->for_stmt.body, fn, data);
+    break;
+  case IF_STMT:
+    walk_tree(t->if_else_stmt.condition, fn, data);
+    walk_tree(t->if_else_stmt.if_block, fn, data);
+    walk_tree(t->if_else_stmt.else_block, fn, data);
+    break;
+  case REFERENCE_EXPR:
+    if (t->reference_expr.type == FN_CALL)
+      walk_tree(t->reference_expr.call.args, fn, data);
+    break;
+  case LAMBDA_LIST:
+    walk_tree(t->lambda_list.args, fn, data);
+    walk_tree(t->lambda_list.optionals, fn, data);
+    walk_tree(t->lambda_list.rest, fn, data);
+    walk_tree(t->lambda_list.keys, fn, data);
+    walk_tree(t->lambda_list.aux, fn, data);
+    break;
+  case LAMBDA_KEY:
+    walk_tree(t->lambda_key.expr, fn, data);
+    break;
+  default:
+    break;
+  }
+}
+
+/* pre-order walk over a chain and its children. Returning false from fn skips
+ * the children of that node. Types are not visited. */
+void walk_tree(struct tree *t, walk_fn fn, void *data) {
+  for (struct tree *head = t; head != NULL; head = head->next)
+    walk_tree_node(head, fn, data);
+}
+
+/* same as walk_tree but does not follow t->next */
+void walk_tree_node(struct tree *t, walk_fn fn, void *data) {
+  if (fn(t, data))
+    walk_children(t, fn, data);
+}
+
 struct tree *append_tree(struct tree *t, struct tree *next) {
   if (next == NULL)
     return t;
@@ -241,75 +430,675 @@ struct tree *append_tree(struct tree *t, struct tree *next) {
   return next;
 }
 
+bool line_directives = false;
+
+/* nodes built by the lowerings without a position keep the line before */
+static void _print_line(struct tree *t) {
+  if (!line_directives || t->loc.first_line <= 0)
+    return;
+  fprintf(stdout, "#line %d \"", t->loc.first_line);
+  for (const char *c = lcc_current_file; *c != '\0'; c++) {
+    if (*c == '"' || *c == '\\')
+      fputc('\\', stdout);
+    fputc(*c, stdout);
+  }
+  fprintf(stdout, "\"\n");
+}
+
 static void _print_tree(struct tree *t);
 static void _print_body(struct tree *t) {
   for (struct tree *body = t; body != NULL; body = body->next) {
+    _print_line(body);
     fprintf(stdout, "  ");
     _print_tree(body);
     fprintf(stdout, ";\n");
   }
 }
 
-static void _print_tree(struct tree *t) {
-  if (t == NULL) {
+void print_type_id(struct type_id *id) {
+  if (id == NULL) {
+    fprintf(stdout, "(null)");
+    return;
+  }
+  switch (id->modifier) {
+  case MOD_CONST:
+    fprintf(stdout, "const ");
+    break;
+  case MOD_VOLATILE:
+    fprintf(stdout, "volatile ");
+    break;
+  case MOD_RESTRICT:
+    fprintf(stdout, "restrict ");
+    break;
+  case MOD_ATOMIC:
+    fprintf(stdout, "_Atomic ");
+    break;
+  case MOD_NONE:
+    break;
+  case MOD_MONOMORPH:
+    // let the C compiler infer what lcc could not
+    if (id->name == NULL) {
+      fprintf(stdout, "__auto_type");
+      return;
+    }
+    break;
+  }
+  if (id->name != NULL) {
+    fprintf(stdout, "%s", id->name);
+  } else {
     fprintf(stdout, "(null)");
+  }
+  if (id->lanes != 0)
+    fprintf(stdout, " __attribute__((vector_size(%d)))",
+            id->lanes * type_id_size(&(struct type_id){id->name, MOD_NONE}));
+}
+
+/* C declarators read inside out, the first pointer in the chain is the
+ * outermost type constructor: [4]*f64 is double *name[4] and *[4]f64 is
+ * double (*name)[4] */
+static void print_declarator(struct type_ptr *ptr, const char *name,
+                             bool parens) {
+  if (ptr == NULL) {
+    fprintf(stdout, "%s", name);
     return;
   }
+  size_t len = strlen(name) + 32;
+  char *inner = malloc(len);
+  switch (ptr->type) {
+  case SINGLE_PTR:
+  case MULTI_PTR:
+  case STRIDED_PTR:
+    snprintf(inner, len, "*%s", name);
+    print_declarator(ptr->next, inner, true);
+    break;
+  case SIZED_PTR:
+    if (parens)
+      snprintf(inner, len, "(%s)[%d]", name, ptr->size);
+    else
+      snprintf(inner, len, "%s[%d]", name, ptr->size);
+    print_declarator(ptr->next, inner, false);
+    break;
+  }
+  free(inner);
+}
 
-  switch (t->type) {
-  case FN_DECL:
-    _print_tree(t->fn_decl.type);
-    fprintf(stdout, " %s", t->fn_decl.name);
-    fprintf(stdout, " (");
-    struct tree *args = t->fn_decl.arglist;
-    if (args != NULL) {
-      if (args->type == LAMBDA_LIST) {
-        int n_lists = (args->lambda_list.args == NULL ? 0 : 1) +
-                      (args->lambda_list.optionals == NULL ? 0 : 1) +
-                      (args->lambda_list.rest == NULL ? 0 : 1) +
-                      (args->lambda_list.keys == NULL ? 0 : 1);
-        for (struct tree *arg = args->lambda_list.args; arg != NULL;
-             arg = arg->next) {
-          _print_tree(arg);
-          if (arg->next == NULL && (--n_lists) <= 0)
-            break;
-          fprintf(stdout, ", ");
-        }
-        for (struct tree *arg = args->lambda_list.optionals; arg != NULL;
-             arg = arg->next) {
-          if (arg->type != PARM_DECL) {
-            error("expected parm_decl");
-            continue;
-          }
-          _print_tree(arg->var_decl.type);
-          fprintf(stdout, " %s", arg->var_decl.name);
-          if (arg->next == NULL && (--n_lists) <= 0)
-            break;
-          fprintf(stdout, ", ");
+void print_decl(struct tree *type, const char *name) {
+  print_type_id(type->type_expr.id);
+  fputc(' ', stdout);
+  print_declarator(type->type_expr.ptr, name, false);
+}
+
+static const struct {
+  const char *name;
+  int size;
+} type_sizes[] = {
+    {"char", 1},           {"unsigned char", 1},
+    {"short", 2},          {"unsigned short", 2},
+    {"int", 4},            {"unsigned int", 4},
+    {"long", 8},           {"unsigned long", 8},
+    {"long long", 8},      {"unsigned long long", 8},
+    {"float", 4},          {"double", 8},
+    {"long double", 16},   {"float complex", 8},
+    {"double complex", 16}, {"long double complex", 32},
+};
+
+/* size in bytes of a builtin type, -1 for anything lcc does not know */
+int type_id_size(struct type_id *id) {
+  if (id == NULL || id->name == NULL)
+    return -1;
+  for (size_t i = 0; i < sizeof(type_sizes) / sizeof(type_sizes[0]); i++) {
+    if (strcmp(type_sizes[i].name, id->name) == 0)
+      return id->lanes == 0 ? type_sizes[i].size
+                            : type_sizes[i].size * id->lanes;
+  }
+  return -1;
+}
+
+/* the GCC optimisation level of (optimize speed|size|debug), or of
+ * (optimize (speed N)), NULL when attr asks for anything else */
+const char *optimize_level(struct tree *attr) {
+  static const char *speed[] = {"O0", "O1", "O2", "O3"};
+  struct tree *quality = attr->attr_decl.args;
+  if (quality == NULL || quality->next != NULL ||
+      quality->type != REFERENCE_EXPR)
+    return NULL;
+  if (quality->reference_expr.type == VAR_REF) {
+    const char *name = quality->reference_expr.symbol;
+    if (strcmp(name, "speed") == 0)
+      return "O3";
+    if (strcmp(name, "size") == 0 || strcmp(name, "space") == 0)
+      return "Os";
+    if (strcmp(name, "debug") == 0)
+      return "Og";
+    return NULL;
+  }
+  struct tree *n = quality->reference_expr.call.args;
+  if (quality->reference_expr.type != FN_CALL ||
+      strcmp(quality->reference_expr.call.name, "speed") != 0 || n == NULL ||
+      n->next != NULL || n->type != REFERENCE_EXPR ||
+      n->reference_expr.type != INTEGER_CST || n->reference_expr.ival < 0 ||
+      n->reference_expr.ival > 3)
+    return NULL;
+  return speed[n->reference_expr.ival];
+}
+
+/* (declare (pure)), (hot), (optimize speed), (target "avx2") and the like
+ * in the body become GCC attributes of the function */
+static void _print_fn_attrs(struct tree *t) {
+  const char *level = NULL;
+  bool fast_math = false;
+  for (struct tree *body = t->fn_decl.body; body != NULL; body = body->next) {
+    if (body->type != ATTR_DECL)
+      continue;
+    const char *name = body->attr_decl.name;
+    if (strcmp(name, "optimize") == 0) {
+      level = optimize_level(body);
+    } else if (strcmp(name, "fast-math") == 0) {
+      fast_math = true;
+    } else if (strcmp(name, "target") == 0 && body->attr_decl.args != NULL) {
+      fprintf(stdout, "__attribute__((target(");
+      for (struct tree *arg = body->attr_decl.args; arg != NULL;
+           arg = arg->next)
+        fprintf(stdout, "%s%s", arg->reference_expr.symbol,
+                arg->next != NULL ? ", " : "");
+      fprintf(stdout, "))) ");
+    } else if (body->attr_decl.args == NULL &&
+               (strcmp(name, "pure") == 0 || strcmp(name, "const") == 0 ||
+                strcmp(name, "hot") == 0 || strcmp(name, "cold") == 0 ||
+                strcmp(name, "flatten") == 0)) {
+      fprintf(stdout, "__attribute__((%s)) ", name);
+    }
+  }
+  if (level != NULL && fast_math)
+    fprintf(stdout, "__attribute__((optimize(\"%s\", \"fast-math\"))) ",
+            level);
+  else if (level != NULL || fast_math)
+    fprintf(stdout, "__attribute__((optimize(\"%s\"))) ",
+            level != NULL ? level : "fast-math");
+}
+
+static void _print_fn_header(struct tree *t) {
+  _print_fn_attrs(t);
+  _print_tree(t->fn_decl.type);
+  fprintf(stdout, " %s", t->fn_decl.name);
+  fprintf(stdout, " (");
+  struct tree *args = t->fn_decl.arglist;
+  if (args != NULL) {
+    if (args->type == LAMBDA_LIST) {
+      int n_lists = (args->lambda_list.args == NULL ? 0 : 1) +
+                    (args->lambda_list.optionals == NULL ? 0 : 1) +
+                    (args->lambda_list.rest == NULL ? 0 : 1) +
+                    (args->lambda_list.keys == NULL ? 0 : 1);
+      for (struct tree *arg = args->lambda_list.args; arg != NULL;
+           arg = arg->next) {
+        _print_tree(arg);
+        if (arg->next == NULL && (--n_lists) <= 0)
+          break;
+        fprintf(stdout, ", ");
+      }
+      for (struct tree *arg = args->lambda_list.optionals; arg != NULL;
+           arg = arg->next) {
+        if (arg->type != PARM_DECL) {
+          error("expected parm_decl");
+          continue;
         }
-        for (struct tree *arg = args->lambda_list.keys; arg != NULL;
-             arg = arg->next) {
-          if (arg->type != LAMBDA_KEY) {
-            error("expected lambda_key");
-            continue;
-          }
-          _print_tree(arg->lambda_key.expr->var_decl.type);
-          fprintf(stdout, " %s", arg->lambda_key.expr->var_decl.name);
-          if (arg->next == NULL && (--n_lists) <= 0)
-            break;
-          fprintf(stdout, ", ");
+        _print_tree(arg->var_decl.type);
+        fprintf(stdout, " %s", arg->var_decl.name);
+        if (arg->next == NULL && (--n_lists) <= 0)
+          break;
+        fprintf(stdout, ", ");
+      }
+      for (struct tree *arg = args->lambda_list.keys; arg != NULL;
+           arg = arg->next) {
+        if (arg->type != LAMBDA_KEY) {
+          error("expected lambda_key");
+          continue;
         }
+        _print_tree(arg->lambda_key.expr->var_decl.type);
+        fprintf(stdout, " %s", arg->lambda_key.expr->var_decl.name);
+        if (arg->next == NULL && (--n_lists) <= 0)
+          break;
+        fprintf(stdout, ", ");
+      }
 
-        if (args->lambda_list.rest != NULL) {
-          fprintf(stdout, "...");
-        }
-      } else {
-        errorat("expected lambda_list but received %s", lcc_current_file,
-                args->loc.first_line, args->loc.first_column,
-                get_tree_type(args));
+      // a typed &rest is a pointer followed by its length, see pass.c
+      struct tree *rest = args->lambda_list.rest;
+      if (rest != NULL && rest->next == NULL) {
+        fprintf(stdout, "...");
+      } else if (rest != NULL) {
+        _print_tree(rest);
+        fprintf(stdout, ", ");
+        _print_tree(rest->next);
       }
+    } else {
+      errorat("expected lambda_list but received %s", lcc_current_file,
+              args->loc.first_line, args->loc.first_column,
+              get_tree_type(args));
     }
-    fputc(')', stdout);
+  }
+  fputc(')', stdout);
+}
+
+/* with (soa N) every field is an array of N */
+static void _print_field(struct tree *type, const char *name, int soa) {
+  if (soa == 0) {
+    print_decl(type, name);
+    return;
+  }
+  size_t len = strlen(name) + 16;
+  char *field = malloc(len);
+  snprintf(field, len, "%s[%d]", name, soa);
+  print_decl(type, field);
+  free(field);
+}
+
+static bool is_array_type(struct tree *type) {
+  return type != NULL && type->type == TYPE_EXPR &&
+         type->type_expr.ptr != NULL && type->type_expr.ptr->type == SIZED_PTR;
+}
+
+static bool has_sized_dim(struct tree *type) {
+  if (type == NULL || type->type != TYPE_EXPR)
+    return false;
+  for (struct type_ptr *ptr = type->type_expr.ptr; ptr != NULL;
+       ptr = ptr->next) {
+    if (ptr->type == SIZED_PTR)
+      return true;
+  }
+  return false;
+}
+
+static bool is_array_field(struct tree *field) {
+  return is_array_type(field->var_decl.type);
+}
+
+/* an array is initialised from a list of its elements, or like C from a
+ * single value that sets the first element and clears the rest */
+static void _print_array_init(struct tree *value) {
+  if (value->type != LIST_EXPR) {
+    fprintf(stdout, "{");
+    _print_tree(value);
+    fprintf(stdout, "}");
+    return;
+  }
+  fprintf(stdout, "{");
+  for (struct tree *elem = value->list_expr.elems; elem != NULL;
+       elem = elem->next) {
+    _print_tree(elem);
+    if (elem->next != NULL)
+      fprintf(stdout, ", ");
+  }
+  fprintf(stdout, "}");
+}
+
+static void _print_var(struct tree *type, const char *name) {
+  if (has_sized_dim(type)) {
+    // the dimensions follow the name
+    print_decl(type, name);
+  } else {
+    _print_tree(type);
+    fprintf(stdout, " %s", name);
+  }
+}
+
+static void _print_init(struct tree *type, struct tree *value) {
+  if (is_array_type(type))
+    _print_array_init(value);
+  else
+    _print_tree(value);
+}
+
+/* _Alignas only places the start of a cacheline global, the next global can
+ * still share its last line. It is stored as the only member of a structure
+ * padded to whole lines, and its name is an alias for that member */
+static void _print_cacheline_global(struct tree *t) {
+  char *name = t->var_decl.name;
+  const char *tls = t->var_decl.thread_local ? "_Thread_local " : "";
+  fprintf(stdout, "%sstruct { _Alignas(%d) ", tls, t->var_decl.align);
+  _print_var(t->var_decl.type, "value");
+  fprintf(stdout, "; } _lcc_line_%s", name);
+  if (t->var_decl.value != NULL) {
+    fprintf(stdout, " = {");
+    _print_init(t->var_decl.type, t->var_decl.value);
+    fputc('}', stdout);
+  }
+  fprintf(stdout, ";\nextern %s", tls);
+  _print_var(t->var_decl.type, name);
+  fprintf(stdout, " __attribute__((alias(\"_lcc_line_%s\")))", name);
+}
+
+static void _print_fields(struct tree *fields, int soa) {
+  for (struct tree *field = fields; field != NULL; field = field->next) {
+    fprintf(stdout, "  ");
+    _print_field(field->var_decl.type, field->var_decl.name, soa);
+    fprintf(stdout, ";\n");
+  }
+}
+
+/* make-NAME takes every field that is not an array, in layout order */
+static void _print_constructor(struct tree *t) {
+  char *name = t->struct_decl.name;
+  fprintf(stdout, "static inline %s make_%s(", name, name);
+  bool first = true;
+  for (struct tree *list = t->struct_decl.fields; list != NULL;
+       list = list == t->struct_decl.fields ? t->struct_decl.cold : NULL) {
+    for (struct tree *field = list; field != NULL; field = field->next) {
+      if (is_array_field(field))
+        continue;
+      if (!first)
+        fprintf(stdout, ", ");
+      _print_field(field->var_decl.type, field->var_decl.name, 0);
+      first = false;
+    }
+  }
+  if (first)
+    fprintf(stdout, "void");
+  fprintf(stdout, ") {\n  %s _s = {0};\n", name);
+  for (struct tree *field = t->struct_decl.fields; field != NULL;
+       field = field->next) {
+    if (!is_array_field(field))
+      fprintf(stdout, "  _s.%s = %s;\n", field->var_decl.name,
+              field->var_decl.name);
+  }
+  if (t->struct_decl.cold != NULL) {
+    fprintf(stdout, "  _s._cold = calloc(1, sizeof(struct %s_cold));\n", name);
+    for (struct tree *field = t->struct_decl.cold; field != NULL;
+         field = field->next) {
+      if (!is_array_field(field))
+        fprintf(stdout, "  _s._cold->%s = %s;\n", field->var_decl.name,
+                field->var_decl.name);
+    }
+  }
+  fprintf(stdout, "  return _s;\n}");
+  if (t->struct_decl.cold != NULL)
+    fprintf(stdout, "\nstatic inline void destroy_%s(%s s) { free(s._cold); }",
+            name, name);
+}
+
+static void _print_struct(struct tree *t) {
+  char *name = t->struct_decl.name;
+  const char *suffix = t->struct_decl.soa > 0 ? "_soa" : "";
+  if (t->struct_decl.cold != NULL) {
+    fprintf(stdout, "struct %s_cold {\n", name);
+    _print_fields(t->struct_decl.cold, 0);
+    fprintf(stdout, "};\n");
+  }
+  // declared first so that fields can point to the structure itself
+  fprintf(stdout, "typedef struct %s%s %s%s;\nstruct %s%s {\n", name, suffix,
+          name, suffix, name, suffix);
+  _print_fields(t->struct_decl.fields, t->struct_decl.soa);
+  if (t->struct_decl.cold != NULL)
+    fprintf(stdout, "  struct %s_cold *_cold;\n", name);
+  fputc('}', stdout);
+  if (t->struct_decl.packed && t->struct_decl.align > 0)
+    fprintf(stdout, " __attribute__((packed, aligned(%d)))",
+            t->struct_decl.align);
+  else if (t->struct_decl.packed)
+    fprintf(stdout, " __attribute__((packed))");
+  else if (t->struct_decl.align > 0)
+    fprintf(stdout, " __attribute__((aligned(%d)))", t->struct_decl.align);
+  if (t->struct_decl.soa > 0)
+    return;
+  fprintf(stdout, ";\n");
+  _print_constructor(t);
+}
+
+static void _print_vector(struct tree *t) {
+  char *name = t->container_decl.name;
+  struct tree *elem = t->container_decl.value;
+  fprintf(stdout, "typedef struct %s {\n  ", name);
+  _print_tree(elem);
+  fprintf(stdout, " *data;\n  size_t len, cap;\n} %s;\n", name);
+  fprintf(stdout, "static inline %s %s_new(void) { return (%s){0}; }\n",
+          name, name, name);
+  fprintf(stdout,
+          "static inline void %s_reserve(%s *v, size_t n) {\n"
+          "  if (n <= v->cap)\n    return;\n"
+          "  size_t cap = v->cap == 0 ? 8 : v->cap;\n"
+          "  while (cap < n)\n    cap *= 2;\n"
+          "  v->data = realloc(v->data, cap * sizeof(*v->data));\n"
+          "  v->cap = cap;\n}\n",
+          name, name);
+  fprintf(stdout, "static inline void %s_push(%s *v, ", name, name);
+  _print_tree(elem);
+  fprintf(stdout,
+          " x) {\n  if (v->len == v->cap)\n    %s_reserve(v, v->len + 1);\n"
+          "  v->data[v->len++] = x;\n}\n",
+          name);
+  fprintf(stdout, "static inline ");
+  _print_tree(elem);
+  fprintf(stdout,
+          " %s_pop(%s *v) { return v->data[--v->len]; }\n"
+          "static inline void %s_clear(%s *v) { v->len = 0; }\n"
+          "static inline void %s_destroy(%s *v) {\n"
+          "  free(v->data);\n  *v = (%s){0};\n}",
+          name, name, name, name, name, name, name);
+}
+
+/* open addressing with linear probing over a power of two capacity kept at
+ * most 3/4 full, entries are removed by shifting the rest of their run back
+ * so that no tombstones are needed */
+static void _print_hash_table(struct tree *t) {
+  char *name = t->container_decl.name;
+  struct tree *key = t->container_decl.key;
+  struct tree *value = t->container_decl.value;
+  fprintf(stdout, "typedef struct %s_entry {\n  ", name);
+  _print_tree(key);
+  fprintf(stdout, " key;\n  ");
+  _print_tree(value);
+  fprintf(stdout,
+          " value;\n  int in_use;\n} %s_entry;\n"
+          "typedef struct %s {\n  %s_entry *data;\n  size_t len, cap;\n} %s;\n",
+          name, name, name, name);
+
+  fprintf(stdout, "static inline %s %s_new(void) { return (%s){0}; }\n",
+          name, name, name);
+  fprintf(stdout, "static inline size_t %s_hash(", name);
+  _print_tree(key);
+  if (is_string_type(key)) {
+    // FNV-1a
+    fprintf(stdout, " key) {\n  size_t h = 14695981039346656037UL;\n"
+                    "  for (; *key != 0; key++)\n"
+                    "    h = (h ^ (unsigned char)*key) * 1099511628211UL;\n"
+                    "  return h;\n}\n");
+  } else {
+    fprintf(stdout,
+            " key) {\n"
+            "  _Static_assert(sizeof(key) <= sizeof(size_t), \"key too wide\");\n"
+            "  size_t h = 0;\n  __builtin_memcpy(&h, &key, sizeof(key));\n"
+            "  h ^= h >> 33;\n  h *= 0xff51afd7ed558ccdUL;\n"
+            "  return h ^ (h >> 33);\n}\n");
+  }
+  fprintf(stdout, "static inline int %s_equal(", name);
+  _print_tree(key);
+  fprintf(stdout, " a, ");
+  _print_tree(key);
+  fprintf(stdout, is_string_type(key)
+                      ? " b) { return __builtin_strcmp(a, b) == 0; }\n"
+                      : " b) { return a == b; }\n");
+
+  fprintf(stdout, "static inline %s_entry *%s_find(const %s *h, ", name, name,
+          name);
+  _print_tree(key);
+  fprintf(stdout,
+          " key) {\n  if (h->cap == 0)\n    return NULL;\n"
+          "  size_t mask = h->cap - 1;\n"
+          "  for (size_t i = %s_hash(key) & mask;; i = (i + 1) & mask) {\n"
+          "    if (!h->data[i].in_use)\n      return NULL;\n"
+          "    if (%s_equal(h->data[i].key, key))\n      return &h->data[i];\n"
+          "  }\n}\n",
+          name, name);
+  fprintf(stdout,
+          "static inline void %s_rehash(%s *h, size_t cap) {\n"
+          "  %s_entry *old = h->data;\n  size_t old_cap = h->cap;\n"
+          "  h->data = calloc(cap, sizeof(%s_entry));\n  h->cap = cap;\n"
+          "  for (size_t i = 0; i < old_cap; i++) {\n"
+          "    if (!old[i].in_use)\n      continue;\n"
+          "    size_t j = %s_hash(old[i].key) & (cap - 1);\n"
+          "    while (h->data[j].in_use)\n      j = (j + 1) & (cap - 1);\n"
+          "    h->data[j] = old[i];\n  }\n  free(old);\n}\n",
+          name, name, name, name, name);
+  fprintf(stdout, "static inline void %s_put(%s *h, ", name, name);
+  _print_tree(key);
+  fprintf(stdout, " key, ");
+  _print_tree(value);
+  fprintf(stdout,
+          " value) {\n  if ((h->len + 1) * 4 > h->cap * 3)\n"
+          "    %s_rehash(h, h->cap == 0 ? 16 : h->cap * 2);\n"
+          "  size_t mask = h->cap - 1, i = %s_hash(key) & mask;\n"
+          "  while (h->data[i].in_use && !%s_equal(h->data[i].key, key))\n"
+          "    i = (i + 1) & mask;\n"
+          "  if (!h->data[i].in_use) {\n    h->data[i].in_use = 1;\n"
+          "    h->data[i].key = key;\n    h->len++;\n  }\n"
+          "  h->data[i].value = value;\n}\n",
+          name, name, name);
+  fprintf(stdout, "static inline ");
+  _print_tree(value);
+  fprintf(stdout, " %s_get_or(const %s *h, ", name, name);
+  _print_tree(key);
+  fprintf(stdout, " key, ");
+  _print_tree(value);
+  fprintf(stdout,
+          " otherwise) {\n  %s_entry *e = %s_find(h, key);\n"
+          "  return e != NULL ? e->value : otherwise;\n}\n",
+          name, name);
+  fprintf(stdout, "static inline ");
+  _print_tree(value);
+  fprintf(stdout, " %s_get(const %s *h, ", name, name);
+  _print_tree(key);
+  fprintf(stdout, " key) {\n  ");
+  _print_tree(value);
+  fprintf(stdout, " zero = {0};\n  return %s_get_or(h, key, zero);\n}\n", name);
+  fprintf(stdout, "static inline int %s_has(const %s *h, ", name, name);
+  _print_tree(key);
+  fprintf(stdout, " key) { return %s_find(h, key) != NULL; }\n", name);
+  fprintf(stdout, "static inline void %s_remove(%s *h, ", name, name);
+  _print_tree(key);
+  fprintf(stdout,
+          " key) {\n  %s_entry *e = %s_find(h, key);\n"
+          "  if (e == NULL)\n    return;\n"
+          "  size_t mask = h->cap - 1, i = e - h->data, j = i;\n"
+          "  for (;;) {\n    j = (j + 1) & mask;\n"
+          "    if (!h->data[j].in_use)\n      break;\n"
+          "    size_t home = %s_hash(h->data[j].key) & mask;\n"
+          "    if (i <= j ? home <= i || home > j : home <= i && home > j) {\n"
+          "      h->data[i] = h->data[j];\n      i = j;\n    }\n  }\n"
+          "  h->data[i].in_use = 0;\n  h->len--;\n}\n",
+          name, name, name);
+  fprintf(stdout,
+          "static inline void %s_clear(%s *h) {\n"
+          "  for (size_t i = 0; i < h->cap; i++)\n    h->data[i].in_use = 0;\n"
+          "  h->len = 0;\n}\n"
+          "static inline void %s_destroy(%s *h) {\n"
+          "  free(h->data);\n  *h = (%s){0};\n}",
+          name, name, name, name, name);
+}
+
+/* a closure is a code pointer taking the environment as its first argument
+ * and the environment itself, see closure.c */
+static void _print_closure(struct tree *t) {
+  char *name = t->closure_decl.name;
+  struct tree *ret = t->closure_decl.type;
+  bool has_value = strcmp(ret->type_expr.id->name, "void") != 0 ||
+                   ret->type_expr.ptr != NULL;
+  fprintf(stdout, "typedef struct %s {\n  ", name);
+  _print_tree(ret);
+  fprintf(stdout, " (*fn)(void *");
+  for (struct tree *arg = t->closure_decl.args; arg != NULL; arg = arg->next) {
+    fprintf(stdout, ", ");
+    _print_tree(arg);
+  }
+  fprintf(stdout, ");\n  void *env;\n} %s;\n", name);
+  fprintf(stdout, "static inline %s %s_make(", name, name);
+  _print_tree(ret);
+  fprintf(stdout, " (*fn)(void *");
+  for (struct tree *arg = t->closure_decl.args; arg != NULL; arg = arg->next) {
+    fprintf(stdout, ", ");
+    _print_tree(arg);
+  }
+  fprintf(stdout, "), void *env) {\n  return (%s){fn, env};\n}\n", name);
+  fprintf(stdout, "static inline ");
+  _print_tree(ret);
+  fprintf(stdout, " %s_call(%s f", name, name);
+  int i = 0;
+  for (struct tree *arg = t->closure_decl.args; arg != NULL; arg = arg->next) {
+    fprintf(stdout, ", ");
+    _print_tree(arg);
+    fprintf(stdout, " a%d", i++);
+  }
+  fprintf(stdout, ") {\n  %sf.fn(f.env", has_value ? "return " : "");
+  for (int j = 0; j < i; j++)
+    fprintf(stdout, ", a%d", j);
+  fprintf(stdout, ");\n}");
+}
+
+/* a coroutine is its frame, a resume function switching on the state saved
+ * by the last suspension, see coro.c, and constructors for heap frames and
+ * frames in storage of the caller's choosing */
+static void _print_coro(struct tree *t) {
+  char *name = t->coro_decl.name;
+  fprintf(stdout, "typedef struct %s_frame {\n  lcc_coro _co;\n", name);
+  if (t->coro_decl.type != NULL) {
+    fprintf(stdout, "  ");
+    _print_field(t->coro_decl.type, "_value", 0);
+    fprintf(stdout, ";\n");
+  }
+  _print_fields(t->coro_decl.frame, 0);
+  fprintf(stdout, "} %s_frame;\n", name);
+  fprintf(stdout,
+          "static int %s_resume(void *_c) {\n  %s_frame *_f = _c;\n"
+          "  switch (_f->_co.state) {\n  case 0:;\n",
+          name, name);
+  _print_body(t->coro_decl.body);
+  fprintf(stdout, "  }\n  _f->_co.state = -1;\n  return 0;\n}\n");
+
+  fprintf(stdout, "%s_frame *%s(", name, name);
+  bool first = true;
+  for (struct tree *parm = t->coro_decl.params; parm != NULL;
+       parm = parm->next) {
+    if (!first)
+      fprintf(stdout, ", ");
+    _print_field(parm->var_decl.type, parm->var_decl.name, 0);
+    first = false;
+  }
+  if (first)
+    fprintf(stdout, "void");
+  fprintf(stdout,
+          ") {\n  %s_frame *_f = lcc_coro_new(sizeof(%s_frame), %s_resume);\n",
+          name, name, name);
+  for (struct tree *parm = t->coro_decl.params; parm != NULL;
+       parm = parm->next)
+    fprintf(stdout, "  _f->%s = %s;\n", parm->var_decl.name,
+            parm->var_decl.name);
+  fprintf(stdout, "  return _f;\n}\n");
+
+  fprintf(stdout, "%s_frame *%s_at(void *frame", name, name);
+  for (struct tree *parm = t->coro_decl.params; parm != NULL;
+       parm = parm->next) {
+    fprintf(stdout, ", ");
+    _print_field(parm->var_decl.type, parm->var_decl.name, 0);
+  }
+  fprintf(stdout,
+          ") {\n  %s_frame *_f = lcc_coro_init(frame, sizeof(%s_frame), "
+          "%s_resume);\n",
+          name, name, name);
+  for (struct tree *parm = t->coro_decl.params; parm != NULL;
+       parm = parm->next)
+    fprintf(stdout, "  _f->%s = %s;\n", parm->var_decl.name,
+            parm->var_decl.name);
+  fprintf(stdout, "  return _f;\n}");
+}
+
+static void _print_tree(struct tree *t) {
+  if (t == NULL) {
+    fprintf(stdout, "(null)");
+    return;
+  }
+
+  switch (t->type) {
+  case FN_DECL:
+    _print_fn_header(t);
+    struct tree *args = t->fn_decl.arglist;
 
     if (t->fn_decl.body == NULL && args->lambda_list.aux == NULL) {
       fputc(';', stdout);
@@ -326,36 +1115,18 @@ static void _print_tree(struct tree *t) {
     break;
   case PARM_DECL:
   case VAR_DECL:
-    _print_tree(t->var_decl.type);
-    fprintf(stdout, " %s", t->var_decl.name);
+    if (t->type == VAR_DECL && t->var_decl.align != 0)
+      fprintf(stdout, "_Alignas(%d) ", t->var_decl.align);
+    if (t->type == VAR_DECL && t->var_decl.thread_local)
+      fprintf(stdout, "_Thread_local ");
+    _print_var(t->var_decl.type, t->var_decl.name);
     if (t->var_decl.value == NULL)
       break;
     fprintf(stdout, " = ");
-    _print_tree(t->var_decl.value);
+    _print_init(t->var_decl.type, t->var_decl.value);
     break;
   case TYPE_EXPR:
-    switch (t->type_expr.id->modifier) {
-    case MOD_CONST:
-      fprintf(stdout, "const ");
-      break;
-    case MOD_VOLATILE:
-      fprintf(stdout, "volatile ");
-      break;
-    case MOD_RESTRICT:
-      fprintf(stdout, "restrict ");
-      break;
-    case MOD_ATOMIC:
-      fprintf(stdout, "atomic ");
-      break;
-    case MOD_NONE:
-    case MOD_MONOMORPH:
-      break;
-    }
-    if (t->type_expr.id != NULL && t->type_expr.id->name != NULL) {
-      fprintf(stdout, "%s", t->type_expr.id->name);
-    } else {
-      fprintf(stdout, "(null)");
-    }
+    print_type_id(t->type_expr.id);
     for (struct type_ptr *ptr = t->type_expr.ptr; ptr != NULL;
          ptr = ptr->next) {
       switch (ptr->type) {
@@ -368,6 +1139,10 @@ static void _print_tree(struct tree *t) {
       case SIZED_PTR:
         fprintf(stdout, "[%d]", ptr->size);
         break;
+      case STRIDED_PTR:
+        // lowered to a pointer by lower_arrays
+        fputc('*', stdout);
+        break;
       }
     }
     break;
@@ -412,6 +1187,30 @@ static void _print_tree(struct tree *t) {
     _print_tree(t->ref_expr.expr);
     fprintf(stdout, ")");
     break;
+  case FIELD_EXPR:
+    fputc('(', stdout);
+    _print_tree(t->field_expr.expr);
+    fprintf(stdout, ")%s%s", t->field_expr.indirect ? "->" : ".",
+            t->field_expr.field);
+    break;
+  case STRUCT_DECL:
+    _print_struct(t);
+    break;
+  case CONTAINER_DECL:
+    if (t->container_decl.key == NULL)
+      _print_vector(t);
+    else
+      _print_hash_table(t);
+    break;
+  case CLOSURE_DECL:
+    _print_closure(t);
+    break;
+  case CORO_DECL:
+    _print_coro(t);
+    break;
+  case RESUME_STMT:
+    fprintf(stdout, "case %d:", t->resume_stmt.state);
+    break;
   case CAST_EXPR:
     fprintf(stdout, "((");
     _print_tree(t->cast_expr.type);
@@ -420,6 +1219,19 @@ static void _print_tree(struct tree *t) {
     fprintf(stdout, ")");
     break;
     break;
+  case LIST_EXPR:
+    // a compound literal lives until the end of the enclosing block
+    fprintf(stdout, "((");
+    _print_tree(t->list_expr.type);
+    fprintf(stdout, "[]){");
+    for (struct tree *elem = t->list_expr.elems; elem != NULL;
+         elem = elem->next) {
+      _print_tree(elem);
+      if (elem->next != NULL)
+        fprintf(stdout, ", ");
+    }
+    fprintf(stdout, "})");
+    break;
   case BINOP_EXPR:
     fprintf(stdout, "(");
     for (struct tree *body = t->binop_expr.body; body != NULL;
@@ -615,8 +1427,10 @@ static void _print_tree(struct tree *t) {
     case INTEGER_CST:
       fprintf(stdout, "%d", t->reference_expr.ival);
       break;
-    case FLOAT_CST:
-      fprintf(stdout, "%g", t->reference_expr.fval);
+    case FLOAT_CST:;
+      char fbuf[32];
+      snprintf(fbuf, sizeof(fbuf), "%.17g", t->reference_expr.fval);
+      fprintf(stdout, "%s%s", fbuf, strpbrk(fbuf, ".en") == NULL ? ".0" : "");
       break;
     case STRING_CST:
       fprintf(stdout, "%s", t->reference_expr.symbol);
@@ -658,25 +1472,38 @@ static void _print_tree(struct tree *t) {
     }
     break;
   case TYPE_DECL:
+  case ATTR_DECL:
     break;
   default:
     fprintf(stdout, "(unknown)");
     break;
   }
 }
+void print_tree_node(struct tree *t) {
+  _print_line(t);
+  if (t->type == VAR_DECL && t->var_decl.cacheline)
+    _print_cacheline_global(t);
+  else
+    _print_tree(t);
+  fputc(';', stdout);
+  fputc('\n', stdout);
+}
 void print_tree(struct tree *t) {
   for (struct tree *head = t; head != NULL; head = head->next) {
-    _print_tree(head);
-    fputc(';', stdout);
-    fputc('\n', stdout);
+    timer_begin_form("emit", head);
+    print_tree_node(head);
+    timer_end();
   }
 }
+void print_fn_header(struct tree *t) { _print_fn_header(t); }
+void print_expr(struct tree *t) { _print_tree(t); }
 #define A(B, c) B c
 
 A(int, dontuse);
 
 struct type_id *build_tid(char *name, enum type_mod mod) {
   struct type_id *tid = calloc(1, sizeof(struct type_id));
+  mem_alloc(MEM_TYPE_ID, sizeof(struct type_id));
   translate_to_var_name(name);
   tid->name = name;
   tid->modifier = mod;
@@ -687,8 +1514,8 @@ struct type_id *build_tid(char *name, enum type_mod mod) {
 void destroy_tid(struct type_id *tid) {
   if (tid == NULL)
     return;
-  if (tid->name)
-    free(tid->name);
+  free_string(tid->name);
+  mem_free(MEM_TYPE_ID, sizeof(struct type_id));
   free(tid);
 }
 
@@ -700,6 +1527,7 @@ void add_type_ptr(struct tree *type, enum type_ptr_type ptr_type, int size) {
     return;
   }
   struct type_ptr *tp = calloc(1, sizeof(struct type_ptr));
+  mem_alloc(MEM_TYPE_PTR, sizeof(struct type_ptr));
   tp->type = ptr_type;
   tp->size = size;
   tp->next = type->type_expr.ptr;
@@ -711,6 +1539,7 @@ void destroy_type_ptr(struct type_ptr *ptr) {
     return;
   if (ptr->next != NULL)
     destroy_type_ptr(ptr->next);
+  mem_free(MEM_TYPE_PTR, sizeof(struct type_ptr));
   free(ptr);
 }
 
@@ -832,6 +1661,17 @@ struct tree *build_for_stmt(struct location loc, struct tree *type,
   return loop;
 }
 
+struct tree *build_foreach_stmt(struct location loc, struct tree *vars,
+                                struct tree *expr, struct tree *body) {
+  struct tree *loop = alloc_tree(1);
+  loop->loc = loc;
+  loop->type = FOREACH_STMT;
+  loop->foreach_stmt.vars = vars;
+  loop->foreach_stmt.expr = expr;
+  loop->foreach_stmt.body = body;
+  return loop;
+}
+
 struct tree *build_include(struct location loc, struct tree *paths) {
   struct tree *include = alloc_tree(1);
   include->loc = loc;
@@ -960,6 +1800,61 @@ struct tree *build_type_decl(struct location loc, struct tree *type,
   return type_decl;
 }
 
+struct tree *build_attr_decl(struct location loc, char *name,
+                             struct tree *args) {
+  struct tree *attr_decl = alloc_tree(1);
+  attr_decl->loc = loc;
+  attr_decl->type = ATTR_DECL;
+  attr_decl->attr_decl.name = name;
+  attr_decl->attr_decl.args = args;
+  return attr_decl;
+}
+
+struct tree *build_struct(struct location loc, char *name,
+                          struct tree *attrs, struct tree *fields) {
+  struct tree *decl = alloc_tree(1);
+  translate_to_var_name(name);
+  decl->loc = loc;
+  decl->type = STRUCT_DECL;
+  decl->struct_decl.name = name;
+  decl->struct_decl.attrs = attrs;
+  decl->struct_decl.fields = fields;
+  return decl;
+}
+
+struct tree *build_field_ref(struct location loc, struct tree *expr,
+                             char *field, bool indirect) {
+  struct tree *ref = alloc_tree(1);
+  ref->loc = loc;
+  ref->type = FIELD_EXPR;
+  ref->field_expr.expr = expr;
+  ref->field_expr.field = field;
+  ref->field_expr.indirect = indirect;
+  return ref;
+}
+
+struct tree *build_container(struct location loc, char *name, struct tree *key,
+                             struct tree *value) {
+  struct tree *decl = alloc_tree(1);
+  decl->loc = loc;
+  decl->type = CONTAINER_DECL;
+  decl->container_decl.name = name;
+  decl->container_decl.key = key;
+  decl->container_decl.value = value;
+  return decl;
+}
+
+struct tree *build_closure(struct location loc, char *name, struct tree *type,
+                           struct tree *args) {
+  struct tree *decl = alloc_tree(1);
+  decl->loc = loc;
+  decl->type = CLOSURE_DECL;
+  decl->closure_decl.name = name;
+  decl->closure_decl.type = type;
+  decl->closure_decl.args = args;
+  return decl;
+}
+
 struct tree *build_cast(struct location loc, struct tree *type,
                         struct tree *expr) {
 
@@ -971,6 +1866,46 @@ struct tree *build_cast(struct location loc, struct tree *type,
   return cast_expr;
 }
 
+struct tree *build_list(struct location loc, struct tree *type,
+                        struct tree *elems) {
+  struct tree *list = alloc_tree(1);
+  list->loc = loc;
+  list->type = LIST_EXPR;
+  list->list_expr.type = type;
+  list->list_expr.elems = elems;
+  return list;
+}
+
+struct tree *build_coro_decl(struct location loc, char *name, struct tree *type,
+                             struct tree *params, struct tree *frame,
+                             struct tree *body) {
+  struct tree *decl = alloc_tree(1);
+  decl->loc = loc;
+  decl->type = CORO_DECL;
+  decl->coro_decl.name = name;
+  decl->coro_decl.type = type;
+  decl->coro_decl.params = params;
+  decl->coro_decl.frame = frame;
+  decl->coro_decl.body = body;
+  return decl;
+}
+
+struct tree *build_resume_stmt(struct location loc, int state) {
+  struct tree *stmt = alloc_tree(1);
+  stmt->loc = loc;
+  stmt->type = RESUME_STMT;
+  stmt->resume_stmt.state = state;
+  return stmt;
+}
+
+struct tree *build_lambda_expr(struct location loc, struct tree *decl) {
+  struct tree *lambda = alloc_tree(1);
+  lambda->loc = loc;
+  lambda->type = LAMBDA_EXPR;
+  lambda->lambda_expr.decl = decl;
+  return lambda;
+}
+
 struct tree *build_lambda_key(struct location loc, char *key,
                               struct tree *expr) {
   struct tree *lambda_key = alloc_tree(1);
@@ -1054,7 +1989,9 @@ static void copy_to_type_id(struct type_id *dest, struct type_id *src) {
   if (dest == NULL || src == NULL)
     return;
   dest->modifier = src->modifier;
-  dest->name = strdup(src->name);
+  dest->lanes = src->lanes;
+  free(dest->name);
+  dest->name = src->name == NULL ? NULL : strdup(src->name);
 }
 
 static struct type_ptr *copy_type_ptr(struct type_ptr *ptr) {
@@ -1065,12 +2002,43 @@ static struct type_ptr *copy_type_ptr(struct type_ptr *ptr) {
     next = copy_type_ptr(ptr->next);
 
   struct type_ptr *copy = calloc(1, sizeof(struct type_ptr));
+  mem_alloc(MEM_TYPE_PTR, sizeof(struct type_ptr));
   copy->type = ptr->type;
   copy->size = ptr->size;
   copy->next = next;
   return copy;
 }
 
+bool same_type(struct tree *a, struct tree *b) {
+  if (a == b)
+    return true;
+  if (a == NULL || b == NULL || a->type != TYPE_EXPR || b->type != TYPE_EXPR)
+    return false;
+  if (a->type_expr.id == NULL || b->type_expr.id == NULL ||
+      a->type_expr.id->name == NULL || b->type_expr.id->name == NULL)
+    return false;
+  if (strcmp(a->type_expr.id->name, b->type_expr.id->name) != 0 ||
+      a->type_expr.id->modifier != b->type_expr.id->modifier ||
+      a->type_expr.id->lanes != b->type_expr.id->lanes)
+    return false;
+  struct type_ptr *pa = a->type_expr.ptr, *pb = b->type_expr.ptr;
+  for (; pa != NULL && pb != NULL; pa = pa->next, pb = pb->next) {
+    if (pa->type != pb->type || pa->size != pb->size)
+      return false;
+  }
+  return pa == pb;
+}
+
+/* *char, the strings used as hash-table keys */
+bool is_string_type(struct tree *t) {
+  if (t == NULL || t->type != TYPE_EXPR || t->type_expr.id->name == NULL)
+    return false;
+  struct type_ptr *ptr = t->type_expr.ptr;
+  return strcmp(t->type_expr.id->name, "char") == 0 && ptr != NULL &&
+         ptr->next == NULL && ptr->type != SIZED_PTR &&
+         t->type_expr.id->lanes == 0;
+}
+
 void copy_type_to_type(struct tree *dest, struct tree *src) {
   if (dest == NULL || src == NULL)
     return;
@@ -1081,3 +2049,185 @@ void copy_type_to_type(struct tree *dest, struct tree *src) {
   destroy_type_ptr(dest->type_expr.ptr);
   dest->type_expr.ptr = copy_type_ptr(src->type_expr.ptr);
 }
+
+static struct tree *copy_chain(struct tree *t) {
+  struct tree *head = NULL, *end = NULL;
+  for (; t != NULL; t = t->next) {
+    struct tree *copy = copy_tree(t);
+    if (end == NULL)
+      head = end = copy;
+    else
+      end = end->next = copy;
+  }
+  return head;
+}
+
+static char *copy_string(const char *s) { return s == NULL ? NULL : strdup(s); }
+
+/* a deep copy of t and of every chain below it, t->next is not followed */
+struct tree *copy_tree(struct tree *t) {
+  if (t == NULL)
+    return NULL;
+  struct tree *copy = alloc_tree(1);
+  *copy = *t;
+  copy->next = NULL;
+
+  switch (t->type) {
+  case FN_DECL:
+    copy->fn_decl.name = copy_string(t->fn_decl.name);
+    copy->fn_decl.source_name = copy_string(t->fn_decl.source_name);
+    copy->fn_decl.type = copy_chain(t->fn_decl.type);
+    copy->fn_decl.arglist = copy_chain(t->fn_decl.arglist);
+    copy->fn_decl.body = copy_chain(t->fn_decl.body);
+    break;
+  case PARM_DECL:
+  case VAR_DECL:
+    copy->var_decl.name = copy_string(t->var_decl.name);
+    copy->var_decl.type = copy_chain(t->var_decl.type);
+    copy->var_decl.value = copy_chain(t->var_decl.value);
+    break;
+  case TYPE_EXPR:
+    copy->type_expr.id = build_tid(NULL, MOD_NONE);
+    copy_to_type_id(copy->type_expr.id, t->type_expr.id);
+    copy->type_expr.ptr = copy_type_ptr(t->type_expr.ptr);
+    break;
+  case SET_EXPR:
+    copy->set_expr.var = copy_chain(t->set_expr.var);
+    copy->set_expr.value = copy_chain(t->set_expr.value);
+    break;
+  case AREF_EXPR:
+  case ADDR_EXPR:
+    copy->ref_expr.expr = copy_chain(t->ref_expr.expr);
+    copy->ref_expr.indices = copy_chain(t->ref_expr.indices);
+    break;
+  case CAST_EXPR:
+    copy->cast_expr.type = copy_chain(t->cast_expr.type);
+    copy->cast_expr.expr = copy_chain(t->cast_expr.expr);
+    break;
+  case LIST_EXPR:
+    copy->list_expr.type = copy_chain(t->list_expr.type);
+    copy->list_expr.elems = copy_chain(t->list_expr.elems);
+    break;
+  case LAMBDA_EXPR:
+    copy->lambda_expr.decl = copy_chain(t->lambda_expr.decl);
+    break;
+  case BINOP_EXPR:
+    copy->binop_expr.body = copy_chain(t->binop_expr.body);
+    break;
+  case COMPARE_EXPR:
+    copy->compare_expr.lhs = copy_chain(t->compare_expr.lhs);
+    copy->compare_expr.rhs = copy_chain(t->compare_expr.rhs);
+    break;
+  case COND_EXPR:
+    copy->cond_expr.condition = copy_chain(t->cond_expr.condition);
+    copy->cond_expr.body = copy_chain(t->cond_expr.body);
+    break;
+  case COND_STMT:
+    copy->cond_stmt.exprs = copy_chain(t->cond_stmt.exprs);
+    break;
+  case CASE_EXPR:
+    copy->case_expr.expr = copy_chain(t->case_expr.expr);
+    copy->case_expr.body = copy_chain(t->case_expr.body);
+    break;
+  case CASE_STMT:
+    copy->case_stmt.expr = copy_chain(t->case_stmt.expr);
+    copy->case_stmt.cases = copy_chain(t->case_stmt.cases);
+    break;
+  case LET_STMT:
+    copy->let_stmt.vars = copy_chain(t->let_stmt.vars);
+    copy->let_stmt.body = copy_chain(t->let_stmt.body);
+    break;
+  case WHILE_STMT:
+  case DOWHILE_STMT:
+    copy->while_stmt.condition = copy_chain(t->while_stmt.condition);
+    copy->while_stmt.body = copy_chain(t->while_stmt.body);
+    break;
+  case FOREACH_STMT:
+    copy->foreach_stmt.vars = copy_chain(t->foreach_stmt.vars);
+    copy->foreach_stmt.expr = copy_chain(t->foreach_stmt.expr);
+    copy->foreach_stmt.body = copy_chain(t->foreach_stmt.body);
+    break;
+  case FOR_STMT:
+    copy->for_stmt.type = copy_chain(t->for_stmt.type);
+    copy->for_stmt.vars = copy_chain(t->for_stmt.vars);
+    copy->for_stmt.condition = copy_chain(t->for_stmt.condition);
+    copy->for_stmt.loop_eval = copy_chain(t->for_stmt.loop_eval);
+    copy->for_stmt.body = copy_chain(t->for_stmt.body);
+    break;
+  case IF_STMT:
+    copy->if_else_stmt.condition = copy_chain(t->if_else_stmt.condition);
+    copy->if_else_stmt.if_block = copy_chain(t->if_else_stmt.if_block);
+    copy->if_else_stmt.else_block = copy_chain(t->if_else_stmt.else_block);
+    break;
+  case REFERENCE_EXPR:
+    switch (t->reference_expr.type) {
+    case STRING_CST:
+    case VAR_REF:
+      copy->reference_expr.symbol = copy_string(t->reference_expr.symbol);
+      break;
+    case FN_CALL:
+      copy->reference_expr.call.name = copy_string(t->reference_expr.call.name);
+      copy->reference_expr.call.args = copy_chain(t->reference_expr.call.args);
+      break;
+    default:
+      break;
+    }
+    break;
+  case INCLUDE_STMT:
+    copy->include_stmt.paths = copy_chain(t->include_stmt.paths);
+    break;
+  case LAMBDA_LIST:
+    copy->lambda_list.args = copy_chain(t->lambda_list.args);
+    copy->lambda_list.optionals = copy_chain(t->lambda_list.optionals);
+    copy->lambda_list.rest = copy_chain(t->lambda_list.rest);
+    copy->lambda_list.keys = copy_chain(t->lambda_list.keys);
+    copy->lambda_list.aux = copy_chain(t->lambda_list.aux);
+    break;
+  case LAMBDA_KEY:
+    copy->lambda_key.key_name = copy_string(t->lambda_key.key_name);
+    copy->lambda_key.expr = copy_chain(t->lambda_key.expr);
+    break;
+  case TYPE_DECL:
+    copy->type_decl.type = copy_chain(t->type_decl.type);
+    copy->type_decl.symbol_list = copy_chain(t->type_decl.symbol_list);
+    break;
+  case ATTR_DECL:
+    copy->attr_decl.name = copy_string(t->attr_decl.name);
+    copy->attr_decl.args = copy_chain(t->attr_decl.args);
+    break;
+  case STRUCT_DECL:
+    copy->struct_decl.name = copy_string(t->struct_decl.name);
+    copy->struct_decl.fields = copy_chain(t->struct_decl.fields);
+    copy->struct_decl.cold = copy_chain(t->struct_decl.cold);
+    copy->struct_decl.attrs = copy_chain(t->struct_decl.attrs);
+    break;
+  case FIELD_EXPR:
+    copy->field_expr.field = copy_string(t->field_expr.field);
+    copy->field_expr.expr = copy_chain(t->field_expr.expr);
+    break;
+  case CONTAINER_DECL:
+    copy->container_decl.name = copy_string(t->container_decl.name);
+    copy->container_decl.key = copy_chain(t->container_decl.key);
+    copy->container_decl.value = copy_chain(t->container_decl.value);
+    break;
+  case CLOSURE_DECL:
+    copy->closure_decl.name = copy_string(t->closure_decl.name);
+    copy->closure_decl.type = copy_chain(t->closure_decl.type);
+    copy->closure_decl.args = copy_chain(t->closure_decl.args);
+    break;
+  case CORO_DECL:
+    copy->coro_decl.name = copy_string(t->coro_decl.name);
+    copy->coro_decl.source_name = copy_string(t->coro_decl.source_name);
+    copy->coro_decl.type = copy_chain(t->coro_decl.type);
+    copy->coro_decl.params = copy_chain(t->coro_decl.params);
+    copy->coro_decl.frame = copy_chain(t->coro_decl.frame);
+    copy->coro_decl.body = copy_chain(t->coro_decl.body);
+    break;
+  case RESUME_STMT:
+    break;
+  default:
+    warning("Copying unimplemented tree type %d", t->type);
+    break;
+  }
+  return copy;
+}
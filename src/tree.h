@@ -1,6 +1,7 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
 
 struct location {
   int first_line;
@@ -48,12 +49,14 @@ enum compare_op {
 struct type_id {
   char *name;
   enum type_mod modifier;
+  int lanes; // elements of a (vec T N) type, 0 for scalars
 };
 
 enum type_ptr_type {
   SINGLE_PTR,
   MULTI_PTR,
   SIZED_PTR,
+  STRIDED_PTR, // dynamic multi-dimensional array, size is the rank
 };
 
 struct type_ptr {
@@ -76,12 +79,14 @@ struct tree {
 };
 
 struct tree *reverse_tree(struct tree *t);
+struct tree *alloc_tree(size_t n);
 
 struct tree *build_fn(struct location loc, char *name, struct tree *ret_type,
                       struct tree *arglist, struct tree *body);
 struct tree *build_var(struct location loc, enum tree_type type, char *name,
                        struct tree *var_type, struct tree *value);
 struct tree *build_type_expr(struct location loc, struct type_id *id);
+struct tree *build_vector_type(struct location loc, char *elem, int lanes);
 struct tree *build_set_expr(struct location loc, struct tree *name,
                             struct tree *value, char mod);
 struct tree *build_binop(struct location loc, char binop, struct tree *body);
@@ -97,6 +102,8 @@ struct tree *build_while_stmt(struct location loc, enum tree_type while_type,
 struct tree *build_for_stmt(struct location loc, struct tree *type,
                             struct tree *vars, struct tree *condition,
                             struct tree *loop_eval, struct tree *body);
+struct tree *build_foreach_stmt(struct location loc, struct tree *vars,
+                                struct tree *expr, struct tree *body);
 struct tree *build_if_else_stmt(struct location loc, struct tree *condition,
                                 struct tree *if_block, struct tree *else_block);
 struct tree *build_cond_body(struct location loc, struct tree *condition,
@@ -123,6 +130,9 @@ struct tree *build_aref(struct location loc, struct tree *expr,
 struct tree *build_addr(struct location loc, struct tree *expr);
 struct tree *build_cast(struct location loc, struct tree *type,
                         struct tree *expr);
+struct tree *build_list(struct location loc, struct tree *type,
+                        struct tree *elems);
+struct tree *build_lambda_expr(struct location loc, struct tree *decl);
 
 struct tree *build_lambda_list(struct location loc, struct tree *args,
                                struct tree *optionals, struct tree *rest,
@@ -132,20 +142,54 @@ struct tree *build_lambda_key(struct location loc, char *key,
 
 struct tree *build_type_decl(struct location loc, struct tree *type,
                              struct tree *symbol_list);
+struct tree *build_attr_decl(struct location loc, char *name,
+                             struct tree *args);
+struct tree *build_struct(struct location loc, char *name,
+                          struct tree *attrs, struct tree *fields);
+struct tree *build_field_ref(struct location loc, struct tree *expr,
+                             char *field, bool indirect);
+struct tree *build_container(struct location loc, char *name, struct tree *key,
+                             struct tree *value);
+struct tree *build_closure(struct location loc, char *name, struct tree *type,
+                           struct tree *args);
+struct tree *build_coro_decl(struct location loc, char *name, struct tree *type,
+                             struct tree *params, struct tree *frame,
+                             struct tree *body);
+struct tree *build_resume_stmt(struct location loc, int state);
 
 struct tree *append_tree(struct tree *t, struct tree *next);
 
+typedef bool (*walk_fn)(struct tree *t, void *data);
+void walk_tree(struct tree *t, walk_fn fn, void *data);
+void walk_tree_node(struct tree *t, walk_fn fn, void *data);
+
 struct type_id *build_tid(char *name, enum type_mod mod);
 void destroy_tid(struct type_id *tid);
 void destroy_type_ptr(struct type_ptr *ptr);
 
 void add_type_ptr(struct tree *type, enum type_ptr_type ptr_type, int size);
 void destroy_tree(struct tree *t);
+/* -g: print_tree marks statements with #line and print_asm with .loc, so
+ * that debuggers and profilers step through the .lc source */
+extern bool line_directives;
+/* maps the C symbols back to LCC names and positions, see symbols.c */
+extern const char *symbol_map;
+void write_symbol_map(struct tree *t);
 void print_tree(struct tree *t);
+void print_tree_node(struct tree *t);
+void print_fn_header(struct tree *t);
+const char *optimize_level(struct tree *attr);
+void print_type_id(struct type_id *id);
+void print_decl(struct tree *type, const char *name);
+int type_id_size(struct type_id *id);
+void print_expr(struct tree *t);
+void print_asm(struct tree *t);
 
 void translate_to_var_name(char *var_name);
 int get_bool(struct tree *t); // -1 -> not a bool, 0 -> false, 1 -> false
 bool is_monomorph(struct tree *t);
+bool same_type(struct tree *a, struct tree *b);
+bool is_string_type(struct tree *t);
 
 void resolve_pass(struct tree *t);
 const char *get_tree_type(struct tree *t);
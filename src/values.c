@@ -0,0 +1,273 @@
+#include "debug.h"
+#include "opt.h"
+#include "tree.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hashmap.h"
+
+/*
+ * Multiple values. A function declared to return (values T1 T2 ...) returns
+ * a structure with one field per value, v0, v1 and so on, by value, so that
+ * small results come back in registers instead of through out-pointers, and
+ * (values a b ...) in its body builds that structure.
+ *
+ *   (multiple-value-bind (q r) (divmod a b) body)
+ *
+ * evaluates the call once and binds q and r to its values for the duration
+ * of body. Their types are those of the callee's declaration unless body
+ * declares others.
+ *
+ * Every distinct (values ...) type becomes an (ordered) defstruct named after
+ * its element types, values_int__int for (values i32 i32), which is lowered
+ * with the other structures.
+ */
+
+extern const char *lcc_current_file;
+
+static struct hashmap_s tuples;
+static bool tuples_created = false;
+static struct tree *decls = NULL, *decls_end = NULL;
+static bool values_used = false;
+static int n_binds = 0;
+static struct tree *functions;
+static bool user_values = false; // a user definition takes precedence
+
+struct tree *build_values_type(struct location loc, struct tree *types) {
+  char name[256] = "values_";
+  bool valid = true;
+  int n = 0;
+  for (struct tree *type = types; type != NULL && valid; type = type->next) {
+    if (n++ > 0)
+      strncat(name, "__", sizeof(name) - strlen(name) - 1);
+    valid = mangle_type(type, name, sizeof(name));
+  }
+  if (!valid) {
+    destroy_tree(types);
+    return build_type_expr(loc, build_tid(NULL, MOD_MONOMORPH));
+  }
+
+  if (!tuples_created) {
+    if (hashmap_create(32, &tuples) != 0)
+      error("Failed to create hashmap.");
+    tuples_created = true;
+  }
+  if (hashmap_get(&tuples, name, strlen(name)) != NULL) {
+    destroy_tree(types);
+  } else {
+    struct tree *fields = NULL;
+    int i = 0;
+    for (struct tree *type = types, *next; type != NULL; type = next) {
+      next = type->next;
+      type->next = NULL;
+      char field[16];
+      snprintf(field, sizeof(field), "v%d", i++);
+      fields = append_tree(
+          build_var(type->loc, VAR_DECL, strdup(field), type, NULL), fields);
+    }
+    struct tree *decl =
+        build_struct(loc, strdup(name),
+                     build_attr_decl(loc, strdup("ordered"), NULL), fields);
+    hashmap_put(&tuples, decl->struct_decl.name, strlen(name), decl);
+    if (decls_end == NULL)
+      decls = decls_end = decl;
+    else
+      decls_end = decls_end->next = decl;
+  }
+  values_used = true;
+  return build_type_expr(loc, build_tid(strdup(name), MOD_NONE));
+}
+
+struct tree *build_values_bind(struct location loc, struct tree *symbols,
+                               struct tree *expr, struct tree *body) {
+  char name[32];
+  snprintf(name, sizeof(name), "_mv%d", n_binds++);
+  struct location none = {0, 0, 0, 0};
+  struct tree *vars = build_var(
+      loc, VAR_DECL, strdup(name),
+      build_type_expr(none, build_tid(NULL, MOD_MONOMORPH)), expr);
+  int i = 0;
+  for (struct tree *symbol = symbols; symbol != NULL; symbol = symbol->next) {
+    char field[16];
+    snprintf(field, sizeof(field), "v%d", i++);
+    struct tree *value = build_field_ref(
+        symbol->loc, build_var_ref(symbol->loc, strdup(name)), strdup(field),
+        false);
+    vars = append_tree(
+        build_var(symbol->loc, VAR_DECL, symbol->reference_expr.symbol,
+                  build_type_expr(none, build_tid(NULL, MOD_MONOMORPH)),
+                  value),
+        vars);
+    symbol->reference_expr.symbol = NULL;
+  }
+  destroy_tree(symbols);
+  values_used = true;
+  return build_let_stmt(loc, vars, body);
+}
+
+static struct tree *find_tuple(struct tree *type) {
+  if (type == NULL || type->type != TYPE_EXPR || !tuples_created ||
+      type->type_expr.ptr != NULL || type->type_expr.id->name == NULL)
+    return NULL;
+  char *name = type->type_expr.id->name;
+  return hashmap_get(&tuples, name, strlen(name));
+}
+
+static struct tree *find_fn(const char *name) {
+  for (struct tree *head = functions; head != NULL; head = head->next) {
+    if (head->type == FN_DECL && strcmp(head->fn_decl.name, name) == 0)
+      return head;
+  }
+  return NULL;
+}
+
+static struct tree *find_value(struct tree *tuple, const char *field) {
+  for (struct tree *v = tuple->struct_decl.fields; v != NULL; v = v->next) {
+    if (strcmp(v->var_decl.name, field) == 0)
+      return v;
+  }
+  return NULL;
+}
+
+static int count_values(struct tree *tuple) {
+  int n = 0;
+  for (struct tree *v = tuple->struct_decl.fields; v != NULL; v = v->next)
+    n++;
+  return n;
+}
+
+/* (values a b) becomes (make-values_T :v0 a :v1 b), which lower_structs
+ * turns into a call of the constructor */
+static void lower_values_call(struct tree *t, struct tree *fn) {
+  struct tree *tuple = find_tuple(fn->fn_decl.type);
+  if (tuple == NULL) {
+    errorat("values outside of a function declared to return (values ...)",
+            lcc_current_file, t->loc.first_line, t->loc.first_column);
+    return;
+  }
+  int n = 0;
+  for (struct tree *arg = t->reference_expr.call.args; arg != NULL;
+       arg = arg->next)
+    n++;
+  if (n != count_values(tuple)) {
+    errorat("%s returns %d values, not %d", lcc_current_file,
+            t->loc.first_line, t->loc.first_column, fn->fn_decl.name,
+            count_values(tuple), n);
+    return;
+  }
+
+  struct tree *keys = NULL;
+  int i = 0;
+  for (struct tree *arg = t->reference_expr.call.args, *next; arg != NULL;
+       arg = next) {
+    next = arg->next;
+    arg->next = NULL;
+    char field[16];
+    snprintf(field, sizeof(field), "v%d", i++);
+    keys = append_tree(build_lambda_key(arg->loc, strdup(field), arg), keys);
+  }
+  size_t len = strlen(tuple->struct_decl.name) + sizeof("make_");
+  char *name = malloc(len);
+  snprintf(name, len, "make_%s", tuple->struct_decl.name);
+  free(t->reference_expr.call.name);
+  t->reference_expr.call.name = name;
+  t->reference_expr.call.args = keys;
+}
+
+/* the variables of a multiple-value-bind take the types of the values of the
+ * callee, the first one holds the whole result */
+static void type_bind(struct tree *let) {
+  struct tree *result = let->let_stmt.vars;
+  struct tree *call = result->var_decl.value;
+  if (!is_monomorph(result->var_decl.type) || call == NULL ||
+      call->type != REFERENCE_EXPR || call->reference_expr.type != FN_CALL)
+    return;
+  struct tree *callee = find_fn(call->reference_expr.call.name);
+  if (callee == NULL)
+    return;
+  struct tree *tuple = find_tuple(callee->fn_decl.type);
+  if (tuple == NULL) {
+    errorat("%s does not return multiple values", lcc_current_file,
+            call->loc.first_line, call->loc.first_column, callee->fn_decl.name);
+    return;
+  }
+  copy_type_to_type(result->var_decl.type, callee->fn_decl.type);
+
+  for (struct tree *var = result->next; var != NULL; var = var->next) {
+    struct tree *ref = var->var_decl.value;
+    if (ref == NULL || ref->type != FIELD_EXPR)
+      continue;
+    struct tree *value = find_value(tuple, ref->field_expr.field);
+    if (value == NULL) {
+      errorat("%s returns %d values, cannot bind '%s'", lcc_current_file,
+              var->loc.first_line, var->loc.first_column,
+              callee->fn_decl.name, count_values(tuple), var->var_decl.name);
+      continue;
+    }
+    if (is_monomorph(var->var_decl.type))
+      copy_type_to_type(var->var_decl.type, value->var_decl.type);
+  }
+}
+
+static bool is_bind(struct tree *t) {
+  struct tree *result = t->let_stmt.vars;
+  return result != NULL && result->type == VAR_DECL &&
+         strncmp(result->var_decl.name, "_mv", 3) == 0;
+}
+
+static bool lower_values_walk(struct tree *t, void *data) {
+  if (t->type == REFERENCE_EXPR && t->reference_expr.type == FN_CALL &&
+      !user_values && strcmp(t->reference_expr.call.name, "values") == 0)
+    lower_values_call(t, data);
+  else if (t->type == LET_STMT && is_bind(t))
+    type_bind(t);
+  return true;
+}
+
+/* a structure follows the includes and the structures named by its values */
+static struct tree *place(struct tree *t, struct tree *decl) {
+  struct tree *after = NULL;
+  for (struct tree *head = t; head != NULL; head = head->next) {
+    if (head->type == INCLUDE_STMT)
+      after = head;
+    if (head->type != STRUCT_DECL)
+      continue;
+    for (struct tree *v = decl->struct_decl.fields; v != NULL; v = v->next) {
+      char *name = v->var_decl.type->type_expr.id->name;
+      if (name != NULL && strcmp(name, head->struct_decl.name) == 0)
+        after = head;
+    }
+  }
+  if (after == NULL) {
+    decl->next = t;
+    return decl;
+  }
+  decl->next = after->next;
+  after->next = decl;
+  return t;
+}
+
+struct tree *lower_values(struct tree *t) {
+  if (!values_used)
+    return t;
+  functions = t;
+  user_values = find_fn("values") != NULL;
+  for (struct tree *head = t; head != NULL; head = head->next) {
+    if (head->type == FN_DECL)
+      walk_tree(head->fn_decl.body, lower_values_walk, head);
+  }
+
+  for (struct tree *decl = decls, *next; decl != NULL; decl = next) {
+    next = decl->next;
+    t = place(t, decl);
+  }
+  decls = decls_end = NULL;
+  if (tuples_created)
+    hashmap_destroy(&tuples);
+  tuples_created = false;
+  return t;
+}
@@ -0,0 +1,605 @@
+#include "debug.h"
+#include "opt.h"
+#include "tree.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hashmap.h"
+
+/*
+ * Builtins for (vec T N) types. Element-wise arithmetic and (aref v i) are
+ * handled by the C compiler's vector extensions directly, the builtins below
+ * are rewritten into calls to static inline helpers that are specialised for
+ * the vector type and printed ahead of the program:
+ *
+ *   (vec-load p N) (vec-loadu p N)     load N elements from *T p
+ *   (vec-store p v) (vec-storeu p v)   store v to p
+ *   (vec-shuffle v i0 ... iN-1)        permute the lanes of v
+ *   (vec-shuffle a b i0 ... iN-1)      select lanes from a (0..N-1), b (N..2N-1)
+ *   (vec-sum v) (vec-min v) (vec-max v) horizontal reductions
+ *
+ * The -u variants do not require the pointer to be aligned to the vector
+ * size. A vector variable initialised with a scalar gets it in every lane.
+ */
+
+extern const char *lcc_current_file;
+
+enum vec_kind {
+  VEC_LOAD,
+  VEC_LOADU,
+  VEC_STORE,
+  VEC_STOREU,
+  VEC_SHUFFLE,
+  VEC_SHUFFLE2,
+  VEC_SUM,
+  VEC_MIN,
+  VEC_MAX,
+  VEC_SPLAT,
+};
+
+static const char *vec_kind_names[] = {
+    [VEC_LOAD] = "load",       [VEC_LOADU] = "loadu", [VEC_STORE] = "store",
+    [VEC_STOREU] = "storeu",   [VEC_SHUFFLE] = "shuffle",
+    [VEC_SHUFFLE2] = "shuffle2", [VEC_SUM] = "sum",   [VEC_MIN] = "min",
+    [VEC_MAX] = "max",         [VEC_SPLAT] = "splat",
+};
+
+struct vec_helper {
+  char *name;
+  enum vec_kind kind;
+  struct type_id type;
+  struct vec_helper *next;
+};
+
+static struct hashmap_s helpers;
+static struct vec_helper *helper_list = NULL, *helper_end = NULL;
+
+struct vec_scope {
+  char *name;
+  struct tree *type;
+};
+
+static struct vec_scope *scope = NULL;
+static int n_scope = 0, cap_scope = 0;
+
+static struct hashmap_s fn_types;
+
+static void push_scope(char *name, struct tree *type) {
+  if (n_scope >= cap_scope) {
+    cap_scope = cap_scope == 0 ? 32 : cap_scope * 2;
+    scope = realloc(scope, cap_scope * sizeof(struct vec_scope));
+  }
+  scope[n_scope++] = (struct vec_scope){name, type};
+}
+
+static struct tree *lookup(char *name) {
+  for (int i = n_scope - 1; i >= 0; i--) {
+    if (strcmp(scope[i].name, name) == 0)
+      return scope[i].type;
+  }
+  return NULL;
+}
+
+static bool is_int_cst(struct tree *t) {
+  return t != NULL && t->type == REFERENCE_EXPR &&
+         t->reference_expr.type == INTEGER_CST;
+}
+
+static struct type_id *vector_type(struct tree *type) {
+  if (type == NULL || type->type != TYPE_EXPR || type->type_expr.ptr != NULL ||
+      type->type_expr.id == NULL || type->type_expr.id->lanes == 0)
+    return NULL;
+  return type->type_expr.id;
+}
+
+static int count_args(struct tree *args) {
+  int n = 0;
+  for (; args != NULL; args = args->next)
+    n++;
+  return n;
+}
+
+/* the vector type of an expression, NULL for scalars and unknown types */
+static struct type_id *vector_of(struct tree *t) {
+  if (t == NULL)
+    return NULL;
+  switch (t->type) {
+  case REFERENCE_EXPR:
+    if (t->reference_expr.type == VAR_REF)
+      return vector_type(lookup(t->reference_expr.symbol));
+    if (t->reference_expr.type == FN_CALL) {
+      char *name = t->reference_expr.call.name;
+      struct vec_helper *helper = hashmap_get(&helpers, name, strlen(name));
+      if (helper != NULL)
+        return helper->kind == VEC_SUM || helper->kind == VEC_MIN ||
+                       helper->kind == VEC_MAX || helper->kind == VEC_STORE ||
+                       helper->kind == VEC_STOREU
+                   ? NULL
+                   : &helper->type;
+      return vector_type(hashmap_get(&fn_types, name, strlen(name)));
+    }
+    return NULL;
+  case BINOP_EXPR:
+    for (struct tree *op = t->binop_expr.body; op != NULL; op = op->next) {
+      struct type_id *type = vector_of(op);
+      if (type != NULL)
+        return type;
+    }
+    return NULL;
+  case AREF_EXPR:;
+    // *(vec T N) indexed down to the vector
+    if (t->ref_expr.expr->type != REFERENCE_EXPR ||
+        t->ref_expr.expr->reference_expr.type != VAR_REF)
+      return NULL;
+    struct tree *type = lookup(t->ref_expr.expr->reference_expr.symbol);
+    if (type == NULL || type->type != TYPE_EXPR ||
+        type->type_expr.id->lanes == 0)
+      return NULL;
+    int depth = 0;
+    for (struct type_ptr *ptr = type->type_expr.ptr; ptr != NULL;
+         ptr = ptr->next)
+      depth++;
+    int n_indices = t->ref_expr.indices == NULL
+                        ? 1
+                        : count_args(t->ref_expr.indices);
+    return depth == n_indices ? type->type_expr.id : NULL;
+  case CAST_EXPR:
+    return vector_type(t->cast_expr.type);
+  case SET_EXPR:
+    return vector_of(t->set_expr.var);
+  default:
+    return NULL;
+  }
+}
+
+/* the scalar element type behind a pointer expression */
+static struct type_id *pointer_elem(struct tree *t) {
+  struct tree *type = NULL;
+  switch (t->type) {
+  case REFERENCE_EXPR:
+    if (t->reference_expr.type == STRING_CST) {
+      static struct type_id char_id = {"char", MOD_NONE, 0};
+      return &char_id;
+    }
+    if (t->reference_expr.type == VAR_REF)
+      type = lookup(t->reference_expr.symbol);
+    break;
+  case CAST_EXPR:
+    type = t->cast_expr.type;
+    break;
+  case BINOP_EXPR:
+    if (t->binop_expr.op == '+' || t->binop_expr.op == '-')
+      return pointer_elem(t->binop_expr.body);
+    return NULL;
+  case ADDR_EXPR:;
+    // (addr (aref a i)) with a single index into a one level array
+    struct tree *aref = t->ref_expr.expr;
+    if (aref->type != AREF_EXPR || count_args(aref->ref_expr.indices) != 1 ||
+        aref->ref_expr.expr->type != REFERENCE_EXPR ||
+        aref->ref_expr.expr->reference_expr.type != VAR_REF)
+      return NULL;
+    type = lookup(aref->ref_expr.expr->reference_expr.symbol);
+    break;
+  default:
+    return NULL;
+  }
+  if (type == NULL || type->type != TYPE_EXPR || type->type_expr.ptr == NULL ||
+      type->type_expr.ptr->next != NULL || type->type_expr.id->lanes != 0)
+    return NULL;
+  return type->type_expr.id;
+}
+
+static char *helper_name(enum vec_kind kind, struct type_id *type) {
+  size_t len = strlen(type->name) + 48;
+  char *name = malloc(len);
+  snprintf(name, len, "lcc_vec_%s_%s_%d", vec_kind_names[kind], type->name,
+           type->lanes);
+  for (char *c = name; *c != '\0'; c++) {
+    if (*c == ' ')
+      *c = '_';
+  }
+  return name;
+}
+
+/* renames the call to the helper for the vector type, creating it on first
+ * use */
+static void use_helper(struct tree *call, enum vec_kind kind,
+                       struct type_id *type) {
+  char *name = helper_name(kind, type);
+  if (hashmap_get(&helpers, name, strlen(name)) == NULL) {
+    struct vec_helper *helper = calloc(1, sizeof(struct vec_helper));
+    helper->name = name;
+    helper->kind = kind;
+    helper->type.name = strdup(type->name);
+    helper->type.lanes = type->lanes;
+    hashmap_put(&helpers, helper->name, strlen(helper->name), helper);
+    if (helper_end == NULL)
+      helper_list = helper;
+    else
+      helper_end->next = helper;
+    helper_end = helper;
+    name = strdup(name);
+  }
+  free(call->reference_expr.call.name);
+  call->reference_expr.call.name = name;
+}
+
+static void vec_error(struct tree *t, const char *msg) {
+  errorat("%s: %s", lcc_current_file, t->loc.first_line, t->loc.first_column,
+          t->reference_expr.call.name, msg);
+}
+
+static void lower_load(struct tree *t, enum vec_kind kind) {
+  struct tree *ptr = t->reference_expr.call.args;
+  struct tree *lanes = ptr == NULL ? NULL : ptr->next;
+  if (!is_int_cst(lanes) || lanes->next != NULL) {
+    vec_error(t, "expected a pointer and a constant number of elements");
+    return;
+  }
+  struct type_id *elem = pointer_elem(ptr);
+  if (elem == NULL) {
+    vec_error(t, "cannot tell the element type of the pointer");
+    return;
+  }
+  int n = lanes->reference_expr.ival;
+  if (n <= 0 || (n & (n - 1)) != 0) {
+    vec_error(t, "the number of elements must be a power of two");
+    return;
+  }
+  ptr->next = NULL;
+  destroy_tree(lanes);
+  use_helper(t, kind, &(struct type_id){elem->name, MOD_NONE, n});
+}
+
+static void lower_store(struct tree *t, enum vec_kind kind) {
+  struct tree *ptr = t->reference_expr.call.args;
+  struct tree *value = ptr == NULL ? NULL : ptr->next;
+  if (value == NULL || value->next != NULL) {
+    vec_error(t, "expected a pointer and a vector");
+    return;
+  }
+  struct type_id *type = vector_of(value);
+  struct type_id *elem = pointer_elem(ptr);
+  if (type == NULL) {
+    vec_error(t, "the stored value is not a vector");
+    return;
+  }
+  if (elem != NULL && strcmp(elem->name, type->name) != 0) {
+    vec_error(t, "pointer and vector element types differ");
+    return;
+  }
+  use_helper(t, kind, type);
+}
+
+static void lower_shuffle(struct tree *t) {
+  struct tree *args = t->reference_expr.call.args;
+  struct type_id *type = vector_of(args);
+  if (type == NULL) {
+    vec_error(t, "the first argument is not a vector");
+    return;
+  }
+  enum vec_kind kind = VEC_SHUFFLE;
+  struct tree *indices = args->next;
+  if (indices != NULL && !is_int_cst(indices)) {
+    struct type_id *second = vector_of(indices);
+    if (second == NULL || strcmp(second->name, type->name) != 0 ||
+        second->lanes != type->lanes) {
+      vec_error(t, "both vectors must have the same type");
+      return;
+    }
+    kind = VEC_SHUFFLE2;
+    indices = indices->next;
+  }
+  int limit = kind == VEC_SHUFFLE2 ? 2 * type->lanes : type->lanes;
+  if (count_args(indices) != type->lanes) {
+    vec_error(t, "expected one index per lane");
+    return;
+  }
+  for (struct tree *index = indices; index != NULL; index = index->next) {
+    if (!is_int_cst(index) || index->reference_expr.ival < 0 ||
+        index->reference_expr.ival >= limit) {
+      vec_error(t, "lane indices must be constants selecting an input lane");
+      return;
+    }
+  }
+  use_helper(t, kind, type);
+}
+
+static void lower_reduce(struct tree *t, enum vec_kind kind) {
+  struct tree *args = t->reference_expr.call.args;
+  struct type_id *type = vector_of(args);
+  if (type == NULL || args->next != NULL) {
+    vec_error(t, "expected a single vector");
+    return;
+  }
+  use_helper(t, kind, type);
+}
+
+static void lower_call(struct tree *t) {
+  static const struct {
+    const char *name;
+    enum vec_kind kind;
+  } builtins[] = {
+      {"vec_load", VEC_LOAD},       {"vec_loadu", VEC_LOADU},
+      {"vec_store", VEC_STORE},     {"vec_storeu", VEC_STOREU},
+      {"vec_shuffle", VEC_SHUFFLE}, {"vec_sum", VEC_SUM},
+      {"vec_min", VEC_MIN},         {"vec_max", VEC_MAX},
+  };
+  for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++) {
+    if (strcmp(builtins[i].name, t->reference_expr.call.name) != 0)
+      continue;
+    switch (builtins[i].kind) {
+    case VEC_LOAD:
+    case VEC_LOADU:
+      lower_load(t, builtins[i].kind);
+      break;
+    case VEC_STORE:
+    case VEC_STOREU:
+      lower_store(t, builtins[i].kind);
+      break;
+    case VEC_SHUFFLE:
+      lower_shuffle(t);
+      break;
+    default:
+      lower_reduce(t, builtins[i].kind);
+      break;
+    }
+    return;
+  }
+}
+
+static bool scalar_value(struct tree *t) {
+  if (t->type != REFERENCE_EXPR)
+    return false;
+  switch (t->reference_expr.type) {
+  case INTEGER_CST:
+  case FLOAT_CST:
+  case CHAR_CST:
+    return true;
+  case VAR_REF:;
+    struct tree *type = lookup(t->reference_expr.symbol);
+    return type != NULL && type->type == TYPE_EXPR &&
+           type->type_expr.ptr == NULL && type->type_expr.id->lanes == 0 &&
+           type_id_size(type->type_expr.id) > 0;
+  default:
+    return false;
+  }
+}
+
+static void lower_chain(struct tree *t);
+
+static void lower(struct tree *t) {
+  if (t == NULL)
+    return;
+  int saved = n_scope;
+  switch (t->type) {
+  case FN_DECL:
+    lower(t->fn_decl.arglist);
+    lower_chain(t->fn_decl.body);
+    break;
+  case LAMBDA_LIST:
+    lower_chain(t->lambda_list.args);
+    lower_chain(t->lambda_list.optionals);
+    for (struct tree *key = t->lambda_list.keys; key != NULL; key = key->next)
+      lower(key->lambda_key.expr);
+    lower_chain(t->lambda_list.aux);
+    // the enclosing FN_DECL owns these scopes
+    return;
+  case VAR_DECL:
+  case PARM_DECL:
+    lower(t->var_decl.value);
+    struct type_id *type = vector_type(t->var_decl.type);
+    if (type != NULL && t->var_decl.value != NULL &&
+        scalar_value(t->var_decl.value)) {
+      struct tree *splat =
+          build_fn_call(t->loc, strdup("vec_splat"), t->var_decl.value);
+      use_helper(splat, VEC_SPLAT, type);
+      t->var_decl.value = splat;
+    }
+    push_scope(t->var_decl.name, t->var_decl.type);
+    // declarations stay visible for the rest of the enclosing body
+    return;
+  case SET_EXPR:
+    lower(t->set_expr.var);
+    lower(t->set_expr.value);
+    break;
+  case AREF_EXPR:
+  case ADDR_EXPR:
+    lower(t->ref_expr.expr);
+    lower_chain(t->ref_expr.indices);
+    break;
+  case FIELD_EXPR:
+    lower(t->field_expr.expr);
+    break;
+  case CAST_EXPR:
+    lower(t->cast_expr.expr);
+    break;
+  case LIST_EXPR:
+    lower_chain(t->list_expr.elems);
+    break;
+  case BINOP_EXPR:
+    lower_chain(t->binop_expr.body);
+    break;
+  case COMPARE_EXPR:
+    lower(t->compare_expr.lhs);
+    lower(t->compare_expr.rhs);
+    break;
+  case REFERENCE_EXPR:
+    if (t->reference_expr.type == FN_CALL) {
+      lower_chain(t->reference_expr.call.args);
+      lower_call(t);
+    }
+    break;
+  case LET_STMT:
+    lower_chain(t->let_stmt.vars);
+    lower_chain(t->let_stmt.body);
+    break;
+  case IF_STMT:
+    lower(t->if_else_stmt.condition);
+    lower_chain(t->if_else_stmt.if_block);
+    n_scope = saved;
+    lower_chain(t->if_else_stmt.else_block);
+    break;
+  case COND_STMT:
+    for (struct tree *expr = t->cond_stmt.exprs; expr != NULL;
+         expr = expr->next) {
+      lower(expr->cond_expr.condition);
+      lower_chain(expr->cond_expr.body);
+      n_scope = saved;
+    }
+    break;
+  case CASE_STMT:
+    lower(t->case_stmt.expr);
+    for (struct tree *c = t->case_stmt.cases; c != NULL; c = c->next) {
+      lower_chain(c->case_expr.body);
+      n_scope = saved;
+    }
+    break;
+  case WHILE_STMT:
+  case DOWHILE_STMT:
+    lower(t->while_stmt.condition);
+    lower_chain(t->while_stmt.body);
+    break;
+  case FOR_STMT:
+    lower_chain(t->for_stmt.vars);
+    lower(t->for_stmt.condition);
+    lower(t->for_stmt.loop_eval);
+    lower_chain(t->for_stmt.body);
+    break;
+  default:
+    break;
+  }
+  n_scope = saved;
+}
+
+static void lower_chain(struct tree *t) {
+  for (; t != NULL; t = t->next)
+    lower(t);
+}
+
+void lower_vectors(struct tree *t) {
+  if (hashmap_create(64, &helpers) != 0 || hashmap_create(64, &fn_types) != 0) {
+    error("Failed to create hashmap.");
+    return;
+  }
+  for (struct tree *head = t; head != NULL; head = head->next) {
+    if (head->type == FN_DECL)
+      hashmap_put(&fn_types, head->fn_decl.name, strlen(head->fn_decl.name),
+                  head->fn_decl.type);
+  }
+  for (struct tree *head = t; head != NULL; head = head->next) {
+    lower(head);
+    if (head->type == VAR_DECL)
+      push_scope(head->var_decl.name, head->var_decl.type);
+  }
+  free(scope);
+  scope = NULL;
+  n_scope = cap_scope = 0;
+  hashmap_destroy(&fn_types);
+}
+
+/* an integer vector with lanes of the same width, for __builtin_shuffle */
+static void print_mask(struct type_id *type) {
+  static const char *ints[] = {NULL, "char", "short", NULL, "int",
+                               NULL, NULL,    NULL,    "long"};
+  int size = type_id_size(&(struct type_id){type->name, MOD_NONE, 0});
+  print_type_id(&(struct type_id){(char *)ints[size], MOD_NONE, type->lanes});
+}
+
+static void print_helper(struct vec_helper *helper) {
+  struct type_id *v = &helper->type;
+  const char *elem = v->name;
+  int n = v->lanes;
+  fprintf(stdout, "static inline ");
+  switch (helper->kind) {
+  case VEC_LOAD:
+  case VEC_LOADU:
+    print_type_id(v);
+    fprintf(stdout, " %s(const %s *p) {\n", helper->name, elem);
+    if (helper->kind == VEC_LOAD) {
+      fprintf(stdout, "  return *(const ");
+      print_type_id(v);
+      fprintf(stdout, " *)p;\n");
+    } else {
+      fprintf(stdout, "  ");
+      print_type_id(v);
+      fprintf(stdout, " v;\n  __builtin_memcpy(&v, p, sizeof(v));\n"
+                      "  return v;\n");
+    }
+    break;
+  case VEC_STORE:
+  case VEC_STOREU:
+    fprintf(stdout, "void %s(%s *p, ", helper->name, elem);
+    print_type_id(v);
+    fprintf(stdout, " v) {\n");
+    if (helper->kind == VEC_STORE) {
+      fprintf(stdout, "  *(");
+      print_type_id(v);
+      fprintf(stdout, " *)p = v;\n");
+    } else {
+      fprintf(stdout, "  __builtin_memcpy(p, &v, sizeof(v));\n");
+    }
+    break;
+  case VEC_SHUFFLE:
+  case VEC_SHUFFLE2:
+    print_type_id(v);
+    fprintf(stdout, " %s(", helper->name);
+    print_type_id(v);
+    fprintf(stdout, " a");
+    if (helper->kind == VEC_SHUFFLE2) {
+      fprintf(stdout, ", ");
+      print_type_id(v);
+      fprintf(stdout, " b");
+    }
+    for (int i = 0; i < n; i++)
+      fprintf(stdout, ", int i%d", i);
+    fprintf(stdout, ") {\n  return __builtin_shuffle(a, %s(",
+            helper->kind == VEC_SHUFFLE2 ? "b, " : "");
+    print_mask(v);
+    fprintf(stdout, "){");
+    for (int i = 0; i < n; i++)
+      fprintf(stdout, i == 0 ? "i%d" : ", i%d", i);
+    fprintf(stdout, "});\n");
+    break;
+  case VEC_SUM:
+  case VEC_MIN:
+  case VEC_MAX:
+    fprintf(stdout, "%s %s(", elem, helper->name);
+    print_type_id(v);
+    fprintf(stdout, " v) {\n  %s r = v[0];\n  for (int i = 1; i < %d; i++)\n",
+            elem, n);
+    if (helper->kind == VEC_SUM)
+      fprintf(stdout, "    r += v[i];\n");
+    else
+      fprintf(stdout, "    r = v[i] %c r ? v[i] : r;\n",
+              helper->kind == VEC_MIN ? '<' : '>');
+    fprintf(stdout, "  return r;\n");
+    break;
+  case VEC_SPLAT:
+    print_type_id(v);
+    fprintf(stdout, " %s(%s x) {\n  return (", helper->name, elem);
+    print_type_id(v);
+    fprintf(stdout, "){0} + x;\n");
+    break;
+  }
+  fprintf(stdout, "}\n");
+}
+
+void print_vector_helpers(bool emit_asm) {
+  for (struct vec_helper *helper = helper_list; helper != NULL;) {
+    // the asm backend rejects vector types, so there is nothing to call these
+    if (!emit_asm)
+      print_helper(helper);
+    struct vec_helper *next = helper->next;
+    free(helper->name);
+    free(helper->type.name);
+    free(helper);
+    helper = next;
+  }
+  helper_list = helper_end = NULL;
+  hashmap_destroy(&helpers);
+}
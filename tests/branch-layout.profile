@@ -0,0 +1,17 @@
+lcc-profile tests/branch-layout.lc
+8:3 8:10 1
+8:3 9:10 91
+8:3 10:10 1
+8:3 11:10 901
+8:3 12:10 6
+16:3 17:6 91
+16:3 18:6 1
+16:3 19:6 901
+31:9 then 100
+31:9 else 900
+32:9 then 10
+32:9 else 990
+35:9 then 1
+35:9 else 999
+36:9 then 999
+36:9 else 1
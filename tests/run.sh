@@ -0,0 +1,36 @@
+#!/bin/sh
+# Compiles each test with lcc and the flags on its "; flags:" line, builds the
+# C output (or the assembly, with -S) with the compiler in $CC and compares
+# what it prints with NAME.out.
+#
+#   sh tests/run.sh ./lcc tests/*.lc
+
+LCC=$1
+shift
+CC=${CC:-gcc}
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+failed=0
+for test in "$@"; do
+  name=$(basename "$test" .lc)
+  flags=$(sed -n 's/^; flags: //p' "$test")
+  case " $flags " in
+  *" -S "*) out="$TMP/$name.s" ;;
+  *) out="$TMP/$name.c" ;;
+  esac
+  if ! $LCC $flags "$test" > "$out" 2> "$TMP/$name.err"; then
+    echo "FAIL $name: lcc"
+    tail -5 "$TMP/$name.err"
+    failed=$((failed + 1))
+  elif ! $CC -w "$out" -lm -o "$TMP/$name" 2> "$TMP/$name.err"; then
+    echo "FAIL $name: $CC"
+    head -5 "$TMP/$name.err"
+    failed=$((failed + 1))
+  elif ! "$TMP/$name" 2>&1 | cmp -s - "${test%.lc}.out"; then
+    echo "FAIL $name: output differs from ${test%.lc}.out"
+    failed=$((failed + 1))
+  else
+    echo "ok   $name"
+  fi
+done
+[ $failed -eq 0 ]